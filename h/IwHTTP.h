@@ -17,6 +17,8 @@
 #include "s3eFile.h"
 #include "IwURI.h"
 #include "IwArray.h"
+#include "IwHTTPConnector.h"
+#include "IwHTTPResolver.h"
 
 #include <list>
 #include <string>
@@ -36,6 +38,10 @@
  * HTTP-Basic authentication and similar can all be implemented using the
  * @ref SetRequestHeader and @ref GetHeader functions.
  *
+ * Connections the server keeps alive are returned to a shared pool
+ * (CIwHTTPConnectionPool) when a response has been fully read, and are
+ * reused by later requests to the same host.
+ *
  * @note For more information on the HTTP Client Object, see the
  * @ref httpclient "HTTP Client" section in the
  * <i>IwHTTP API Documentation</i>.
@@ -47,12 +53,14 @@
 
 #ifdef IW_HTTP_SSL
 typedef struct SSL SSL;
-typedef struct SSL_CTX SSL_CTX;
 #endif
 
-#define POST_BUFFER_PREFIX_SIZE 6
-#define POST_BUFFER_SIZE 4096
-#define POST_BUFFER_POSTFIX_SIZE 4
+class CIwHTTPSession;
+class CIwHTTP2Connection;
+class CIwHTTPDecoder;
+class CIwHTTPEncoder;
+class CIwHTTPCacheBody;
+class CIwHTTPFlight;
 
 /**
  * @addtogroup iwhttpclientobject
@@ -78,13 +86,21 @@ public:
         PUT,
         DELETE
     };
+    enum RequestEncoding {
+        ENCODING_NONE,
+        ENCODING_GZIP,
+        ENCODING_ZSTD
+    };
 
 protected:
+    friend class CIwHTTPSession;
+    friend class CIwHTTPFlight;
 
     CIwURI m_URI;
     int m_socket;
     s3eSocket *m_pSocket;
-    s3eInetAddress m_addr;
+    CIwHTTPAddressList m_addrs;
+    CIwHTTPConnector m_connector;
 
     SendType m_Type;
     bool m_SendingData; //This is a PUT or POST
@@ -95,23 +111,90 @@ protected:
 #ifdef IW_HTTP_SSL
     // Concerning SSL
     SSL *m_SSL;
-    SSL_CTX *m_SSL_CTX;
     bool m_bSecureSocket;
     bool m_bSSLHandshaking;
+    int m_early_len;    // Bytes of the request sent as TLS early data
 #endif
 
     // Concerning chunked transfer encoding.
     bool m_chunked;
     bool m_post_chunked;
-    int m_chunk_size;
     bool m_last_chunk_seen;
-    bool m_reading_chunk_header;
+
+    // Where the chunked decoder is within the body..
+    enum ChunkState
+    {
+        CHUNK_SIZE_START,   // Expecting the first hex digit of a size
+        CHUNK_SIZE,         // Reading hex digits
+        CHUNK_EXT,          // Skipping chunk extensions
+        CHUNK_SIZE_LF,      // Expecting LF after the size line
+        CHUNK_DATA,         // Chunk data, m_chunk_remaining to go
+        CHUNK_DATA_CR,      // Expecting CR after the data
+        CHUNK_DATA_LF,      // Expecting LF after the data
+        CHUNK_TRAILER,      // At the start of a trailer line
+        CHUNK_TRAILER_LINE, // Skipping a trailer line
+        CHUNK_END_LF,       // Expecting LF after the blank line
+        CHUNK_DONE,
+        CHUNK_ERROR
+    };
+    ChunkState m_chunk_state;
+    uint32 m_chunk_remaining;
+
+    // Concerning content coding. With m_decoder the body is handed out
+    // decoded; m_total_transferred still counts it as it came..
+    bool m_accept_encoding;     // Accept-Encoding was added for us
+    CIwHTTPDecoder *m_decoder;
+    int m_decoded_transferred;
+
+    // Concerning the response cache. With m_cached the body is handed out
+    // from the cache rather than read; m_total_transferred counts it..
+    CIwHTTPCacheBody *m_cached;
+    CIwHTTPCacheBody *m_cache_stale;    // Held while it is revalidated
+    CIwHTTPCacheBody *m_cache_store;    // The body being captured
+    std::string m_cache_headers;
+    std::string m_cache_conditions;
+    uint64 m_request_time;
+    uint64 m_response_time;
+    int m_cache_timer;
+    void UseCachedResponse();
+    void ReleaseCache();
+    static int32 CacheCallback(void *, void *);
+
+    // Concerning coalescing. A GET joining another's flight sends nothing;
+    // the leader's response is handed to it through m_cached, growing as
+    // the leader reads it..
+    CIwHTTPFlight *m_flight;
+    s3eSocketCallbackFn m_flight_wait;  // To call once more has been fed
+    int m_flight_timer;
+    bool JoinFlight();
+    void LeaveFlight();
+    void WakeFlight();
+    void FlightChanged();
+    bool AwaitingFlight() const;
+    static int32 FlightCallback(void *, void *);
 
     // Concerning the use of proxies
     int m_proxyPort;
     bool m_firstDns;
     bool m_usingProxy;
     bool m_neverUseProxy;
+    std::string m_proxyHost;
+
+    // Concerning connection reuse
+    bool m_keepAlive;
+    bool m_body_complete;
+    bool m_reusedConnection;
+    bool m_retried;
+    int m_reuse_timer;
+    std::string m_poolKey;
+    std::string m_lookupHost;
+    bool m_lookupViaProxy;
+
+    // Concerning HTTP/2. With m_h2 the request is a stream on a shared
+    // connection; m_socket and m_pSocket are the connection's, not ours..
+    CIwHTTP2Connection *m_h2;
+    uint32 m_h2_stream;
+    uint32 m_h2_weight;
 
     // General status.
     s3eResult m_Status;
@@ -125,13 +208,31 @@ protected:
     s3eCallback m_header_callback;
 
     // In/Out buffers..
+    std::string m_request_head;
     int m_request_idx;
     size_t m_headers_end;
     std::string m_response;
 
-    // Chunk header buffer
-    int m_chunk_header_idx;
-    std::string m_chunk_header;
+    // Response headers, indexed by GotHeaders. Offsets are into m_response..
+    struct HeaderEntry
+    {
+        uint32 m_name;
+        uint32 m_name_len;
+        uint32 m_value;
+        uint32 m_value_len;
+    };
+    CIwArray<HeaderEntry> m_header_index;
+    void IndexHeaders();
+
+    // Receive buffer shared by every read path. Unread bytes are those
+    // in [m_recv_start, m_recv_end)..
+    char *m_recv_buf;
+    uint32 m_recv_size;
+    uint32 m_recv_start;
+    uint32 m_recv_end;
+
+    // How much of the blank line ending the headers has been seen..
+    int m_header_scan;
 
     // Response code cache..
     int32 m_response_code;
@@ -141,6 +242,7 @@ protected:
     char *m_content_buf;
     char *m_orig_content_buf;
     int m_content_length;
+    bool m_length_known;    // m_content_length is the body's whole length
     int m_total_transferred;
     int m_read_content_transferred;
     bool m_pending_read_callback;
@@ -148,6 +250,24 @@ protected:
     int m_connect_timeout;
     int m_callback_timer;
 
+    // Downloading straight to a file..
+    int m_download_fd;
+    int m_download_pipe[2];
+    char *m_download_buf;
+    uint32 m_download_buf_size;
+    bool m_download_splice;
+    bool m_download_busy;
+    bool m_download_timer;
+    s3eCallback m_download_callback;
+    void DoDownload();
+    bool DownloadFinished();
+    int32 BufferToFile();
+    int32 SpliceToFile();
+    void FinishDownload();
+    void CloseDownload();
+    static int32 DownloadTimerCallback(void *, void *);
+    static int32 DownloadCallback(s3eSocket *, void *, void *);
+
     struct ReqHeader
     {
         std::string m_name;
@@ -155,56 +275,136 @@ protected:
     };
     struct Data
     {
-        std::string m_value;
-        s3eFile* m_file;
+        std::string m_value;    // The bytes to send, unless they come from..
+        s3eFile* m_file;        // ..an s3e file
+        int m_fd;               // ..or a native one
+        void *m_map;            // The native file mapped, once tried
         int m_size;
         int m_idx;
 
-        Data() : m_file(NULL), m_idx(0) {}
+        Data() : m_file(NULL), m_fd(-1), m_map(NULL), m_size(0), m_idx(0) {}
     };
 
-    // Post and Get data to send
+    // Post and Get data to send. m_data_len is as sent, framing and all
     int m_data_len;
     int m_data_sent;
     std::list<Data>::iterator m_data_it;
     std::list<Data> m_data;
+    std::list<Data> m_form_data;    // Set for the next request
+
+    // Sending from files, and chunk framing between parts..
+    char *m_upload_buf;
+    uint32 m_upload_size;
+    uint32 m_upload_start;
+    uint32 m_upload_end;
+    bool m_upload_sendfile;
+    char *m_gather_buf;
+
+    // Compressing the body as it is sent, in chunks framed as they are
+    // made. m_data_len grows with them until m_encode_done..
+    RequestEncoding m_request_encoding;
+    CIwHTTPEncoder *m_encoder;
+    bool m_encode_done;
+    char m_frame[24];
+    int m_frame_len;
+    int m_frame_idx;
 
     CIwArray<ReqHeader> m_req_headers;
 
+    // The request headers serialised, kept until they change..
+    std::string m_header_block;
+    bool m_header_block_valid;
+    bool m_header_block_sending;    // Whether made for a request with a body
+    uint32 m_header_block_gen;      // The session's headers it was made with
+    static std::string s_user_agent;
+    const std::string& GetHeaderBlock();
+    static const char* FormatDecimal(char *buf, uint32 val);
+
+    // Concerning requests made through a CIwHTTPSession
+    enum SessionState
+    {
+        SESSION_NONE,
+        SESSION_QUEUED,
+        SESSION_ACTIVE
+    };
+    CIwHTTPSession *m_session;
+    SessionState m_session_state;
+    uint32 m_session_gen;
+    std::string m_session_host;
+    void SessionRequestFinished();
+
+    // Concerning pipelining through a CIwHTTPSession. A request with a
+    // m_pipe_prev has been written on that request's connection and
+    // waits for the responses ahead of it before reading its own..
+    CIwHTTP *m_pipe_prev;
+    CIwHTTP *m_pipe_next;
+    bool m_pipe_close;      // The connection isn't to be used past this response
+    int m_pipe_timer;
+    bool PipelineAfter(CIwHTTP *prev);
+    bool CanPipelineAfter() const;
+    uint32 PipelineLength() const;
+    bool RequestSent() const;
+    void PipelineHandOver();
+    void PipelineWithdraw();
+    void PipelineBreak();
+    void PipelineReplay();
+    void PipelineFailed();
+    static int32 PipelineCallback(void *, void *);
+
+    static void SetHeader(CIwArray<ReqHeader> &headers, const char *pName, const std::string &val);
+    static void AppendRequestHeader(std::string &out, const ReqHeader &header, bool sendingData, bool &skip_ua, bool &skip_ct, bool &skip_ae);
+
     // Universal fail.
     void Fail();
 
     // DNS..
-    static bool s_bLookupInProgress;
-    void DoDNSCallback(s3eInetAddress *);
+    CIwHTTPResolver::Waiter* m_dnsWaiter;
+    void OnDNSResult(const CIwHTTPAddressList *);
     static int32 DNSCallback(void *, void *);
-    bool CheckProxy(const char* name);
 
-    struct DNSRequest
+    // Answers from the DNS cache, and lookups that couldn't be started,
+    // are delivered by timer..
+    enum DNSCacheTimer
     {
-        CIwHTTP *m_caller;
-        std::string m_host;
-        s3eInetAddress *m_addr;
+        DNS_CACHE_NONE,
+        DNS_CACHE_HIT,
+        DNS_CACHE_FAILED
     };
+    DNSCacheTimer m_dns_cache_timer;
+    static int32 DNSCacheCallback(void *, void *);
+    bool CheckProxy(const char* name);
 
-    typedef std::list<DNSRequest *> DNSRequestList;
-
-
-    // DNS is single a shared resource..
-    static DNSRequestList* s_pendingDNS;
-    static void IssueDNSRequest();
-    static int32 DoIssueDNSRequest(void *, void *);
-    bool EnqueueDNSRequest(const char *host, s3eInetAddress *);
-
-    //Thread safety
-    static s3eThreadLock* m_dnsLock;
+    // Looks the host up, the result goes in m_addrs..
+    bool EnqueueDNSRequest(const char *host);
 
     // Connecting..
     void DoConnectTimeout();
     void DoConnectCallback(s3eResult);
-    static int32 ConnectCallback(s3eSocket *, void *, void *);
+    static int32 ConnectCallback(void *, void *);
     static int32 ConnectTimeoutCallback(void *, void *);
 
+    // Starts the request going, once it's known it must..
+    void Dispatch();
+
+    // Connection reuse..
+    void SetPoolKey();
+    bool TryPooledConnection();
+    bool IsReusable();
+    bool IsIdempotent() const;
+    bool RetryRequest();
+    void ReleaseConnection();
+    void CloseConnection();
+    void FinishConnection();
+    static int32 ReuseCallback(void *, void *);
+
+    // HTTP/2..
+    bool WantHTTP2(bool secure) const;
+    bool UseHTTP2();
+    void StartHTTP2();
+    void WaitReadable(s3eSocketCallbackFn fn);
+    void WaitWritable(s3eSocketCallbackFn fn);
+    void WaitContent(s3eSocketCallbackFn fn);
+
 #ifdef IW_HTTP_SSL
     // Secure sockets..
     void DestroySSL();
@@ -214,7 +414,18 @@ protected:
 
     // Sending..
     void SendRequest();
+    int SendNext();
+    int GatherData(struct iovec *iov, char (*frames)[24], int max);
+    void AdvanceData(int bytes);
+    int SendFile(Data &d);
+    int FileData(Data &d, const char *&pData);
+    bool EncodeData();
+    bool WantEncoding() const;
     int SendBytes(const char *buf, int len);
+    void RewindData();
+    void NextData();
+    void FrameChunk(bool first);
+    int FormatFrame(char *buf, bool first, std::list<Data>::iterator it);
     static int32 WriteableCallback(s3eSocket *, void *, void *);
 
     // Event driven I/O..
@@ -223,18 +434,37 @@ protected:
 
     // Receiving..
     bool GotHeaders();
+    bool ScanHeaders();
     void ReadResponse();
     int ReadBytes(char *buf, int len);
+    int FillRecvBuffer();
+    int RecvBuffered(char *buf, int len);
     static int32 ReadableCallback(s3eSocket *, void *, void *);
 
     // Transferring content..
     int TransferContent(char *, int);
+    int TransferWire(char *, int);
     int TransferContentInternal(char *, int);
+    int TransferDecoded(char *, int);
+    bool PullEncoded();
+    bool WireFinished();
+    bool HasHeldContent() const;
+    bool CachedFinished() const;
+    int TransferCached(char *, int);
+    void CacheContent(const char *, int);
     int DoTransferCallback();
     static int32 TransferCallback(s3eSocket *, void *, void *);
+    void EndOfContent(bool closed, uint32 received);
+
+    // Borrowing content..
+    uint32 PeekAvailable();
+    bool PeekFinished();
+    void DoPeekCallback();
+    static int32 PeekCallback(s3eSocket *, void *, void *);
 
-    void GetChunkHeader();
-    bool ParseChunkHeader();
+    int DecodeChunked(char *, int);
+    void StartChunk();
+    void ChunkedFinished();
 
     // Read timer..
     static int32 ReadTimeoutCallback(void *, void *);
@@ -243,13 +473,19 @@ protected:
     // DoCallback in yield to avoid deep recursion
     static int32 DoCallback(void *, void *);
 
-    void AddChunked(Data& f);
+    void AddFormDataFile(const char *pName, const char* destName, const char* mimeType, Data &file);
+    void ClearData();
+    static void FreeData(std::list<Data> &data);
 
     s3eResult Send(SendType type, const char *URI, const char* Body, int32 BodyLength, s3eCallback callback, void *data);
 public:
     /**
      * Performs a GET request. If supplied, the callback will be
-     * called when all the headers have been received.
+     * called when all the headers have been received. A response held
+     * by CIwHTTPCache is used if it is fresh, and revalidated if not.
+     * With httpcoalesce set, the same request already being made by
+     * another CIwHTTP is joined instead of being sent again, see
+     * CIwHTTPFlight.
      * @param URI The URI to fetch.
      * @param callback A callback that is called when the headers have
      * been received. The callback is also called when the operation fails;
@@ -331,7 +567,9 @@ public:
     s3eResult Delete(const char *URI, s3eCallback callback, void *data);
 
     /**
-     * Cancel the current GET or POST request.
+     * Cancel the current GET or POST request. If the response has been
+     * read in full and the server allows it, the connection is returned
+     * to the connection pool rather than closed.
      * @return A standard s3e result code to indicate if the operation
      * succeeded.
      */
@@ -384,6 +622,37 @@ public:
      */
     bool GetHeader(const char *pName, std::string &val);
 
+    /**
+     * Finds a response header without copying it. Header names are
+     * matched case-insensitively. Repeated headers, such as Set-Cookie,
+     * can be found by passing the previous index back in.
+     * @param pName The name of the header (without colon)
+     * @param after Start searching after this index, -1 to start at the
+     * beginning
+     * @return the index of the header, for GetHeaderAt, or -1 if there
+     * are no (more) headers of that name.
+     */
+    int32 FindHeader(const char *pName, int32 after = -1);
+
+    /**
+     * Returns the number of response headers received.
+     * @return the number of headers, or 0 if they haven't all arrived.
+     */
+    uint32 GetHeaderCount();
+
+    /**
+     * Gets a response header by index, in the order they were received.
+     * The returned pointers are not null-terminated and remain valid
+     * until the next request is sent.
+     * @param index The index of the header
+     * @param pName Filled in with the start of the name
+     * @param nameLen Filled in with the length of the name
+     * @param pValue Filled in with the start of the value
+     * @param valueLen Filled in with the length of the value
+     * @return true if the header exists.
+     */
+    bool GetHeaderAt(uint32 index, const char *&pName, uint32 &nameLen, const char *&pValue, uint32 &valueLen);
+
     /**
      * DEPRECATED: Use GetHeader("Content-Length:", int32 &); instead.
      * Returns the length of the response content. This assumes the
@@ -404,10 +673,31 @@ public:
      * then the return will be that value. If the transfer encoding is
      * chunked then this value will increase over time as chunk sizes
      * are received.
+     *
+     * @note Content the server compressed when httpacceptencoding is set
+     * (see SetRequestHeader) is counted as it is read, after decoding. Its decoded size isn't known
+     * until the end, so as for chunked content this is the least that is
+     * expected, and ContentLength returns 0. ContentWireReceived and
+     * ContentWireExpected count the content as it was sent.
      * @return the minumum expected content size
      */
     uint32 ContentExpected();
 
+    /**
+     * Returns the amount of content so far received, before any
+     * Content-Encoding is undone. Otherwise as ContentReceived.
+     * @return the number of bytes received
+     */
+    uint32 ContentWireReceived();
+
+    /**
+     * Returns the amount of content currently known to be expected,
+     * before any Content-Encoding is undone. Otherwise as
+     * ContentExpected.
+     * @return the minimum expected content size
+     */
+    uint32 ContentWireExpected();
+
     /**
      * Returns true when the data has all been received
      * @return true when the data has all been received
@@ -473,6 +763,66 @@ public:
      */
     void ReadDataAsync(char *pBuf, uint32 max_bytes, uint32 timeout, s3eCallback cb, void *usrData = NULL);
 
+    /**
+     * Borrows received content without copying it.
+     * Returns a pointer into the object's own receive buffer and the
+     * number of content bytes available there. Like ReadData this never
+     * blocks, and returns 0 if nothing is available yet. The data stays
+     * put until ConsumeData is called; the pointer is valid until the
+     * next call to any of the read functions or Send.
+     *
+     * @param pData Filled in with the start of the available content
+     * @return the number of bytes available at pData.
+     */
+    uint32 PeekData(const char *&pData);
+
+    /**
+     * Releases content borrowed with PeekData.
+     *
+     * @param bytes The number of bytes used, at most the amount PeekData
+     * returned.
+     */
+    void ConsumeData(uint32 bytes);
+
+    /**
+     * Waits for content that can be borrowed with PeekData.
+     * The callback is made when content is available, an error occurs,
+     * all content has been received or the timeout elapses, but never
+     * from within this function. Its systemData parameter is the number
+     * of bytes PeekData will return.
+     *
+     * @param timeout A time out in ms, or 0 for none
+     * @param cb The callback
+     * @param userData A user supplied argument passed to the callback
+     */
+    void PeekDataAsync(uint32 timeout, s3eCallback cb, void *userData = NULL);
+
+    /**
+     * Saves the content to a file instead of reading it.
+     * Call this once the headers have been received. The content goes
+     * straight from the connection to the file, the callback being made
+     * just once when it has all been written or something has failed
+     * (check GetStatus). Its systemData parameter is the number of bytes
+     * written. It is never made from within this function.
+     *
+     * Where the platform allows, plain HTTP content that needs no
+     * decoding is moved to the file by the kernel without passing
+     * through user memory. Otherwise it is written from a buffer of
+     * httpdownloadbuffersize bytes (in the [connection] section of the
+     * icf, default 262144). If the Content-Length is known the space is
+     * reserved up front.
+     *
+     * Cancel abandons the download, leaving a partial file.
+     *
+     * @param filename The file to create or overwrite. This is a native
+     * path, not an s3eFile one.
+     * @param cb The callback
+     * @param userData A user supplied argument passed to the callback
+     * @return S3E_RESULT_ERROR if the file couldn't be created or there is
+     * no content to save.
+     */
+    s3eResult DownloadToFile(const char *filename, s3eCallback cb, void *userData = NULL);
+
     /**
      * Sets a request header as an integer. This will be used for all
      * subsequent requests. To remove it, set it to the empty string
@@ -501,6 +851,14 @@ public:
      * Content-Type has not been set, then a default Content-Type of
      * multipart/form-data is added.
      *
+     * @note If httpacceptencoding is set to 1 in the [connection] section
+     * of the icf (default 0), then unless Accept-Encoding or Range is set,
+     * an Accept-Encoding header naming the codings IwHTTP can undo is
+     * added, and content the server compresses is decoded as it is read.
+     * Its length is then not known until the end (see ContentExpected).
+     * Setting Accept-Encoding yourself gets the content just as the
+     * server sent it.
+     *
      * @param pName The name of the header, excluding the colon.
      * @param val The value
      */
@@ -519,7 +877,8 @@ public:
 
     /**
      * Sets a form data section from a file. This will be used for the
-     * next request.
+     * next request. The file is read httpuploadbuffersize bytes at a time
+     * (in the [connection] section of the icf, default 262144).
      *
      * @note This sets Content-Type to multipart/form-data with a boundary
      *
@@ -531,15 +890,59 @@ public:
      */
     s3eResult SetFormDataFile(const char *pName, const char* sourceFile, const char* destName, const char* mimeType);
 
+    /**
+     * As SetFormDataFile, but sourceFile is a native path rather than
+     * an s3eFile one, as for DownloadToFile.
+     *
+     * Large files upload much faster this way: where the platform allows,
+     * plain HTTP requests have the file sent by the kernel, and otherwise
+     * it is mapped into memory rather than read through a buffer.
+     *
+     * @param pName The name of the part.
+     * @param sourceFile The file to send the the server.
+     * @param destName The filename the file is to be named on the server.
+     * @param mimeType The mime type of the file.
+     * @return whether the file was successfully opened.
+     */
+    s3eResult SetFormDataNativeFile(const char *pName, const char* sourceFile, const char* destName, const char* mimeType);
+
     /**
      * Sets whether GET and POST send in chunked mode
      *
-     * @note You must set this before calling SetFormData/SetFormDataFile
+     * @note You must set this before calling Post or Put
      *
      * @param isChunked Do we send in chunked mode.
      */
     void SetPostChunkedMode(bool isChunked);
 
+    /**
+     * Sets how the bodies of POST and PUT requests are compressed.
+     *
+     * The body, form data and files included, is compressed as it is sent
+     * and goes with a Content-Encoding header, in chunked mode since its
+     * length isn't known up front. Such requests are always made over
+     * HTTP/1.1. A request with its own Content-Encoding header is sent as
+     * it is. The server must be able to accept the encoding.
+     *
+     * @note You must set this before calling Post or Put
+     *
+     * @param encoding ENCODING_NONE (the default), ENCODING_GZIP or
+     * ENCODING_ZSTD.
+     * @return S3E_RESULT_ERROR if the encoding isn't supported by this
+     * build (see CIwHTTPEncoder).
+     */
+    s3eResult SetRequestEncoding(RequestEncoding encoding);
+
+    /**
+     * Sets the priority weight of the request, relative to others going
+     * to the same server. Only used when the request goes over HTTP/2.
+     *
+     * @note You must set this before calling Get, Post, Head or Put
+     *
+     * @param weight From 1 to 256, 16 by default.
+     */
+    void SetStreamWeight(uint32 weight) { m_h2_weight = weight; }
+
     /**
      * Returns the amount of data sent in the last POST
      * @return the amount sent
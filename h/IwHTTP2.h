@@ -0,0 +1,259 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP2_H
+#define IW_HTTP2_H
+
+#include "s3eSocket.h"
+#include "IwHTTPHPACK.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+#ifdef IW_HTTP_SSL
+typedef struct SSL SSL;
+#endif
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * An HTTP/2 (RFC 7540) connection, carrying many CIwHTTP requests at once
+ * as streams.
+ *
+ * A connection is made when TLS negotiates "h2" by ALPN, or for plain
+ * HTTP with prior knowledge when httph2c is set. It then stays in a
+ * process-wide list, keyed as CIwHTTPConnectionPool keys connections,
+ * for later requests to the same host to find.
+ *
+ * Each stream looks to its request much like a socket of its own: the
+ * response is presented as HTTP/1.1 text (a status line, the headers and
+ * a blank line, then the body), so everything above reads it as it
+ * would any other response.
+ *
+ * Tuned through the [connection] section of the icf:
+ * - httph2streamwindow: receive window of each stream (default 1048576)
+ * - httph2connectionwindow: receive window of the connection (default
+ *   16777216)
+ * - httph2maxstreams: most streams open at once, whatever the server
+ *   allows (default 100)
+ * - httpidletimeout: milliseconds a connection with no streams is kept
+ *   (default 30000)
+ *
+ * Like the rest of IwHTTP connections must only be used from the main
+ * thread.
+ */
+class CIwHTTP2Connection
+{
+public:
+    /**
+     * Finds an open connection with room for another stream. The caller
+     * must Attach to it.
+     * @param key The connection's key, as made by CIwHTTPConnectionPool
+     * @return the connection, or NULL if there isn't one
+     */
+    static CIwHTTP2Connection* Find(const std::string &key);
+
+    /**
+     * Starts speaking HTTP/2 on a connected socket, which the connection
+     * then owns along with any SSL. The caller is attached to it.
+     * @param key The connection's key
+     * @param socket The socket
+     * @param pSocket The socket's s3eSocket
+     * @param ssl The TLS session, with IW_HTTP_SSL
+     * @return the connection
+     */
+#ifdef IW_HTTP_SSL
+    static CIwHTTP2Connection* Create(const std::string &key, int socket, s3eSocket *pSocket, SSL *ssl);
+#else
+    static CIwHTTP2Connection* Create(const std::string &key, int socket, s3eSocket *pSocket);
+#endif
+
+    /**
+     * Closes every connection that has no streams.
+     */
+    static void Flush();
+
+    /**
+     * Keeps the connection around for a request that is to open a stream.
+     */
+    void Attach();
+
+    /**
+     * Lets the connection go, closing the request's stream if it has one.
+     * @param id The stream, or 0
+     * @param complete Whether the whole response has been read, in which
+     * case the server is left to finish the stream
+     */
+    void Detach(uint32 id, bool complete);
+
+    /**
+     * Sends a request's headers, opening a stream for it.
+     * @param head The request line and headers, as for HTTP/1.1
+     * @param secure Whether this is an https request
+     * @param bodyLength How much body Write will be given
+     * @param weight The stream's priority weight, 1 to 256
+     * @return the stream, or 0 if no more can be opened
+     */
+    uint32 OpenStream(const std::string &head, bool secure, uint32 bodyLength, uint32 weight);
+
+    /**
+     * Reads from a stream, as recv would.
+     * @return the bytes read, 0 at the end of the response, or -1 with
+     * errno set to EAGAIN if there's nothing yet or ECONNRESET if the
+     * stream was reset. A stream abandoned before any response arrived
+     * reads as ended, so the request may be retried.
+     */
+    int Read(uint32 id, char *buf, int len);
+
+    /**
+     * Writes a request body to a stream, as send would.
+     * @return the bytes taken, 0 if flow control or the connection won't
+     * take any yet, or -1 if the stream has gone
+     */
+    int Write(uint32 id, const char *buf, int len);
+
+    /**
+     * As s3eSocketReadable, for a stream.
+     */
+    void WaitReadable(uint32 id, s3eSocketCallbackFn fn, void *data);
+
+    /**
+     * As s3eSocketWritable, for a stream.
+     */
+    void WaitWritable(uint32 id, s3eSocketCallbackFn fn, void *data);
+
+    int GetSocket() const { return m_socket; }
+    s3eSocket* GetSocketHandle() const { return m_pSocket; }
+
+private:
+    struct Stream
+    {
+        uint32 m_id;
+        std::string m_in;           // The response so far, as HTTP/1.1..
+        uint32 m_in_start;          // ..of which this much has been read
+        uint32 m_text_left;         // Unread bytes not from DATA frames
+        bool m_headers;             // The final response headers are in
+        bool m_end;                 // The server has finished
+        bool m_reset;
+        bool m_local_end;           // We have finished
+        bool m_orphan;              // Left to the server to finish
+        int32 m_send_window;
+        uint32 m_send_left;
+        uint32 m_recv_unacked;      // Read but not yet given back
+        s3eSocketCallbackFn m_read_fn;
+        void *m_read_data;
+        s3eSocketCallbackFn m_write_fn;
+        void *m_write_data;
+    };
+    typedef std::map<uint32, Stream *> StreamMap;
+
+    std::string m_key;
+    int m_socket;
+    s3eSocket *m_pSocket;
+#ifdef IW_HTTP_SSL
+    SSL *m_SSL;
+#endif
+
+    StreamMap m_streams;
+    uint32 m_users;             // Requests attached
+    uint32 m_next_id;
+    uint32 m_max_streams;
+    bool m_goaway;              // No new streams, either side has said so
+    bool m_dead;                // The socket has gone
+
+    CIwHTTPHPACK m_hpack;
+    std::string m_header_block; // Header block waiting for CONTINUATION..
+    uint32 m_header_stream;     // ..on this stream
+    bool m_header_end_stream;
+
+    // Flow control, both ways..
+    int32 m_send_window;
+    int32 m_peer_initial_window;
+    uint32 m_peer_max_frame;
+    uint32 m_stream_window;
+    uint32 m_conn_window;
+    uint32 m_conn_unacked;
+
+    // Frames read, and frames to write..
+    char *m_in;
+    uint32 m_in_size;
+    uint32 m_in_end;
+    std::string m_out;
+    uint32 m_out_start;
+    uint32 m_out_retry;         // Length of a TLS write to be made again
+    bool m_out_waiting;
+
+    bool m_notify_timer;
+    bool m_idle_timer;
+
+    static std::list<CIwHTTP2Connection *> *s_connections;
+
+#ifdef IW_HTTP_SSL
+    CIwHTTP2Connection(const std::string &key, int socket, s3eSocket *pSocket, SSL *ssl);
+#else
+    CIwHTTP2Connection(const std::string &key, int socket, s3eSocket *pSocket);
+#endif
+    ~CIwHTTP2Connection();
+
+    bool CanOpenStream() const;
+    Stream* GetStream(uint32 id);
+    bool IsReadable(const Stream *s) const;
+    bool IsWritable(const Stream *s) const;
+    void CloseStream(StreamMap::iterator it);
+    void ResetStream(Stream *s, uint32 error);
+    void StreamRead(Stream *s, uint32 data);
+
+    void BuildHeaders(std::string &block, const std::string &head, bool secure);
+
+    // Writing..
+    void WriteFrame(uint8 type, uint8 flags, uint32 id, const char *payload, uint32 len);
+    void WriteSettings();
+    void WriteWindowUpdate(uint32 id, uint32 increment);
+    void WriteRstStream(uint32 id, uint32 error);
+    void Send();
+    int SendRaw(const char *buf, int len);
+
+    // Reading..
+    void OnReadable();
+    void OnWritable();
+    int RecvRaw(char *buf, int len);
+    bool ParseFrames();
+    bool HandleFrame(uint8 type, uint8 flags, uint32 id, const uint8 *payload, uint32 len);
+    bool HandleData(uint8 flags, uint32 id, const uint8 *payload, uint32 len);
+    bool HandleHeaders(uint8 flags, uint32 id, const uint8 *payload, uint32 len);
+    bool HandleSettings(uint8 flags, const uint8 *payload, uint32 len);
+    bool HandleGoAway(const uint8 *payload, uint32 len);
+    bool HandleWindowUpdate(uint32 id, const uint8 *payload, uint32 len);
+    bool EndHeaders();
+
+    // Going away..
+    void Fail(uint32 error);
+    void Drop();
+    void CheckIdle();
+    void Notify();
+    void ScheduleNotify();
+
+    static int32 ReadableCallback(s3eSocket *, void *, void *);
+    static int32 WritableCallback(s3eSocket *, void *, void *);
+    static int32 NotifyCallback(void *, void *);
+    static int32 IdleCallback(void *, void *);
+
+    CIwHTTP2Connection(const CIwHTTP2Connection &);
+    CIwHTTP2Connection &operator=(const CIwHTTP2Connection &);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP2_H */
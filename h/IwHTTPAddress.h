@@ -0,0 +1,76 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_ADDRESS_H
+#define IW_HTTP_ADDRESS_H
+
+#include "s3eSocket.h"
+
+#include <vector>
+
+#include <sys/socket.h>
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * A resolved socket address, either IPv4 or IPv6.
+ */
+struct CIwHTTPAddress
+{
+    struct sockaddr_storage m_addr;
+    socklen_t m_len;
+
+    /**
+     * Returns the address family, AF_INET or AF_INET6.
+     * @return the family
+     */
+    int GetFamily() const { return m_addr.ss_family; }
+
+    /**
+     * Sets the port.
+     * @param port The port, in host byte order
+     */
+    void SetPort(uint16 port);
+
+    /**
+     * Sets the address from an IPv4 s3e address.
+     * @param addr The address
+     */
+    void Set(const s3eInetAddress &addr);
+
+    /**
+     * Parses a numeric IPv4 or IPv6 address, without brackets.
+     * @param str The string
+     * @return true if the string was a numeric address
+     */
+    bool Parse(const char *str);
+
+    /**
+     * Formats the address (not the port) for tracing.
+     * @param buf Buffer to write to
+     * @param len Size of buf
+     * @return buf
+     */
+    const char* ToString(char *buf, int len) const;
+
+    bool operator==(const CIwHTTPAddress &that) const;
+};
+
+// A std::vector rather than a CIwArray, as these lists are built on the
+// resolver threads..
+typedef std::vector<CIwHTTPAddress> CIwHTTPAddressList;
+
+/** @} */
+
+#endif /* !IW_HTTP_ADDRESS_H */
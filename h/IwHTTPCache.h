@@ -0,0 +1,253 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_CACHE_H
+#define IW_HTTP_CACHE_H
+
+#include "s3eTypes.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * A response body held by CIwHTTPCache. It is shared by the cache and the
+ * requests reading it, so an entry can be dropped or replaced while it is
+ * still being read.
+ *
+ * The body is either held in memory or mapped from a file of the disk
+ * cache (CIwHTTPDiskCache). While it is being captured it can be going to
+ * both, until it grows too big for one or the other.
+ */
+class CIwHTTPCacheBody
+{
+public:
+    CIwHTTPCacheBody();
+
+    const char* GetData() const { return m_map ? (const char *)m_map : m_data.data(); }
+    uint32 GetSize() const { return m_size; }
+
+    /**
+     * Returns whether the body is held in memory, rather than mapped.
+     */
+    bool IsHeld() const { return m_held; }
+
+    /**
+     * Adds to the body, while it is being captured.
+     * @return false once it is too big to be kept anywhere
+     */
+    bool Append(const char *pData, uint32 len);
+
+    void AddRef() { m_refs++; }
+    void Release() { if (!--m_refs) delete this; }
+
+private:
+    friend class CIwHTTPCache;
+    friend class CIwHTTPDiskCache;
+    friend class CIwHTTPFlight;
+
+    std::string m_data;
+    uint32 m_size;
+    bool m_held;
+    uint32 m_held_max;  // Most to hold in memory while capturing
+    void *m_map;        // The file's contents, once mapped
+
+    // While it is being written to the disk cache..
+    int m_fd;
+    uint32 m_file_max;
+    std::string m_file;
+    int m_refs;
+
+    ~CIwHTTPCacheBody();
+
+    CIwHTTPCacheBody(const CIwHTTPCacheBody &);
+    CIwHTTPCacheBody &operator=(const CIwHTTPCacheBody &);
+};
+
+/**
+ * How fresh a stored response is, as worked out when it was received.
+ */
+struct CIwHTTPCacheFreshness
+{
+    uint64 m_response_time; ///< When it was received (UTC ms)
+    uint64 m_initial_age;   ///< Its age when received, in ms
+    uint64 m_lifetime;      ///< How long it is fresh for, in ms
+    bool m_no_cache;        ///< It must be revalidated every time
+};
+
+/**
+ * Process-wide private cache of responses to GET requests made by
+ * CIwHTTP, after RFC 9111.
+ *
+ * A response is stored when its status code is cacheable by default (200,
+ * 203, 300, 301, 308, 404 or 410), neither it nor the request says
+ * no-store, and it either says how long it stays fresh (Cache-Control
+ * max-age or Expires) or can be revalidated (ETag or Last-Modified). The
+ * body is stored as the application read it, so with any Content-Encoding
+ * undone. Requests with a Range or conditions of their own are neither
+ * answered from nor stored in the cache.
+ *
+ * A fresh response is used without going to the network. Freshness comes
+ * from max-age, then Expires, then 10% of the time since Last-Modified
+ * (at most a day), less the response's age. A stale one, or one stored
+ * with no-cache, or asked for with Cache-Control no-cache or max-age, is
+ * revalidated with If-None-Match and If-Modified-Since, a 304 refreshing
+ * the stored headers. One response is kept per URI; if its Vary headers
+ * don't match the new request it isn't used, and the new response
+ * replaces it.
+ *
+ * A successful POST, PUT or DELETE to a URI drops the response stored
+ * for it.
+ *
+ * With a disk cache directory configured, responses are also written to
+ * CIwHTTPDiskCache as they are read, and what isn't in memory is looked
+ * for there, so they outlast the application. Likewise small responses are
+ * kept in CIwHTTPSharedCache, if there is one, for other processes to use.
+ *
+ * Read from the [connection] section of the icf:
+ * - httpcachesize: most bytes of headers and bodies kept in memory
+ *   (default 4194304, 0 disables the memory cache), the least recently
+ *   used being dropped first
+ * - httpcacheentrysize: largest single response kept in memory (default
+ *   1048576)
+ *
+ * Like the rest of IwHTTP the cache must only be used from the main thread.
+ */
+class CIwHTTPCache
+{
+public:
+    /// The outcome of a cache lookup.
+    enum Result
+    {
+        MISS,   ///< Nothing usable is stored
+        FRESH,  ///< A response can be used as it is
+        STALE   ///< A response can be used once the server says it may
+    };
+
+    /**
+     * Looks for a response to a GET request.
+     * @param uri The request's URI
+     * @param request The request's header block, as sent
+     * @param headers Receives the stored response's header block, on a
+     * FRESH or STALE result
+     * @param conditions Receives the header lines to add to the request to
+     * revalidate, on a STALE result
+     * @param pBody Receives a reference to the body, to be Released by the
+     * caller, on a FRESH or STALE result
+     * @return the outcome of the lookup
+     */
+    static Result Lookup(const char *uri, const std::string &request, std::string &headers, std::string &conditions, CIwHTTPCacheBody *&pBody);
+
+    /**
+     * Updates a response revalidated by a 304, and the headers it is
+     * stored with.
+     * @param uri The request's URI
+     * @param response The 304's header block
+     * @param headers The stored header block, updated with the 304's
+     * @param pBody The stored body, as returned by Lookup
+     * @param request_time When the request was sent (UTC ms)
+     * @param response_time When the 304 was received (UTC ms)
+     */
+    static void Revalidated(const char *uri, const std::string &response, std::string &headers, CIwHTTPCacheBody *pBody, uint64 request_time, uint64 response_time);
+
+    /**
+     * Decides whether a response to a GET request is to be stored, and if
+     * so makes the body to capture it into.
+     * @param uri The request's URI
+     * @param request The request's header block, as sent
+     * @param response The response's header block
+     * @param code The response's status code
+     * @return the body to Append to, or NULL if the response isn't stored
+     */
+    static CIwHTTPCacheBody* StartStore(const char *uri, const std::string &request, const std::string &response, uint32 code);
+
+    /**
+     * Stores a response whose body has been captured.
+     * @param uri The request's URI
+     * @param request The request's header block, as sent
+     * @param response The response's header block
+     * @param pBody The body from StartStore, which the cache keeps a
+     * reference to
+     * @param decoded Whether the Content-Encoding was undone
+     * @param request_time When the request was sent (UTC ms)
+     * @param response_time When the response was received (UTC ms)
+     */
+    static void Store(const char *uri, const std::string &request, const std::string &response, CIwHTTPCacheBody *pBody, bool decoded, uint64 request_time, uint64 response_time);
+
+    /**
+     * Forgets the response for a URI, in memory and on disk.
+     * @param uri The URI
+     */
+    static void Remove(const char *uri);
+
+    /**
+     * Forgets every response held in memory. Those on disk are left.
+     */
+    static void Flush();
+
+    /**
+     * Makes the key responses to a URI are stored under: the URI without
+     * any fragment, with the scheme and host in lower case.
+     * @param key Receives the key
+     * @param uri The URI
+     */
+    static void MakeKey(std::string &key, const char *uri);
+
+    /**
+     * Returns the number of responses currently cached in memory.
+     * @return the number of entries
+     */
+    static uint32 GetSize();
+
+    /**
+     * Returns the bytes used by the responses currently cached in memory.
+     * @return the bytes used
+     */
+    static uint32 GetBytes();
+
+private:
+    typedef std::list<std::string> LRUList;
+
+    struct Entry
+    {
+        std::string m_headers;  // The response's header block
+        std::string m_vary;     // The request's values for the Vary headers
+        CIwHTTPCacheBody *m_body;
+        CIwHTTPCacheFreshness m_fresh;
+        LRUList::iterator m_lru;
+    };
+
+    typedef std::map<std::string, Entry> EntryMap;
+
+    static EntryMap* s_entries;
+    static LRUList* s_lru;  // Most recently used first
+    static uint32 s_bytes;
+
+    static uint32 GetEntryLimit();
+    static void Assess(const std::string &headers, CIwHTTPCacheFreshness &fresh, uint64 request_time, uint64 response_time);
+    static Result Judge(const std::string &key, const std::string &headers, const CIwHTTPCacheFreshness &fresh, const std::string &request, std::string &conditions);
+    static void MakeVary(std::string &vary, const std::string &headers, const std::string &request);
+    static bool IsCacheableRequest(const std::string &request);
+    static void Insert(const std::string &key, Entry &e);
+    static void Erase(EntryMap::iterator it);
+    static bool LookupShared(const std::string &key, Entry &e);
+    static void Share(const std::string &key, const Entry &e);
+    static void Trim(uint32 max);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_CACHE_H */
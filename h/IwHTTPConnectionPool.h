@@ -0,0 +1,124 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_CONNECTION_POOL_H
+#define IW_HTTP_CONNECTION_POOL_H
+
+#include "s3eSocket.h"
+
+#include <list>
+#include <string>
+
+#ifdef IW_HTTP_SSL
+typedef struct SSL SSL;
+#endif
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * Process-wide pool of idle HTTP/1.1 connections.
+ *
+ * When a CIwHTTP request completes on a connection the server agreed to
+ * keep alive, the connection is handed to the pool instead of being
+ * closed. The next request to the same host and port (through the same
+ * proxy, if any) picks it up and skips the DNS lookup, the TCP handshake
+ * and, for HTTPS, the TLS handshake.
+ *
+ * The pool is tuned through the [connection] section of the icf:
+ * - httpmaxidleconnections: total idle connections kept (default 8, 0
+ *   disables pooling)
+ * - httpmaxidleperhost: idle connections kept per host (default 4)
+ * - httpidletimeout: milliseconds an idle connection is kept (default 30000)
+ *
+ * Like the rest of IwHTTP the pool must only be used from the main thread.
+ */
+class CIwHTTPConnectionPool
+{
+public:
+    /// An open connection, as handed between CIwHTTP and the pool.
+    struct Connection
+    {
+        std::string m_key;
+        int m_socket;
+        s3eSocket *m_pSocket;
+#ifdef IW_HTTP_SSL
+        SSL *m_SSL;
+#endif
+        uint64 m_idleSince;
+
+        Connection() : m_socket(-1), m_pSocket(NULL),
+#ifdef IW_HTTP_SSL
+            m_SSL(NULL),
+#endif
+            m_idleSince(0) {}
+    };
+
+    /**
+     * Builds the key connections are pooled under.
+     * @param key Receives the key
+     * @param host The origin host
+     * @param port The origin port
+     * @param secure Whether the connection uses TLS
+     * @param proxy The proxy host, or NULL for a direct connection
+     * @param proxyPort The proxy port (ignored if proxy is NULL)
+     */
+    static void MakeKey(std::string &key, const char *host, uint16 port, bool secure, const char *proxy, int proxyPort);
+
+    /**
+     * Takes an idle connection for the given key out of the pool. Expired
+     * connections and connections the server has since closed are
+     * discarded along the way.
+     * @param key The key the connection was pooled under
+     * @param conn Receives the connection
+     * @return true if a live connection was found
+     */
+    static bool Acquire(const std::string &key, Connection &conn);
+
+    /**
+     * Returns a connection to the pool. The pool takes ownership and
+     * closes it if the idle limits are exceeded.
+     * @param conn The connection, with m_key set
+     */
+    static void Release(const Connection &conn);
+
+    /**
+     * Closes every idle connection.
+     */
+    static void Flush();
+
+    /**
+     * Returns the number of idle connections currently pooled.
+     * @return the number of idle connections
+     */
+    static uint32 GetIdleCount();
+
+    /**
+     * Closes a connection that is not (or no longer) pooled.
+     * @param conn The connection to close
+     */
+    static void Close(Connection &conn);
+
+private:
+    typedef std::list<Connection> ConnectionList;
+
+    // Most recently released first..
+    static ConnectionList* s_idle;
+
+    static bool IsStale(const Connection &conn);
+    static void PurgeExpired(uint64 now);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_CONNECTION_POOL_H */
@@ -0,0 +1,97 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_CONNECTOR_H
+#define IW_HTTP_CONNECTOR_H
+
+#include "IwHTTPAddress.h"
+
+#include <list>
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * Connects to the first reachable address of a host, racing connection
+ * attempts in the manner of RFC 8305 ("Happy Eyeballs").
+ *
+ * Addresses are tried in the order given. Each attempt gets a head start
+ * of httpconnectattemptdelay milliseconds (default 250, from the
+ * [connection] section of the icf) before the next address is tried
+ * alongside it; an attempt that fails outright moves on to the next
+ * address straight away. The first connection to complete wins and the
+ * rest are abandoned.
+ *
+ * The callback's system data points to an s3eResult. It is never made
+ * from within Start.
+ */
+class CIwHTTPConnector
+{
+public:
+    CIwHTTPConnector();
+    ~CIwHTTPConnector();
+
+    /**
+     * Starts connecting, abandoning any previous attempt.
+     * @param addrs The addresses to try, in order of preference
+     * @param port The port, in host byte order
+     * @param callback Called with the outcome
+     * @param userData User data argument to the callback
+     * @return false if there was nothing to try
+     */
+    bool Start(const CIwHTTPAddressList &addrs, uint16 port, s3eCallback callback, void *userData);
+
+    /**
+     * Abandons all attempts. The callback will not be made.
+     */
+    void Cancel();
+
+    /**
+     * Takes ownership of the connected socket after a successful callback.
+     * @return the socket, or -1 if there isn't one
+     */
+    int TakeSocket();
+
+private:
+    struct Attempt
+    {
+        CIwHTTPConnector *m_owner;
+        int m_socket;
+        s3eSocket *m_pSocket;
+    };
+
+    CIwHTTPAddressList m_addrs;
+    uint32 m_next;
+    std::list<Attempt *> m_attempts;
+    int m_socket;
+
+    s3eCallback m_callback;
+    void *m_userData;
+    bool m_delay_timer;
+    bool m_fail_timer;
+
+    bool StartAttempt();
+    void CloseAttempts();
+    void Report(s3eResult result);
+
+    static int32 AttemptCallback(s3eSocket *, void *, void *);
+    static int32 DelayCallback(void *, void *);
+    static int32 FailCallback(void *, void *);
+
+    CIwHTTPConnector(const CIwHTTPConnector &);
+    CIwHTTPConnector &operator=(const CIwHTTPConnector &);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_CONNECTOR_H */
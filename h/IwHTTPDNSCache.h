@@ -0,0 +1,108 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_DNS_CACHE_H
+#define IW_HTTP_DNS_CACHE_H
+
+#include "IwHTTPAddress.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * Process-wide cache of host name lookups made by CIwHTTP.
+ *
+ * Successful lookups are remembered for httpdnsttl milliseconds (default
+ * 60000) and failed ones for httpdnsnegativettl milliseconds (default
+ * 5000). At most httpdnscachesize hosts (default 64, 0 disables the
+ * cache) are kept, the least recently used being dropped first. All
+ * three are read from the [connection] section of the icf.
+ *
+ * Hosts not in the cache are looked for in CIwHTTPSharedCache, if there is
+ * one, and what is stored is shared there too.
+ *
+ * Like the rest of IwHTTP the cache must only be used from the main thread.
+ */
+class CIwHTTPDNSCache
+{
+public:
+    /// The outcome of a cache lookup.
+    enum Result
+    {
+        MISS,   ///< Nothing (current) is known about the host
+        HIT,    ///< The host's address is known
+        FAILED  ///< The host recently failed to resolve
+    };
+
+    /**
+     * Looks a host up in the cache.
+     * @param host The host name
+     * @param addrs Receives the addresses on a HIT
+     * @return the outcome of the lookup
+     */
+    static Result Lookup(const char *host, CIwHTTPAddressList &addrs);
+
+    /**
+     * Records the result of resolving a host.
+     * @param host The host name
+     * @param addrs The addresses, or NULL if the lookup failed
+     * @param ttl How long to keep the entry in milliseconds, or -1 to use
+     * the configured default
+     */
+    static void Store(const char *host, const CIwHTTPAddressList *addrs, int ttl = -1);
+
+    /**
+     * Forgets a single host.
+     * @param host The host name
+     */
+    static void Remove(const char *host);
+
+    /**
+     * Forgets every host.
+     */
+    static void Flush();
+
+    /**
+     * Returns the number of hosts currently cached.
+     * @return the number of entries
+     */
+    static uint32 GetSize();
+
+private:
+    typedef std::list<std::string> LRUList;
+
+    struct Entry
+    {
+        CIwHTTPAddressList m_addrs;
+        bool m_failed;
+        uint64 m_expires;
+        LRUList::iterator m_lru;
+    };
+
+    typedef std::map<std::string, Entry> EntryMap;
+
+    static EntryMap* s_entries;
+    static LRUList* s_lru;  // Most recently used first
+
+    static void Erase(EntryMap::iterator it);
+    static Result LookupShared(const char *host, CIwHTTPAddressList &addrs);
+    static void Keep(const char *host, const CIwHTTPAddressList *addrs, int ttl);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_DNS_CACHE_H */
@@ -0,0 +1,159 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_DECODER_H
+#define IW_HTTP_DECODER_H
+
+#include "s3eTypes.h"
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * Undoes the Content-Encoding of a response body as it is read.
+ *
+ * The body goes in as it arrives from the connection, and comes out
+ * decoded into the reader's own buffer, so memory use is bounded by the
+ * decoder's buffers and the coding's window whatever the body's size.
+ *
+ * Which codings are understood depends on the build:
+ * - gzip and deflate with IW_HTTP_ZLIB (zlib)
+ * - br with IW_HTTP_BROTLI (the Brotli decoder library)
+ * - zstd with IW_HTTP_ZSTD (libzstd), with windows of up to 8MB
+ *
+ * Responses are only decoded for requests that asked for a coding, which
+ * CIwHTTP does when httpacceptencoding is set.
+ *
+ * Read from the [connection] section of the icf:
+ * - httpacceptencoding: add an Accept-Encoding header to requests that
+ *   don't set their own (default 0)
+ * - httpdecodebuffersize: bytes of body held waiting to be decoded, and
+ *   of output held for PeekData (default 16384)
+ */
+class CIwHTTPDecoder
+{
+public:
+    /**
+     * Returns the value of the Accept-Encoding header to send.
+     * @return the codings understood, or NULL if there are none
+     */
+    static const char* GetAcceptEncoding();
+
+    /**
+     * Makes a decoder for a Content-Encoding header.
+     * @param value The header's value
+     * @param len The length of the value
+     * @return the decoder, or NULL if the body isn't encoded or is
+     * encoded in a way that can't be undone
+     */
+    static CIwHTTPDecoder* Create(const char *value, uint32 len);
+
+    ~CIwHTTPDecoder();
+
+    /**
+     * Returns where more of the encoded body can be put.
+     * @param space Filled in with the room there
+     * @return the space, to be followed by AddInput
+     */
+    char* GetInput(uint32 &space);
+
+    /**
+     * Takes encoded body put where GetInput said.
+     * @param len The number of bytes
+     */
+    void AddInput(uint32 len);
+
+    /**
+     * Decodes as much as fits.
+     * @param buf The buffer to fill
+     * @param len The length of the buffer
+     * @return the bytes decoded, which is less than len if more input is
+     * needed or the end has been reached, or -1 if the body is corrupt
+     */
+    int32 Read(char *buf, uint32 len);
+
+    /**
+     * Decodes into the decoder's own buffer, as for CIwHTTP::PeekData.
+     * @param pData Filled in with the start of the decoded bytes
+     * @return the bytes available, 0 if more input is needed (or on
+     * error, see HasFailed)
+     */
+    uint32 Peek(const char *&pData);
+
+    /**
+     * Releases bytes returned by Peek.
+     * @param bytes The number of bytes used
+     */
+    void Consume(uint32 bytes);
+
+    /**
+     * Returns the decoded bytes held for Peek and not yet consumed.
+     */
+    uint32 GetPending() const { return m_out_end - m_out_start; }
+
+    /**
+     * Returns true once the encoded stream has ended and everything it
+     * decoded to has been read.
+     */
+    bool IsFinished() const { return m_end && m_out_start == m_out_end; }
+
+    /**
+     * Returns true if the body was found to be corrupt.
+     */
+    bool HasFailed() const { return m_failed; }
+
+    /**
+     * Returns the name of the coding, for tracing.
+     */
+    const char* GetName() const;
+
+private:
+    enum Coding
+    {
+        GZIP,
+        DEFLATE,
+        BROTLI,
+        ZSTD
+    };
+
+    Coding m_coding;
+    void *m_stream;     // The library's state, made on first use
+    bool m_end;
+    bool m_failed;
+
+    // Encoded body waiting, in [m_in_start, m_in_end)..
+    char *m_in;
+    uint32 m_in_size;
+    uint32 m_in_start;
+    uint32 m_in_end;
+
+    // Decoded for Peek, in [m_out_start, m_out_end)..
+    char *m_out;
+    uint32 m_out_size;
+    uint32 m_out_start;
+    uint32 m_out_end;
+
+    CIwHTTPDecoder(Coding coding);
+
+    bool Init();
+    int32 Decode(char *buf, uint32 len);
+    int32 DecodeStep(char *buf, uint32 len);
+    void Fail(const char *what);
+
+    CIwHTTPDecoder(const CIwHTTPDecoder &);
+    CIwHTTPDecoder &operator=(const CIwHTTPDecoder &);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_DECODER_H */
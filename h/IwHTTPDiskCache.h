@@ -0,0 +1,174 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_DISK_CACHE_H
+#define IW_HTTP_DISK_CACHE_H
+
+#include "IwHTTPCache.h"
+
+#include <string>
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * The disk tier of CIwHTTPCache, so responses outlast the application.
+ *
+ * Each response is a file named for the hash of its key, holding the body
+ * followed by the key, headers and Vary values, so a hit can map the body
+ * straight from the file. Bodies are written as they are read, to a
+ * temporary file that is renamed into place once complete.
+ *
+ * The files are found through an index file, mapped into memory, with a
+ * fixed number of fixed size slots. A slot holds a key's hash, how fresh
+ * the response is, the size of its file and when it was last used; slots
+ * are found by hash, a few per hash being tried. A slot is only written
+ * once its file is in place, and carries a checksum, so after a crash a
+ * torn slot or one that doesn't match its file is simply dropped.
+ *
+ * The least recently used files are removed to keep within the size
+ * limit.
+ *
+ * Processes can share a cache directory: the index is locked while it is
+ * used, and temporary files are named for the process writing them, so
+ * only those whose process has gone (or that have been left untouched
+ * for an hour) are cleared away. Processes sharing a directory must agree
+ * on httpcachediskentries.
+ *
+ * Read from the [connection] section of the icf:
+ * - httpcachedir: the directory to keep the cache in (by default there is
+ *   no disk cache)
+ * - httpcachedisksize: most bytes of files kept (default 33554432)
+ * - httpcachediskentrysize: largest single response kept (default
+ *   8388608)
+ * - httpcachediskentries: slots in the index, so most responses kept
+ *   (default 1024). Changing it empties the cache.
+ */
+class CIwHTTPDiskCache
+{
+public:
+    /**
+     * Opens the cache, if it is configured and not yet open.
+     * @return true if the cache can be used
+     */
+    static bool Open();
+
+    /**
+     * Unmaps the index. The cache is opened again when next used.
+     */
+    static void Close();
+
+    /**
+     * Starts writing a body to the cache.
+     * @param key The response's key
+     * @param pBody The body being captured, which is given a file to write
+     * to
+     */
+    static void Create(const std::string &key, CIwHTTPCacheBody *pBody);
+
+    /**
+     * Writes some of a body being captured.
+     * @param pBody The body
+     * @param pData The bytes to write
+     * @param len The number of bytes
+     * @return false if it couldn't be written, and has been abandoned
+     */
+    static bool Write(CIwHTTPCacheBody *pBody, const char *pData, uint32 len);
+
+    /**
+     * Stops writing a body, throwing away what was written.
+     * @param pBody The body
+     */
+    static void Abandon(CIwHTTPCacheBody *pBody);
+
+    /**
+     * Puts a completely written body in place, replacing any response
+     * stored under its key.
+     * @param key The response's key
+     * @param headers The response's header block, as it is to be stored
+     * @param vary The request's values for the response's Vary headers
+     * @param fresh How fresh the response is
+     * @param pBody The body, written since Create
+     */
+    static void Commit(const std::string &key, const std::string &headers, const std::string &vary, const CIwHTTPCacheFreshness &fresh, CIwHTTPCacheBody *pBody);
+
+    /**
+     * Finds a stored response.
+     * @param key The key to look for
+     * @param headers Receives the response's header block
+     * @param vary Receives the request's values for its Vary headers
+     * @param fresh Receives how fresh it is
+     * @param pBody Receives the body, mapped from its file, to be Released
+     * by the caller
+     * @return true if found
+     */
+    static bool Lookup(const std::string &key, std::string &headers, std::string &vary, CIwHTTPCacheFreshness &fresh, CIwHTTPCacheBody *&pBody);
+
+    /**
+     * Records a stored response's freshness, after it was revalidated.
+     * @param key The response's key
+     * @param fresh How fresh it is now
+     */
+    static void Update(const std::string &key, const CIwHTTPCacheFreshness &fresh);
+
+    /**
+     * Removes a stored response.
+     * @param key The response's key
+     */
+    static void Remove(const std::string &key);
+
+    /**
+     * Removes every stored response.
+     */
+    static void Flush();
+
+    /**
+     * Returns the number of responses stored.
+     */
+    static uint32 GetSize();
+
+    /**
+     * Returns the bytes of files stored.
+     */
+    static uint64 GetBytes();
+
+private:
+    struct Header;
+    struct Slot;
+
+    static bool s_tried;
+    static std::string s_dir;
+    static Header* s_index;
+    static Slot* s_slots;
+    static uint32 s_index_size;
+    static int s_fd;
+    static uint64 s_bytes;
+    static uint32 s_temp;
+
+    static uint64 Hash(const std::string &key);
+    static Slot* Find(uint64 hash);
+    static Slot* Claim(uint64 hash);
+    static void Seal(Slot *slot);
+    static void Clear(Slot *slot);
+    static void Trim(uint64 max);
+    static void MakePath(std::string &path, uint64 hash);
+    static bool Lock();
+    static void Unlock();
+    static bool IsStaleTemp(const char *name);
+    static void Sweep(bool all);
+    static bool LookupInternal(const std::string &key, std::string &headers, std::string &vary, CIwHTTPCacheFreshness &fresh, CIwHTTPCacheBody *&pBody);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_DISK_CACHE_H */
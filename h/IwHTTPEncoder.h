@@ -0,0 +1,151 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_ENCODER_H
+#define IW_HTTP_ENCODER_H
+
+#include "s3eTypes.h"
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * Applies a Content-Encoding to a request body as it is sent.
+ *
+ * The body goes in a piece at a time, straight from where it is held, and
+ * comes out compressed into the encoder's own buffer, to be sent before
+ * any more goes in. The compressed body is never held whole.
+ *
+ * Which codings can be applied depends on the build:
+ * - gzip with IW_HTTP_ZLIB (zlib)
+ * - zstd with IW_HTTP_ZSTD (libzstd)
+ *
+ * Read from the [connection] section of the icf:
+ * - httpencodebuffersize: bytes of compressed body held waiting to be
+ *   sent (default 16384)
+ * - httpencodelevel: the compression level, 0 being the library's
+ *   default (default 0)
+ */
+class CIwHTTPEncoder
+{
+public:
+    enum Coding
+    {
+        GZIP,
+        ZSTD
+    };
+
+    /**
+     * Returns whether a coding was built in.
+     * @param coding The coding
+     * @return true if Create can make an encoder for it
+     */
+    static bool IsSupported(Coding coding);
+
+    /**
+     * Makes an encoder.
+     * @param coding The coding to apply
+     * @return the encoder, or NULL if the coding isn't supported or the
+     * library couldn't be set up
+     */
+    static CIwHTTPEncoder* Create(Coding coding);
+
+    ~CIwHTTPEncoder();
+
+    /**
+     * Compresses as much of some body as there is room for.
+     * @param buf The body
+     * @param len The length of the body
+     * @return the bytes of the body taken, or -1 on error
+     */
+    int32 Write(const char *buf, uint32 len);
+
+    /**
+     * Ends the stream, once all the body has been written. Call again
+     * after the output has been consumed until IsFinished.
+     * @return false on error
+     */
+    bool Finish();
+
+    /**
+     * Returns the compressed bytes waiting to be sent.
+     * @param pData Filled in with the start of them
+     * @return the number of bytes
+     */
+    uint32 Peek(const char *&pData) const;
+
+    /**
+     * Releases bytes returned by Peek, once sent.
+     * @param bytes The number of bytes sent
+     */
+    void Consume(uint32 bytes);
+
+    /**
+     * Returns the compressed bytes waiting to be sent.
+     */
+    uint32 GetPending() const { return m_out_end - m_out_start; }
+
+    /**
+     * Returns the room left for output. Nothing more should be written
+     * once there is none.
+     */
+    uint32 GetSpace() const { return m_out_size - m_out_end; }
+
+    /**
+     * Starts the stream again, dropping anything not yet consumed, for a
+     * request being sent again.
+     */
+    void Reset();
+
+    /**
+     * Returns true once the end of the stream has been output.
+     */
+    bool IsFinished() const { return m_end; }
+
+    /**
+     * Returns the bytes of body written and compressed bytes output, for
+     * tracing.
+     */
+    uint32 GetTotalIn() const { return m_total_in; }
+    uint32 GetTotalOut() const { return m_total_out; }
+
+    /**
+     * Returns the name of the coding, as for Content-Encoding.
+     */
+    const char* GetName() const;
+
+private:
+    Coding m_coding;
+    void *m_stream;     // The library's state
+    bool m_end;
+    uint32 m_total_in;
+    uint32 m_total_out;
+
+    // Compressed and waiting, in [m_out_start, m_out_end)..
+    char *m_out;
+    uint32 m_out_size;
+    uint32 m_out_start;
+    uint32 m_out_end;
+
+    CIwHTTPEncoder(Coding coding);
+
+    bool Init();
+    int32 Encode(const char *buf, uint32 len, bool finish);
+
+    CIwHTTPEncoder(const CIwHTTPEncoder &);
+    CIwHTTPEncoder &operator=(const CIwHTTPEncoder &);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_ENCODER_H */
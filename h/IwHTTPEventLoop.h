@@ -0,0 +1,267 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_EVENT_LOOP_H
+#define IW_HTTP_EVENT_LOOP_H
+
+#include "s3eSocket.h"
+#include "s3eThread.h"
+#include "s3eTimer.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * Where IwHTTP waits for its sockets and timers.
+ *
+ * By default this is s3e: the calls here pass straight on to
+ * s3eSocketReadable, s3eSocketWritable, s3eTimerSetTimer and friends,
+ * and callbacks are made as the application yields.
+ *
+ * On Linux, setting httpepoll to 1 in the [connection] section of the icf
+ * has IwHTTP run its own loop instead, which the application drives by
+ * calling Run in place of s3eDeviceYield. Each socket is added to an
+ * edge-triggered epoll set once, for both reading and writing, and stays
+ * there until it is closed, so waiting on it again is just a matter of
+ * recording the callback. Whether a socket can be read or written is
+ * remembered from the edges seen, and only forgotten once IwHTTP is told
+ * it would block, so a callback made ready is made on the next Run
+ * without waiting. Timers are kept in order and a timerfd woken for the
+ * earliest; callbacks from other threads are handed over through an
+ * eventfd.
+ *
+ * Setting httpiouring to 1 as well has the loop read and write plain
+ * sockets through io_uring rather than waiting for them to be ready.
+ * Recv hands over what has already been read into a buffer of the
+ * socket's own, and starts the next read as soon as that is all taken;
+ * Send, SendMsg and SendFile take what fits in another buffer and send
+ * it from there, the readable and writable callbacks being made as these
+ * complete. Connect and downloads' Write go through the ring too, as do
+ * the reads of files SendFile sends. Everything asked for is submitted
+ * together at the start of the next Run. The buffers, httpringbuffers of
+ * httpringbuffersize bytes, are registered with the kernel where the
+ * memory can be locked; sockets and files that find none free are read
+ * and written directly, as are TLS sockets, whose reads and writes
+ * OpenSSL makes itself. Without io_uring, or with a kernel too old to
+ * poll sockets for it, the loop carries on with epoll alone.
+ *
+ * Callbacks are never made from within the calls that ask for them,
+ * and each is made once per request, as with s3e. Everything but
+ * EnqueueCallback must be used from the thread that calls Run.
+ */
+class CIwHTTPEventLoop
+{
+public:
+    /**
+     * Whether IwHTTP runs its own loop, which Run must then drive.
+     */
+    static bool IsNative();
+
+    /**
+     * Waits for sockets and timers, making the callbacks that are due.
+     * With s3e this just yields.
+     * @param ms The longest to wait, 0 not to wait at all
+     * @return the number of callbacks made
+     */
+    static int32 Run(int32 ms);
+
+    /**
+     * Asks for a callback once a socket can be read, as
+     * s3eSocketReadable does.
+     * @param fd The socket
+     * @param pSocket Its s3e handle, passed to the callback
+     * @param fn The callback, or NULL to stop waiting
+     * @param pUserData User data argument to the callback
+     */
+    static s3eResult SocketReadable(int fd, s3eSocket *pSocket, s3eSocketCallbackFn fn, void *pUserData);
+
+    /**
+     * Asks for a callback once a socket can be written, as
+     * s3eSocketWritable does.
+     * @param fd The socket
+     * @param pSocket Its s3e handle, passed to the callback
+     * @param fn The callback, or NULL to stop waiting
+     * @param pUserData User data argument to the callback
+     */
+    static s3eResult SocketWritable(int fd, s3eSocket *pSocket, s3eSocketCallbackFn fn, void *pUserData);
+
+    /**
+     * Records that reading or writing a socket would block, so that it
+     * is waited for until the next edge. Called wherever IwHTTP gets
+     * EAGAIN or its SSL equivalent.
+     * @param fd The socket
+     * @param write true if it was writing that would block
+     */
+    static void WouldBlock(int fd, bool write);
+
+    /**
+     * Closes a socket, forgetting anything waiting on it.
+     * @param fd The socket
+     */
+    static void CloseSocket(int fd);
+
+    /**
+     * Closes a file written with Write. Anything still being written is
+     * abandoned.
+     * @param fd The file
+     */
+    static void CloseFile(int fd);
+
+    /**
+     * Says a socket has been put aside with nothing expected from it.
+     * Through the ring its read is cancelled and its buffer given back.
+     * @param fd The socket
+     */
+    static void SocketIdle(int fd);
+
+    /**
+     * Looks at what can be read from a socket without taking it, as recv
+     * with MSG_PEEK does. This never starts a read through the ring, but
+     * does see what the ring has already read.
+     * @param fd The socket
+     * @param pBuf Where to copy to
+     * @param len The most to copy
+     * @return the number of bytes there, 0 at the end, or -1 with errno set
+     */
+    static int Peek(int fd, char *pBuf, int len);
+
+    /**
+     * Reads a socket, as recv does. Through the ring this is from what
+     * has already been read, failing with EAGAIN while a read is on its
+     * way, and errors are seen once what was read before them is taken.
+     * @param fd The socket
+     * @param pBuf Where to read to
+     * @param len The most to read
+     * @param flags recv flags, of which only MSG_PEEK is kept to
+     * through the ring
+     * @return the number of bytes read, 0 at the end, or -1 with errno set
+     */
+    static int Recv(int fd, char *pBuf, int len, int flags);
+
+    /**
+     * Sends on a socket, as send does but without SIGPIPE. Through the
+     * ring what fits is taken to be sent, failing with EAGAIN while an
+     * earlier send is still going, and a failed send is reported by the
+     * next.
+     * @param fd The socket
+     * @param pBuf The bytes
+     * @param len The number of bytes
+     * @return the number of bytes taken, or -1 with errno set
+     */
+    static int Send(int fd, const char *pBuf, int len);
+
+    /**
+     * Sends from several buffers, as sendmsg does. Otherwise as Send.
+     * @param fd The socket
+     * @param iov The buffers
+     * @param n The number of buffers
+     * @return the number of bytes taken, or -1 with errno set
+     */
+    static int SendMsg(int fd, const struct iovec *iov, int n);
+
+    /**
+     * Sends from a file, as sendfile does. Through the ring the file is
+     * read into the socket's buffer and sent from there, a short read
+     * failing the next send. Only on Linux.
+     * @param fd The socket
+     * @param file The file
+     * @param pOffset Where in the file to start, moved on past what is sent
+     * @param count The most to send
+     * @return the number of bytes taken, or -1 with errno set
+     */
+    static int SendFile(int fd, int file, off_t *pOffset, uint32 count);
+
+    /**
+     * Writes to a file, as write does. Through the ring what fits is
+     * taken to be written, failing with EAGAIN while IsWriting, and a
+     * failed write is reported by the next Write, which can be of 0 bytes
+     * to find out.
+     * @param fd The file
+     * @param pBuf The bytes
+     * @param len The number of bytes
+     * @return the number of bytes taken, or -1 with errno set
+     */
+    static int Write(int fd, const char *pBuf, int len);
+
+    /**
+     * Whether the ring is still writing to a file or socket. Once it has
+     * finished a callback asked for with SocketWritable is made, for files
+     * too.
+     * @param fd The file or socket
+     */
+    static bool IsWriting(int fd);
+
+    /**
+     * Returns the most the ring takes in one go, or 0 if there's no ring.
+     */
+    static uint32 GetRingBufferSize();
+
+    /**
+     * Connects a non-blocking socket, calling back once it has or hasn't,
+     * when GetConnectError says which.
+     * @param fd The socket
+     * @param pSocket Its s3e handle, passed to the callback
+     * @param pAddr The address
+     * @param len The address's length
+     * @param fn The callback
+     * @param pUserData User data argument to the callback
+     * @return S3E_RESULT_ERROR, with errno set, if it failed straight away
+     */
+    static s3eResult Connect(int fd, s3eSocket *pSocket, const struct sockaddr *pAddr, socklen_t len, s3eSocketCallbackFn fn, void *pUserData);
+
+    /**
+     * Returns how a connect went, 0 if it went well or an errno.
+     * @param fd The socket
+     */
+    static int GetConnectError(int fd);
+
+    /**
+     * Sets a timer, as s3eTimerSetTimer does.
+     * @param ms The delay
+     * @param fn The callback
+     * @param pUserData User data argument to the callback
+     */
+    static s3eResult SetTimer(uint32 ms, s3eCallback fn, void *pUserData);
+
+    /**
+     * Cancels every timer set with this callback and user data, as
+     * s3eTimerCancelTimer does.
+     * @param fn The callback
+     * @param pUserData The user data it was set with
+     */
+    static s3eResult CancelTimer(s3eCallback fn, void *pUserData);
+
+    /**
+     * Has a callback made on the loop's thread, as
+     * s3eThreadEnqueueCallback does. This can be called from any thread,
+     * once IsNative has been called on the loop's.
+     * @param pThread The loop's thread, for s3e
+     * @param fn The callback
+     * @param pUserData User data argument to the callback
+     */
+    static s3eResult EnqueueCallback(s3eThread *pThread, s3eCallback fn, void *pUserData);
+
+    /**
+     * Closes the loop, dropping every timer and callback waiting. The icf
+     * is read again when next used.
+     */
+    static void Terminate();
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_EVENT_LOOP_H */
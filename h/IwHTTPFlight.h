@@ -0,0 +1,174 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_FLIGHT_H
+#define IW_HTTP_FLIGHT_H
+
+#include "s3eTypes.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+class CIwHTTP;
+class CIwHTTPCacheBody;
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * A GET request on its way, that the same request made meanwhile joins
+ * rather than going to the network itself.
+ *
+ * The first request for a key leads: it is sent as usual, and its
+ * response is handed to the others, its followers, as the leader reads
+ * it. Followers read the body through their own ReadData, ReadDataAsync,
+ * PeekData or DownloadToFile; it is kept in memory until they are done
+ * with it. The body is as the leader reads it, so with any
+ * Content-Encoding undone, and the leader must be read for the followers
+ * to be.
+ *
+ * When the body's length is known up front, room is made for all of it
+ * and followers are given the leader's headers as soon as it has them,
+ * reading the body as it arrives. Otherwise followers are answered once
+ * the leader has the whole body, as it may have to move while it grows.
+ * A body bigger than httpcoalescesize in the [connection] section of the
+ * icf (default 1MB) isn't shared: followers not yet answered are sent
+ * on their own instead.
+ *
+ * Requests join until the leader has all of its response. If nobody has
+ * joined by the time the leader has its headers, no more can, so a lone
+ * request's body isn't copied. If the leader is cancelled before its
+ * followers are answered one of them is sent in its place; if it fails,
+ * or is cancelled part way through a body already handed out, its
+ * followers fail too.
+ *
+ * CIwHTTP keys requests on the URI and the whole request header block, so
+ * only requests that would be sent alike are joined. Since followers wait
+ * on the leader being read, requests are only joined when httpcoalesce is
+ * set to 1 in the [connection] section of the icf (default 0), by code
+ * that reads every request it makes.
+ *
+ * Like the rest of IwHTTP flights must only be used from the main thread.
+ */
+class CIwHTTPFlight
+{
+public:
+    /**
+     * Joins a request to the flight for its key, starting one with it as
+     * the leader if there is none.
+     * @param key The request's key
+     * @param pHTTP The request
+     * @return the flight, which pHTTP leads if GetLeader returns it
+     */
+    static CIwHTTPFlight* Join(const std::string &key, CIwHTTP *pHTTP);
+
+    /**
+     * Takes a request out of the flight. A leader leaving before it is
+     * answered hands over to the first follower; one leaving before the
+     * body is complete fails it. The flight is freed once everyone has
+     * left.
+     * @param pHTTP The request
+     */
+    void Leave(CIwHTTP *pHTTP);
+
+    /**
+     * Gives the followers the leader's response headers, or keeps them
+     * until the body is complete if its length isn't known.
+     * @param headers The response's header block
+     * @param content_length The body's length, 0 if not known
+     * @param pBody The whole body if it is already to hand, which the
+     * flight keeps a reference to, or NULL for it to be Fed
+     */
+    void Answer(const std::string &headers, int32 content_length, CIwHTTPCacheBody *pBody);
+
+    /**
+     * Gives the followers more of the body.
+     * @param pData The bytes
+     * @param len The number of bytes
+     */
+    void Feed(const char *pData, uint32 len);
+
+    /**
+     * Tells the followers they have all of the body.
+     */
+    void Complete();
+
+    /**
+     * Fails the followers.
+     */
+    void Fail();
+
+    /// The request sending for the flight.
+    CIwHTTP* GetLeader() const { return m_leader; }
+
+    /// Whether the leader has its response headers.
+    bool IsAnswered() const { return m_body != NULL; }
+
+    /// Whether the followers can have the response headers.
+    bool IsReady() const { return m_body && (m_streamed || m_complete) && !m_overflowed; }
+
+    /// Whether the body is too big to share, so followers go on their own.
+    bool HasOverflowed() const { return m_overflowed; }
+
+    /// Whether the followers have all of the body.
+    bool IsComplete() const { return m_complete; }
+
+    /// Whether the followers are to fail.
+    bool HasFailed() const { return m_failed; }
+
+    /// The response header block, once answered.
+    const std::string& GetHeaders() const { return m_headers; }
+
+    /// The body's length, 0 if not known.
+    int32 GetContentLength() const { return m_content_length; }
+
+    /// The body so far, once answered.
+    CIwHTTPCacheBody* GetBody() const { return m_body; }
+
+    /// The number of requests following the leader.
+    uint32 GetFollowerCount() const { return m_followers.size(); }
+
+    /**
+     * Returns the number of flights that can be joined.
+     */
+    static uint32 GetSize();
+
+private:
+    typedef std::map<std::string, CIwHTTPFlight*> FlightMap;
+
+    static FlightMap* s_flights;
+
+    std::string m_key;
+    CIwHTTP *m_leader;
+    std::list<CIwHTTP*> m_followers;
+    std::string m_headers;
+    int32 m_content_length;
+    CIwHTTPCacheBody *m_body;
+    bool m_open;        // In s_flights, so can be joined
+    bool m_streamed;    // Handed out as it arrives, room made for all of it
+    bool m_complete;
+    bool m_failed;
+    bool m_overflowed;
+
+    CIwHTTPFlight(const std::string &key, CIwHTTP *pLeader);
+    ~CIwHTTPFlight();
+
+    void Close();
+    void Wake();
+    void Overflow();
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_FLIGHT_H */
@@ -0,0 +1,125 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_HPACK_H
+#define IW_HTTP_HPACK_H
+
+#include "s3eTypes.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * HPACK header compression (RFC 7541) for one HTTP/2 connection.
+ *
+ * Each direction has its own dynamic table, so one object encodes the
+ * header blocks we send and decodes those we receive. Header blocks must
+ * be encoded and decoded in the order they go over the connection.
+ *
+ * Headers likely to be repeated are added to the peer's dynamic table so
+ * later requests send just an index. Credentials are sent as never
+ * indexed, and strings are Huffman coded when that makes them shorter.
+ */
+class CIwHTTPHPACK
+{
+public:
+    /// A decoded header field.
+    struct Header
+    {
+        std::string m_name;
+        std::string m_value;
+    };
+    typedef std::vector<Header> HeaderList;
+
+    CIwHTTPHPACK();
+
+    /**
+     * Sets the most the peer lets our encoder's dynamic table hold, from
+     * its SETTINGS_HEADER_TABLE_SIZE. The change is signalled at the start
+     * of the next header block.
+     * @param size The size in bytes
+     */
+    void SetEncoderTableSize(uint32 size);
+
+    /**
+     * Starts encoding a header block.
+     * @param out The block is appended to this
+     */
+    void BeginBlock(std::string &out);
+
+    /**
+     * Encodes one header field. Names must be lower case.
+     * @param out The block is appended to this
+     * @param name The field name
+     * @param value The field value
+     */
+    void Encode(std::string &out, const std::string &name, const std::string &value);
+
+    /**
+     * Decodes a complete header block.
+     * @param data The block
+     * @param len The length of the block
+     * @param headers The fields are appended to this
+     * @return false if the block is malformed, which is fatal to the
+     * connection since the tables are then out of step.
+     */
+    bool Decode(const uint8 *data, uint32 len, HeaderList &headers);
+
+private:
+    // A dynamic table, the newest entry at the front..
+    class Table
+    {
+    public:
+        Table(uint32 maxSize) : m_size(0), m_max_size(maxSize) {}
+
+        void Add(const std::string &name, const std::string &value);
+        void SetMaxSize(uint32 size);
+        uint32 GetMaxSize() const { return m_max_size; }
+        uint32 GetCount() const { return m_entries.size(); }
+        const Header& Get(uint32 i) const { return m_entries[i]; }
+
+    private:
+        std::deque<Header> m_entries;
+        uint32 m_size;
+        uint32 m_max_size;
+
+        void Evict(uint32 size);
+    };
+
+    Table m_encoder;
+    Table m_decoder;
+    bool m_size_update;         // m_encoder's size is yet to be signalled
+
+    bool GetEntry(uint32 index, std::string &name, std::string &value) const;
+    int FindEncoded(const std::string &name, const std::string &value, bool &name_only) const;
+    static bool ShouldIndex(const std::string &name, const std::string &value, bool &never);
+
+    static void EncodeInteger(std::string &out, uint8 first, uint32 prefix, uint32 value);
+    static bool DecodeInteger(const uint8 *&p, const uint8 *end, uint32 prefix, uint32 &value);
+    static void EncodeString(std::string &out, const std::string &str);
+    static bool DecodeString(const uint8 *&p, const uint8 *end, std::string &str);
+
+    // Huffman coding, with the code itself built on first use..
+    static void HuffmanInit();
+    static uint32 HuffmanLength(const std::string &str);
+    static void HuffmanEncode(std::string &out, const std::string &str);
+    static bool HuffmanDecode(const uint8 *p, uint32 len, std::string &str);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_HPACK_H */
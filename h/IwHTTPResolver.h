@@ -0,0 +1,133 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_RESOLVER_H
+#define IW_HTTP_RESOLVER_H
+
+#include "IwHTTPAddress.h"
+#include "s3eThread.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * Host name resolver used by CIwHTTP.
+ *
+ * Where threads are available lookups run concurrently on a small pool
+ * of worker threads (httpdnsthreads in the [connection] section of the
+ * icf, default 4), so one slow host name doesn't hold up the others.
+ * Without threads lookups go through s3eInetLookup one at a time, which
+ * only finds IPv4 addresses (numeric IPv6 addresses are still accepted).
+ *
+ * Threaded lookups return both IPv4 and IPv6 addresses unless httpipv6
+ * is set to 0. The system's order of preference is kept but the two
+ * families are interleaved, as RFC 8305 recommends, so that connection
+ * racing alternates between them.
+ *
+ * Concurrent requests for the same host share a single lookup. Results
+ * are recorded in CIwHTTPDNSCache.
+ *
+ * Callbacks are always made on the main thread, and never from within
+ * Resolve. The callback's system data is a pointer to the resolved
+ * CIwHTTPAddressList (valid only for the duration of the callback) or
+ * NULL if the lookup failed.
+ */
+class CIwHTTPResolver
+{
+public:
+    struct Waiter;
+
+    /**
+     * Starts resolving a host, or joins a lookup already under way.
+     * @param host The host name
+     * @param callback Called once the lookup completes
+     * @param userData User data argument to the callback
+     * @return A handle that can be passed to Cancel until the callback
+     * has been made, or NULL if the lookup could not be started.
+     */
+    static Waiter* Resolve(const char *host, s3eCallback callback, void *userData);
+
+    /**
+     * Withdraws interest in a lookup. The callback will not be made.
+     * This is a constant time operation.
+     * @param waiter The handle returned by Resolve
+     */
+    static void Cancel(Waiter *waiter);
+
+    /**
+     * Stops the worker threads. Lookups that have not yet started fail,
+     * their callbacks being made from within Terminate; lookups already
+     * running complete as normal.
+     */
+    static void Terminate();
+
+protected:
+    struct Lookup;
+    typedef std::list<Waiter *> WaiterList;
+    typedef std::map<std::string, Lookup *> LookupMap;
+
+    struct Lookup
+    {
+        std::string m_host;
+        WaiterList m_waiters;
+        CIwHTTPAddressList m_addrs;
+        s3eInetAddress m_inet;
+    };
+
+public:
+    struct Waiter
+    {
+        Lookup *m_lookup;
+        WaiterList::iterator m_it;
+        s3eCallback m_callback;
+        void *m_userData;
+    };
+
+protected:
+    // Main thread only..
+    static LookupMap* s_lookups;
+
+    // Shared with the workers, under s_lock..
+    static std::list<Lookup *>* s_jobs;
+    static s3eThreadLock* s_lock;
+    static s3eThreadSem* s_jobSem;
+    static s3eThread* s_mainThread;
+    static s3eThread** s_workers;
+    static int s_numWorkers;
+    static int s_family;
+
+    static bool s_terminate;
+
+    // Used when there are no threads..
+    static bool s_bLookupInProgress;
+    static bool s_bIssueTimer;
+
+    static void Lock();
+    static void Unlock();
+    static bool StartWorkers();
+    static void* WorkerMain(void *);
+    static void Issue();
+    static int32 IssueCallback(void *, void *);
+    static int32 InetLookupCallback(void *, void *);
+    static int32 CompleteCallback(void *, void *);
+    static void Complete(Lookup *lookup);
+    static void Interleave(CIwHTTPAddressList &addrs);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_RESOLVER_H */
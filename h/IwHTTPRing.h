@@ -0,0 +1,133 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_RING_H
+#define IW_HTTP_RING_H
+
+#include "s3eTypes.h"
+
+#include <stddef.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#if defined(IORING_FEAT_FAST_POLL)
+#define IW_HTTP_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef IW_HTTP_IO_URING
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * An io_uring submission and completion queue pair, set up with the raw
+ * system calls.
+ *
+ * Entries taken with GetSQE are queued until Submit hands them all to the
+ * kernel in the one call, so work asked for across many connections goes
+ * in together. Completions are taken with GetCQE. The ring's fd can be
+ * polled to find out when there are completions to take.
+ *
+ * Only the features CIwHTTPEventLoop needs are here. A ring can only be
+ * used from one thread.
+ */
+class CIwHTTPRing
+{
+public:
+    CIwHTTPRing();
+    ~CIwHTTPRing();
+
+    /**
+     * Sets up the ring. This fails if the kernel hasn't io_uring, or it
+     * has been turned off, or the kernel can't poll sockets itself.
+     * @param entries The size of the submission queue
+     * @param cq_entries The size of the completion queue
+     * @return false if it isn't to be had
+     */
+    bool Open(uint32 entries, uint32 cq_entries);
+
+    /**
+     * Closes the ring, cancelling everything in it.
+     */
+    void Close();
+
+    /// The ring's fd, which is readable while there are completions.
+    int GetFD() const { return m_fd; }
+
+    /**
+     * Registers a buffer for the fixed reads and writes, as buffer 0.
+     * @param pBuf The buffer
+     * @param len Its size
+     * @return false if it couldn't be, when the memory couldn't be locked
+     */
+    bool RegisterBuffer(void *pBuf, uint32 len);
+
+    /**
+     * Returns a cleared submission entry, submitting what is queued to
+     * make room if need be.
+     * @return the entry, or NULL if there is still no room
+     */
+    struct io_uring_sqe* GetSQE();
+
+    /**
+     * Returns how many entries GetSQE could return without submitting.
+     */
+    uint32 GetSpace() const;
+
+    /**
+     * Hands whatever is queued to the kernel.
+     * @param wait The number of completions to wait for
+     * @return the number submitted, or -1 with errno set
+     */
+    int Submit(uint32 wait = 0);
+
+    /**
+     * Takes the next completion.
+     * @param cqe Filled in with it
+     * @return false if there isn't one
+     */
+    bool GetCQE(struct io_uring_cqe &cqe);
+
+private:
+    int m_fd;
+
+    void *m_sq_map;
+    size_t m_sq_map_size;
+    void *m_cq_map;
+    size_t m_cq_map_size;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqes_size;
+
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned *m_sq_array;
+    unsigned *m_sq_flags;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned m_queued;      // Taken by GetSQE but not yet submitted
+
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+};
+
+/** @} */
+
+#endif /* IW_HTTP_IO_URING */
+
+#endif /* !IW_HTTP_RING_H */
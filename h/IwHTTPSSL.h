@@ -0,0 +1,154 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_SSL_H
+#define IW_HTTP_SSL_H
+
+#ifdef IW_HTTP_SSL
+
+#include "s3eTypes.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+typedef struct SSL SSL;
+typedef struct SSL_CTX SSL_CTX;
+typedef struct SSL_SESSION SSL_SESSION;
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * The TLS context shared by every CIwHTTP connection, and the sessions
+ * to resume on them.
+ *
+ * The context is made on first use and kept for the life of the process.
+ * It negotiates the highest TLS version both sides support, preferring
+ * AEAD cipher suites with forward secrecy. Once a handshake completes its
+ * session is remembered under the connection's key, as made by
+ * CIwHTTPConnectionPool, so the next connection going the same way can
+ * resume it with an abbreviated handshake. Session tickets are asked for
+ * where CyaSSL supports them (HAVE_SESSION_TICKET).
+ *
+ * With a TLS 1.3 library (HAVE_TLS13), tickets are stored as the server
+ * sends them, and GET and HEAD requests may be sent as early data on a
+ * resumed connection, saving a round trip. Early data can be replayed by
+ * an attacker, so it is off unless httptlsearlydata is set.
+ *
+ * Where sessions can be serialised (HAVE_EXT_CACHE), they are also kept
+ * in CIwHTTPSharedCache, so another process can resume them.
+ *
+ * Read from the [connection] section of the icf:
+ * - httptlsciphers: OpenSSL-style cipher list, replacing the default
+ * - httptlssessioncachesize: most sessions kept (default 32, 0 disables
+ *   resumption), the least recently used being dropped first
+ * - httptlsearlydata: send early data where possible (default 0)
+ *
+ * Like the rest of IwHTTP the context must only be used from the main
+ * thread.
+ */
+class CIwHTTPSSLContext
+{
+public:
+    /**
+     * Makes the SSL for a new connection, set to resume the last session
+     * for its key if there is one.
+     * @param socket The connected socket
+     * @param key The connection's key
+     * @return the SSL, or NULL if one couldn't be made
+     */
+    static SSL* Create(int socket, const std::string &key);
+
+    /**
+     * Shuts down and frees an SSL made by Create.
+     * @param ssl The SSL, or NULL
+     */
+    static void Destroy(SSL *ssl);
+
+    /**
+     * Remembers the session of a completed handshake.
+     * @param ssl The SSL
+     * @param key The connection's key
+     */
+    static void Established(SSL *ssl, const std::string &key);
+
+    /**
+     * Returns whether an idle connection is still fit to reuse. Any
+     * records waiting on it are processed first, so a server sending
+     * session tickets after the handshake doesn't make it look stale.
+     * @param ssl The SSL
+     * @return true if there's nothing to read and the server hasn't
+     * closed the connection
+     */
+    static bool IsIdle(SSL *ssl);
+
+#ifdef HAVE_TLS13
+    /**
+     * Returns whether a request may go as early data on a connection,
+     * which must not yet have started its handshake.
+     * @param ssl The SSL
+     * @return true if early data is enabled and the session allows it
+     */
+    static bool CanSendEarlyData(SSL *ssl);
+#endif
+
+    /**
+     * Forgets the session for a key, so the next handshake is a full one.
+     * @param key The connection's key
+     */
+    static void Forget(const std::string &key);
+
+    /**
+     * Forgets every session.
+     */
+    static void Flush();
+
+    /**
+     * Returns the number of sessions currently kept.
+     * @return the number of sessions
+     */
+    static uint32 GetSize();
+
+private:
+    typedef std::list<std::string> LRUList;
+
+    struct Entry
+    {
+        SSL_SESSION *m_session;
+        LRUList::iterator m_lru;
+    };
+
+    typedef std::map<std::string, Entry> EntryMap;
+
+    static SSL_CTX* s_ctx;
+    static EntryMap* s_entries;
+    static LRUList* s_lru;  // Most recently used first
+
+    static SSL_CTX* GetContext();
+    static void Store(const std::string &key, SSL_SESSION *session, bool share = true);
+    static void Erase(EntryMap::iterator it);
+#ifdef HAVE_EXT_CACHE
+    static SSL_SESSION* LookupShared(const std::string &key);
+    static void Share(const std::string &key, SSL_SESSION *session);
+#endif
+#ifdef HAVE_TLS13
+    static int NewSessionCallback(SSL *ssl, SSL_SESSION *session);
+#endif
+};
+
+/** @} */
+
+#endif /* IW_HTTP_SSL */
+
+#endif /* !IW_HTTP_SSL_H */
@@ -0,0 +1,227 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_SESSION_H
+#define IW_HTTP_SESSION_H
+
+#include "IwHTTP.h"
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+/**
+ * @addtogroup iwhttpclientobject
+ * @{
+ */
+
+/**
+ * HTTP Session Class
+ *
+ * A session runs any number of requests at once. Each request is
+ * represented by a CIwHTTP handle owned by the session, which is used
+ * exactly like a standalone CIwHTTP object to read the response
+ * (GetResponseCode, GetHeader, ReadData, ReadDataAsync...).
+ *
+ * Requests beyond the concurrency limits are queued and started in
+ * order as earlier ones finish. A request counts as finished once its
+ * response has been read in full, it has failed, or it has been
+ * released. Handles are recycled, so the buffers they carry are reused
+ * rather than reallocated for every request.
+ *
+ * The default limits are read from the [connection] section of the icf:
+ * httpsessionmaxconcurrent (default 64) and httpsessionmaxperhost
+ * (default 6). A limit of 0 means unlimited.
+ *
+ * Pipelining is off unless httpsessionpipelinedepth (or SetPipelineDepth)
+ * is above 1. Once a host has as many connections as the per-host limit
+ * allows, further GET and HEAD requests to it are then written on those
+ * connections behind the requests already sent, up to that many per
+ * connection, and answered in order. A response must be read in full (or
+ * its request released) before the next can be read. Should the server
+ * close a connection with requests outstanding they are sent again on
+ * new connections, and the session stops pipelining to that host.
+ *
+ * Requests to a host spoken to over HTTP/2 share its connection as
+ * streams, so aren't held to the per-host limit while the connection
+ * has room for another.
+ *
+ * @nosubgrouping
+ */
+class CIwHTTPSession
+{
+public:
+    /**
+     * Constructor
+     */
+    CIwHTTPSession();
+
+    /**
+     * Destructor. Cancels every request and frees all handles.
+     */
+    virtual ~CIwHTTPSession();
+
+    /**
+     * Queues a GET request.
+     * @param URI The URI to fetch.
+     * @param callback Called with the request handle as system data
+     * when the headers have been received, or when the request fails.
+     * @param data User data argument to the callback.
+     * @return The request handle, or NULL if the request could not be
+     * started.
+     */
+    CIwHTTP* Get(const char *URI, s3eCallback callback, void *data);
+
+    /**
+     * Queues a HEAD request.
+     * @see Get
+     */
+    CIwHTTP* Head(const char *URI, s3eCallback callback, void *data);
+
+    /**
+     * Queues a DELETE request.
+     * @see Get
+     */
+    CIwHTTP* Delete(const char *URI, s3eCallback callback, void *data);
+
+    /**
+     * Queues a POST request. The body is copied, so it need not
+     * remain valid after this call.
+     * @param URI The URI to post to.
+     * @param Body A pointer to the request body
+     * @param BodyLength the length of the request body in bytes.
+     * @param callback Called with the request handle as system data
+     * when the headers have been received, or when the request fails.
+     * @param data User data argument to the callback.
+     * @return The request handle, or NULL if the request could not be
+     * started.
+     */
+    CIwHTTP* Post(const char *URI, const char* Body, int32 BodyLength, s3eCallback callback, void *data);
+
+    /**
+     * Queues a PUT request.
+     * @see Post
+     */
+    CIwHTTP* Put(const char *URI, const char* Body, int32 BodyLength, s3eCallback callback, void *data);
+
+    /**
+     * Hands a request handle back to the session. An unfinished request
+     * is cancelled. The handle must not be used after this call.
+     * @param request The handle returned when the request was made.
+     */
+    void Release(CIwHTTP *request);
+
+    /**
+     * Cancels every queued and in-flight request. The handles remain
+     * valid until they are released.
+     */
+    void CancelAll();
+
+    /**
+     * Sets a request header for every request made through the session.
+     * Headers set on an individual handle take precedence. Set a header to
+     * the empty string to remove it.
+     * @param pName The name of the header, excluding the colon.
+     * @param val The value
+     */
+    void SetRequestHeader(const char *pName, const std::string &val);
+
+    /**
+     * Sets a request header for every request as an integer.
+     * @see SetRequestHeader
+     */
+    void SetRequestHeader(const char *pName, int32 val);
+
+    /**
+     * Sets the number of requests that may be in flight at once.
+     * @param max The limit, or 0 for no limit.
+     */
+    void SetMaxConcurrent(uint32 max) { m_maxConcurrent = max; SchedulePump(); }
+
+    /**
+     * Sets the number of requests that may be in flight to any one host.
+     * @param max The limit, or 0 for no limit.
+     */
+    void SetMaxPerHost(uint32 max) { m_maxPerHost = max; SchedulePump(); }
+
+    /**
+     * Sets how many requests may be pipelined on one connection.
+     * @param depth The limit, counting the request being answered; 1 turns
+     * pipelining off.
+     */
+    void SetPipelineDepth(uint32 depth) { m_pipelineDepth = depth ? depth : 1; SchedulePump(); }
+
+    /**
+     * Returns the number of requests currently in flight.
+     * @return the number of requests in flight
+     */
+    uint32 GetInFlightCount() const { return m_inFlight; }
+
+    /**
+     * Returns the number of requests waiting to start.
+     * @return the number of queued requests
+     */
+    uint32 GetQueuedCount() const { return m_queued; }
+
+protected:
+    friend class CIwHTTP;
+
+    struct Pending
+    {
+        CIwHTTP *m_request;
+        uint32 m_gen;
+        CIwHTTP::SendType m_type;
+        std::string m_URI;
+        std::string m_host;
+        std::string m_body;
+        s3eCallback m_callback;
+        void *m_data;
+    };
+
+    typedef std::map<std::string, uint32> HostCounts;
+    typedef std::set<std::string> HostSet;
+
+    CIwArray<CIwHTTP::ReqHeader> m_req_headers;
+    CIwArray<CIwHTTP *> m_requests;
+    CIwArray<CIwHTTP *> m_free;
+    std::list<Pending> m_queue;
+    HostCounts m_hostCounts;
+    HostSet m_noPipeline;   // Hosts pipelining has failed with
+
+    uint32 m_maxConcurrent;
+    uint32 m_maxPerHost;
+    uint32 m_pipelineDepth;
+    uint32 m_inFlight;
+    uint32 m_queued;
+    uint32 m_headers_gen;   // Bumped when m_req_headers changes
+    bool m_pump_timer;
+
+    CIwHTTP* Request(CIwHTTP::SendType type, const char *URI, const char* Body, int32 BodyLength, s3eCallback callback, void *data);
+    CIwHTTP* AllocRequest();
+    bool CanStart(const Pending &p) const;
+    bool Start(Pending &p);
+    void Pump();
+
+    // Pipelining..
+    uint32 CountConnections(const std::string &host) const;
+    CIwHTTP* FindPipelineTail(const std::string &host, CIwHTTP::SendType type, bool hasBody) const;
+    CIwHTTP* PipelineTail(CIwHTTP *request) const;
+    void PipelineFailed(const std::string &host);
+    void RequestSent();
+    void SchedulePump();
+    void RequestFinished(CIwHTTP *request);
+    static int32 PumpCallback(void *, void *);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_SESSION_H */
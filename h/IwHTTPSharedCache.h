@@ -0,0 +1,120 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+#ifndef IW_HTTP_SHARED_CACHE_H
+#define IW_HTTP_SHARED_CACHE_H
+
+#include "s3eTypes.h"
+
+#include <string>
+
+/**
+ * @addtogroup iwhttpgroup
+ * @{
+ */
+
+/**
+ * A cache shared by every process on the device using the same file, so
+ * that what one has looked up the others needn't. CIwHTTPDNSCache,
+ * CIwHTTPSSLContext and CIwHTTPCache consult it when they don't have what
+ * they need themselves, and add what they learn to it.
+ *
+ * The file is mapped into each process. It holds a table for each kind of
+ * thing kept, made of fixed size slots, a slot being found by hashing its
+ * key and trying a few slots from there. Each slot has a sequence count
+ * that is odd while it is being written: readers copy a slot without
+ * locking, and try again if the count was odd or changed meanwhile. A
+ * process claims a slot before writing it, and another wanting to write
+ * it at the same time gives up instead of waiting; a claim left by a
+ * process that died is taken over.
+ *
+ * Read from the [connection] section of the icf:
+ * - httpsharedcache: the file to share, ideally on a memory file system
+ *   such as /dev/shm (by default nothing is shared)
+ * - httpsharedcachesize: its size in bytes (default 4194304). Processes
+ *   with different sizes don't share.
+ * - httpsharedentrysize: largest response shared, headers and body
+ *   together (default 32768)
+ */
+class CIwHTTPSharedCache
+{
+public:
+    /// The kinds of thing kept, each in a table of its own.
+    enum Table
+    {
+        DNS,        ///< Host names' addresses, by host
+        TLS,        ///< TLS sessions, by route
+        RESPONSE,   ///< Small responses, by URI
+        TABLE_COUNT
+    };
+
+    /**
+     * Maps the file, if it is configured and not yet mapped.
+     * @return true if the cache can be used
+     */
+    static bool Open();
+
+    /**
+     * Unmaps the file. It is mapped again when next used.
+     */
+    static void Close();
+
+    /**
+     * Returns the largest value a table can keep.
+     * @param table The table
+     * @param key The key it is to be kept under
+     * @return the length in bytes, 0 if the cache can't be used
+     */
+    static uint32 GetValueLimit(Table table, const std::string &key);
+
+    /**
+     * Looks something up.
+     * @param table The table to look in
+     * @param key The key
+     * @param value Receives what is kept
+     * @param expires Receives when it expires (UTC ms)
+     * @return true if found and not expired
+     */
+    static bool Lookup(Table table, const std::string &key, std::string &value, uint64 &expires);
+
+    /**
+     * Keeps something, unless another process is writing the same slot.
+     * @param table The table to keep it in
+     * @param key The key
+     * @param value The value, no longer than GetValueLimit
+     * @param expires When it expires (UTC ms)
+     */
+    static void Store(Table table, const std::string &key, const std::string &value, uint64 expires);
+
+    /**
+     * Forgets something.
+     * @param table The table
+     * @param key The key
+     */
+    static void Remove(Table table, const std::string &key);
+
+private:
+    struct Header;
+    struct Slot;
+
+    static bool s_tried;
+    static Header* s_header;
+    static uint32 s_size;
+
+    static Slot* GetSlot(Table table, uint32 index);
+    static bool BeginWrite(Slot *slot);
+    static void EndWrite(Slot *slot);
+    static bool Read(Table table, Slot *slot, uint64 hash, const std::string &key, std::string *value, uint64 *expires);
+};
+
+/** @} */
+
+#endif /* !IW_HTTP_SHARED_CACHE_H */
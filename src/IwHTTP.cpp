@@ -11,16 +11,30 @@
  */
 
 #include "IwHTTP.h"
+#include "IwHTTP2.h"
+#include "IwHTTPCache.h"
+#include "IwHTTPConnectionPool.h"
+#include "IwHTTPDNSCache.h"
+#include "IwHTTPFlight.h"
+#include "IwHTTPDecoder.h"
+#include "IwHTTPEncoder.h"
+#include "IwHTTPEventLoop.h"
+#include "IwHTTPSession.h"
+#include "IwHTTPSSL.h"
 
+#include <algorithm>
 #include <string>
 #include <sstream>
-#include <algorithm>
 #include <stdlib.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
 #include "IwMath.h"
 #include "s3eConfig.h"
@@ -34,6 +48,12 @@
 
 #define MULTIPART_BOUNDARY "--------:fjksalgjalkgjlk:"
 
+// Most pieces of a request sent with one call
+#define SEND_IOV_MAX 16
+
+// Largest TLS record payload
+#define TLS_RECORD_SIZE 16384
+
 #ifdef IW_TRACE_CHANNEL_HTTP
 static void Log(const char* b, uint32 l)
 {
@@ -114,9 +134,23 @@ static void LogHeaders(std::string response, int response_code, size_t len)
 #define LogHeaders(X,Y) ((void)0)
 #endif
 
-bool CIwHTTP::s_bLookupInProgress = false;
-CIwHTTP::DNSRequestList* CIwHTTP::s_pendingDNS = NULL;
-s3eThreadLock* CIwHTTP::m_dnsLock = NULL; //never gets destroyed, but delay init
+// Case-insensitive search for a token in a header value
+static bool HeaderHasToken(const char *value, size_t value_len, const char *token)
+{
+    size_t len = strlen(token);
+    for (size_t i = 0; i + len <= value_len; i++)
+    {
+        size_t j = 0;
+        while (j < len && tolower(value[i + j]) == tolower(token[j]))
+            j++;
+
+        if (j == len)
+            return true;
+    }
+    return false;
+}
+
+std::string CIwHTTP::s_user_agent;
 
 CIwHTTP::CIwHTTP() :
     m_user_data(NULL),
@@ -129,99 +163,151 @@ CIwHTTP::CIwHTTP() :
     m_bGetInProgress(false),
     m_Status(S3E_RESULT_SUCCESS),
     m_headers_end(std::string::npos),
-    m_chunk_header_idx(0),
+    m_recv_buf(NULL),
+    m_recv_size(0),
+    m_recv_start(0),
+    m_recv_end(0),
+    m_header_scan(0),
     m_chunked(false),
     m_post_chunked(false),
-    m_reading_chunk_header(false),
+    m_length_known(false),
     m_connect_timeout(0),
     m_read_timeout(0),
     m_callback_timer(0),
     m_pending_read_callback(false),
+    m_download_fd(-1),
+    m_download_buf(NULL),
+    m_download_buf_size(0),
+    m_download_splice(false),
+    m_download_busy(false),
+    m_download_timer(false),
+    m_download_callback(NULL),
     m_error_status(NONE),
     m_last_chunk_seen(false),
-    m_data_sent(0)
+    m_chunk_state(CHUNK_SIZE_START),
+    m_chunk_remaining(0),
+    m_accept_encoding(false),
+    m_decoder(NULL),
+    m_decoded_transferred(0),
+    m_cached(NULL),
+    m_cache_stale(NULL),
+    m_cache_store(NULL),
+    m_request_time(0),
+    m_response_time(0),
+    m_cache_timer(0),
+    m_flight(NULL),
+    m_flight_wait(NULL),
+    m_flight_timer(0),
+    m_data_len(0),
+    m_data_sent(0),
+    m_upload_buf(NULL),
+    m_upload_size(0),
+    m_upload_start(0),
+    m_upload_end(0),
+    m_upload_sendfile(false),
+    m_gather_buf(NULL),
+    m_request_encoding(ENCODING_NONE),
+    m_encoder(NULL),
+    m_encode_done(false),
+    m_frame_len(0),
+    m_frame_idx(0),
+    m_header_block_valid(false),
+    m_header_block_sending(false),
+    m_header_block_gen(0),
+    m_keepAlive(false),
+    m_body_complete(false),
+    m_reusedConnection(false),
+    m_retried(false),
+    m_reuse_timer(0),
+    m_lookupViaProxy(false),
+    m_h2(NULL),
+    m_h2_stream(0),
+    m_h2_weight(16),
+    m_session(NULL),
+    m_session_state(SESSION_NONE),
+    m_session_gen(0),
+    m_pipe_prev(NULL),
+    m_pipe_next(NULL),
+    m_pipe_close(false),
+    m_pipe_timer(0),
+    m_dnsWaiter(NULL),
+    m_dns_cache_timer(DNS_CACHE_NONE)
 #ifdef IW_HTTP_SSL
-,m_bSSLHandshaking(false), m_bSecureSocket(false), m_SSL(NULL), m_SSL_CTX(NULL)
+,m_bSSLHandshaking(false), m_bSecureSocket(false), m_SSL(NULL), m_early_len(0)
 #endif
 {
-    if (m_dnsLock == NULL && s3eThreadAvailable())
-        m_dnsLock = s3eThreadLockCreate();
+    m_download_pipe[0] = m_download_pipe[1] = -1;
 }
 
 CIwHTTP::~CIwHTTP()
 {
     Cancel();
+    LeaveFlight();
+    ReleaseCache();
+    FreeData(m_form_data);
+    delete m_decoder;
+    delete[] m_gather_buf;
+    delete[] m_recv_buf;
 }
 
-bool CIwHTTP::EnqueueDNSRequest(const char *host, s3eInetAddress *addr)
-{
-    //This will be threadsafe via the callee
-    DNSRequest *r = new DNSRequest;
-    if (!r) return false;
-
-    r->m_host = host;
-    r->m_addr = addr;
-    r->m_caller = this;
-
-    if (!s_pendingDNS)
-        s_pendingDNS = new DNSRequestList;
-
-
-    s_pendingDNS->push_back(r);
-    if (s_pendingDNS->size() == 1)
-        IssueDNSRequest();
-
-    return true;
-}
-
-int32 CIwHTTP::DoIssueDNSRequest(void *sysData, void *usrData)
+bool CIwHTTP::EnqueueDNSRequest(const char *host)
 {
-    //Don't lock here - it should be protected by the callee
-    if (!s_pendingDNS || s_pendingDNS->size() == 0)
-        return 0;
-
-    IwAssert(HTTP, s_bLookupInProgress == false);
-
-    s_bLookupInProgress =
-        (s3eInetLookup(
-            s_pendingDNS->front()->m_host.c_str(), s_pendingDNS->front()->m_addr, DNSCallback, s_pendingDNS->front()->m_caller
-        ) == S3E_RESULT_SUCCESS);
-
-    if (!s_bLookupInProgress)
+    // Answer from the cache if we can. The result is delivered on the
+    // next yield, just as a real lookup's would be..
+    switch (CIwHTTPDNSCache::Lookup(host, m_addrs))
     {
-        IwTrace(HTTP, ("DNS lookup failed"));
-        // Failed to even start the lookup, inform immediately..
-        s_pendingDNS->front()->m_caller->DoDNSCallback(NULL);
+        case CIwHTTPDNSCache::HIT:
+            m_dns_cache_timer = DNS_CACHE_HIT;
+            CIwHTTPEventLoop::SetTimer(0, DNSCacheCallback, this);
+            return true;
+        case CIwHTTPDNSCache::FAILED:
+            m_dns_cache_timer = DNS_CACHE_FAILED;
+            CIwHTTPEventLoop::SetTimer(0, DNSCacheCallback, this);
+            return true;
+        default:
+            break;
     }
 
-    return 0;
-}
+    m_dnsWaiter = CIwHTTPResolver::Resolve(host, DNSCallback, this);
+    if (m_dnsWaiter)
+        return true;
 
-void CIwHTTP::IssueDNSRequest()
-{
-    // On platforms with true async DNS via a thread s3eInetLookup can
-    // have called it's callback before returning. If you issue the next
-    // lookup during that callback the lookup ID's can get out of sync
-    // and lookups will fail thereafter. Doing the lookup on the next
-    // yield fixes this at the module level.
-    // Only seen on iPhone so far.
-    s3eTimerSetTimer(0, DoIssueDNSRequest, NULL);
+    // The lookup couldn't even be started (there's no host, say), so fail
+    // on the next yield as a lookup would..
+    IwTrace(HTTP, ("(Failed to start DNS lookup of %s)", host ? host : ""));
+    m_dns_cache_timer = DNS_CACHE_FAILED;
+    CIwHTTPEventLoop::SetTimer(0, DNSCacheCallback, this);
+    return false;
 }
 
 int32 CIwHTTP::DNSCallback(void *pSysData, void *pUserData)
 {
-    if (pUserData)
-        ((CIwHTTP *)pUserData)->DoDNSCallback((s3eInetAddress *)pSysData);
+    CIwHTTP *self = (CIwHTTP *)pUserData;
+    if (!self)
+        return S3E_RESULT_SUCCESS;
+
+    self->m_dnsWaiter = NULL;
+    if (pSysData)
+        self->m_addrs = *(const CIwHTTPAddressList *)pSysData;
+    self->OnDNSResult(pSysData ? &self->m_addrs : NULL);
 
     return S3E_RESULT_SUCCESS;
 }
 
-int32 CIwHTTP::ConnectCallback(s3eSocket *, void *pSysData, void *pUserData)
+int32 CIwHTTP::ConnectCallback(void *pSysData, void *pUserData)
 {
-    //Ensure that we are safe if pSysData came from a loader using variable size enums
-    s3eResult res = static_cast<s3eResult>(*(static_cast<char*>(pSysData)));
-    if (pUserData)
-        ((CIwHTTP *)pUserData)->DoConnectCallback(res);
+    CIwHTTP *self = (CIwHTTP *)pUserData;
+    if (!self)
+        return S3E_RESULT_SUCCESS;
+
+    s3eResult res = *(s3eResult *)pSysData;
+    if (res == S3E_RESULT_SUCCESS)
+    {
+        // The winning connection becomes ours..
+        self->m_socket = self->m_connector.TakeSocket();
+        self->m_pSocket = s3esocket(self->m_socket);
+    }
+    self->DoConnectCallback(res);
 
     return S3E_RESULT_SUCCESS;
 }
@@ -257,140 +343,100 @@ bool CIwHTTP::CheckProxy(const char* name)
     return true;
 }
 
-void CIwHTTP::DoDNSCallback(s3eInetAddress *pAddr)
+int32 CIwHTTP::DNSCacheCallback(void *, void *pUserData)
 {
-    s_bLookupInProgress = false;
-
-    IwAssert(HTTP, s_pendingDNS);
-    if (!s_pendingDNS)
-        return; //shouldn't happen
-
-    if (m_dnsLock != NULL)
-        s3eThreadLockAcquire(m_dnsLock);
+    CIwHTTP *self = (CIwHTTP *)pUserData;
+    bool hit = (self->m_dns_cache_timer == DNS_CACHE_HIT);
+    self->m_dns_cache_timer = DNS_CACHE_NONE;
+    self->OnDNSResult(hit ? &self->m_addrs : NULL);
+    return 0;
+}
 
-    // Must be the front request..
-    delete s_pendingDNS->front();
-    s_pendingDNS->pop_front();
-    if (s_pendingDNS->empty())
+void CIwHTTP::OnDNSResult(const CIwHTTPAddressList *pAddrs)
+{
+    if (!pAddrs)
     {
-        delete s_pendingDNS;
-        s_pendingDNS = NULL;
+        IwTrace(HTTP, ("(DNS Failed)"));
+        Fail();
+        return;
     }
 
-    if (pAddr)
-    {
-        // DNS lookup successful so start connecting..
-        IwTrace(HTTP, ("(DNS OK)"));
-        if (m_socket != -1)
-            close(m_socket);
-
-        if ((m_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
-        {
-            IwTrace(HTTP, ("(Socket creation failed)"));
-            Fail();
-
-            // Need to keep DNS running..
-            IssueDNSRequest();
-            if (m_dnsLock != NULL)
-                s3eThreadLockRelease(m_dnsLock);
-            return;
-        }
-
-        // Set non-blocking..
-        int non_blocking = 1;
-        ioctl(m_socket, FIONBIO, &non_blocking);
-
-        // Grab the s3eSocket that backs the BSD-style one..
-        m_pSocket = s3esocket(m_socket);
+    // DNS lookup successful so start connecting..
+    IwTrace(HTTP, ("(DNS OK)"));
 
-        if (!m_neverUseProxy && !m_usingProxy && m_firstDns)
+    if (!m_neverUseProxy && !m_usingProxy && m_firstDns)
+    {
+        // Now that we've done the DNS lookup, we've probably
+        // established the correct connection. We now check s3e's
+        // proxy setting since it now applies to the right
+        // connection. If there is a proxy, we do another DNS
+        // lookup to get the right settings.
+        m_firstDns = false;
+        const char* proxy = s3eSocketGetString(S3E_SOCKET_HTTP_PROXY);
+
+        if (CheckProxy(proxy))
         {
-            // Now that we've done the DNS lookup, we've probably
-            // established the correct connection. We now check s3e's
-            // proxy setting since it now applies to the right
-            // connection. If there is a proxy, we do another DNS
-            // lookup to get the right settings.
-            m_firstDns = false;
-            const char* proxy = s3eSocketGetString(S3E_SOCKET_HTTP_PROXY);
+            // There is a proxy.
+            const char* host;
+            char host_buf[128];
 
-            if (CheckProxy(proxy))
+            char* colon = strchr(proxy, ':');
+            if (colon)
             {
-                // There is a proxy.
-                const char* host;
-                char host_buf[128];
-
-                char* colon = strchr(proxy, ':');
-                if (colon)
-                {
-                    strncpy(host_buf, proxy, MIN(128, colon - proxy));
-                    host_buf[colon - proxy] = 0;
-                    host = host_buf;
-                    sscanf(colon + 1, "%d", &m_proxyPort);
-                }
-                else
-                {
-                    host = proxy;
-                    m_proxyPort = 80;
-                }
-
-                IwTrace(HTTP, ("(Using proxy %s)", host));
-                EnqueueDNSRequest(host, pAddr);
-                m_usingProxy = true;
-
-                if (m_dnsLock != NULL)
-                    s3eThreadLockRelease(m_dnsLock);
-                return;
+                strncpy(host_buf, proxy, MIN(128, colon - proxy));
+                host_buf[colon - proxy] = 0;
+                host = host_buf;
+                sscanf(colon + 1, "%d", &m_proxyPort);
             }
-        }
-
-        if (!m_usingProxy)
-            pAddr->m_Port = s3eInetHtons(m_URI.GetPort());
-        else
-            pAddr->m_Port = s3eInetHtons(m_proxyPort);
-
-        s3eResult result = s3eSocketConnect(m_pSocket, &m_addr, ConnectCallback, this);
-        if (result != S3E_RESULT_SUCCESS)
-        {
-            s3eSocketError error = s3eSocketGetError();
-            if (error != S3E_SOCKET_ERR_INPROGRESS)
+            else
             {
-                IwTrace(HTTP, ("(Connect fail)"));
-                Fail();
-
-                // Need to keep DNS running..
-                IssueDNSRequest();
-                if (m_dnsLock != NULL)
-                    s3eThreadLockRelease(m_dnsLock);
-                return;
+                host = proxy;
+                m_proxyPort = 80;
             }
-        }
 
-        int ms = 60000; // 1 minute
-        s3eConfigGetInt("connection", "httpconnecttimeout", &ms);
-        if (ms)
-        {
-            m_connect_timeout = ms;
-            s3eTimerSetTimer(ms, ConnectTimeoutCallback, this);
-        }
+            IwTrace(HTTP, ("(Using proxy %s)", host));
+            m_usingProxy = true;
+            m_proxyHost = host;
 
-        IwTrace(HTTP, ("(Connecting...)"));
+            EnqueueDNSRequest(host);
+            return;
+        }
+    }
 
-        // Need to keep DNS running..
-        IssueDNSRequest();
-        if (m_dnsLock != NULL)
-            s3eThreadLockRelease(m_dnsLock);
+    // The route is settled, so an HTTP/2 connection or an idle one going
+    // the same way saves connecting afresh..
+    SetPoolKey();
+    if (UseHTTP2() || TryPooledConnection())
+    {
+        DoConnectCallback(S3E_RESULT_SUCCESS);
         return;
     }
 
-    IwTrace(HTTP, ("(DNS Failed)"));
+    if (m_socket != -1)
+    {
+        CIwHTTPEventLoop::CloseSocket(m_socket);
+        m_socket = -1;
+        m_pSocket = NULL;
+    }
 
-    if (m_dnsLock != NULL)
-        s3eThreadLockRelease(m_dnsLock);
+    // Race the addresses we got back..
+    uint16 port = m_usingProxy ? (uint16)m_proxyPort : m_URI.GetPort();
+    if (!m_connector.Start(*pAddrs, port, ConnectCallback, this))
+    {
+        IwTrace(HTTP, ("(Connect fail)"));
+        Fail();
+        return;
+    }
 
-    Fail();
+    int ms = 60000; // 1 minute
+    s3eConfigGetInt("connection", "httpconnecttimeout", &ms);
+    if (ms)
+    {
+        m_connect_timeout = ms;
+        CIwHTTPEventLoop::SetTimer(ms, ConnectTimeoutCallback, this);
+    }
 
-    // Need to keep DNS running..
-    IssueDNSRequest();
+    IwTrace(HTTP, ("(Connecting...)"));
 }
 
 void CIwHTTP::DoConnectCallback(s3eResult result)
@@ -399,7 +445,7 @@ void CIwHTTP::DoConnectCallback(s3eResult result)
     if (m_connect_timeout)
     {
         m_connect_timeout = 0;
-        s3eTimerCancelTimer(ConnectTimeoutCallback, this);
+        CIwHTTPEventLoop::CancelTimer(ConnectTimeoutCallback, this);
     }
 
     if (result != S3E_RESULT_SUCCESS)
@@ -410,27 +456,30 @@ void CIwHTTP::DoConnectCallback(s3eResult result)
     }
 
     IwTrace(HTTP, ("(Connected)"));
-    m_request_idx = 0;
 
-    Data data;
+    // Everything but the request line is mostly as last time, so there
+    // should be room for it all without growing..
+    std::string &head = m_request_head;
+    head.clear();
+    head.reserve(m_header_block.size() + strlen(m_URI.GetAll()) + 128);
 
     // Connected, fire off the the request
     switch (m_Type)
     {
         case CIwHTTP::GET:
-            data.m_value += "GET ";
+            head += "GET ";
             break;
         case CIwHTTP::POST:
-            data.m_value += "POST ";
+            head += "POST ";
             break;
         case CIwHTTP::HEAD:
-            data.m_value += "HEAD ";
+            head += "HEAD ";
             break;
         case CIwHTTP::PUT:
-            data.m_value += "PUT ";
+            head += "PUT ";
             break;
         case CIwHTTP::DELETE:
-            data.m_value += "DELETE ";
+            head += "DELETE ";
             break;
         default:
             IwTrace(HTTP, ("(Invalid type)"));
@@ -442,85 +491,186 @@ void CIwHTTP::DoConnectCallback(s3eResult result)
     {
         const char* all = m_URI.GetAll();
         if (all)
-            data.m_value += all;
+            head += all;
     }
     else
     {
-        data.m_value += "/";
+        head += "/";
         const char* tail = m_URI.GetTail();
         if (tail)
-            data.m_value += tail;
+            head += tail;
     }
 
-    bool skip_ua = false;
-    bool skip_ct = false;
-
-    data.m_value += " HTTP/1.1\r\nHost: ";
-    data.m_value += m_URI.GetHost();
-
-    for (uint32 i = 0; i < m_req_headers.size(); i++)
+    head += " HTTP/1.1\r\nHost: ";
+    const char* host = m_URI.GetHost();
+    if (strchr(host, ':'))
     {
-        if (m_req_headers[i].m_name == "Host" ||
-            m_req_headers[i].m_name == "Content-Length" ||
-          (!m_SendingData && m_req_headers[i].m_name.find("Content-") == 0))
-            continue;
-
-        if (m_req_headers[i].m_name == "User-Agent")
-            skip_ua = true;
-
-        if (m_req_headers[i].m_name == "Content-Type")
-            skip_ct = true;
-
-        data.m_value += "\r\n";
-        data.m_value += m_req_headers[i].m_name;
-        data.m_value += ": ";
-        data.m_value += m_req_headers[i].m_value;
+        // IPv6 literal..
+        head += "[";
+        head += host;
+        head += "]";
     }
+    else
+        head += host;
 
-    if (!skip_ua)
-    {
-        data.m_value += "\r\nUser-Agent: S3E/";
-        data.m_value += s3eDeviceGetString(S3E_DEVICE_OS);
-        data.m_value += "/";
-        data.m_value += s3eDeviceGetString(S3E_DEVICE_ID);
-        data.m_value += "/";
-        data.m_value += s3eDeviceGetString(S3E_DEVICE_S3E_VERSION);
-    }
+    head += GetHeaderBlock();
+
+    // Asking whether a stored response is still good..
+    head += m_cache_conditions;
 
     if (m_SendingData)
     {
-        if (m_post_chunked)
+        if (m_encoder)
         {
-            data.m_value += "\r\nTransfer-Encoding: chunked";
+            // How long it is isn't known until it has been compressed..
+            head += "\r\nContent-Encoding: ";
+            head += m_encoder->GetName();
+            head += "\r\nTransfer-Encoding: chunked";
+        }
+        else if (m_post_chunked)
+        {
+            head += "\r\nTransfer-Encoding: chunked";
         }
         else
         {
-            data.m_value += "\r\nContent-Length: ";
-            std::ostringstream b;
-            b << m_data_len;
-            data.m_value += b.str();
+            char len[16];
+            head += "\r\nContent-Length: ";
+            head += FormatDecimal(len, m_data_len);
         }
-
-        if (!skip_ct)
-            data.m_value += "\r\nContent-Type: multipart/form-data; boundary=" MULTIPART_BOUNDARY;
     }
 
-    data.m_value += "\r\n\r\n";
-    data.m_size = data.m_value.size();
-    m_data.push_front(data);
+    head += "\r\n\r\n";
 
-    m_data_it = m_data.begin();
-    m_data_len += data.m_size;
+    RewindData();
 
     IwTrace(HTTP_VERBOSE, ("(Request Built)"));
-    IwTrace(HTTP_VERBOSE, ("%s", data.m_value.c_str()));
+    IwTrace(HTTP_VERBOSE, ("%s", head.c_str()));
 
 #ifdef IW_HTTP_SSL
-    if (m_bSecureSocket)
+    // A pooled connection has already done its handshake..
+    if (m_bSecureSocket && !m_reusedConnection)
         StartSSLHandshake();
     else
 #endif
+    {
+        // Plain HTTP/2 needs prior knowledge, there's nothing to ask..
+        if (!m_reusedConnection && WantHTTP2(false))
+            StartHTTP2();
+
         SendRequest();
+    }
+}
+
+const std::string& CIwHTTP::GetHeaderBlock()
+{
+    uint32 gen = m_session ? m_session->m_headers_gen : 0;
+    if (m_header_block_valid && m_header_block_sending == m_SendingData && m_header_block_gen == gen)
+        return m_header_block;
+
+    IwTrace(HTTP_VERBOSE, ("(Serialising request headers)"));
+
+    std::string &block = m_header_block;
+    block.clear();
+
+    bool skip_ua = false;
+    bool skip_ct = false;
+    bool skip_ae = false;
+
+    if (m_session)
+    {
+        // Session-wide headers, unless overridden on this request..
+        const CIwArray<ReqHeader> &shared = m_session->m_req_headers;
+        for (uint32 i = 0; i < shared.size(); i++)
+        {
+            uint32 j = 0;
+            while (j < m_req_headers.size() && m_req_headers[j].m_name != shared[i].m_name)
+                j++;
+
+            if (j == m_req_headers.size())
+                AppendRequestHeader(block, shared[i], m_SendingData, skip_ua, skip_ct, skip_ae);
+        }
+    }
+
+    for (uint32 i = 0; i < m_req_headers.size(); i++)
+        AppendRequestHeader(block, m_req_headers[i], m_SendingData, skip_ua, skip_ct, skip_ae);
+
+    if (!skip_ua)
+    {
+        // The device doesn't change, so nor does the default..
+        if (s_user_agent.empty())
+        {
+            s_user_agent = "\r\nUser-Agent: S3E/";
+            s_user_agent += s3eDeviceGetString(S3E_DEVICE_OS);
+            s_user_agent += "/";
+            s_user_agent += s3eDeviceGetString(S3E_DEVICE_ID);
+            s_user_agent += "/";
+            s_user_agent += s3eDeviceGetString(S3E_DEVICE_S3E_VERSION);
+        }
+        block += s_user_agent;
+    }
+
+    // Ask for the content compressed, if we can undo it. Responses to a
+    // request with its own Accept-Encoding are left for it to decode..
+    m_accept_encoding = false;
+    if (!skip_ae)
+    {
+        int accept = 0;
+        s3eConfigGetInt("connection", "httpacceptencoding", &accept);
+
+        const char *codings = CIwHTTPDecoder::GetAcceptEncoding();
+        if (accept && codings)
+        {
+            block += "\r\nAccept-Encoding: ";
+            block += codings;
+            m_accept_encoding = true;
+        }
+    }
+
+    if (m_SendingData && !skip_ct)
+        block += "\r\nContent-Type: multipart/form-data; boundary=" MULTIPART_BOUNDARY;
+
+    m_header_block_valid = true;
+    m_header_block_sending = m_SendingData;
+    m_header_block_gen = gen;
+
+    return m_header_block;
+}
+
+const char* CIwHTTP::FormatDecimal(char *buf, uint32 val)
+{
+    // Digits are written backwards from the end of buf, which holds 16..
+    char *p = &buf[15];
+    *p = 0;
+    do
+    {
+        *--p = '0' + val % 10;
+        val /= 10;
+    } while (val);
+
+    return p;
+}
+
+void CIwHTTP::AppendRequestHeader(std::string &out, const ReqHeader &header, bool sendingData, bool &skip_ua, bool &skip_ct, bool &skip_ae)
+{
+    if (header.m_name == "Host" ||
+        header.m_name == "Content-Length" ||
+      (!sendingData && header.m_name.find("Content-") == 0))
+        return;
+
+    if (header.m_name == "User-Agent")
+        skip_ua = true;
+
+    if (header.m_name == "Content-Type")
+        skip_ct = true;
+
+    // Part of a compressed body can't be decoded on its own..
+    if (header.m_name == "Accept-Encoding" || header.m_name == "Range")
+        skip_ae = true;
+
+    out += "\r\n";
+    out += header.m_name;
+    out += ": ";
+    out += header.m_value;
 }
 
 void CIwHTTP::DoConnectTimeout()
@@ -532,6 +682,16 @@ void CIwHTTP::DoConnectTimeout()
 void CIwHTTP::Fail()
 {
     IwTrace(HTTP, ("(FAIL)"));
+    m_keepAlive = false;
+    PipelineFailed();
+
+    // Those that joined fail with it..
+    if (m_flight && m_flight->GetLeader() == this)
+    {
+        m_flight->Fail();
+        LeaveFlight();
+    }
+
     Cancel();
 
     m_Status = S3E_RESULT_ERROR;
@@ -582,23 +742,44 @@ s3eResult CIwHTTP::Send(SendType type, const char *URI, const char* Body, int32
 
     Cancel();
 
+    // Cancel has cleared out the last request's data, this one's is
+    // only now taken on..
+    m_data.swap(m_form_data);
+
+    LeaveFlight();
+
     m_URI = URI;
 
     m_response.clear();
-    m_chunk_header.clear();
+    m_header_index.clear();
+    m_header_scan = 0;
+    m_recv_start = m_recv_end = 0;
 
     m_data_sent = 0;
+    m_encode_done = false;
 
-    m_chunk_header_idx = 0;
     m_chunked = false;
     m_last_chunk_seen = false;
-    m_reading_chunk_header = false;
+    m_chunk_state = CHUNK_SIZE_START;
+    m_chunk_remaining = 0;
+
+    delete m_decoder;
+    m_decoder = NULL;
+    m_decoded_transferred = 0;
+
+    ReleaseCache();
 
     m_response_code = 0;
     m_headers_end = std::string::npos;
-    m_total_transferred = m_chunk_size = 0;
+    m_total_transferred = 0;
     m_firstDns = true;
 
+    m_keepAlive = false;
+    m_body_complete = false;
+    m_reusedConnection = false;
+    m_retried = false;
+    m_pipe_close = false;
+
     if (m_URI.GetProtocol() != CIwURI::HTTP
 #ifdef IW_HTTP_SSL
          && m_URI.GetProtocol() != CIwURI::HTTPS
@@ -627,6 +808,7 @@ s3eResult CIwHTTP::Send(SendType type, const char *URI, const char* Body, int32
     {
         pHost = tmpstr;
         m_usingProxy = true;
+        m_proxyHost = tmpstr;
         m_proxyPort = 80;
         s3eConfigGetInt("connection", "httpproxyport", &m_proxyPort);
         IwTrace(HTTP, ("(Using proxy %s from icf)", pHost));
@@ -647,6 +829,7 @@ s3eResult CIwHTTP::Send(SendType type, const char *URI, const char* Body, int32
     m_user_data = pUserData;
 
     m_content_length = 0;
+    m_length_known = false;
 
     // add end marker if we have multi part data
     if (!m_data.empty())
@@ -654,10 +837,6 @@ s3eResult CIwHTTP::Send(SendType type, const char *URI, const char* Body, int32
         Data f;
 
         f.m_value = "--" MULTIPART_BOUNDARY "--\r\n";
-
-        if (m_post_chunked)
-            AddChunked(f);
-
         f.m_size = f.m_value.size();
 
         m_data.push_back(f);
@@ -677,41 +856,80 @@ s3eResult CIwHTTP::Send(SendType type, const char *URI, const char* Body, int32
 
         f.m_size = BodyLength;
 
-        if (m_post_chunked)
-            AddChunked(f);
-
         m_data.push_front(f);
     }
 
-    // insert chunk end marker
-    if (m_post_chunked && !m_data.empty())
-    {
-        m_data.back().m_value += "0\r\n\r\n";
-        m_data.back().m_size += 5;
-    }
-
+    // Chunk framing is added as the parts are sent, one chunk each, but
+    // counts towards what is to be sent..
     m_data_len = 0;
     for (std::list<Data>::iterator it = m_data.begin(); it != m_data.end(); ++it)
+    {
         m_data_len += it->m_size;
+        if (m_post_chunked && m_SendingData)
+            m_data_len += sprintf(m_frame, "%x\r\n\r\n", it->m_size);
+    }
+    if (m_post_chunked && m_SendingData)
+        m_data_len += 5;
 
-    // close off http (do after length so length does not include this)
-    // do not append crlf to post body
-    if (!m_data.empty() && m_SendingData)
+    // A compressed body is measured as it's made, see EncodeData..
+    if (WantEncoding())
     {
-        m_data.back().m_value += "\r\n";
-        m_data.back().m_size += 2;
+        m_encoder = CIwHTTPEncoder::Create(m_request_encoding == ENCODING_ZSTD ? CIwHTTPEncoder::ZSTD : CIwHTTPEncoder::GZIP);
+        if (!m_encoder)
+            IwTrace(HTTP, ("(Sending the body uncompressed)"));
     }
 
-    // Start the whole process by looking up the host
-    if (m_dnsLock != NULL)
-        s3eThreadLockAcquire(m_dnsLock);
-    EnqueueDNSRequest(pHost, &m_addr);
-    if (m_dnsLock != NULL)
-        s3eThreadLockRelease(m_dnsLock);
+    // Remember how to get there in case a pooled connection has to
+    // be abandoned and the request retried..
+    m_lookupHost = pHost;
+    m_lookupViaProxy = m_usingProxy;
+
+    // A fresh stored response answers without going anywhere. A stale one
+    // is asked about, sending the request with conditions..
+    m_request_time = s3eTimerGetUTC();
+    if (m_Type == GET)
+    {
+        CIwHTTPCacheBody *pBody = NULL;
+        switch (CIwHTTPCache::Lookup(m_URI.GetAll(), GetHeaderBlock(), m_cache_headers, m_cache_conditions, pBody))
+        {
+            case CIwHTTPCache::FRESH:
+                m_cached = pBody;
+                m_cache_timer = 1;
+                CIwHTTPEventLoop::SetTimer(0, CacheCallback, this);
+                return m_Status;
+            case CIwHTTPCache::STALE:
+                m_cache_stale = pBody;
+                break;
+            default:
+                break;
+        }
+
+        // The same request already on its way answers this one too..
+        if (!m_session && JoinFlight())
+            return m_Status;
+    }
 
+    Dispatch();
     return m_Status;
 }
 
+void CIwHTTP::Dispatch()
+{
+    // If a session has this follow another request on its connection, or
+    // there's an HTTP/2 or idle connection to the host already, use it (on
+    // the next yield, so the callback isn't made from within Send)..
+    SetPoolKey();
+    if (PipelineAfter(m_session ? m_session->PipelineTail(this) : NULL) || UseHTTP2() || TryPooledConnection())
+    {
+        m_reuse_timer = 1;
+        CIwHTTPEventLoop::SetTimer(0, ReuseCallback, this);
+        return;
+    }
+
+    // Otherwise start the whole process by looking up the host
+    EnqueueDNSRequest(m_lookupHost.c_str());
+}
+
 s3eResult CIwHTTP::Cancel()
 {
     IwTrace(HTTP, ("(Cancel)"));
@@ -719,987 +937,2993 @@ s3eResult CIwHTTP::Cancel()
     // Cancel any possible callbacks..
     if (m_callback_timer)
     {
-        s3eTimerCancelTimer(DoCallback, this);
+        CIwHTTPEventLoop::CancelTimer(DoCallback, this);
         m_callback_timer = 0;
     }
 
     if (m_read_timeout)
     {
         m_read_timeout = 0;
-        s3eTimerCancelTimer(ReadTimeoutCallback, this);
+        CIwHTTPEventLoop::CancelTimer(ReadTimeoutCallback, this);
     }
 
     if (m_connect_timeout)
     {
         m_connect_timeout = 0;
-        s3eTimerCancelTimer(ConnectTimeoutCallback, this);
+        CIwHTTPEventLoop::CancelTimer(ConnectTimeoutCallback, this);
     }
 
-    if (s_pendingDNS)
+    if (m_reuse_timer)
     {
-        if (m_dnsLock != NULL)
-            s3eThreadLockAcquire(m_dnsLock);
-        // Remove any enqueued DNS requests relating to this object
-        if(s_pendingDNS) //double check locking pattern
-        {
-            std::list<DNSRequest *>::iterator i = s_pendingDNS->begin();
-            while (i != s_pendingDNS->end())
-            {
-                if ((*i)->m_caller == this)
-                {
-                    bool bFirst = (i == s_pendingDNS->begin());
-
-                    delete (*i);
-                    i = s_pendingDNS->erase(i);
-
-                    if (bFirst)
-                    {
-                        s3eInetLookupCancel();
-                        s_bLookupInProgress = false;
-                        IssueDNSRequest(); // Pump the queue
-                    }
+        m_reuse_timer = 0;
+        CIwHTTPEventLoop::CancelTimer(ReuseCallback, this);
+    }
 
-                    break; // Should only be one..
-                }
-                i++;
-            }
+    if (m_cache_timer)
+    {
+        m_cache_timer = 0;
+        CIwHTTPEventLoop::CancelTimer(CacheCallback, this);
+    }
 
-        #ifdef IW_DEBUG
-            i = s_pendingDNS->begin();
-            while (i != s_pendingDNS->end())
-            {
-                IwAssert(HTTP, (*i)->m_caller != this);
-                i++;
-            }
-        #endif
+    if (m_dns_cache_timer)
+    {
+        m_dns_cache_timer = DNS_CACHE_NONE;
+        CIwHTTPEventLoop::CancelTimer(DNSCacheCallback, this);
+    }
 
-            if (s_pendingDNS->size() == 0)
-            {
-                delete s_pendingDNS;
-                s_pendingDNS = NULL;
-            }
-        }
-        if (m_dnsLock != NULL)
-            s3eThreadLockRelease(m_dnsLock);
+    if (m_pipe_timer)
+    {
+        m_pipe_timer = 0;
+        CIwHTTPEventLoop::CancelTimer(PipelineCallback, this);
     }
 
-#ifdef IW_HTTP_SSL
-    // Bring down SSL before the socket..
-    DestroySSL();
-#endif
+    // A pipelined request yet to have its turn leaves the connection to
+    // the one ahead of it..
+    if (m_pipe_prev)
+        PipelineWithdraw();
 
-    if (m_pSocket)
+    // Withdraw from any lookup in progress, which carries on for the cache..
+    if (m_dnsWaiter)
     {
-        close(m_socket);
-        m_socket = -1;
-        m_pSocket = NULL;
+        CIwHTTPResolver::Cancel(m_dnsWaiter);
+        m_dnsWaiter = NULL;
     }
 
+    m_connector.Cancel();
+
+    // Abandon any download, unless it is the one doing the cancelling..
+    if (m_download_fd != -1 && !m_download_busy)
+        CloseDownload();
+
+    // Pool the connection if the response is complete, otherwise close it
+    FinishConnection();
+
     // clear form data
-    for (std::list<Data>::iterator it = m_data.begin(); it != m_data.end(); ++it)
-        if (it->m_file != NULL)
-            s3eFileClose(it->m_file);
-    m_data.clear();
+    ClearData();
+
+    if (m_flight)
+    {
+        // One that joined another's request stops waiting for it. A leader
+        // may still hand out what it holds, or be about to finish the body
+        // when the end of the content cancels it, so only gives up later
+        // if not..
+        if (m_flight->GetLeader() != this || !m_flight->IsAnswered())
+            LeaveFlight();
+        else if (!m_flight_timer)
+        {
+            m_flight_timer = 1;
+            CIwHTTPEventLoop::SetTimer(0, FlightCallback, this);
+        }
+    }
 
     m_bGetInProgress = false;
 
+    // Still waiting for its turn, so drop its queue entry as Release
+    // would..
+    if (m_session && m_session_state == SESSION_QUEUED)
+    {
+        m_session_state = SESSION_NONE;
+        m_session_gen++;
+        m_session->m_queued--;
+    }
+
+    SessionRequestFinished();
+
     return S3E_RESULT_SUCCESS;
 }
 
-void CIwHTTP::Writeable()
+void CIwHTTP::SessionRequestFinished()
 {
-    IwTrace(HTTP_VERBOSE, ("(Writeable)"));
-
-#ifdef IW_HTTP_SSL
-    if (m_bSSLHandshaking)
-        ContinueSSLHandshake();
-    else
-#endif
-        SendRequest();
+    // Let an owning session start its next request..
+    if (m_session && m_session_state == SESSION_ACTIVE)
+    {
+        m_session_state = SESSION_NONE;
+        m_session->RequestFinished(this);
+    }
 }
 
-void CIwHTTP::Readable()
+void CIwHTTP::ClearData()
 {
-    IwTrace(HTTP_VERBOSE, ("(Readable)"));
+    FreeData(m_data);
 
-#ifdef IW_HTTP_SSL
-    if (m_bSSLHandshaking)
-        ContinueSSLHandshake();
-    else
-#endif
-        ReadResponse();
+    delete[] m_upload_buf;
+    m_upload_buf = NULL;
+    m_upload_start = m_upload_end = 0;
+
+    delete m_encoder;
+    m_encoder = NULL;
 }
 
-int32 CIwHTTP::WriteableCallback(s3eSocket *pSocket, void *pSysData, void *pUserData)
+void CIwHTTP::FreeData(std::list<Data> &data)
 {
-    if (pUserData)
-        ((CIwHTTP *)pUserData)->Writeable();
+    for (std::list<Data>::iterator it = data.begin(); it != data.end(); ++it)
+    {
+        if (it->m_file != NULL)
+            s3eFileClose(it->m_file);
 
-    return S3E_RESULT_SUCCESS;
+        if (it->m_map != NULL && it->m_map != MAP_FAILED)
+            munmap(it->m_map, it->m_size);
+
+        if (it->m_fd != -1)
+            close(it->m_fd);
+    }
+    data.clear();
 }
 
-int32 CIwHTTP::ReadableCallback(s3eSocket *pSocket, void *pSysData, void *pUserData)
+void CIwHTTP::SetPoolKey()
 {
-    IwTrace(HTTP_VERBOSE, ("ReadableCallback"));
+    CIwHTTPConnectionPool::MakeKey(
+        m_poolKey, m_URI.GetHost(), m_URI.GetPort(), m_URI.GetProtocol() == CIwURI::HTTPS,
+        m_usingProxy ? m_proxyHost.c_str() : NULL, m_proxyPort
+    );
+}
 
-    if (pUserData)
-        ((CIwHTTP *)pUserData)->Readable();
+bool CIwHTTP::TryPooledConnection()
+{
+    // A retry always gets a fresh connection..
+    if (m_retried)
+        return false;
 
-    return S3E_RESULT_SUCCESS;
+    CIwHTTPConnectionPool::Connection conn;
+    if (!CIwHTTPConnectionPool::Acquire(m_poolKey, conn))
+        return false;
+
+    if (m_socket != -1)
+        CIwHTTPEventLoop::CloseSocket(m_socket);
+
+    m_socket = conn.m_socket;
+    m_pSocket = conn.m_pSocket;
+#ifdef IW_HTTP_SSL
+    m_SSL = conn.m_SSL;
+#endif
+    m_reusedConnection = true;
+    return true;
 }
 
-int CIwHTTP::SendBytes(const char *buf, int len)
+int32 CIwHTTP::ReuseCallback(void *, void *pUserData)
+{
+    CIwHTTP *self = (CIwHTTP *)pUserData;
+    self->m_reuse_timer = 0;
+    self->DoConnectCallback(S3E_RESULT_SUCCESS);
+    return 0;
+}
+
+bool CIwHTTP::IsIdempotent() const
+{
+    return m_Type != POST;
+}
+
+bool CIwHTTP::IsReusable()
 {
+    if (!m_keepAlive || !m_body_complete || m_pSocket == NULL || m_pipe_close || m_h2)
+        return false;
+
 #ifdef IW_HTTP_SSL
-    if (m_bSecureSocket)
+    if (m_bSSLHandshaking)
+        return false;
+#endif
+
+    // Nothing past the end of this response may be left over, it
+    // wouldn't belong to anyone..
+    return m_recv_start == m_recv_end;
+}
+
+bool CIwHTTP::RetryRequest()
+{
+    // Only a request that went out on a pooled connection the server
+    // had meanwhile closed is retried, and only once..
+    if (!m_reusedConnection || m_retried || !m_response.empty() || !IsIdempotent())
+        return false;
+
+    IwTrace(HTTP, ("(Pooled connection was closed by the server, retrying)"));
+
+    m_retried = true;
+    m_reusedConnection = false;
+    m_keepAlive = false;
+    PipelineFailed();
+    CloseConnection();
+
+    // The request is rewound once connected again..
+    m_usingProxy = m_lookupViaProxy;
+    m_firstDns = true;
+
+    EnqueueDNSRequest(m_lookupHost.c_str());
+
+    return true;
+}
+
+void CIwHTTP::ReleaseConnection()
+{
+    CIwHTTPConnectionPool::Connection conn;
+    conn.m_key = m_poolKey;
+    conn.m_socket = m_socket;
+    conn.m_pSocket = m_pSocket;
+#ifdef IW_HTTP_SSL
+    conn.m_SSL = m_SSL;
+    m_SSL = NULL;
+#endif
+
+    // Drop any outstanding readiness callbacks that point at us..
+    CIwHTTPEventLoop::SocketReadable(m_socket, m_pSocket, NULL, NULL);
+    CIwHTTPEventLoop::SocketWritable(m_socket, m_pSocket, NULL, NULL);
+
+    m_socket = -1;
+    m_pSocket = NULL;
+    m_keepAlive = false;
+
+    CIwHTTPConnectionPool::Release(conn);
+}
+
+void CIwHTTP::CloseConnection()
+{
+    if (m_h2)
     {
-        int ret = SSL_write(m_SSL, buf, len);
-        if (ret == -1)
-        {
-            int err = SSL_get_error(m_SSL, ret);
-            if (err == SSL_ERROR_WANT_WRITE)
-                // Blocked on send, SSL_write in current mode is atomic
-                // so entire send must be repeated.
-                // Read carefully: http://www.openssl.org/docs/ssl/SSL_write.html
-                ret = 0;
-        }
-        IwTrace(HTTP, ("SSL_write returns %d", ret));
-        return ret;
+        // The connection carries on for the other streams..
+        m_h2->Detach(m_h2_stream, m_body_complete);
+        m_h2 = NULL;
+        m_h2_stream = 0;
+        m_socket = -1;
+        m_pSocket = NULL;
+        return;
     }
-    else
+
+    // Whatever was pipelined behind us will never be answered. If the
+    // server chose to close, don't pipeline to it again..
+    if (m_pipe_next)
     {
-        return s3eSocketSend(m_pSocket, buf, len, 0);
+        if (!m_keepAlive && m_headers_end != std::string::npos)
+            PipelineFailed();
+        m_pipe_next->PipelineBreak();
     }
-#else
-    return s3eSocketSend(m_pSocket, buf, len, 0);
+
+#ifdef IW_HTTP_SSL
+    // Bring down SSL before the socket..
+    DestroySSL();
 #endif
+
+    if (m_pSocket)
+    {
+        CIwHTTPEventLoop::CloseSocket(m_socket);
+        m_socket = -1;
+        m_pSocket = NULL;
+    }
 }
 
-int CIwHTTP::ReadBytes(char *buf, int len)
+void CIwHTTP::FinishConnection()
+{
+    // The next request in a pipeline takes over, leftovers and all..
+    if (m_pipe_next && m_keepAlive && m_body_complete && m_pSocket && !m_pipe_close)
+        PipelineHandOver();
+    else if (IsReusable())
+        ReleaseConnection();
+    else
+        CloseConnection();
+}
+
+bool CIwHTTP::PipelineAfter(CIwHTTP *prev)
 {
+    if (!prev)
+        return false;
+
+    IwTrace(HTTP, ("(Pipelining behind %p)", prev));
+
+    // Share the connection for writing. It's ours once prev is done..
+    m_socket = prev->m_socket;
+    m_pSocket = prev->m_pSocket;
 #ifdef IW_HTTP_SSL
-    return m_bSecureSocket ? SSL_read(m_SSL, buf, len) : recv(m_socket, buf, len, 0);
-#else
-    return recv(m_socket, buf, len, 0);
+    m_SSL = prev->m_SSL;
 #endif
+    m_reusedConnection = true;
+
+    m_pipe_prev = prev;
+    prev->m_pipe_next = this;
+    return true;
 }
 
-#ifdef IW_HTTP_SSL
-void CIwHTTP::ContinueSSLHandshake()
+bool CIwHTTP::CanPipelineAfter() const
 {
-    IwAssert(HTTP, m_bSSLHandshaking);
+    // Only behind requests that can be sent again, once they have gone,
+    // on connections not known to be closing..
+    return m_pSocket && !m_h2 && !m_pipe_next && !m_pipe_close && !m_retried && !m_body_complete &&
+        (m_Type == GET || m_Type == HEAD) && RequestSent() &&
+        (m_headers_end == std::string::npos || m_keepAlive)
+#ifdef IW_HTTP_SSL
+        && !m_bSSLHandshaking
+#endif
+        ;
+}
 
-    IwTrace(HTTP, ("ContinueSSLHandshake:0"));
+uint32 CIwHTTP::PipelineLength() const
+{
+    uint32 len = 1;
+    for (const CIwHTTP *r = m_pipe_prev; r; r = r->m_pipe_prev)
+        len++;
+    return len;
+}
 
-    int ret;
-    if ((ret = SSL_connect(m_SSL)) != SSL_SUCCESS)
-    {
-        IwTrace(HTTP, ("ContinueSSLHandshake"));
+bool CIwHTTP::RequestSent() const
+{
+    // A compressed body's length isn't known until it has all been made..
+    if (m_encoder && !m_encode_done)
+        return false;
 
-        int err = SSL_get_error(m_SSL, 0);
+    return !m_request_head.empty() && m_request_idx >= (int)m_request_head.size() + m_data_len;
+}
 
-        if (err == SSL_ERROR_WANT_READ)
-        {
-            IwTrace(HTTP, ("Waiting until Readable"));
-            s3eSocketReadable(m_pSocket, ReadableCallback, this);
-        }
-        else if (err == SSL_ERROR_WANT_WRITE)
-        {
-            IwTrace(HTTP, ("Waiting until Writeable"));
-            s3eSocketWritable(m_pSocket, WriteableCallback, this);
-        }
-        else
-        {
-            m_bSSLHandshaking = false;
-            IwTrace(HTTP, ("SSL Error"));
-            Fail();
-        }
-    }
-    else
-    {
-        // Succesful SSL handshake
-        m_bSSLHandshaking = false;
+void CIwHTTP::PipelineHandOver()
+{
+    CIwHTTP *next = m_pipe_next;
+    IwTrace(HTTP_VERBOSE, ("(Handing connection over to pipelined %p)", next));
+
+    CIwHTTPEventLoop::SocketReadable(m_socket, m_pSocket, NULL, NULL);
+
+    // Anything read past the end of our response is the start of theirs,
+    // so they take the buffer..
+    std::swap(m_recv_buf, next->m_recv_buf);
+    std::swap(m_recv_size, next->m_recv_size);
+    next->m_recv_start = m_recv_start;
+    next->m_recv_end = m_recv_end;
+    m_recv_start = m_recv_end = 0;
+
+    // They already have the connection itself..
+    m_socket = -1;
+    m_pSocket = NULL;
+#ifdef IW_HTTP_SSL
+    m_SSL = NULL;
+#endif
+    m_keepAlive = false;
 
-        IwTrace(HTTP, ("Handshake Done"));
+    m_pipe_next = NULL;
+    next->m_pipe_prev = NULL;
 
-        // Connection is now secure, send the request..
-        SendRequest();
-    }
+    // Not from within whatever finished our response..
+    next->m_pipe_timer = 1;
+    CIwHTTPEventLoop::SetTimer(0, PipelineCallback, next);
 }
 
-void CIwHTTP::StartSSLHandshake()
+int32 CIwHTTP::PipelineCallback(void *, void *pUserData)
 {
-    if (m_SSL)
-        DestroySSL();
+    CIwHTTP *self = (CIwHTTP *)pUserData;
+    self->m_pipe_timer = 0;
 
-    // Just TLSv1 right now..
-    SSL_METHOD *method  = TLSv1_client_method();
+    // If still sending, reading starts once it's all gone..
+    if (self->RequestSent())
+        self->ReadResponse();
 
-    m_SSL_CTX = SSL_CTX_new(method);
+    return 0;
+}
 
-    // Turn off verification of certs..
-    SSL_CTX_set_verify(m_SSL_CTX, SSL_VERIFY_NONE, NULL);
+void CIwHTTP::PipelineWithdraw()
+{
+    // Those behind us go elsewhere. Our response will still arrive, so
+    // the connection is finished with after the one ahead of us..
+    if (m_pipe_next)
+        m_pipe_next->PipelineBreak();
 
-    m_SSL = SSL_new(m_SSL_CTX);
+    m_pipe_prev->m_pipe_next = NULL;
+    m_pipe_prev->m_pipe_close = true;
+    m_pipe_prev = NULL;
 
-    // Set socket to use..
-    SSL_set_fd(m_SSL, m_socket);
+    if (m_pSocket && !RequestSent())
+        CIwHTTPEventLoop::SocketWritable(m_socket, m_pSocket, NULL, NULL);
 
-    m_bSSLHandshaking = true;
-    ContinueSSLHandshake();
+    m_socket = -1;
+    m_pSocket = NULL;
+#ifdef IW_HTTP_SSL
+    m_SSL = NULL;
+#endif
 }
 
-void CIwHTTP::DestroySSL()
+void CIwHTTP::PipelineBreak()
 {
-    if (m_SSL)
+    // The connection won't be used again beyond the request ahead..
+    if (m_pipe_prev)
     {
-        SSL_shutdown(m_SSL);
-        SSL_free(m_SSL);
-        m_SSL = NULL;
+        m_pipe_prev->m_pipe_next = NULL;
+        m_pipe_prev->m_pipe_close = true;
+        m_pipe_prev = NULL;
     }
 
-    if (m_SSL_CTX)
+    for (CIwHTTP *r = this; r; )
     {
-        SSL_CTX_free(m_SSL_CTX);
-        m_SSL_CTX = NULL;
+        CIwHTTP *next = r->m_pipe_next;
+        r->m_pipe_prev = r->m_pipe_next = NULL;
+        r->PipelineReplay();
+        r = next;
     }
 }
-#endif
 
-void CIwHTTP::SendRequest()
+void CIwHTTP::PipelineReplay()
 {
-    IwTrace(HTTP, ("(SendRequest [%d->%d])", m_request_idx, m_data_len));
-    if (m_request_idx < m_data_len)
-    {
-        int result;
-        int extra_size = 0;
+    IwTrace(HTTP, ("(Pipelined request went unanswered, resending)"));
 
-        if (m_data_it->m_idx < (int)m_data_it->m_value.size())
-        {
-            result = SendBytes(m_data_it->m_value.c_str() + m_data_it->m_idx, m_data_it->m_value.size() - m_data_it->m_idx);
-        }
-        else
-        {
-            char buffer[POST_BUFFER_PREFIX_SIZE + POST_BUFFER_SIZE + POST_BUFFER_POSTFIX_SIZE];
-            int size;
+    if (m_reuse_timer)
+    {
+        m_reuse_timer = 0;
+        CIwHTTPEventLoop::CancelTimer(ReuseCallback, this);
+    }
 
-            if (m_post_chunked)
-            {
-                char buffer2[8];
+    // Let go of the connection, which was never ours to close..
+    if (m_pSocket && !RequestSent())
+        CIwHTTPEventLoop::SocketWritable(m_socket, m_pSocket, NULL, NULL);
 
-                s3eFileSeek(m_data_it->m_file, m_data_it->m_idx - m_data_it->m_value.size(), S3E_FILESEEK_SET);
-                size = s3eFileRead(buffer + POST_BUFFER_PREFIX_SIZE, 1, POST_BUFFER_SIZE, m_data_it->m_file);
+    m_socket = -1;
+    m_pSocket = NULL;
+#ifdef IW_HTTP_SSL
+    m_SSL = NULL;
+#endif
 
-                // add ending CR to chunk size
-                if (m_data_it->m_idx + size >= m_data_it->m_size)
-                    sprintf(buffer2, "%04x\r\n", size + 2);
-                else
-                    sprintf(buffer2, "%04x\r\n", size);
+    // ..and start again on a connection of its own
+    m_retried = true;
+    m_reusedConnection = false;
+    m_usingProxy = m_lookupViaProxy;
+    m_firstDns = true;
 
-                memcpy(buffer, buffer2, POST_BUFFER_PREFIX_SIZE);
-                extra_size += POST_BUFFER_PREFIX_SIZE;
+    EnqueueDNSRequest(m_lookupHost.c_str());
+}
 
-                buffer[size + extra_size    ] = '\r';
-                buffer[size + extra_size + 1] = '\n';
-                extra_size += 2;
-            }
-            else
-            {
-                s3eFileSeek(m_data_it->m_file, m_data_it->m_idx - m_data_it->m_value.size(), S3E_FILESEEK_SET);
-                size = s3eFileRead(buffer, 1, POST_BUFFER_SIZE, m_data_it->m_file);
-            }
+void CIwHTTP::PipelineFailed()
+{
+    if (m_pipe_next && m_session)
+        m_session->PipelineFailed(m_session_host);
+}
 
-            // ending CR
-            if (m_data_it->m_idx + size >= m_data_it->m_size)
-            {
-                buffer[size + extra_size    ] = '\r';
-                buffer[size + extra_size + 1] = '\n';
-                extra_size += 2;
-            }
+bool CIwHTTP::WantHTTP2(bool secure) const
+{
+    // Chunk framing means nothing to HTTP/2, and proxies are spoken to in
+    // HTTP/1.1..
+    if ((m_post_chunked && m_SendingData) || m_encoder || m_usingProxy)
+        return false;
 
-            result = SendBytes(buffer, size + extra_size);
+    int enabled = secure ? 1 : 0;
+    s3eConfigGetInt("connection", secure ? "httph2" : "httph2c", &enabled);
+    return enabled != 0;
+}
 
-            if(result != -1)
-                result -= extra_size;
-        }
+bool CIwHTTP::UseHTTP2()
+{
+    // A retry always gets a fresh connection..
+    if (m_retried || !WantHTTP2(m_URI.GetProtocol() == CIwURI::HTTPS))
+        return false;
 
-        if (result == -1)
-        {
-            IwTrace(HTTP, ("(Failed to send request)"));
-            Fail();
-            return;
-        }
+    CIwHTTP2Connection *conn = CIwHTTP2Connection::Find(m_poolKey);
+    if (!conn)
+        return false;
 
-        m_request_idx += result;
-        m_data_it->m_idx += result;
+    IwTrace(HTTP, ("(Multiplexing onto HTTP/2 connection %s)", m_poolKey.c_str()));
 
-        if (m_data_it->m_idx >= m_data_it->m_size)
-            ++m_data_it;
+    if (m_socket != -1)
+        CIwHTTPEventLoop::CloseSocket(m_socket);
 
-        if (m_request_idx < m_data_len)
-        {
-            IwTrace(HTTP_VERBOSE, ("Didn't send all request. Requesting writable (%p)", this));
+    conn->Attach();
+    m_h2 = conn;
+    m_h2_stream = 0;
+    m_socket = conn->GetSocket();
+    m_pSocket = conn->GetSocketHandle();
+    m_reusedConnection = true;
+    return true;
+}
 
-            // Request callback if we didn't send everything
-            s3eSocketWritable(m_pSocket, WriteableCallback, this);
-        }
-        else
-        {
-            IwTrace(HTTP_VERBOSE, ("Request sent. Reading results... (%p)", this));
+void CIwHTTP::StartHTTP2()
+{
+    // The connection is shared from now on, along with its SSL..
+#ifdef IW_HTTP_SSL
+    m_h2 = CIwHTTP2Connection::Create(m_poolKey, m_socket, m_pSocket, m_SSL);
+    m_SSL = NULL;
+#else
+    m_h2 = CIwHTTP2Connection::Create(m_poolKey, m_socket, m_pSocket);
+#endif
+    m_h2_stream = 0;
+}
 
-            // clear form data
-            for (std::list<Data>::iterator it = m_data.begin(); it != m_data.end(); ++it)
-                if (it->m_file != NULL)
-                    s3eFileClose(it->m_file);
-            m_data.clear();
-            m_data_sent = m_request_idx;
+void CIwHTTP::WaitReadable(s3eSocketCallbackFn fn)
+{
+    if (m_h2)
+        m_h2->WaitReadable(m_h2_stream, fn, fn ? this : NULL);
+    else
+        CIwHTTPEventLoop::SocketReadable(m_socket, m_pSocket, fn, fn ? this : NULL);
+}
 
-            // All sent so request callback when the reply comes in
-            ReadResponse();
-        }
-    }
+void CIwHTTP::WaitWritable(s3eSocketCallbackFn fn)
+{
+    if (m_h2)
+        m_h2->WaitWritable(m_h2_stream, fn, fn ? this : NULL);
+    else
+        CIwHTTPEventLoop::SocketWritable(m_socket, m_pSocket, fn, fn ? this : NULL);
 }
 
-void CIwHTTP::ReadResponse()
+void CIwHTTP::WaitContent(s3eSocketCallbackFn fn)
 {
-    const int BUF_SIZE(64);
-    char recv_buf[BUF_SIZE];
+    // A joined request is called back once the leader has read more..
+    if (AwaitingFlight())
+        m_flight_wait = fn;
+    else
+        WaitReadable(fn);
+}
 
-    // Read headers into response..
+void CIwHTTP::Writeable()
+{
+    IwTrace(HTTP_VERBOSE, ("(Writeable)"));
 
 #ifdef IW_HTTP_SSL
-    do
-    {
-        // SSL buffers underneath us so make sure
-        // we exhaust the buffer before going back to
-        // waiting for select to come true
+    if (m_bSSLHandshaking)
+        ContinueSSLHandshake();
+    else
 #endif
+        SendRequest();
+}
 
-    int32 bytes_read = ReadBytes(recv_buf, BUF_SIZE);
-    IwTrace(HTTP_VERBOSE, ("ReadResponse: %d", bytes_read));
+void CIwHTTP::Readable()
+{
+    IwTrace(HTTP_VERBOSE, ("(Readable)"));
 
-    if (bytes_read > 0)
-    {
-        m_response.append(recv_buf, bytes_read);
-    }
-    else if(bytes_read == 0)
-    {
-        IwTrace(HTTP, ("(Socket connection ended before all headers were read)"));
-        Fail();
-        return;
-    }
-    else
-    {
-        if (errno != EAGAIN)
-        {
-            IwTrace(HTTP, ("(Socket error whilst reading headers)"));
-            Fail();
-            return;
-        }
-    }
 #ifdef IW_HTTP_SSL
-    }
-    // Only for secure sockets..
-    while (m_bSecureSocket && SSL_pending(m_SSL));
+    if (m_bSSLHandshaking)
+        ContinueSSLHandshake();
+    else
 #endif
+        ReadResponse();
+}
 
-    if (!GotHeaders())
-    {
-        // Keep reading until all headers received..
-        s3eSocketReadable(m_pSocket, ReadableCallback, this);
+int32 CIwHTTP::WriteableCallback(s3eSocket *pSocket, void *pSysData, void *pUserData)
+{
+    if (pUserData)
+        ((CIwHTTP *)pUserData)->Writeable();
+
+    return S3E_RESULT_SUCCESS;
+}
+
+int32 CIwHTTP::ReadableCallback(s3eSocket *pSocket, void *pSysData, void *pUserData)
+{
+    IwTrace(HTTP_VERBOSE, ("ReadableCallback"));
+
+    if (pUserData)
+        ((CIwHTTP *)pUserData)->Readable();
+
+    return S3E_RESULT_SUCCESS;
+}
+
+int CIwHTTP::SendBytes(const char *buf, int len)
+{
+    if (m_h2)
+        return m_h2->Write(m_h2_stream, buf, len);
+
+#ifdef IW_HTTP_SSL
+    if (m_bSecureSocket)
+    {
+        int ret = SSL_write(m_SSL, buf, len);
+        if (ret == -1)
+        {
+            int err = SSL_get_error(m_SSL, ret);
+            if (err == SSL_ERROR_WANT_WRITE)
+            {
+                // Blocked on send, SSL_write in current mode is atomic
+                // so entire send must be repeated.
+                // Read carefully: http://www.openssl.org/docs/ssl/SSL_write.html
+                CIwHTTPEventLoop::WouldBlock(m_socket, true);
+                ret = 0;
+            }
+        }
+        IwTrace(HTTP_VERBOSE, ("SSL_write returns %d", ret));
+        return ret;
+    }
+#endif
+
+    int ret = CIwHTTPEventLoop::Send(m_socket, buf, len);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        CIwHTTPEventLoop::WouldBlock(m_socket, true);
+        ret = 0;
+    }
+
+    return ret;
+}
+
+int CIwHTTP::ReadBytes(char *buf, int len)
+{
+    if (m_h2)
+        return m_h2->Read(m_h2_stream, buf, len);
+
+#ifdef IW_HTTP_SSL
+    if (m_bSecureSocket)
+    {
+        int ret = SSL_read(m_SSL, buf, len);
+        if (ret <= 0)
+        {
+            int err = SSL_get_error(m_SSL, ret);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                CIwHTTPEventLoop::WouldBlock(m_socket, err == SSL_ERROR_WANT_WRITE);
+        }
+        return ret;
+    }
+#endif
+
+    int ret = CIwHTTPEventLoop::Recv(m_socket, buf, len, 0);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        CIwHTTPEventLoop::WouldBlock(m_socket, false);
+    return ret;
+}
+
+int CIwHTTP::FillRecvBuffer()
+{
+    if (!m_recv_buf)
+    {
+        int size = 16384;
+        s3eConfigGetInt("connection", "httprecvbuffersize", &size);
+        m_recv_size = MAX(size, 1024);
+        m_recv_buf = new char[m_recv_size];
+    }
+
+    // Keep whatever is unread at the front..
+    if (m_recv_start)
+    {
+        memmove(m_recv_buf, &m_recv_buf[m_recv_start], m_recv_end - m_recv_start);
+        m_recv_end -= m_recv_start;
+        m_recv_start = 0;
+    }
+
+    IwAssertMsg(HTTP, m_recv_end < m_recv_size, ("Receive buffer full"));
+
+    int total = 0;
+    while (m_recv_end < m_recv_size)
+    {
+        int32 read = ReadBytes(&m_recv_buf[m_recv_end], m_recv_size - m_recv_end);
+        if (read <= 0)
+            return total ? total : read;
+
+        m_recv_end += read;
+        total += read;
+
+#ifdef IW_HTTP_SSL
+        // SSL buffers underneath us so make sure we exhaust the buffer
+        // before going back to waiting for select to come true
+        if (m_bSecureSocket && m_SSL && SSL_pending(m_SSL))
+            continue;
+#endif
+        break;
+    }
+
+    return total;
+}
+
+int CIwHTTP::RecvBuffered(char *buf, int len)
+{
+    if (m_recv_start == m_recv_end)
+    {
+        m_recv_start = m_recv_end = 0;
+
+        // Big reads may as well go straight to the caller..
+        if (m_recv_buf == NULL ? len >= 16384 : len >= (int)m_recv_size)
+            return ReadBytes(buf, len);
+
+        int read = FillRecvBuffer();
+        if (read <= 0)
+            return read;
+    }
+
+    int n = MIN((int)(m_recv_end - m_recv_start), len);
+    memcpy(buf, &m_recv_buf[m_recv_start], n);
+    m_recv_start += n;
+    return n;
+}
+
+#ifdef IW_HTTP_SSL
+void CIwHTTP::ContinueSSLHandshake()
+{
+    IwAssert(HTTP, m_bSSLHandshaking);
+
+    IwTrace(HTTP, ("ContinueSSLHandshake:0"));
+
+    int ret;
+    if ((ret = SSL_connect(m_SSL)) != SSL_SUCCESS)
+    {
+        IwTrace(HTTP, ("ContinueSSLHandshake"));
+
+        int err = SSL_get_error(m_SSL, 0);
+
+        if (err == SSL_ERROR_WANT_READ)
+        {
+            IwTrace(HTTP, ("Waiting until Readable"));
+            CIwHTTPEventLoop::WouldBlock(m_socket, false);
+            CIwHTTPEventLoop::SocketReadable(m_socket, m_pSocket, ReadableCallback, this);
+        }
+        else if (err == SSL_ERROR_WANT_WRITE)
+        {
+            IwTrace(HTTP, ("Waiting until Writeable"));
+            CIwHTTPEventLoop::WouldBlock(m_socket, true);
+            CIwHTTPEventLoop::SocketWritable(m_socket, m_pSocket, WriteableCallback, this);
+        }
+        else
+        {
+            // Don't offer a session the server has just turned down..
+            m_bSSLHandshaking = false;
+            IwTrace(HTTP, ("SSL Error"));
+            CIwHTTPSSLContext::Forget(m_poolKey);
+            Fail();
+        }
+    }
+    else
+    {
+        // Succesful SSL handshake
+        m_bSSLHandshaking = false;
+
+        IwTrace(HTTP, ("Handshake Done"));
+
+        // The next connection this way can resume the session..
+        CIwHTTPSSLContext::Established(m_SSL, m_poolKey);
+
+#ifdef HAVE_TLS13
+        if (m_early_len)
+        {
+            // What went early needn't go again, unless the server
+            // ignored it..
+            if (SSL_get_early_data_status(m_SSL) == SSL_EARLY_DATA_ACCEPTED)
+                m_request_idx = m_early_len;
+            else
+                IwTrace(HTTP, ("(Early data rejected, sending the request again)"));
+            m_early_len = 0;
+        }
+#endif
+
+#ifdef HAVE_ALPN
+        // The server may have chosen HTTP/2..
+        char *proto = NULL;
+        word16 protoLen = 0;
+        if (CyaSSL_ALPN_GetProtocol(m_SSL, &proto, &protoLen) == SSL_SUCCESS &&
+            protoLen == 2 && !memcmp(proto, "h2", 2))
+            StartHTTP2();
+#endif
+
+        // Connection is now secure, send the request..
+        SendRequest();
+    }
+}
+
+void CIwHTTP::StartSSLHandshake()
+{
+    if (m_SSL)
+        DestroySSL();
+
+    // Every connection shares one context, and resumes the last session
+    // going the same way if it can..
+    m_SSL = CIwHTTPSSLContext::Create(m_socket, m_poolKey);
+    if (!m_SSL)
+    {
+        IwTrace(HTTP, ("SSL Error"));
+        Fail();
+        return;
+    }
+
+#ifdef HAVE_ALPN
+    // Offer HTTP/2, settling for HTTP/1.1..
+    if (WantHTTP2(true))
+    {
+        char protos[] = "h2,http/1.1";
+        CyaSSL_UseALPN(m_SSL, protos, sizeof(protos) - 1, CYASSL_ALPN_CONTINUE_ON_MISMATCH);
+    }
+#endif
+
+#ifdef HAVE_TLS13
+    // Resuming, a request that is safe to repeat can go along with the
+    // ClientHello. It may be replayed, so nothing with a body goes, and
+    // nothing that could be meant for HTTP/2..
+    m_early_len = 0;
+    if ((m_Type == GET || m_Type == HEAD) && m_data.empty() &&
+#ifdef HAVE_ALPN
+        !WantHTTP2(true) &&
+#endif
+        CIwHTTPSSLContext::CanSendEarlyData(m_SSL))
+    {
+        size_t written = 0;
+        if (SSL_write_early_data(m_SSL, m_request_head.data(), m_request_head.size(), &written) == 1)
+        {
+            IwTrace(HTTP, ("(Sent %d bytes of early data)", (int)written));
+            m_early_len = written;
+        }
+    }
+#endif
+
+    m_bSSLHandshaking = true;
+    ContinueSSLHandshake();
+}
+
+void CIwHTTP::DestroySSL()
+{
+    CIwHTTPSSLContext::Destroy(m_SSL);
+    m_SSL = NULL;
+}
+#endif
+
+void CIwHTTP::SendRequest()
+{
+    if (m_h2 && !m_h2_stream)
+    {
+        // The head goes as a HEADERS frame, leaving just the body..
+        m_h2_stream = m_h2->OpenStream(m_request_head, m_URI.GetProtocol() == CIwURI::HTTPS, m_data_len, m_h2_weight);
+        if (!m_h2_stream)
+        {
+            if (RetryRequest())
+                return;
+
+            IwTrace(HTTP, ("(Failed to open HTTP/2 stream)"));
+            Fail();
+            return;
+        }
+
+        m_request_idx = m_request_head.size();
+    }
+
+    IwTrace(HTTP, ("(SendRequest [%d->%d])", m_request_idx, (int)m_request_head.size() + m_data_len));
+
+    // Keep going until the socket won't take any more..
+    while (!RequestSent())
+    {
+        int result = SendNext();
+
+        if (result == -1)
+        {
+            if (m_pipe_prev)
+            {
+                // Send it again elsewhere, along with anything behind it..
+                PipelineBreak();
+                return;
+            }
+
+            if (RetryRequest())
+                return;
+
+            IwTrace(HTTP, ("(Failed to send request)"));
+            Fail();
+            return;
+        }
+
+        if (result == 0)
+        {
+            IwTrace(HTTP_VERBOSE, ("Didn't send all request. Requesting writable (%p)", this));
+
+            // Request callback if we didn't send everything
+            WaitWritable(WriteableCallback);
+            return;
+        }
+
+        m_request_idx += result;
+    }
+
+    IwTrace(HTTP_VERBOSE, ("Request sent. Reading results... (%p)", this));
+
+    // clear form data, unless the connection was pooled. It may
+    // turn out the server has closed it, and the request will have
+    // to be sent again..
+    if (!m_reusedConnection)
+        ClearData();
+    m_data_sent = m_request_idx;
+
+    // Another request may be able to follow this one now..
+    if (m_session)
+        m_session->RequestSent();
+
+    // A pipelined request waits for the responses ahead of it..
+    if (m_pipe_prev)
+        return;
+
+    // All sent so request callback when the reply comes in
+    ReadResponse();
+}
+
+int CIwHTTP::SendNext()
+{
+    if (m_encoder && !EncodeData())
+        return -1;
+
+    // Everything up to the next file part goes in one go..
+    struct iovec iov[SEND_IOV_MAX];
+    char frames[SEND_IOV_MAX][24];
+    int n = GatherData(iov, frames, SEND_IOV_MAX);
+
+    // Over TLS or HTTP/2 every send makes a record or frame of its own..
+    bool copy = m_h2 != NULL;
+#ifdef IW_HTTP_SSL
+    copy = copy || m_bSecureSocket;
+#endif
+
+    int ret;
+    if (n == 0)
+    {
+        if (m_encoder || m_data_it == m_data.end())
+        {
+            IwAssertMsg(HTTP, false, ("Request data shorter than its length"));
+            return -1;
+        }
+
+        ret = SendFile(*m_data_it);
+    }
+    else if (copy)
+    {
+        // Small pieces are copied together so they make one record rather
+        // than a record each. Gathering again after a WANT_WRITE gives the
+        // same bytes in the same place, as SSL_write needs..
+        if (n == 1 || iov[0].iov_len >= TLS_RECORD_SIZE)
+        {
+            ret = SendBytes((const char *)iov[0].iov_base, iov[0].iov_len);
+        }
+        else
+        {
+            if (!m_gather_buf)
+                m_gather_buf = new char[TLS_RECORD_SIZE];
+
+            uint32 len = 0;
+            for (int i = 0; i < n && len < TLS_RECORD_SIZE; i++)
+            {
+                uint32 part = MIN(iov[i].iov_len, TLS_RECORD_SIZE - len);
+                memcpy(&m_gather_buf[len], iov[i].iov_base, part);
+                len += part;
+            }
+
+            ret = SendBytes(m_gather_buf, len);
+        }
+    }
+    else
+    {
+        ret = CIwHTTPEventLoop::SendMsg(m_socket, iov, n);
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            CIwHTTPEventLoop::WouldBlock(m_socket, true);
+            ret = 0;
+        }
+    }
+
+    if (ret > 0)
+        AdvanceData(ret);
+
+    return ret;
+}
+
+int CIwHTTP::GatherData(struct iovec *iov, char (*frames)[24], int max)
+{
+    int n = 0;
+
+    // The request line and headers..
+    int head = m_request_head.size();
+    if (m_request_idx < head)
+    {
+        iov[n].iov_base = (void *)(m_request_head.data() + m_request_idx);
+        iov[n++].iov_len = head - m_request_idx;
+    }
+
+    // ..the rest of any chunk framing..
+    if (m_frame_idx < m_frame_len)
+    {
+        iov[n].iov_base = &m_frame[m_frame_idx];
+        iov[n++].iov_len = m_frame_len - m_frame_idx;
+    }
+
+    // ..and what's been compressed of the body, if it is being..
+    if (m_encoder)
+    {
+        const char *pData;
+        uint32 len = m_encoder->Peek(pData);
+        if (len)
+        {
+            iov[n].iov_base = (void *)pData;
+            iov[n++].iov_len = len;
+        }
+        return n;
+    }
+
+    // ..then the parts held in memory and the framing between them, up
+    // to the first file. Nothing is copied; what's left of each piece is
+    // pointed at where it is..
+    std::list<Data>::iterator it = m_data_it;
+    int idx = it != m_data.end() ? it->m_idx : 0;
+    while (it != m_data.end() && n < max)
+    {
+        if (it->m_file != NULL || it->m_fd != -1)
+            break;
+
+        iov[n].iov_base = (void *)(it->m_value.data() + idx);
+        iov[n++].iov_len = it->m_size - idx;
+
+        ++it;
+        idx = 0;
+
+        if (n < max)
+        {
+            int len = FormatFrame(frames[n], false, it);
+            if (len)
+            {
+                iov[n].iov_base = frames[n];
+                iov[n++].iov_len = len;
+            }
+        }
+    }
+
+    return n;
+}
+
+void CIwHTTP::AdvanceData(int bytes)
+{
+    // Moves through the request as GatherData would have laid it out..
+    int head = m_request_head.size();
+    if (m_request_idx < head)
+        bytes -= MIN(bytes, head - m_request_idx);
+
+    while (bytes > 0)
+    {
+        if (m_frame_idx < m_frame_len)
+        {
+            int n = MIN(bytes, m_frame_len - m_frame_idx);
+            m_frame_idx += n;
+            bytes -= n;
+            continue;
+        }
+
+        if (m_encoder)
+        {
+            m_encoder->Consume(bytes);
+            break;
+        }
+
+        IwAssert(HTTP, m_data_it != m_data.end());
+        Data &d = *m_data_it;
+        int n = MIN(bytes, d.m_size - d.m_idx);
+        d.m_idx += n;
+        bytes -= n;
+
+        if (d.m_idx >= d.m_size)
+            NextData();
+    }
+}
+
+int CIwHTTP::SendFile(Data &d)
+{
+    // Files are read from where the last send left off, m_idx being the
+    // cursor. Nothing is read again when a send has to be retried..
+#if defined(__linux__)
+    if (d.m_fd != -1 && m_upload_sendfile && !m_h2
+#ifdef IW_HTTP_SSL
+        && !m_bSecureSocket
+#endif
+        )
+    {
+        // Straight from the file to the socket..
+        off_t off = d.m_idx;
+        int ret = CIwHTTPEventLoop::SendFile(m_socket, d.m_fd, &off, d.m_size - d.m_idx);
+        if (ret > 0)
+            return ret;
+
+        if (ret == 0)
+        {
+            IwTrace(HTTP, ("(Upload file is shorter than expected)"));
+            return -1;
+        }
+
+        if (errno == EAGAIN)
+        {
+            CIwHTTPEventLoop::WouldBlock(m_socket, true);
+            return 0;
+        }
+
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+
+        // Not for this file or socket after all..
+        m_upload_sendfile = false;
+    }
+#endif
+
+    const char *pData;
+    int len = FileData(d, pData);
+    if (len == -1)
+        return -1;
+
+    // Sends are limited so TLS records are made from a sensible amount
+    // at a time. What was read stays put until it has all gone, so a
+    // retry asks for the same again, which is just what SSL_write wants..
+    int ret = SendBytes(pData, len);
+    if (ret > 0 && (d.m_map == NULL || d.m_map == MAP_FAILED))
+        m_upload_start += ret;
+
+    return ret;
+}
+
+int CIwHTTP::FileData(Data &d, const char *&pData)
+{
+    int left = d.m_size - d.m_idx;
+
+    if (d.m_fd != -1 && d.m_map == NULL)
+    {
+        d.m_map = mmap(NULL, d.m_size, PROT_READ, MAP_PRIVATE, d.m_fd, 0);
+        if (d.m_map != MAP_FAILED)
+            madvise(d.m_map, d.m_size, MADV_SEQUENTIAL);
+    }
+
+    if (!m_upload_size)
+    {
+        int size = 262144;
+        s3eConfigGetInt("connection", "httpuploadbuffersize", &size);
+        m_upload_size = MAX(size, 4096);
+    }
+
+    if (d.m_map != NULL && d.m_map != MAP_FAILED)
+    {
+        pData = (const char *)d.m_map + d.m_idx;
+        return MIN(left, (int)m_upload_size);
+    }
+
+    if (!m_upload_buf)
+        m_upload_buf = new char[m_upload_size];
+
+    if (m_upload_start == m_upload_end)
+    {
+        int want = MIN(left, (int)m_upload_size);
+        int got;
+        if (d.m_file != NULL)
+            got = s3eFileRead(m_upload_buf, 1, want, d.m_file);
+        else
+            got = read(d.m_fd, m_upload_buf, want);
+
+        if (got <= 0)
+        {
+            IwTrace(HTTP, ("(Failed to read upload file)"));
+            return -1;
+        }
+
+        m_upload_start = 0;
+        m_upload_end = got;
+    }
+
+    pData = &m_upload_buf[m_upload_start];
+    return m_upload_end - m_upload_start;
+}
+
+void CIwHTTP::RewindData()
+{
+    m_request_idx = 0;
+    m_upload_start = m_upload_end = 0;
+    m_upload_sendfile = true;
+
+    for (std::list<Data>::iterator it = m_data.begin(); it != m_data.end(); ++it)
+    {
+        if (it->m_file != NULL)
+            s3eFileSeek(it->m_file, 0, S3E_FILESEEK_SET);
+        else if (it->m_fd != -1)
+            lseek(it->m_fd, 0, SEEK_SET);
+
+        it->m_idx = 0;
+    }
+
+    m_data_it = m_data.begin();
+    FrameChunk(true);
+
+    if (m_encoder)
+    {
+        m_encoder->Reset();
+        m_encode_done = false;
+        m_data_len = 0;
+    }
+}
+
+void CIwHTTP::NextData()
+{
+    m_upload_start = m_upload_end = 0;
+
+    ++m_data_it;
+    FrameChunk(false);
+}
+
+void CIwHTTP::FrameChunk(bool first)
+{
+    m_frame_idx = 0;
+    m_frame_len = FormatFrame(m_frame, first, m_data_it);
+}
+
+int CIwHTTP::FormatFrame(char *buf, bool first, std::list<Data>::iterator it)
+{
+    // Compressed chunks are framed by EncodeData instead..
+    if (!m_post_chunked || !m_SendingData || m_encoder)
+        return 0;
+
+    // Each part goes as a chunk of its own, followed by the last chunk..
+    const char *end = first ? "" : "\r\n";
+    if (it != m_data.end())
+        return sprintf(buf, "%s%x\r\n", end, it->m_size);
+    else
+        return sprintf(buf, "%s0\r\n\r\n", end);
+}
+
+bool CIwHTTP::EncodeData()
+{
+    // More is only made once the last chunk has all gone..
+    const char *pData;
+    if (m_encode_done || m_frame_idx < m_frame_len || m_encoder->GetPending())
+        return true;
+
+    // Compress as much of the body as fits, taking it straight from
+    // where each part is held..
+    while (m_data_it != m_data.end() && m_encoder->GetSpace())
+    {
+        Data &d = *m_data_it;
+        bool buffered = false;
+        int len;
+        if (d.m_file != NULL || d.m_fd != -1)
+        {
+            len = FileData(d, pData);
+            if (len == -1)
+                return false;
+            buffered = d.m_map == NULL || d.m_map == MAP_FAILED;
+        }
+        else
+        {
+            pData = d.m_value.data() + d.m_idx;
+            len = d.m_size - d.m_idx;
+        }
+
+        int32 used = m_encoder->Write(pData, len);
+        if (used == -1)
+            return false;
+        if (!used)
+            break;
+
+        d.m_idx += used;
+        if (buffered)
+            m_upload_start += used;
+
+        if (d.m_idx >= d.m_size)
+            NextData();
+    }
+
+    if (m_data_it == m_data.end() && !m_encoder->Finish())
+        return false;
+
+    // Frame whatever was made as a chunk, or end the body once the
+    // stream has ended and all of it has gone..
+    bool first = m_data_len == 0;
+    uint32 len = m_encoder->Peek(pData);
+    if (len)
+    {
+        m_frame_len = sprintf(m_frame, "%s%x\r\n", first ? "" : "\r\n", len);
+    }
+    else if (m_encoder->IsFinished())
+    {
+        m_frame_len = sprintf(m_frame, "%s0\r\n\r\n", first ? "" : "\r\n");
+        m_encode_done = true;
+
+        IwTrace(HTTP, ("(Compressed %u bytes of body to %u with %s)",
+            m_encoder->GetTotalIn(), m_encoder->GetTotalOut(), m_encoder->GetName()));
+    }
+    else
+    {
+        m_frame_len = 0;
+    }
+
+    m_frame_idx = 0;
+    m_data_len += m_frame_len + len;
+    return true;
+}
+
+bool CIwHTTP::WantEncoding() const
+{
+    if (m_request_encoding == ENCODING_NONE || !m_SendingData || !m_data_len)
+        return false;
+
+    // A body with a Content-Encoding of its own is sent as it is..
+    for (uint32 i = 0; i < m_req_headers.size(); i++)
+    {
+        if (m_req_headers[i].m_name == "Content-Encoding")
+            return false;
+    }
+
+    if (m_session)
+    {
+        const CIwArray<ReqHeader> &shared = m_session->m_req_headers;
+        for (uint32 i = 0; i < shared.size(); i++)
+        {
+            if (shared[i].m_name == "Content-Encoding")
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void CIwHTTP::ReadResponse()
+{
+    // Read as much as we can into the receive buffer. GotHeaders takes
+    // the headers out of it. A pipelined request may have been handed
+    // all of them already..
+    int32 bytes_read = (m_recv_start != m_recv_end && ScanHeaders()) ? 1 : FillRecvBuffer();
+    IwTrace(HTTP_VERBOSE, ("ReadResponse: %d", bytes_read));
+
+    if (bytes_read > 0)
+    {
+        // The server is answering, so the request won't need resending..
+        if (m_reusedConnection && !m_data.empty())
+            ClearData();
+    }
+    else if(bytes_read == 0)
+    {
+        if (RetryRequest())
+            return;
+
+        IwTrace(HTTP, ("(Socket connection ended before all headers were read)"));
+        Fail();
+        return;
+    }
+    else
+    {
+        if (errno != EAGAIN)
+        {
+            if (RetryRequest())
+                return;
+
+            IwTrace(HTTP, ("(Socket error whilst reading headers)"));
+            Fail();
+            return;
+        }
+    }
+
+    if (!GotHeaders())
+    {
+        // Keep reading until all headers received..
+        WaitReadable(ReadableCallback);
+    }
+    else
+    {
+        IwTrace(HTTP, ("Got headers"));
+
+        m_bGetInProgress = false;
+
+        // Got all the headers, callback..
+        if (m_header_callback)
+        {
+            m_header_callback(this, m_user_data);
+        }
+    }
+}
+
+bool CIwHTTP::ScanHeaders()
+{
+    // Move header bytes out of the receive buffer into m_response until
+    // the blank line is found. Each scan carries on where the last one
+    // stopped..
+    static const char terminator[] = "\r\n\r\n";
+
+    if (!m_recv_buf)
+        return false;
+
+    uint32 i = m_recv_start;
+    while (i < m_recv_end && m_header_scan < 4)
+    {
+        char c = m_recv_buf[i++];
+        if (c == terminator[m_header_scan])
+            m_header_scan++;
+        else
+            m_header_scan = (c == '\r') ? 1 : 0;
+    }
+
+    m_response.append(&m_recv_buf[m_recv_start], i - m_recv_start);
+    m_recv_start = i;
+
+    return m_header_scan == 4;
+}
+
+bool CIwHTTP::GotHeaders()
+{
+    if (m_headers_end != std::string::npos)
+        return true;
+
+    m_chunked = false;
+    if (!ScanHeaders())
+        return false;
+
+    m_headers_end = m_response.size();
+    m_total_transferred = 0;
+
+    IndexHeaders();
+
+    bool has_length = GetHeader("Content-Length", m_content_length);
+
+    // Try to determine the transfer-encoding..
+
+    int32 te = FindHeader("Transfer-Encoding");
+    if (te != -1)
+    {
+        const HeaderEntry &h = m_header_index[te];
+        if (HeaderHasToken(m_response.data() + h.m_value, h.m_value_len, "chunked"))
+        {
+            m_chunked = true;
+
+            // Whatever followed the headers is still in the receive
+            // buffer, decode as far as the first chunk's data..
+            m_chunk_state = CHUNK_SIZE_START;
+            m_chunk_remaining = 0;
+            DecodeChunked(NULL, 0);
+        }
+        else
+        {
+            // Insert your additional transfer-encoding handlers here...
+        }
+    }
+
+    // Chunked framing wins over any Content-Length..
+    m_length_known = has_length && !m_chunked;
+
+    GetResponseCode();
+
+    // Work out whether the connection can be used again once this
+    // response has been read..
+    m_keepAlive = m_response.compare(0, 9, "HTTP/1.1 ") == 0;
+
+    int32 connection = FindHeader("Connection");
+    if (connection != -1)
+    {
+        const HeaderEntry &h = m_header_index[connection];
+        if (HeaderHasToken(m_response.data() + h.m_value, h.m_value_len, "close"))
+            m_keepAlive = false;
+        else if (HeaderHasToken(m_response.data() + h.m_value, h.m_value_len, "keep-alive"))
+            m_keepAlive = true;
+    }
+
+    bool has_body = !(m_Type == HEAD || m_response_code == 204 || m_response_code == 304 ||
+        (m_response_code >= 100 && m_response_code < 200));
+
+    if (!has_body || (m_length_known && !m_content_length))
+    {
+        // No body follows these, or it's empty..
+        m_body_complete = true;
+        if (m_pipe_next)
+            FinishConnection();
+        SessionRequestFinished();
+    }
+    else if (!m_chunked && !has_length)
+    {
+        // The end of the body is signalled by closing the connection
+        m_keepAlive = false;
+    }
+
+    // Undo any content coding we asked for..
+    if (m_accept_encoding && has_body && !(has_length && !m_content_length))
+    {
+        int32 ce = FindHeader("Content-Encoding");
+        if (ce != -1)
+        {
+            const HeaderEntry &h = m_header_index[ce];
+            m_decoder = CIwHTTPDecoder::Create(m_response.data() + h.m_value, h.m_value_len);
+            if (m_decoder)
+                IwTrace(HTTP_VERBOSE, ("(Decoding %s content)", m_decoder->GetName()));
+        }
+    }
+
+    LogHeaders(m_response, m_response_code, m_headers_end);
+
+    m_response_time = s3eTimerGetUTC();
+    if (m_cache_stale)
+    {
+        if (m_response_code == 304)
+        {
+            // Still good, so the stored response stands in for this one..
+            IwTrace(HTTP, ("(Using revalidated response from cache)"));
+            CIwHTTPCache::Revalidated(m_URI.GetAll(), m_response, m_cache_headers, m_cache_stale, m_request_time, m_response_time);
+            m_cached = m_cache_stale;
+            m_cache_stale = NULL;
+
+            FinishConnection();
+            UseCachedResponse();
+
+            if (m_flight)
+            {
+                m_flight->Answer(m_cache_headers, m_content_length, m_cached);
+                LeaveFlight();
+            }
+            return true;
+        }
+
+        m_cache_stale->Release();
+        m_cache_stale = NULL;
+    }
+
+    if (m_Type != GET && m_Type != HEAD && m_response_code < 400)
+    {
+        // What was stored for it is out of date now..
+        CIwHTTPCache::Remove(m_URI.GetAll());
+    }
+    else if (m_Type == GET && has_body && (m_chunked || has_length))
+    {
+        // Kept as it is read, if it is to be stored. A body ended by the
+        // connection closing can't be told from one cut short..
+        m_cache_store = CIwHTTPCache::StartStore(m_URI.GetAll(), m_header_block, m_response, m_response_code);
+    }
+
+    if (m_flight)
+    {
+        // Those that joined have the headers now, and the body as it's
+        // read..
+        m_flight->Answer(m_response, m_decoder ? 0 : m_content_length, NULL);
+        if (!has_body || (has_length && !m_content_length))
+            m_flight->Complete();
+        if (m_flight->IsComplete() || m_flight->HasOverflowed())
+            LeaveFlight();
+    }
+
+    return true;
+}
+
+uint32 CIwHTTP::ContentLength()
+{
+    // The decoded length isn't known up front..
+    if (GotHeaders() && !m_decoder)
+        return m_content_length;
+    return 0;
+}
+
+uint32 CIwHTTP::ContentReceived()
+{
+    if (m_decoder)
+        return m_decoded_transferred;
+    return m_total_transferred;
+}
+
+uint32 CIwHTTP::ContentExpected()
+{
+    if (m_decoder)
+        return m_decoded_transferred + m_decoder->GetPending();
+    return ContentWireExpected();
+}
+
+uint32 CIwHTTP::ContentWireReceived()
+{
+    return m_total_transferred;
+}
+
+uint32 CIwHTTP::ContentWireExpected()
+{
+    if (m_content_length)
+        return m_content_length;
+
+    int expected = m_total_transferred;
+    if (m_chunked && m_chunk_state == CHUNK_DATA)
+        expected += m_chunk_remaining;
+    return expected;
+}
+
+int CIwHTTP::TransferContent(char *pBuf, int max_bytes)
+{
+    if (m_cached)
+        return TransferCached(pBuf, max_bytes);
+
+    int got = m_decoder ? TransferDecoded(pBuf, max_bytes) : TransferWire(pBuf, max_bytes);
+    CacheContent(pBuf, MAX(got, 0));
+    return got;
+}
+
+int CIwHTTP::TransferWire(char *pBuf, int max_bytes)
+{
+    if (!m_chunked)
+        return TransferContentInternal(pBuf, max_bytes);
+
+    int total_bytes_read = 0;
+
+    while (total_bytes_read < max_bytes && m_chunk_state != CHUNK_DONE)
+    {
+        if (m_recv_start == m_recv_end)
+        {
+            int32 read;
+            int want = MIN(max_bytes - total_bytes_read, (int)m_chunk_remaining);
+
+            if (m_chunk_state == CHUNK_DATA && want >= (m_recv_buf ? (int)m_recv_size : 16384))
+            {
+                // Plenty of chunk data to come, read it straight into
+                // the caller's buffer..
+                read = ReadBytes(&pBuf[total_bytes_read], want);
+                if (read > 0)
+                {
+                    total_bytes_read += read;
+                    m_total_transferred += read;
+                    m_chunk_remaining -= read;
+                    if (!m_chunk_remaining)
+                        m_chunk_state = CHUNK_DATA_CR;
+                    continue;
+                }
+            }
+            else
+            {
+                read = FillRecvBuffer();
+                if (read > 0)
+                    continue;
+            }
+
+            if (!read)
+            {
+                IwTrace(HTTP, ("(Socket closed before all data received. Chunked: true)"));
+                m_keepAlive = false;
+                Fail();
+            }
+            else if (errno != EAGAIN)
+            {
+                IwTrace(HTTP, ("(Socket error whilst reading chunked content: %d)", errno));
+                Fail();
+            }
+            break;
+        }
+
+        total_bytes_read += DecodeChunked(&pBuf[total_bytes_read], max_bytes - total_bytes_read);
+
+        if (m_chunk_state == CHUNK_ERROR)
+            break;
+    }
+
+    // Get through anything after the data that's already buffered, so
+    // the end of the body is noticed as soon as possible..
+    if (m_chunk_state != CHUNK_DONE && m_chunk_state != CHUNK_ERROR)
+        DecodeChunked(NULL, 0);
+
+    return total_bytes_read;
+}
+
+static inline int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int CIwHTTP::DecodeChunked(char *pBuf, int max_bytes)
+{
+    // Decodes what's in the receive buffer, in place, straight into
+    // pBuf. Chunk framing is:
+    //   size [; extensions] CR LF data CR LF ... 0 CR LF [trailers] CR LF
+    int out = 0;
+
+    while (m_recv_start < m_recv_end && m_chunk_state < CHUNK_DONE)
+    {
+        if (m_chunk_state == CHUNK_DATA)
+        {
+            if (out == max_bytes)
+                break;
+
+            uint32 n = MIN(MIN(m_recv_end - m_recv_start, m_chunk_remaining), (uint32)(max_bytes - out));
+            memcpy(&pBuf[out], &m_recv_buf[m_recv_start], n);
+            m_recv_start += n;
+            m_chunk_remaining -= n;
+            m_total_transferred += n;
+            out += n;
+
+            if (!m_chunk_remaining)
+                m_chunk_state = CHUNK_DATA_CR;
+            continue;
+        }
+
+        char c = m_recv_buf[m_recv_start++];
+        int digit;
+
+        switch (m_chunk_state)
+        {
+            case CHUNK_SIZE_START:
+            case CHUNK_SIZE:
+                if ((digit = HexDigit(c)) >= 0)
+                {
+                    if (m_chunk_remaining > 0x7ffffff)
+                    {
+                        m_chunk_state = CHUNK_ERROR;
+                        break;
+                    }
+                    m_chunk_remaining = (m_chunk_remaining << 4) | digit;
+                    m_chunk_state = CHUNK_SIZE;
+                }
+                else if (m_chunk_state == CHUNK_SIZE_START)
+                    m_chunk_state = CHUNK_ERROR;
+                else if (c == '\r')
+                    m_chunk_state = CHUNK_SIZE_LF;
+                else if (c == '\n')
+                    StartChunk();
+                else
+                    m_chunk_state = CHUNK_EXT;
+                break;
+
+            case CHUNK_EXT:
+                // Extensions are allowed but we don't understand any..
+                if (c == '\r')
+                    m_chunk_state = CHUNK_SIZE_LF;
+                else if (c == '\n')
+                    StartChunk();
+                break;
+
+            case CHUNK_SIZE_LF:
+                if (c == '\n')
+                    StartChunk();
+                else
+                    m_chunk_state = CHUNK_ERROR;
+                break;
+
+            case CHUNK_DATA_CR:
+                if (c == '\r')
+                    m_chunk_state = CHUNK_DATA_LF;
+                else if (c == '\n')
+                    m_chunk_state = CHUNK_SIZE_START;
+                else
+                    m_chunk_state = CHUNK_ERROR;
+                break;
+
+            case CHUNK_DATA_LF:
+                m_chunk_state = (c == '\n') ? CHUNK_SIZE_START : CHUNK_ERROR;
+                break;
+
+            case CHUNK_TRAILER:
+                // Trailer fields are skipped, a blank line ends the body..
+                if (c == '\r')
+                    m_chunk_state = CHUNK_END_LF;
+                else if (c == '\n')
+                    ChunkedFinished();
+                else
+                    m_chunk_state = CHUNK_TRAILER_LINE;
+                break;
+
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n')
+                    m_chunk_state = CHUNK_TRAILER;
+                break;
+
+            case CHUNK_END_LF:
+                if (c == '\n')
+                    ChunkedFinished();
+                else
+                    m_chunk_state = CHUNK_ERROR;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (m_chunk_state == CHUNK_ERROR)
+    {
+        IwTrace(HTTP, ("(Malformed Chunk Header)"));
+        Fail();
+    }
+
+    return out;
+}
+
+void CIwHTTP::StartChunk()
+{
+    IwTrace(HTTP, ("ChunkSize: %x", m_chunk_remaining));
+
+    // A zero size chunk is the last, only trailers follow it..
+    m_chunk_state = m_chunk_remaining ? CHUNK_DATA : CHUNK_TRAILER;
+}
+
+void CIwHTTP::ChunkedFinished()
+{
+    m_chunk_state = CHUNK_DONE;
+    m_last_chunk_seen = true;
+    m_body_complete = true;
+    if (m_pipe_next)
+        FinishConnection();
+    SessionRequestFinished();
+    m_content_length = m_total_transferred;
+
+    if (m_read_timeout)
+    {
+        m_read_timeout = 0;
+        CIwHTTPEventLoop::CancelTimer(ReadTimeoutCallback, this);
+    }
+
+    // We're finished, callback..
+    if (m_callback)
+    {
+        m_callback_timer = 1;
+        CIwHTTPEventLoop::SetTimer(0, DoCallback, this);
+    }
+}
+
+int32 CIwHTTP::TransferContentInternal(char *pBuf, int max_bytes)
+{
+    int transferred = 0;
+
+    // Never read past the end of this body, anything after it belongs to
+    // the next response on the connection..
+    if (m_length_known)
+        max_bytes = MIN(max_bytes, (int)(m_content_length - m_total_transferred));
+    if (max_bytes <= 0)
+        return 0;
+
+    if (m_recv_start < m_recv_end)
+    {
+        // There may be some content left over in the receive buffer..
+        transferred = MIN((int)(m_recv_end - m_recv_start), max_bytes);
+        memcpy(pBuf, &m_recv_buf[m_recv_start], transferred);
+        m_recv_start += transferred;
+    }
+
+    if (transferred < max_bytes)
+    {
+#ifdef IW_HTTP_SSL
+    do
+    {
+        // SSL buffers underneath us so make sure
+        // we exhaust the buffer before going back to
+        // waiting for select to come true
+#endif
+        int32 read = RecvBuffered(&pBuf[transferred], max_bytes - transferred);
+        if (read > 0)
+            transferred += read;
+
+        // I've added a second check here to see if the content has all been transferred, but only in
+        // the case the content length is know (i.e. we got content-length headers).  The problem here
+        // is that if we don't close down the socket when this happens then the next ReadBytes call
+        // can block for a considerable period of time thus stalling the download.  I don't want to
+        // use ContentFinished call as it's check is different to this.  I also only want this to
+        // happen for known content length as I think m_content_length == m_total_transferred is always
+        // true when content length is unknown.  A few unknowns here so playing it safe.
+        if (!read || (m_content_length == m_total_transferred + transferred && m_length_known))
+            EndOfContent(!read, m_total_transferred + transferred);
+        else if (read == -1 && errno != EAGAIN)
+        {
+            IwTrace(HTTP, ("(Unspecified socket error: %d)", errno));
+            Fail();
+        }
+
+#ifdef IW_HTTP_SSL
+    }
+    // Only for secure sockets..
+    while (m_bSecureSocket && m_SSL && SSL_pending(m_SSL) && max_bytes > transferred);
+#endif
+    }
+
+    m_total_transferred += transferred;
+    if (m_total_transferred == m_content_length && m_length_known && m_pSocket)
+    {
+        // All content is in. Hand the connection back to the pool, or
+        // close it if the server won't keep it open..
+        m_body_complete = true;
+        FinishConnection();
+        SessionRequestFinished();
+    }
+
+    return transferred;
+}
+
+int CIwHTTP::TransferDecoded(char *pBuf, int max_bytes)
+{
+    int total = 0;
+
+    while (total < max_bytes)
+    {
+        int32 got = m_decoder->Read(&pBuf[total], max_bytes - total);
+        if (got < 0)
+        {
+            if (m_Status == S3E_RESULT_SUCCESS)
+                Fail();
+            break;
+        }
+        total += got;
+
+        // Once the stream has ended what's left of the body is read and
+        // thrown away, so the connection can be used again..
+        if (total == max_bytes || (m_decoder->IsFinished() && WireFinished()) || !PullEncoded())
+            break;
+    }
+
+    m_decoded_transferred += total;
+    return total;
+}
+
+bool CIwHTTP::PullEncoded()
+{
+    if (WireFinished())
+    {
+        if (!m_decoder->IsFinished() && !m_decoder->HasFailed() && m_Status == S3E_RESULT_SUCCESS)
+        {
+            IwTrace(HTTP, ("(Content ended part way through the %s stream)", m_decoder->GetName()));
+            Fail();
+        }
+        return false;
+    }
+
+    if (m_socket == -1)
+        return false;
+
+    uint32 space;
+    char *pIn = m_decoder->GetInput(space);
+    if (!space)
+        return false;
+
+    int got = TransferWire(pIn, space);
+    if (got <= 0)
+        return false;
+
+    m_decoder->AddInput(got);
+    return true;
+}
+
+bool CIwHTTP::WireFinished()
+{
+    if (m_cached)
+        return CachedFinished();
+
+    if (m_chunked)
+        return m_chunk_state >= CHUNK_DONE;
+
+    if (m_length_known)
+        return m_total_transferred >= m_content_length;
+
+    // Otherwise the end is marked by the connection closing..
+    return m_socket == -1 && m_recv_start == m_recv_end;
+}
+
+bool CIwHTTP::HasHeldContent() const
+{
+    if (m_cached)
+        return true;
+
+    return m_decoder && !m_decoder->IsFinished() && !m_decoder->HasFailed() && m_Status == S3E_RESULT_SUCCESS;
+}
+
+int32 CIwHTTP::CacheCallback(void *, void *pUserData)
+{
+    CIwHTTP *self = (CIwHTTP *)pUserData;
+    self->m_cache_timer = 0;
+
+    IwTrace(HTTP, ("(Using response from cache)"));
+    self->UseCachedResponse();
+    self->m_bGetInProgress = false;
+    self->SessionRequestFinished();
+
+    if (self->m_header_callback)
+        self->m_header_callback(self, self->m_user_data);
+    return 0;
+}
+
+void CIwHTTP::UseCachedResponse()
+{
+    m_response = m_cache_headers;
+    m_headers_end = m_response.size();
+    IndexHeaders();
+
+    m_response_code = 0;
+    GetResponseCode();
+
+    m_content_length = m_cached->GetSize();
+    m_length_known = true;
+    m_total_transferred = 0;
+    m_chunked = false;
+    m_body_complete = true;
+    m_keepAlive = false;
+
+    LogHeaders(m_response, m_response_code, m_headers_end);
+}
+
+void CIwHTTP::ReleaseCache()
+{
+    CIwHTTPCacheBody **bodies[] = { &m_cached, &m_cache_stale, &m_cache_store };
+    for (uint32 i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++)
+    {
+        if (*bodies[i])
+        {
+            (*bodies[i])->Release();
+            *bodies[i] = NULL;
+        }
+    }
+
+    m_cache_headers.clear();
+    m_cache_conditions.clear();
+}
+
+bool CIwHTTP::CachedFinished() const
+{
+    // A joined request's body may still be growing..
+    return !AwaitingFlight() && m_total_transferred >= (int)m_cached->GetSize();
+}
+
+int CIwHTTP::TransferCached(char *pBuf, int max_bytes)
+{
+    int got = MIN(max_bytes, (int)m_cached->GetSize() - m_total_transferred);
+    memcpy(pBuf, m_cached->GetData() + m_total_transferred, got);
+    m_total_transferred += got;
+    return got;
+}
+
+void CIwHTTP::CacheContent(const char *pData, int len)
+{
+    if (!m_cache_store && !m_flight)
+        return;
+
+    bool finished = m_decoder ? m_decoder->IsFinished() && WireFinished() : WireFinished();
+    if (m_flight && m_Status == S3E_RESULT_SUCCESS)
+    {
+        // Those that joined have it as soon as it's read, or once it's
+        // all there..
+        m_flight->Feed(pData, len);
+        if (finished)
+            m_flight->Complete();
+        if (m_flight->IsComplete() || m_flight->HasOverflowed() || m_flight->HasFailed())
+            LeaveFlight();
     }
-    else
+
+    if (!m_cache_store)
+        return;
+
+    if (m_Status != S3E_RESULT_SUCCESS || !m_cache_store->Append(pData, len))
     {
-        IwTrace(HTTP, ("Got headers"));
+        // Not all there, or too big after all..
+        m_cache_store->Release();
+        m_cache_store = NULL;
+        return;
+    }
+
+    if (finished)
+    {
+        CIwHTTPCache::Store(m_URI.GetAll(), m_header_block, m_response, m_cache_store, m_decoder != NULL, m_request_time, m_response_time);
+        m_cache_store->Release();
+        m_cache_store = NULL;
+    }
+}
+
+bool CIwHTTP::JoinFlight()
+{
+    int coalesce = 0;
+    s3eConfigGetInt("connection", "httpcoalesce", &coalesce);
+    if (!coalesce)
+        return false;
+
+    // Only a request that would be sent exactly alike..
+    std::string key;
+    CIwHTTPCache::MakeKey(key, m_URI.GetAll());
+    key += GetHeaderBlock();
+
+    m_flight = CIwHTTPFlight::Join(key, this);
+    if (m_flight->GetLeader() == this)
+        return false;
+
+    IwTrace(HTTP, ("(Joining the same request already made, %u waiting)", m_flight->GetFollowerCount()));
+    return true;
+}
+
+void CIwHTTP::LeaveFlight()
+{
+    if (!m_flight)
+        return;
+
+    if (m_flight_timer)
+    {
+        m_flight_timer = 0;
+        CIwHTTPEventLoop::CancelTimer(FlightCallback, this);
+    }
+    m_flight_wait = NULL;
+
+    CIwHTTPFlight *flight = m_flight;
+    m_flight = NULL;
+    flight->Leave(this);
+}
+
+void CIwHTTP::WakeFlight()
+{
+    // Acted on at the next yield, not from within the leader..
+    if (!m_flight_timer)
+    {
+        m_flight_timer = 1;
+        CIwHTTPEventLoop::SetTimer(0, FlightCallback, this);
+    }
+}
+
+int32 CIwHTTP::FlightCallback(void *, void *pUserData)
+{
+    CIwHTTP *self = (CIwHTTP *)pUserData;
+    self->m_flight_timer = 0;
+    if (self->m_flight)
+        self->FlightChanged();
+    return 0;
+}
+
+void CIwHTTP::FlightChanged()
+{
+    CIwHTTPFlight *flight = m_flight;
+    if (flight->GetLeader() == this)
+    {
+        if (!flight->IsAnswered())
+        {
+            // The leader was cancelled, this is sent instead..
+            Dispatch();
+        }
+        else if (!flight->IsComplete() && !HasHeldContent())
+        {
+            // Cancelled with the body part read..
+            LeaveFlight();
+        }
+        return;
+    }
+
+    if (flight->HasOverflowed())
+    {
+        // Too big to share, so this is sent after all..
+        LeaveFlight();
+        Dispatch();
+        return;
+    }
+
+    if (flight->HasFailed())
+    {
+        // A download reports it the once, as it would a failed read..
+        bool downloading = m_download_fd != -1;
+        m_download_busy = downloading;
+        Fail();
+        if (downloading)
+        {
+            m_download_busy = false;
+            FinishDownload();
+        }
+        return;
+    }
+
+    if (m_bGetInProgress)
+    {
+        if (!flight->IsReady())
+            return;
+
+        // The leader's response, handed out as if from the cache..
+        IwTrace(HTTP, ("(Using response to the same request)"));
+        if (m_cache_stale)
+        {
+            m_cache_stale->Release();
+            m_cache_stale = NULL;
+        }
+        m_cache_headers = flight->GetHeaders();
+        m_cached = flight->GetBody();
+        m_cached->AddRef();
+        UseCachedResponse();
+
+        // A body still arriving is as long as the leader was told..
+        if (!flight->IsComplete())
+            m_content_length = flight->GetContentLength();
+
+        if (flight->IsComplete())
+            LeaveFlight();
 
         m_bGetInProgress = false;
+        SessionRequestFinished();
 
-        // Got all the headers, callback..
         if (m_header_callback)
-        {
             m_header_callback(this, m_user_data);
+        return;
+    }
+
+    s3eSocketCallbackFn fn = m_flight_wait;
+    m_flight_wait = NULL;
+
+    // All there, so nothing more to wait for..
+    if (flight->IsComplete())
+        LeaveFlight();
+
+    if (fn)
+        fn(NULL, NULL, this);
+}
+
+bool CIwHTTP::AwaitingFlight() const
+{
+    return m_flight && m_flight->GetLeader() != this && !m_flight->IsComplete();
+}
+
+void CIwHTTP::EndOfContent(bool closed, uint32 received)
+{
+    if (!closed)
+        m_body_complete = true;
+    else
+        m_keepAlive = false;
+
+    // The socket has been closed. Assume all data received.
+    if ((m_length_known
+          && (uint32)m_content_length != received)
+        || m_chunked)
+    {
+        // There's a content length header and we haven't
+        // got all the data yet, or we're using chunked
+        // encoding.
+        IwTrace(
+            HTTP,
+            ("(Socket closed before all data received. Chunked: %s)", m_chunked ? "true" : "false")
+        );
+
+        Fail();
+    }
+
+    // If we get here, the length is being communicated by
+    // closing the socket, and that has happened. So we've
+    // finished and it's all good.
+    IwTrace(HTTP, ("Remote side has closed"));
+    m_content_length = received;
+    m_length_known = true;
+
+    if (m_read_timeout)
+    {
+        m_read_timeout = 0;
+        CIwHTTPEventLoop::CancelTimer(ReadTimeoutCallback, this);
+    }
+
+    // Clean up (which will clear callbacks and pool the
+    // connection if it can be reused)
+    Cancel();
+
+    // Now schedule the callback after the cleanup, but
+    // only if there's not already a pending read callback
+    if (!m_pending_read_callback && m_callback)
+    {
+        m_callback_timer = 1;
+        CIwHTTPEventLoop::SetTimer(0, DoCallback, this);
+    }
+}
+
+int32 CIwHTTP::TransferCallback(s3eSocket *, void *, void *pUserData)
+{
+    if (pUserData)
+        return ((CIwHTTP *)pUserData)->DoTransferCallback();
+
+    return 0;
+}
+
+int32 CIwHTTP::DoTransferCallback()
+{
+    // Called as a result of ReadData/ReadContent not being able to receive
+    // the full buffer.
+    IwTrace(HTTP_VERBOSE, ("Transfer callback"));
+
+    int32 transferred;
+
+    do
+    {
+        //Must keep calling transfer content because it can be reading
+        //out of the header buffer but will only return one chunk at a time,
+        //and if it hasn't called s3eSocketRecv then we won't necessarily get
+        //a readable callback
+        //Would prob be better if ReadBytes called Readable so you register for
+        //socket callbacks if socket runs out of data
+        transferred = TransferContent(m_content_buf, m_max_bytes);
+
+        // I'm almost sure this can't happen anymore.  transferred should always
+        // be >= 0.  A failed read, i.e. read == -1, is handled inside TransferContent.
+        if (transferred == -1)
+        {
+            IwTrace(HTTP, ("(Failed to transfer content)"));
+            Fail();
+        }
+        else
+        {
+            m_max_bytes -= transferred;
+            m_read_content_transferred += transferred;
+            m_content_buf = &m_content_buf[transferred];
+        }
+    } while (m_content_length != m_total_transferred && transferred > 0);
+
+    // I have a strong suspicion that this will never return true.  The ContentFinished function
+    // will return false if m_pending_read_callback is true.  I'm pretty sure there will always be
+    // a pending callback at this stage though!
+    if (ContentFinished())
+        return 0;
+
+    // If the user supplied buffer is still not full && the socket is still valid (which
+    // should be the case unless Cancel() was called).
+    if (m_max_bytes && (m_pSocket != NULL || AwaitingFlight()))
+    {
+        // We're still connected and waiting for data so enqueue another callback and return.
+        WaitContent(TransferCallback);
+    }
+    else
+    {
+        m_pending_read_callback = false;
+
+        if (m_read_timeout)
+        {
+            m_read_timeout = 0;
+            CIwHTTPEventLoop::CancelTimer(ReadTimeoutCallback, this);
         }
+
+        Log(m_orig_content_buf, m_content_length);
+        m_callback((void *)(intptr_t)m_read_content_transferred, m_user_data);
     }
+
+    return transferred;
 }
 
-bool CIwHTTP::GotHeaders()
+bool CIwHTTP::ContentFinished()
+{
+    // Don't report finished until the final async read callback..
+    if (m_cached)
+        return !m_pending_read_callback && CachedFinished();
+    else if (m_decoder)
+        return !m_pending_read_callback && m_decoder->IsFinished() && WireFinished();
+    else if (!m_chunked)
+        return !m_pending_read_callback && (ContentExpected() == ContentReceived());
+    else
+        return !m_pending_read_callback && (ContentExpected() == ContentReceived()) && m_last_chunk_seen;
+}
+
+uint32 CIwHTTP::ReadContent(char *pBuf, uint32 max_bytes, s3eCallback cb, void *userData)
+{
+    static int once = 1;
+    if (once)
+    {
+        IwTrace(HTTP, ("DEPRECATED: ReadContent. Please consider using ReadData/ReadDataAsync instead"));
+        once = 0;
+    }
+
+    if (m_socket == -1 && !HasHeldContent())
+    {
+        IwAssertMsg(HTTP, false, ("HTTP ReadContent called when no connection is present. Post or Get should be called first."));
+        return 0;
+    }
+
+    if (m_bGetInProgress)
+    {
+        // Don't start reading content until we've got
+        // the headers..
+        return 0;
+    }
+
+    m_orig_content_buf = pBuf;
+    int transferred = TransferContent(pBuf, max_bytes);
+    IwTrace(HTTP_VERBOSE, ("ReadContent: Read %d/%d bytes", transferred, max_bytes));
+    if (cb)
+    {
+        m_pending_read_callback = true;
+        m_callback = cb;
+        m_user_data = userData;
+
+        if (transferred < (int)max_bytes && (m_pSocket || AwaitingFlight()))
+        {
+            m_content_buf = &pBuf[transferred];
+            m_max_bytes = max_bytes - transferred;
+
+            // Start the timeout..
+            int ms = 0;
+            s3eConfigGetInt("connection", "httpreadtimeout", &ms);
+            if (ms)
+                CIwHTTPEventLoop::SetTimer(ms, ReadTimeoutCallback, m_user_data);
+
+            // Call me back when there's something to read..
+            WaitContent(TransferCallback);
+        }
+        else
+        {
+            // We got all we asked for queue a callback..
+            Log(m_orig_content_buf, max_bytes);
+            m_callback_timer = 1;
+            CIwHTTPEventLoop::SetTimer(0, DoCallback, this);
+        }
+    }
+    else
+    {
+        m_callback = NULL;
+    }
+
+    return transferred;
+}
+
+uint32 CIwHTTP::ReadData(char *buf, uint32 max_bytes)
+{
+    if (m_bGetInProgress)
+    {
+        // Don't start reading content until we've got
+        // the headers..
+        return 0;
+    }
+
+    if (m_socket == -1 && !HasHeldContent())
+    {
+        IwAssertMsg(HTTP, false, ("HTTP ReadData called when no connection is present. Post or Get should be called first."));
+        return 0;
+    }
+
+    return TransferContent(buf, max_bytes);
+}
+
+void CIwHTTP::ReadDataAsync(char *buf, uint32 max_bytes, uint32 timeout, s3eCallback cb, void *userData)
 {
-    if (m_headers_end != std::string::npos)
-        return true;
+    m_read_content_transferred = 0;
 
-    m_chunked = false;
-    if ((m_headers_end = m_response.find("\r\n\r\n")) == std::string::npos)
-        return false;
+    // Cache user supplied parms..
+    m_callback = cb;
+    m_user_data = userData;
 
-    m_headers_end += 4;
-    m_total_transferred = 0;
+    if (m_socket == -1 && !HasHeldContent())
+    {
+        IwAssertMsg(HTTP, false, ("HTTP ReadDataAsync called when no connection is present. Post or Get should be called first."));
+        return;
+    }
 
-    GetHeader("Content-Length", m_content_length);
+    if (m_bGetInProgress)
+    {
+        // If we're still receiving the headers then call back
+        // with a 0 byte value..
+        m_callback_timer = 1;
+        CIwHTTPEventLoop::SetTimer(0, DoCallback, this);
+        return;
+    }
 
-    m_request_idx = m_headers_end;
+    // Clamp max bytes at what's left of the content if its length was
+    // provided..
+    if (m_length_known && !m_decoder && max_bytes > (uint32)(m_content_length - m_total_transferred))
+        max_bytes = m_content_length - m_total_transferred;
 
-    // Try to determine the transfer-encoding..
+    m_orig_content_buf = buf;
+    m_read_content_transferred = TransferContent(buf, max_bytes);
 
-    std::string te;
-    if (GetHeader("Transfer-Encoding", te))
+    if(cb)
     {
-        if (te.find("chunked") != std::string::npos)
+        m_pending_read_callback = true;
+        if (m_read_content_transferred < (int)max_bytes && (m_pSocket || AwaitingFlight()))
         {
-            m_chunked = true;
-
-            // Transfer residual from response buffer to
-            // chunk_header buffer.
+            m_content_buf = &buf[m_read_content_transferred];
+            m_max_bytes = max_bytes - m_read_content_transferred;
 
-            m_chunk_size = 0;
-            m_chunk_header_idx = 0;
-            m_reading_chunk_header = true;
-            m_chunk_header = m_response.substr(m_headers_end);
+            // Start the timeout..
+            if (timeout)
+            {
+                m_read_timeout = timeout;
+                CIwHTTPEventLoop::SetTimer(timeout, ReadTimeoutCallback, this);
+            }
 
-            // Try to parse the first chunk header..
-            ParseChunkHeader();
+            // Call me back when there's something to read..
+            WaitContent(TransferCallback);
         }
         else
         {
-            // Insert your additional transfer-encoding handlers here...
+            // We got everything, do callback (via timer to avoid recursion)..
+            m_callback_timer = 1;
+            CIwHTTPEventLoop::SetTimer(0, DoCallback, this);
         }
     }
-
-    GetResponseCode();
-    LogHeaders(m_response, m_response_code, m_headers_end);
-    return true;
 }
 
-uint32 CIwHTTP::ContentLength()
+uint32 CIwHTTP::PeekAvailable()
 {
-    if (GotHeaders())
-        return m_content_length;
-    return 0;
-}
+    if (m_chunked)
+    {
+        // Get past any framing, only chunk data can be handed out..
+        if (m_chunk_state < CHUNK_DONE)
+            DecodeChunked(NULL, 0);
 
-uint32 CIwHTTP::ContentReceived()
-{
-    return m_total_transferred;
+        if (m_chunk_state != CHUNK_DATA)
+            return 0;
+
+        return MIN(m_recv_end - m_recv_start, m_chunk_remaining);
+    }
+
+    uint32 avail = m_recv_end - m_recv_start;
+    if (m_length_known)
+        avail = MIN(avail, (uint32)(m_content_length - m_total_transferred));
+    return avail;
 }
 
-uint32 CIwHTTP::ContentExpected()
+bool CIwHTTP::PeekFinished()
 {
-    if (m_content_length)
-        return m_content_length;
+    if (m_cached)
+        return CachedFinished();
 
-    int expected = m_total_transferred;
-    if (m_chunked && m_chunk_size)
-        expected += m_chunk_size - 2;
-    return expected;
+    if (m_decoder)
+        return m_decoder->IsFinished() && WireFinished();
+
+    if (m_chunked)
+        return m_chunk_state >= CHUNK_DONE;
+
+    return m_length_known && m_total_transferred >= m_content_length;
 }
 
-int CIwHTTP::TransferContent(char *pBuf, int max_bytes)
+uint32 CIwHTTP::PeekData(const char *&pData)
 {
-    int total_bytes_read = 0;
+    pData = NULL;
 
-    if (!m_chunked)
+    if (m_bGetInProgress)
     {
-        total_bytes_read = TransferContentInternal(pBuf, max_bytes);
+        // Don't start reading content until we've got
+        // the headers..
+        return 0;
     }
-    else
+
+    if (m_cached)
     {
-        bool blocked = false;
+        pData = m_cached->GetData() + m_total_transferred;
+        return m_cached->GetSize() - m_total_transferred;
+    }
 
-        while (total_bytes_read < max_bytes && !blocked && !ContentFinished())
+    if (m_decoder)
+    {
+        // Handed out from the decoder's buffer instead..
+        while (true)
         {
-            if (m_chunk_size > 2)
+            uint32 avail = m_decoder->Peek(pData);
+            if (avail)
+                return avail;
+
+            if (m_decoder->HasFailed())
             {
-                // Don't attempt to read past end of chunk
-                int max = MIN(max_bytes - total_bytes_read, m_chunk_size - 2);
-                int bytes_read = TransferContentInternal(
-                    &pBuf[total_bytes_read], max
-                );
-
-                if (bytes_read > 0)
-                    m_chunk_size -= bytes_read;
-                else if (bytes_read == -1)
-                    bytes_read = 0;
-
-                total_bytes_read += bytes_read;
-                blocked = (bytes_read == 0);
+                if (m_Status == S3E_RESULT_SUCCESS)
+                    Fail();
+                return 0;
             }
 
-            if (m_chunk_size && m_chunk_size <= 2 && !m_reading_chunk_header)
-            {
-                char discard[2];
-                // Throw away the trailing CR/LF
-                int discarded = TransferContentInternal(discard, m_chunk_size);
+            if (PeekFinished() || !PullEncoded())
+                return 0;
+        }
+    }
 
-                // Adjust for ContentReceived
-                m_total_transferred -= discarded;
+    while (true)
+    {
+        uint32 avail = PeekAvailable();
+        if (avail)
+        {
+            pData = &m_recv_buf[m_recv_start];
+            return avail;
+        }
 
-                if (discarded > 0)
-                    m_chunk_size -= discarded;
+        if (PeekFinished() || m_socket == -1)
+            return 0;
 
-                blocked = (discarded == 0);
-            }
+        int32 read = FillRecvBuffer();
+        if (read > 0)
+            continue;
 
-            if (!m_chunk_size)
+        if (!read)
+        {
+            if (m_chunked)
             {
-                // Check to see if we can parse another
-                // block header from the chunk header buffer
-                if (!ParseChunkHeader())
-                {
-                    // Fetch more data if we can't.
-                    GetChunkHeader();
-                }
+                IwTrace(HTTP, ("(Socket closed before all data received. Chunked: true)"));
+                m_keepAlive = false;
+                Fail();
+            }
+            else
+            {
+                EndOfContent(true, m_total_transferred);
+                CacheContent(NULL, 0);
             }
         }
-    }
+        else if (errno != EAGAIN)
+        {
+            IwTrace(HTTP, ("(Unspecified socket error: %d)", errno));
+            Fail();
+        }
 
-    return total_bytes_read;
+        return 0;
+    }
 }
 
-void CIwHTTP::GetChunkHeader()
+void CIwHTTP::ConsumeData(uint32 bytes)
 {
-    m_reading_chunk_header = true;
+    if (!bytes)
+        return;
 
-    const int BUF_SIZE(128);
-    char recv_buf[BUF_SIZE];
+    if (m_cached)
+    {
+        IwAssertMsg(HTTP, m_total_transferred + bytes <= m_cached->GetSize(), ("Consuming more than was peeked"));
+        m_total_transferred += bytes;
+        return;
+    }
 
-#ifdef IW_HTTP_SSL
-    do
+    if (m_decoder)
     {
-        // SSL buffers underneath us so make sure
-        // we exhaust the buffer before going back to
-        // waiting for select to come true
-#endif
+        const char *pData;
+        m_decoder->Peek(pData);
+        m_decoder->Consume(bytes);
+        m_decoded_transferred += bytes;
+        CacheContent(pData, bytes);
+        return;
+    }
 
-    int32 bytes_read;
-    // Read headers into response..
-    bytes_read = ReadBytes(recv_buf, BUF_SIZE);
+    IwAssertMsg(HTTP, bytes <= PeekAvailable(), ("Consuming more than was peeked"));
 
-    if (bytes_read > 0)
+    const char *pData = &m_recv_buf[m_recv_start];
+    m_recv_start += bytes;
+    m_total_transferred += bytes;
+
+    if (m_chunked)
     {
-        m_chunk_header.append(recv_buf, bytes_read);
+        m_chunk_remaining -= bytes;
+        if (!m_chunk_remaining)
+            m_chunk_state = CHUNK_DATA_CR;
+
+        // Notice the end of the body as soon as possible..
+        DecodeChunked(NULL, 0);
+        CacheContent(pData, bytes);
     }
     else
     {
-        if (errno != EAGAIN || !bytes_read)
+        CacheContent(pData, bytes);
+        if (m_total_transferred == m_content_length && m_length_known && m_pSocket)
         {
-            if (!bytes_read)
-                IwTrace(HTTP, ("(Socket connection ended whilst reading chunk header)"));
-            else
-                IwTrace(HTTP, ("(Socket error whilst reading chunk header)"));
-            Fail();
-            return;
+            // All content is in. Hand the connection back to the pool, or
+            // close it if the server won't keep it open..
+            m_body_complete = true;
+            FinishConnection();
+            SessionRequestFinished();
         }
     }
-#ifdef IW_HTTP_SSL
-    }
-    // Only for secure sockets..
-    while (m_bSecureSocket && SSL_pending(m_SSL));
-#endif
-
-    ParseChunkHeader();
 }
 
-bool CIwHTTP::ParseChunkHeader()
+void CIwHTTP::PeekDataAsync(uint32 timeout, s3eCallback cb, void *userData)
 {
-    // Chunked header is:
-    // nn+ CF LF where n is 1 or more HEX digits as alphanumeric characters
-    // Final chunk is indicated by 0 length chunk
-
-    size_t end = m_chunk_header.find("\r\n", m_chunk_header_idx);
-    if (end == std::string::npos)
-        return false;
-
+    m_read_content_transferred = 0;
 
-    std::string head = m_chunk_header.substr(m_chunk_header_idx, end);
+    // Cache user supplied parms..
+    m_callback = cb;
+    m_user_data = userData;
 
-    uint len;
-    if (sscanf(head.c_str(), "%x", &len) != 1)
+    if (!m_bGetInProgress)
     {
-        IwTrace(HTTP, ("(Malformed Chunk Header)"));
-        Fail();
-        return false;
+        const char *pData;
+        m_read_content_transferred = PeekData(pData);
     }
 
-    // We have a valid chunk header
-    m_chunk_size = len;
-    m_chunk_header_idx = end + 2;
-    m_reading_chunk_header = false;
-
-    IwTrace(HTTP, ("ChunkSize: %x", m_chunk_size));
-
-    // Reset the chunk buffer when exhausted
-    if (m_chunk_header_idx >= (int)m_chunk_header.size())
-    {
-        m_chunk_header.clear();
-        m_chunk_header_idx = 0;
-    }
+    if (!cb)
+        return;
 
-    if (!m_chunk_size)
+    m_pending_read_callback = true;
+    if (!m_bGetInProgress && !m_read_content_transferred && !PeekFinished() && (m_pSocket || AwaitingFlight()))
     {
-        // Last chunk
-        m_last_chunk_seen = true;
-        m_content_length = m_total_transferred;
-
-        if (m_read_timeout)
+        // Start the timeout..
+        if (timeout)
         {
-            m_read_timeout = 0;
-            s3eTimerCancelTimer(ReadTimeoutCallback, this);
+            m_read_timeout = timeout;
+            CIwHTTPEventLoop::SetTimer(timeout, ReadTimeoutCallback, this);
         }
 
-        // We're finished, callback..
-        if (m_callback)
-        {
-            m_callback_timer = 1;
-            s3eTimerSetTimer(0, DoCallback, this);
-        }
+        // Call me back when there's something to read..
+        WaitContent(PeekCallback);
+    }
+    else
+    {
+        // Do callback via timer to avoid recursion..
+        m_callback_timer = 1;
+        CIwHTTPEventLoop::SetTimer(0, DoCallback, this);
     }
+}
 
-    // Adjust for the trailing CR/LF
-    m_chunk_size += 2;
-    return true;
+int32 CIwHTTP::PeekCallback(s3eSocket *, void *, void *pUserData)
+{
+    if (pUserData)
+        ((CIwHTTP *)pUserData)->DoPeekCallback();
+
+    return 0;
 }
 
-int32 CIwHTTP::TransferContentInternal(char *pBuf, const int max_bytes)
+void CIwHTTP::DoPeekCallback()
 {
-    if (m_reading_chunk_header)
-        return -1;
+    const char *pData;
+    m_read_content_transferred = PeekData(pData);
 
-    int transferred = 0;
+    if (!m_pending_read_callback)
+        return; // Failed, and the callback has been made
 
-    if (!m_chunked)
+    if (!m_read_content_transferred && !PeekFinished() && (m_pSocket || AwaitingFlight()))
     {
-        if (m_request_idx < (int)m_response.size())
-        {
-            // There may be some content left over in the
-            // response buffer..
-            transferred = MIN((int)m_response.size() - m_request_idx, max_bytes);
-            memcpy(pBuf, &m_response.data()[m_request_idx], transferred);
-            m_request_idx += transferred;
-        }
+        // Only framing arrived, wait for more..
+        WaitContent(PeekCallback);
+        return;
     }
-    else
-    {
-        if (m_chunk_header_idx < (int)m_chunk_header.size())
-        {
-            // There may also be some content left over in the chunk header
-            // buffer if chunked encoding is being used..
-            transferred = MIN((int)m_chunk_header.size() - m_chunk_header_idx, max_bytes);
-            memcpy(pBuf, &m_chunk_header.data()[m_chunk_header_idx], transferred);
-            m_chunk_header_idx += transferred;
 
-            // Reset the chunk buffer when exhausted
-            if (m_chunk_header_idx >= (int)m_chunk_header.size())
-            {
-                m_chunk_header.clear();
-                m_chunk_header_idx = 0;
-            }
-        }
-    }
+    m_pending_read_callback = false;
 
-    if (transferred < max_bytes)
+    if (m_read_timeout)
     {
-#ifdef IW_HTTP_SSL
-    do
+        m_read_timeout = 0;
+        CIwHTTPEventLoop::CancelTimer(ReadTimeoutCallback, this);
+    }
+
+    if (m_callback)
+        m_callback((void *)(intptr_t)m_read_content_transferred, m_user_data);
+}
+
+s3eResult CIwHTTP::DownloadToFile(const char *filename, s3eCallback cb, void *userData)
+{
+    if (m_bGetInProgress || m_download_fd != -1 || !GotHeaders())
+        return S3E_RESULT_ERROR;
+
+    if (m_socket == -1 && m_recv_start == m_recv_end && !HasHeldContent())
     {
-        // SSL buffers underneath us so make sure
-        // we exhaust the buffer before going back to
-        // waiting for select to come true
-#endif
-        int32 read = ReadBytes(&pBuf[transferred], max_bytes - transferred);
-        if (read > 0)
-            transferred += read;
+        IwAssertMsg(HTTP, false, ("HTTP DownloadToFile called when no connection is present. Post or Get should be called first."));
+        return S3E_RESULT_ERROR;
+    }
 
-        // I've added a second check here to see if the content has all been transferred, but only in
-        // the case the content length is know (i.e. we got content-length headers).  The problem here
-        // is that if we don't close down the socket when this happens then the next ReadBytes call
-        // can block for a considerable period of time thus stalling the download.  I don't want to
-        // use ContentFinished call as it's check is different to this.  I also only want this to
-        // happen for known content length as I think m_content_length == m_total_transferred is always
-        // true when content length is unknown.  A few unknowns here so playing it safe.
-        if (!read || (m_content_length == m_total_transferred + transferred && m_content_length))
-        {
-            // The socket has been closed. Assume all data received.
-            if ((m_content_length
-                  && m_content_length != (m_total_transferred + transferred))
-                || m_chunked)
-            {
-                // There's a content length header and we haven't
-                // got all the data yet, or we're using chunked
-                // encoding.
-                IwTrace(
-                    HTTP,
-                    ("(Socket closed before all data received. Chunked: %s)", m_chunked ? "true" : "false")
-                );
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        IwTrace(HTTP, ("(Failed to create %s: %d)", filename, errno));
+        return S3E_RESULT_ERROR;
+    }
 
-                Fail();
-            }
+#if defined(__linux__)
+    // Reserve the space now rather than growing the file as we go. The
+    // size itself still only grows as data is written..
+    if (!m_chunked && !m_decoder && m_content_length > m_total_transferred)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, m_content_length - m_total_transferred);
 
-            // If we get here, the length is being communicated by
-            // closing the socket, and that has happened. So we've
-            // finished and it's all good.
-            IwTrace(HTTP, ("Remote side has closed"));
-            m_content_length = m_total_transferred + transferred;
+    m_download_splice = true;
+#endif
 
-            if (m_read_timeout)
-            {
-                m_read_timeout = 0;
-                s3eTimerCancelTimer(ReadTimeoutCallback, this);
-            }
+    IwTrace(HTTP, ("(Downloading to %s)", filename));
 
-            // Clean up (which will clear callbacks)
-            Cancel();
+    m_download_fd = fd;
+    m_download_callback = cb;
+    m_user_data = userData;
+    m_read_content_transferred = 0;
 
-            // Now schedule the callback after the cleanup, but
-            // only if there's not already a pending read callback
-            if (!m_pending_read_callback && m_callback)
-            {
-                m_callback_timer = 1;
-                s3eTimerSetTimer(0, DoCallback, this);
-            }
-        }
-        else if (read == -1 && errno != EAGAIN)
-        {
-            IwTrace(HTTP, ("(Unspecified socket error: %d)", errno));
-            Fail();
-        }
+    // Reads mustn't make callbacks of their own while we're at it..
+    m_callback = NULL;
+    m_pending_read_callback = true;
 
-#ifdef IW_HTTP_SSL
-    }
-    // Only for secure sockets..
-    while (m_bSecureSocket && m_SSL && SSL_pending(m_SSL) && max_bytes > transferred);
-#endif
-    }
+    // Start on the next yield..
+    m_download_timer = true;
+    CIwHTTPEventLoop::SetTimer(0, DownloadTimerCallback, this);
 
-    m_total_transferred += transferred;
-    if (m_total_transferred == m_content_length && m_content_length)
-    {
-        std::string connection;
-        if (GetHeader("Connection", connection))
-        {
-            if (connection == "Close")
-            {
-                IwTrace(HTTP, ("got Close header"));
-                Cancel();
-            }
-        }
-    }
+    return S3E_RESULT_SUCCESS;
+}
 
-    return transferred;
+int32 CIwHTTP::DownloadTimerCallback(void *, void *pUserData)
+{
+    CIwHTTP *self = (CIwHTTP *)pUserData;
+    self->m_download_timer = false;
+    self->DoDownload();
+    return 0;
 }
 
-int32 CIwHTTP::TransferCallback(s3eSocket *, void *, void *pUserData)
+int32 CIwHTTP::DownloadCallback(s3eSocket *, void *, void *pUserData)
 {
     if (pUserData)
-        return ((CIwHTTP *)pUserData)->DoTransferCallback();
+        ((CIwHTTP *)pUserData)->DoDownload();
 
     return 0;
 }
 
-int32 CIwHTTP::DoTransferCallback()
+bool CIwHTTP::DownloadFinished()
 {
-    // Called as a result of ReadData/ReadContent not being able to receive
-    // the full buffer.
-    IwTrace(HTTP_VERBOSE, ("Transfer callback"));
+    if (m_decoder && !m_decoder->IsFinished())
+        return false;
 
-    int32 transferred;
+    return WireFinished();
+}
+
+void CIwHTTP::DoDownload()
+{
+    m_download_busy = true;
+
+    while (!DownloadFinished() && m_Status == S3E_RESULT_SUCCESS)
+    {
+        if (CIwHTTPEventLoop::IsWriting(m_download_fd))
+        {
+            // Call me back when the last lot is written..
+            CIwHTTPEventLoop::SocketWritable(m_download_fd, NULL, DownloadCallback, this);
+            m_download_busy = false;
+            return;
+        }
+
+        int32 written;
+#if defined(__linux__)
+        if (m_download_splice && !CIwHTTPEventLoop::GetRingBufferSize() && !m_chunked && !m_decoder && !m_cached && !m_cache_store && !m_flight && m_recv_start == m_recv_end && !m_h2
+#ifdef IW_HTTP_SSL
+            && !m_bSecureSocket
+#endif
+            )
+            written = SpliceToFile();
+        else
+#endif
+            written = BufferToFile();
+
+        if (written < 0)
+            break;
+
+        if (!written && !DownloadFinished() && m_Status == S3E_RESULT_SUCCESS && (m_pSocket || AwaitingFlight()))
+        {
+            // Call me back when there's something to read..
+            WaitContent(DownloadCallback);
+            m_download_busy = false;
+            return;
+        }
+    }
 
-    do
+    // Only done once it has all been written, and written well..
+    if (m_Status == S3E_RESULT_SUCCESS)
     {
-        //Must keep calling transfer content because it can be reading
-        //out of the header buffer but will only return one chunk at a time,
-        //and if it hasn't called s3eSocketRecv then we won't necessarily get
-        //a readable callback
-        //Would prob be better if ReadBytes called Readable so you register for
-        //socket callbacks if socket runs out of data
-        transferred = TransferContent(m_content_buf, m_max_bytes);
-
-        // I'm almost sure this can't happen anymore.  transferred should always
-        // be >= 0.  A failed read, i.e. read == -1, is handled inside TransferContent.
-        if (transferred == -1)
+        if (CIwHTTPEventLoop::IsWriting(m_download_fd))
         {
-            IwTrace(HTTP, ("(Failed to transfer content)"));
-            Fail();
+            CIwHTTPEventLoop::SocketWritable(m_download_fd, NULL, DownloadCallback, this);
+            m_download_busy = false;
+            return;
         }
-        else
+
+        if (CIwHTTPEventLoop::Write(m_download_fd, NULL, 0) == -1)
         {
-            m_max_bytes -= transferred;
-            m_read_content_transferred += transferred;
-            m_content_buf = &m_content_buf[transferred];
+            IwTrace(HTTP, ("(Failed to write download: %d)", errno));
+            Fail();
         }
-    } while (m_content_length != m_total_transferred && transferred > 0);
+    }
 
-    // I have a strong suspicion that this will never return true.  The ContentFinished function
-    // will return false if m_pending_read_callback is true.  I'm pretty sure there will always be
-    // a pending callback at this stage though!
-    if (ContentFinished())
-        return 0;
+    m_download_busy = false;
+    FinishDownload();
+}
 
-    // If the user supplied buffer is still not full && the socket is still valid (which
-    // should be the case unless Cancel() was called).
-    if (m_max_bytes && m_pSocket != NULL)
+int32 CIwHTTP::BufferToFile()
+{
+    if (!m_download_buf)
     {
-        // We're still connected and waiting for data so enqueue another callback and return.
-        s3eSocketReadable(m_pSocket, TransferCallback, this);
+        int size = 262144;
+        s3eConfigGetInt("connection", "httpdownloadbuffersize", &size);
+        m_download_buf_size = MAX(size, 4096);
+        m_download_buf = new char[m_download_buf_size];
     }
-    else
-    {
-        m_pending_read_callback = false;
 
-        if (m_read_timeout)
+    // Don't read beyond the end of the content, or what the ring can
+    // write in one go..
+    int max = m_download_buf_size;
+    if (m_length_known && !m_decoder)
+        max = MIN(max, m_content_length - m_total_transferred);
+    if (CIwHTTPEventLoop::GetRingBufferSize())
+        max = MIN(max, (int)CIwHTTPEventLoop::GetRingBufferSize());
+
+    int got = TransferContent(m_download_buf, max);
+
+    for (int done = 0; done < got; )
+    {
+        int ret = CIwHTTPEventLoop::Write(m_download_fd, &m_download_buf[done], got - done);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
         {
-            m_read_timeout = 0;
-            s3eTimerCancelTimer(ReadTimeoutCallback, this);
+            IwTrace(HTTP, ("(Failed to write download: %d)", errno));
+            Fail();
+            return -1;
         }
-
-        Log(m_orig_content_buf, m_content_length);
-        m_callback((void *)(intptr_t)m_read_content_transferred, m_user_data);
+        done += ret;
     }
 
-    return transferred;
-}
+    if (got > 0)
+        m_read_content_transferred += got;
 
-bool CIwHTTP::ContentFinished()
-{
-    // Don't report finished until the final async read callback..
-    if (!m_chunked)
-        return !m_pending_read_callback && (ContentExpected() == ContentReceived());
-    else
-        return !m_pending_read_callback && (ContentExpected() == ContentReceived()) && m_last_chunk_seen;
+    return MAX(got, 0);
 }
 
-uint32 CIwHTTP::ReadContent(char *pBuf, uint32 max_bytes, s3eCallback cb, void *userData)
+#if defined(__linux__)
+int32 CIwHTTP::SpliceToFile()
 {
-    static int once = 1;
-    if (once)
+    if (m_download_pipe[0] == -1 && pipe(m_download_pipe) == -1)
     {
-        IwTrace(HTTP, ("DEPRECATED: ReadContent. Please consider using ReadData/ReadDataAsync instead"));
-        once = 0;
+        m_download_splice = false;
+        return BufferToFile();
     }
 
-    if (m_socket == -1)
-    {
-        IwAssertMsg(HTTP, false, ("HTTP ReadContent called when no connection is present. Post or Get should be called first."));
-        return 0;
-    }
+    // Socket to pipe, then pipe to file, without the data ever being
+    // copied out to us..
+    uint32 want = 1 << 20;
+    if (m_length_known)
+        want = MIN(want, (uint32)(m_content_length - m_total_transferred));
 
-    if (m_bGetInProgress)
+    int in = splice(m_socket, NULL, m_download_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (in == 0)
     {
-        // Don't start reading content until we've got
-        // the headers..
+        EndOfContent(true, m_total_transferred);
         return 0;
     }
 
-    m_orig_content_buf = pBuf;
-    int transferred = TransferContent(pBuf, max_bytes);
-    IwTrace(HTTP_VERBOSE, ("ReadContent: Read %d/%d bytes", transferred, max_bytes));
-    if (cb)
+    if (in < 0)
     {
-        m_pending_read_callback = true;
-        m_callback = cb;
-        m_user_data = userData;
-
-        if (transferred < (int)max_bytes)
+        if (errno == EAGAIN)
         {
-            m_content_buf = &pBuf[transferred];
-            m_max_bytes = max_bytes - transferred;
-
-            // Start the timeout..
-            int ms = 0;
-            s3eConfigGetInt("connection", "httpreadtimeout", &ms);
-            if (ms)
-                s3eTimerSetTimer(ms, ReadTimeoutCallback, m_user_data);
-
-            // Call me back when there's something to read..
-            s3eSocketReadable(m_pSocket, TransferCallback, this);
+            CIwHTTPEventLoop::WouldBlock(m_socket, false);
+            return 0;
         }
-        else
+
+        if (errno == EINVAL)
         {
-            // We got all we asked for queue a callback..
-            Log(m_orig_content_buf, max_bytes);
-            m_callback_timer = 1;
-            s3eTimerSetTimer(0, DoCallback, this);
+            // Not supported for this socket or file after all..
+            m_download_splice = false;
+            return BufferToFile();
         }
-    }
-    else
-    {
-        m_callback = NULL;
-    }
 
-    return transferred;
-}
+        IwTrace(HTTP, ("(Unspecified socket error: %d)", errno));
+        Fail();
+        return -1;
+    }
 
-uint32 CIwHTTP::ReadData(char *buf, uint32 max_bytes)
-{
-    if (m_bGetInProgress)
+    for (int left = in; left > 0; )
     {
-        // Don't start reading content until we've got
-        // the headers..
-        return 0;
+        int out = splice(m_download_pipe[0], NULL, m_download_fd, NULL, left, SPLICE_F_MOVE);
+        if (out == -1 && errno == EINTR)
+            continue;
+        if (out <= 0)
+        {
+            IwTrace(HTTP, ("(Failed to write download: %d)", errno));
+            Fail();
+            return -1;
+        }
+        left -= out;
     }
 
-    if (m_socket == -1)
+    m_total_transferred += in;
+    m_read_content_transferred += in;
+
+    if (m_length_known && m_total_transferred == m_content_length)
     {
-        IwAssertMsg(HTTP, false, ("HTTP ReadData called when no connection is present. Post or Get should be called first."));
-        return 0;
+        // All content is in. Hand the connection back to the pool, or
+        // close it if the server won't keep it open..
+        m_body_complete = true;
+        FinishConnection();
+        SessionRequestFinished();
     }
 
-    return TransferContent(buf, max_bytes);
+    return in;
 }
+#else
+int32 CIwHTTP::SpliceToFile()
+{
+    return BufferToFile();
+}
+#endif
 
-void CIwHTTP::ReadDataAsync(char *buf, uint32 max_bytes, uint32 timeout, s3eCallback cb, void *userData)
+void CIwHTTP::FinishDownload()
 {
-    m_read_content_transferred = 0;
+    IwTrace(HTTP, ("(Download %s, %d bytes)", m_Status == S3E_RESULT_SUCCESS ? "complete" : "failed", m_read_content_transferred));
 
-    // Cache user supplied parms..
-    m_callback = cb;
-    m_user_data = userData;
+    CloseDownload();
 
-    if (m_socket == -1)
+    // Just the one callback, whatever happened..
+    m_pending_read_callback = false;
+    m_callback = m_download_callback;
+    if (m_callback)
     {
-        IwAssertMsg(HTTP, false, ("HTTP ReadDataAsync called when no connection is present. Post or Get should be called first."));
-        return;
+        m_callback_timer = 1;
+        CIwHTTPEventLoop::SetTimer(0, DoCallback, this);
     }
+}
 
-    if (m_bGetInProgress)
+void CIwHTTP::CloseDownload()
+{
+    if (m_download_timer)
     {
-        // If we're still receiving the headers then call back
-        // with a 0 byte value..
-        m_callback_timer = 1;
-        s3eTimerSetTimer(0, DoCallback, this);
-        return;
+        m_download_timer = false;
+        CIwHTTPEventLoop::CancelTimer(DownloadTimerCallback, this);
     }
 
-    // Clamp max bytes at content-length if it was provided..
-    if (m_content_length && (int)max_bytes > m_content_length)
-        max_bytes = m_content_length;
-
-    m_orig_content_buf = buf;
-    m_read_content_transferred = TransferContent(buf, max_bytes);
+    if (m_pSocket)
+        WaitReadable(NULL);
+    m_flight_wait = NULL;
 
-    if(cb)
+    if (m_download_fd != -1)
     {
-        m_pending_read_callback = true;
-        if (m_read_content_transferred < (int)max_bytes && m_socket)
-        {
-            m_content_buf = &buf[m_read_content_transferred];
-            m_max_bytes = max_bytes - m_read_content_transferred;
-
-            // Start the timeout..
-            if (timeout)
-            {
-                m_read_timeout = timeout;
-                s3eTimerSetTimer(timeout, ReadTimeoutCallback, this);
-            }
+        CIwHTTPEventLoop::CloseFile(m_download_fd);
+        m_download_fd = -1;
+    }
 
-            // Call me back when there's something to read..
-            s3eSocketReadable(m_pSocket, TransferCallback, this);
-        }
-        else
+    for (int i = 0; i < 2; i++)
+    {
+        if (m_download_pipe[i] != -1)
         {
-            // We got everything, do callback (via timer to avoid recursion)..
-            m_callback_timer = 1;
-            s3eTimerSetTimer(0, DoCallback, this);
+            close(m_download_pipe[i]);
+            m_download_pipe[i] = -1;
         }
     }
+
+    delete[] m_download_buf;
+    m_download_buf = NULL;
 }
 
 int32 CIwHTTP::DoCallback(void *sysData, void *usrData)
@@ -1727,57 +3951,107 @@ uint32 CIwHTTP::GetResponseCode()
     return m_response_code;
 }
 
-bool CIwHTTP::GetHeader(const char *name, int32 &result)
+void CIwHTTP::IndexHeaders()
 {
-    if (!GotHeaders())
-        return false;
+    m_header_index.clear();
+
+    // Skip the status line, then one header per line up to the blank
+    // one. Lines without a colon (including obsolete folded ones) are
+    // ignored..
+    const char *base = m_response.data();
+    const char *end = base + m_headers_end - 2;
+    const char *line = (const char *)memchr(base, '\n', end - base);
 
-    std::string str;
-    if (GetHeader(name, str))
+    while (line && ++line < end)
     {
-        result = atoi(str.c_str());
-        return true;
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+
+        const char *colon = (const char *)memchr(line, ':', eol - line);
+        if (colon && colon != line && *line != ' ' && *line != '\t')
+        {
+            // Trim the value's surrounding whitespace and CR..
+            const char *v = colon + 1;
+            const char *v_end = eol;
+            while (v < v_end && (*v == ' ' || *v == '\t'))
+                v++;
+            while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t' || v_end[-1] == '\r'))
+                v_end--;
+
+            HeaderEntry h;
+            h.m_name = line - base;
+            h.m_name_len = colon - line;
+            h.m_value = v - base;
+            h.m_value_len = v_end - v;
+            m_header_index.push_back(h);
+        }
+
+        line = eol;
     }
-    return false;
 }
 
-bool CIwHTTP::GetHeader(const char *name, std::string &result)
+int32 CIwHTTP::FindHeader(const char *name, int32 after)
 {
-    if (!GotHeaders())
-        return false;
+    if (!GotHeaders() || !name)
+        return -1;
 
-    // Need to perform this search case-insensitively but
-    // can't change m_response or name so we're going to have
-    // to copy and convert..
+    uint32 len = strlen(name);
+    for (uint32 i = after + 1; i < m_header_index.size(); i++)
+    {
+        const HeaderEntry &h = m_header_index[i];
+        if (h.m_name_len != len)
+            continue;
 
-    std::string search(name);
-    std::string searched(m_response);
+        const char *p = m_response.data() + h.m_name;
+        uint32 j = 0;
+        while (j < len && tolower(p[j]) == tolower(name[j]))
+            j++;
 
-    // Make it clear that you don't add the colon
-    // to the search string
-    search += ':';
+        if (j == len)
+            return i;
+    }
 
-    std::transform(search.begin(), search.end(), search.begin(), std::tolower);
-    std::transform(searched.begin(), searched.end(), searched.begin(), std::tolower);
+    return -1;
+}
 
-    size_t start;
-    if ((start = searched.find(search)) != std::string::npos)
-    {
-        start += search.size() + 1; // Skip space
-        if (start < searched.size())
-        {
-            size_t end;
-            if ((end = searched.find("\r\n", start)) != std::string::npos)
-            {
-                // Return the actual header text, not the transformed
-                // version..
-                result.assign(m_response, start, end - start);
-                return true;
-            }
-        }
-    }
+uint32 CIwHTTP::GetHeaderCount()
+{
+    return GotHeaders() ? m_header_index.size() : 0;
+}
 
-    return false;
+bool CIwHTTP::GetHeaderAt(uint32 index, const char *&pName, uint32 &nameLen, const char *&pValue, uint32 &valueLen)
+{
+    if (index >= GetHeaderCount())
+        return false;
+
+    const HeaderEntry &h = m_header_index[index];
+    pName = m_response.data() + h.m_name;
+    nameLen = h.m_name_len;
+    pValue = m_response.data() + h.m_value;
+    valueLen = h.m_value_len;
+    return true;
+}
+
+bool CIwHTTP::GetHeader(const char *name, int32 &result)
+{
+    int32 i = FindHeader(name);
+    if (i == -1)
+        return false;
+
+    // The value is followed by the CR, so atoi stops in time..
+    result = atoi(m_response.data() + m_header_index[i].m_value);
+    return true;
+}
+
+bool CIwHTTP::GetHeader(const char *name, std::string &result)
+{
+    int32 i = FindHeader(name);
+    if (i == -1)
+        return false;
+
+    result.assign(m_response, m_header_index[i].m_value, m_header_index[i].m_value_len);
+    return true;
 }
 
 void CIwHTTP::SetRequestHeader(const char *pName, int32 val)
@@ -1789,18 +4063,24 @@ void CIwHTTP::SetRequestHeader(const char *pName, int32 val)
 
 void CIwHTTP::SetRequestHeader(const char *pName, const std::string &val)
 {
-    for (uint32 i = 0; i < m_req_headers.size(); i++)
+    SetHeader(m_req_headers, pName, val);
+    m_header_block_valid = false;
+}
+
+void CIwHTTP::SetHeader(CIwArray<ReqHeader> &headers, const char *pName, const std::string &val)
+{
+    for (uint32 i = 0; i < headers.size(); i++)
     {
-        if (m_req_headers[i].m_name == pName)
+        if (headers[i].m_name == pName)
         {
             if (val == "")
             {
                 // Erase header
-                m_req_headers.erase(i);
+                headers.erase(i);
             }
             else
             {
-                m_req_headers[i].m_value = val;
+                headers[i].m_value = val;
             }
             return;
         }
@@ -1809,16 +4089,7 @@ void CIwHTTP::SetRequestHeader(const char *pName, const std::string &val)
     ReqHeader r;
     r.m_name = pName;
     r.m_value = val;
-    m_req_headers.append(r);
-}
-
-void CIwHTTP::AddChunked(Data& f)
-{
-    char buffer[32];
-    sprintf(buffer, "%x\r\n", (unsigned int)f.m_value.size());
-
-    f.m_value.insert(0, buffer);
-    f.m_value += "\r\n";
+    headers.append(r);
 }
 
 void CIwHTTP::SetFormData(const char *pName, const std::string &val)
@@ -1832,22 +4103,53 @@ void CIwHTTP::SetFormData(const char *pName, const std::string &val)
     f.m_value += val;
     f.m_value += "\r\n";
 
-    if (m_post_chunked)
-        AddChunked(f);
-
     f.m_size = f.m_value.size();
 
-    m_data.push_back(f);
+    m_form_data.push_back(f);
 }
 
 s3eResult CIwHTTP::SetFormDataFile(const char *pName, const char* sourceFile, const char* destName, const char* mimeType)
 {
-    Data f;
+    Data file;
+
+    file.m_file = s3eFileOpen(sourceFile, "rb");
+
+    if (file.m_file == NULL)
+        return S3E_RESULT_ERROR;
+
+    file.m_size = s3eFileGetSize(file.m_file);
 
-    f.m_file = s3eFileOpen(sourceFile, "rb");
+    AddFormDataFile(pName, destName, mimeType, file);
 
-    if (f.m_file == NULL)
+    return S3E_RESULT_SUCCESS;
+}
+
+s3eResult CIwHTTP::SetFormDataNativeFile(const char *pName, const char* sourceFile, const char* destName, const char* mimeType)
+{
+    Data file;
+
+    file.m_fd = open(sourceFile, O_RDONLY);
+
+    if (file.m_fd == -1)
+        return S3E_RESULT_ERROR;
+
+    struct stat st;
+    if (fstat(file.m_fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        close(file.m_fd);
         return S3E_RESULT_ERROR;
+    }
+
+    file.m_size = st.st_size;
+
+    AddFormDataFile(pName, destName, mimeType, file);
+
+    return S3E_RESULT_SUCCESS;
+}
+
+void CIwHTTP::AddFormDataFile(const char *pName, const char* destName, const char* mimeType, Data &file)
+{
+    Data f;
 
     f.m_value = "--" MULTIPART_BOUNDARY "\r\n";
     f.m_value += "Content-Disposition: form-data; name=\"";
@@ -1857,15 +4159,25 @@ s3eResult CIwHTTP::SetFormDataFile(const char *pName, const char* sourceFile, co
     f.m_value += "\"\r\nContent-Type: ";
     f.m_value += mimeType;
     f.m_value += "\r\n\r\n";
+    f.m_size = f.m_value.size();
 
-    if (m_post_chunked)
-        AddChunked(f);
+    m_form_data.push_back(f);
 
-    f.m_size = f.m_value.size() + s3eFileGetSize(f.m_file);
+    // The file itself, unless there's nothing in it..
+    if (file.m_size > 0)
+    {
+        m_form_data.push_back(file);
+    }
+    else
+    {
+        std::list<Data> empty(1, file);
+        FreeData(empty);
+    }
 
-    m_data.push_back(f);
+    f.m_value = "\r\n";
+    f.m_size = f.m_value.size();
 
-    return S3E_RESULT_SUCCESS;
+    m_form_data.push_back(f);
 }
 
 void CIwHTTP::SetPostChunkedMode(bool isChunked)
@@ -1873,6 +4185,16 @@ void CIwHTTP::SetPostChunkedMode(bool isChunked)
     m_post_chunked = isChunked;
 }
 
+s3eResult CIwHTTP::SetRequestEncoding(RequestEncoding encoding)
+{
+    if (encoding != ENCODING_NONE &&
+        !CIwHTTPEncoder::IsSupported(encoding == ENCODING_ZSTD ? CIwHTTPEncoder::ZSTD : CIwHTTPEncoder::GZIP))
+        return S3E_RESULT_ERROR;
+
+    m_request_encoding = encoding;
+    return S3E_RESULT_SUCCESS;
+}
+
 uint32 CIwHTTP::ContentSent()
 {
     return m_data_sent;
@@ -1892,6 +4214,7 @@ void CIwHTTP::onReadTimeout()
 
     m_read_timeout = 0;
     m_error_status = READ_TIMEOUT;
+    m_flight_wait = NULL;
 
     // Make the callback, let the user decide whether to close
     // or try another read..
@@ -0,0 +1,1342 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTP2.h"
+#include "IwHTTPEventLoop.h"
+#include "IwHTTPSSL.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include "IwDebug.h"
+#include "IwMath.h"
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+#include "errno.h"
+
+#if defined IW_HTTP_SSL
+#include "openssl/ssl.h"
+#endif
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+#define H2_FRAME_HEADER 9
+#define H2_DEFAULT_WINDOW 65535
+#define H2_DEFAULT_FRAME 16384
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_MAX_STREAM_ID 0x7fffffff
+#define H2_DEFAULT_WEIGHT 16
+
+// Bytes read from the connection at a time, at least a whole frame
+#define H2_READ_SIZE 65536
+
+// Most reads in one go, so one busy connection doesn't starve the rest
+#define H2_READS_PER_CALLBACK 16
+
+// Writers are held back while this much is waiting to go out
+#define H2_OUT_LIMIT 262144
+
+// Largest header block we'll put together from CONTINUATION frames
+#define H2_MAX_HEADER_BLOCK 262144
+
+// Largest TLS record payload
+#define TLS_RECORD_SIZE 16384
+
+// Frame types (RFC 7540 6)..
+enum
+{
+    H2_DATA = 0,
+    H2_HEADERS = 1,
+    H2_PRIORITY = 2,
+    H2_RST_STREAM = 3,
+    H2_SETTINGS = 4,
+    H2_PUSH_PROMISE = 5,
+    H2_PING = 6,
+    H2_GOAWAY = 7,
+    H2_WINDOW_UPDATE = 8,
+    H2_CONTINUATION = 9
+};
+
+// ..their flags..
+enum
+{
+    H2_FLAG_END_STREAM = 0x1,
+    H2_FLAG_ACK = 0x1,
+    H2_FLAG_END_HEADERS = 0x4,
+    H2_FLAG_PADDED = 0x8,
+    H2_FLAG_PRIORITY = 0x20
+};
+
+// ..settings (RFC 7540 6.5.2)..
+enum
+{
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH = 2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 5
+};
+
+// ..and error codes (RFC 7540 7)
+enum
+{
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR = 1,
+    H2_FLOW_CONTROL_ERROR = 3,
+    H2_FRAME_SIZE_ERROR = 6,
+    H2_REFUSED_STREAM = 7,
+    H2_CANCEL = 8,
+    H2_COMPRESSION_ERROR = 9
+};
+
+static inline uint32 Get32(const uint8 *p)
+{
+    return ((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3];
+}
+
+static inline void Put32(char *p, uint32 v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+std::list<CIwHTTP2Connection *>* CIwHTTP2Connection::s_connections = NULL;
+
+CIwHTTP2Connection* CIwHTTP2Connection::Find(const std::string &key)
+{
+    if (!s_connections)
+        return NULL;
+
+    // The least busy, so streams spread over any there are..
+    CIwHTTP2Connection *best = NULL;
+    for (std::list<CIwHTTP2Connection *>::iterator it = s_connections->begin(); it != s_connections->end(); ++it)
+    {
+        CIwHTTP2Connection *conn = *it;
+        if (conn->m_key == key && conn->CanOpenStream() && (!best || conn->m_users < best->m_users))
+            best = conn;
+    }
+
+    return best;
+}
+
+#ifdef IW_HTTP_SSL
+CIwHTTP2Connection* CIwHTTP2Connection::Create(const std::string &key, int socket, s3eSocket *pSocket, SSL *ssl)
+{
+    return new CIwHTTP2Connection(key, socket, pSocket, ssl);
+}
+#else
+CIwHTTP2Connection* CIwHTTP2Connection::Create(const std::string &key, int socket, s3eSocket *pSocket)
+{
+    return new CIwHTTP2Connection(key, socket, pSocket);
+}
+#endif
+
+void CIwHTTP2Connection::Flush()
+{
+    if (!s_connections)
+        return;
+
+    std::list<CIwHTTP2Connection *> idle;
+    for (std::list<CIwHTTP2Connection *>::iterator it = s_connections->begin(); it != s_connections->end(); ++it)
+    {
+        if (!(*it)->m_users)
+            idle.push_back(*it);
+    }
+
+    for (std::list<CIwHTTP2Connection *>::iterator it = idle.begin(); it != idle.end(); ++it)
+    {
+        (*it)->Fail(H2_NO_ERROR);
+        delete *it;
+    }
+}
+
+#ifdef IW_HTTP_SSL
+CIwHTTP2Connection::CIwHTTP2Connection(const std::string &key, int socket, s3eSocket *pSocket, SSL *ssl) :
+#else
+CIwHTTP2Connection::CIwHTTP2Connection(const std::string &key, int socket, s3eSocket *pSocket) :
+#endif
+    m_key(key),
+    m_socket(socket),
+    m_pSocket(pSocket),
+#ifdef IW_HTTP_SSL
+    m_SSL(ssl),
+#endif
+    m_users(1),
+    m_next_id(1),
+    m_max_streams(100),
+    m_goaway(false),
+    m_dead(false),
+    m_header_stream(0),
+    m_header_end_stream(false),
+    m_send_window(H2_DEFAULT_WINDOW),
+    m_peer_initial_window(H2_DEFAULT_WINDOW),
+    m_peer_max_frame(H2_DEFAULT_FRAME),
+    m_conn_unacked(0),
+    m_in_size(H2_READ_SIZE),
+    m_in_end(0),
+    m_out_start(0),
+    m_out_retry(0),
+    m_out_waiting(false),
+    m_notify_timer(false),
+    m_idle_timer(false)
+{
+    IwTrace(HTTP, ("(Speaking HTTP/2 to %s)", key.c_str()));
+
+    int streamWindow = 1048576;
+    int connWindow = 16777216;
+    int maxStreams = 100;
+    s3eConfigGetInt("connection", "httph2streamwindow", &streamWindow);
+    s3eConfigGetInt("connection", "httph2connectionwindow", &connWindow);
+    s3eConfigGetInt("connection", "httph2maxstreams", &maxStreams);
+
+    m_stream_window = MAX(streamWindow, H2_DEFAULT_WINDOW);
+    m_conn_window = MAX(connWindow, H2_DEFAULT_WINDOW);
+    m_max_streams = MAX(maxStreams, 1);
+
+    m_in = new char[m_in_size];
+
+    // The preface and our settings, opening the connection's window as
+    // far as we want it rather than waiting for data to arrive..
+    m_out = H2_PREFACE;
+    WriteSettings();
+    if (m_conn_window > H2_DEFAULT_WINDOW)
+        WriteWindowUpdate(0, m_conn_window - H2_DEFAULT_WINDOW);
+    Send();
+
+    if (!s_connections)
+        s_connections = new std::list<CIwHTTP2Connection *>;
+    s_connections->push_back(this);
+
+    // The server's settings may already be sitting in the TLS layer, where
+    // the socket becoming readable won't tell us, so have a look shortly..
+    CIwHTTPEventLoop::SocketReadable(m_socket, m_pSocket, ReadableCallback, this);
+    ScheduleNotify();
+}
+
+CIwHTTP2Connection::~CIwHTTP2Connection()
+{
+    if (m_notify_timer)
+        CIwHTTPEventLoop::CancelTimer(NotifyCallback, this);
+
+    if (m_idle_timer)
+        CIwHTTPEventLoop::CancelTimer(IdleCallback, this);
+
+    Drop();
+
+    for (StreamMap::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+        delete it->second;
+
+    delete[] m_in;
+}
+
+bool CIwHTTP2Connection::CanOpenStream() const
+{
+    return !m_dead && !m_goaway && m_users < m_max_streams && m_next_id + 2 * m_users <= H2_MAX_STREAM_ID;
+}
+
+void CIwHTTP2Connection::Attach()
+{
+    m_users++;
+
+    if (m_idle_timer)
+    {
+        m_idle_timer = false;
+        CIwHTTPEventLoop::CancelTimer(IdleCallback, this);
+    }
+}
+
+void CIwHTTP2Connection::Detach(uint32 id, bool complete)
+{
+    StreamMap::iterator it = m_streams.find(id);
+    if (it != m_streams.end())
+    {
+        Stream *s = it->second;
+        s->m_read_fn = NULL;
+        s->m_write_fn = NULL;
+
+        // Whatever wasn't read is given back to the connection..
+        uint32 unread = s->m_in.size() - s->m_in_start - s->m_text_left;
+        StreamRead(NULL, unread);
+
+        if (complete && s->m_local_end && !s->m_end && !s->m_reset && !m_dead)
+        {
+            // All there is has arrived, the server just hasn't said so yet..
+            s->m_orphan = true;
+            s->m_in.clear();
+            s->m_in_start = s->m_text_left = 0;
+        }
+        else
+        {
+            if ((!s->m_end || !s->m_local_end) && !s->m_reset && !m_dead)
+                WriteRstStream(id, H2_CANCEL);
+
+            CloseStream(it);
+        }
+
+        Send();
+    }
+
+    m_users--;
+    CheckIdle();
+}
+
+CIwHTTP2Connection::Stream* CIwHTTP2Connection::GetStream(uint32 id)
+{
+    StreamMap::iterator it = m_streams.find(id);
+    return it != m_streams.end() ? it->second : NULL;
+}
+
+void CIwHTTP2Connection::CloseStream(StreamMap::iterator it)
+{
+    delete it->second;
+    m_streams.erase(it);
+}
+
+void CIwHTTP2Connection::ResetStream(Stream *s, uint32 error)
+{
+    if (s->m_reset)
+        return;
+
+    IwTrace(HTTP, ("(Resetting HTTP/2 stream %u: %u)", s->m_id, error));
+    s->m_reset = true;
+    WriteRstStream(s->m_id, error);
+}
+
+uint32 CIwHTTP2Connection::OpenStream(const std::string &head, bool secure, uint32 bodyLength, uint32 weight)
+{
+    if (m_dead || m_goaway || m_next_id > H2_MAX_STREAM_ID)
+        return 0;
+
+    uint32 id = m_next_id;
+    m_next_id += 2;
+
+    Stream *s = new Stream;
+    s->m_id = id;
+    s->m_in_start = 0;
+    s->m_text_left = 0;
+    s->m_headers = false;
+    s->m_end = false;
+    s->m_reset = false;
+    s->m_local_end = (bodyLength == 0);
+    s->m_orphan = false;
+    s->m_send_window = m_peer_initial_window;
+    s->m_send_left = bodyLength;
+    s->m_recv_unacked = 0;
+    s->m_read_fn = NULL;
+    s->m_read_data = NULL;
+    s->m_write_fn = NULL;
+    s->m_write_data = NULL;
+    m_streams[id] = s;
+
+    std::string payload;
+    uint8 flags = s->m_local_end ? H2_FLAG_END_STREAM : 0;
+
+    weight = MAX(1, MIN(weight, 256));
+    if (weight != H2_DEFAULT_WEIGHT)
+    {
+        // No dependency, just a weight among the others (RFC 7540 5.3)..
+        char prio[5] = { 0, 0, 0, 0, (char)(weight - 1) };
+        payload.assign(prio, sizeof(prio));
+        flags |= H2_FLAG_PRIORITY;
+    }
+
+    std::string block;
+    BuildHeaders(block, head, secure);
+
+    // As much as fits in HEADERS, the rest in CONTINUATIONs..
+    uint32 room = m_peer_max_frame - payload.size();
+    uint32 first = MIN(room, (uint32)block.size());
+    payload.append(block, 0, first);
+
+    if (first == block.size())
+        flags |= H2_FLAG_END_HEADERS;
+    WriteFrame(H2_HEADERS, flags, id, payload.data(), payload.size());
+
+    for (uint32 pos = first; pos < block.size(); )
+    {
+        uint32 len = MIN(m_peer_max_frame, (uint32)block.size() - pos);
+        WriteFrame(H2_CONTINUATION, pos + len == block.size() ? H2_FLAG_END_HEADERS : 0, id, &block[pos], len);
+        pos += len;
+    }
+
+    IwTrace(HTTP_VERBOSE, ("(Opened HTTP/2 stream %u, %u byte header block)", id, (uint32)block.size()));
+
+    Send();
+    return id;
+}
+
+void CIwHTTP2Connection::BuildHeaders(std::string &block, const std::string &head, bool secure)
+{
+    // The request line becomes the pseudo-headers, Host the authority, and
+    // the rest go much as they are, less any that are about the
+    // connection rather than the request (RFC 7540 8.1.2.2)..
+    size_t eol = head.find("\r\n");
+    size_t sp1 = head.find(' ');
+    size_t sp2 = head.rfind(' ', eol);
+    if (eol == std::string::npos || sp1 >= sp2)
+        sp1 = sp2 = eol = 0;
+
+    std::string authority;
+    CIwHTTPHPACK::HeaderList headers;
+
+    size_t pos = eol + 2;
+    while (pos < head.size())
+    {
+        size_t end = head.find("\r\n", pos);
+        if (end == std::string::npos)
+            end = head.size();
+
+        size_t colon = head.find(':', pos);
+        if (colon < end && colon > pos)
+        {
+            CIwHTTPHPACK::Header h;
+            h.m_name.assign(head, pos, colon - pos);
+            for (uint32 i = 0; i < h.m_name.size(); i++)
+                h.m_name[i] = tolower(h.m_name[i]);
+
+            size_t v = colon + 1;
+            while (v < end && (head[v] == ' ' || head[v] == '\t'))
+                v++;
+            h.m_value.assign(head, v, end - v);
+
+            if (h.m_name == "host")
+                authority = h.m_value;
+            else if (h.m_name != "connection" && h.m_name != "keep-alive" && h.m_name != "proxy-connection" &&
+                h.m_name != "transfer-encoding" && h.m_name != "upgrade" && (h.m_name != "te" || h.m_value == "trailers"))
+                headers.push_back(h);
+        }
+
+        pos = end + 2;
+    }
+
+    m_hpack.BeginBlock(block);
+    m_hpack.Encode(block, ":method", head.substr(0, sp1));
+    m_hpack.Encode(block, ":scheme", secure ? "https" : "http");
+    m_hpack.Encode(block, ":authority", authority);
+    m_hpack.Encode(block, ":path", head.substr(sp1 + 1, sp2 - sp1 - 1));
+
+    for (uint32 i = 0; i < headers.size(); i++)
+        m_hpack.Encode(block, headers[i].m_name, headers[i].m_value);
+}
+
+int CIwHTTP2Connection::Read(uint32 id, char *buf, int len)
+{
+    Stream *s = GetStream(id);
+    if (!s)
+    {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    uint32 avail = s->m_in.size() - s->m_in_start;
+    if (avail)
+    {
+        uint32 n = MIN(avail, (uint32)len);
+        memcpy(buf, &s->m_in[s->m_in_start], n);
+        s->m_in_start += n;
+
+        if (s->m_in_start == s->m_in.size())
+        {
+            s->m_in.clear();
+            s->m_in_start = 0;
+        }
+        else if (s->m_in_start >= H2_READ_SIZE)
+        {
+            s->m_in.erase(0, s->m_in_start);
+            s->m_in_start = 0;
+        }
+
+        // Only what came in DATA frames counts against the windows..
+        uint32 text = MIN(n, s->m_text_left);
+        s->m_text_left -= text;
+        StreamRead(s, n - text);
+        Send();
+
+        return n;
+    }
+
+    if (s->m_end)
+        return 0;
+
+    if (s->m_reset)
+    {
+        // Nothing at all came back, so the request can be tried again..
+        if (!s->m_headers)
+            return 0;
+
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+void CIwHTTP2Connection::StreamRead(Stream *s, uint32 data)
+{
+    if (!data || m_dead)
+        return;
+
+    // Give back what has been read once it's a good part of the window,
+    // so the server can keep sending without waiting on us..
+    if (s && !s->m_end && !s->m_reset)
+    {
+        s->m_recv_unacked += data;
+        if (s->m_recv_unacked >= m_stream_window / 2)
+        {
+            WriteWindowUpdate(s->m_id, s->m_recv_unacked);
+            s->m_recv_unacked = 0;
+        }
+    }
+
+    m_conn_unacked += data;
+    if (m_conn_unacked >= m_conn_window / 2)
+    {
+        WriteWindowUpdate(0, m_conn_unacked);
+        m_conn_unacked = 0;
+    }
+}
+
+int CIwHTTP2Connection::Write(uint32 id, const char *buf, int len)
+{
+    Stream *s = GetStream(id);
+    if (!s || s->m_reset || s->m_local_end || m_dead)
+    {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    if (!IsWritable(s))
+        return 0;
+
+    uint32 n = MIN((uint32)len, s->m_send_left);
+    n = MIN(n, (uint32)MIN(s->m_send_window, m_send_window));
+
+    for (uint32 sent = 0; sent < n; )
+    {
+        uint32 piece = MIN(n - sent, m_peer_max_frame);
+        s->m_send_left -= piece;
+        WriteFrame(H2_DATA, s->m_send_left ? 0 : H2_FLAG_END_STREAM, id, &buf[sent], piece);
+        sent += piece;
+    }
+
+    s->m_send_window -= n;
+    m_send_window -= n;
+    s->m_local_end = (s->m_send_left == 0);
+
+    Send();
+    return n;
+}
+
+bool CIwHTTP2Connection::IsReadable(const Stream *s) const
+{
+    return s->m_in.size() > s->m_in_start || s->m_end || s->m_reset || m_dead;
+}
+
+bool CIwHTTP2Connection::IsWritable(const Stream *s) const
+{
+    if (s->m_reset || m_dead)
+        return true;
+
+    return s->m_send_window > 0 && m_send_window > 0 && m_out.size() - m_out_start < H2_OUT_LIMIT;
+}
+
+void CIwHTTP2Connection::WaitReadable(uint32 id, s3eSocketCallbackFn fn, void *data)
+{
+    Stream *s = GetStream(id);
+    if (!s)
+        return;
+
+    s->m_read_fn = fn;
+    s->m_read_data = data;
+    if (fn && IsReadable(s))
+        ScheduleNotify();
+}
+
+void CIwHTTP2Connection::WaitWritable(uint32 id, s3eSocketCallbackFn fn, void *data)
+{
+    Stream *s = GetStream(id);
+    if (!s)
+        return;
+
+    s->m_write_fn = fn;
+    s->m_write_data = data;
+    if (fn && IsWritable(s))
+        ScheduleNotify();
+}
+
+void CIwHTTP2Connection::WriteFrame(uint8 type, uint8 flags, uint32 id, const char *payload, uint32 len)
+{
+    char h[H2_FRAME_HEADER];
+    h[0] = (char)(len >> 16);
+    h[1] = (char)(len >> 8);
+    h[2] = (char)len;
+    h[3] = (char)type;
+    h[4] = (char)flags;
+    Put32(&h[5], id & H2_MAX_STREAM_ID);
+
+    m_out.append(h, sizeof(h));
+    if (len)
+        m_out.append(payload, len);
+}
+
+void CIwHTTP2Connection::WriteSettings()
+{
+    // No server push, and streams get the window we want from the start..
+    char payload[12];
+    payload[0] = 0;
+    payload[1] = H2_SETTINGS_ENABLE_PUSH;
+    Put32(&payload[2], 0);
+    payload[6] = 0;
+    payload[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    Put32(&payload[8], m_stream_window);
+
+    WriteFrame(H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+void CIwHTTP2Connection::WriteWindowUpdate(uint32 id, uint32 increment)
+{
+    char payload[4];
+    Put32(payload, increment);
+    WriteFrame(H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+void CIwHTTP2Connection::WriteRstStream(uint32 id, uint32 error)
+{
+    char payload[4];
+    Put32(payload, error);
+    WriteFrame(H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+void CIwHTTP2Connection::Send()
+{
+    while (!m_dead && m_out_start < m_out.size())
+    {
+        // A TLS write that couldn't finish must be made again just the same..
+        uint32 len = m_out.size() - m_out_start;
+#ifdef IW_HTTP_SSL
+        if (m_SSL)
+            len = m_out_retry ? m_out_retry : MIN(len, TLS_RECORD_SIZE);
+#endif
+
+        int ret = SendRaw(&m_out[m_out_start], len);
+        if (ret < 0)
+        {
+            IwTrace(HTTP, ("(HTTP/2 connection failed whilst sending: %d)", errno));
+            Drop();
+            return;
+        }
+
+        if (ret == 0)
+        {
+            m_out_retry = len;
+            break;
+        }
+
+        m_out_retry = 0;
+        m_out_start += ret;
+    }
+
+    if (m_out_start == m_out.size())
+    {
+        m_out.clear();
+        m_out_start = 0;
+    }
+    else if (m_out_start >= H2_READ_SIZE)
+    {
+        m_out.erase(0, m_out_start);
+        m_out_start = 0;
+    }
+
+    bool waiting = !m_dead && m_out_start < m_out.size();
+    if (waiting != m_out_waiting)
+    {
+        m_out_waiting = waiting;
+        CIwHTTPEventLoop::SocketWritable(m_socket, m_pSocket, waiting ? WritableCallback : NULL, waiting ? this : NULL);
+    }
+}
+
+int CIwHTTP2Connection::SendRaw(const char *buf, int len)
+{
+#ifdef IW_HTTP_SSL
+    if (m_SSL)
+    {
+        int ret = SSL_write(m_SSL, buf, len);
+        if (ret <= 0 && SSL_get_error(m_SSL, ret) == SSL_ERROR_WANT_WRITE)
+        {
+            CIwHTTPEventLoop::WouldBlock(m_socket, true);
+            return 0;
+        }
+        return ret <= 0 ? -1 : ret;
+    }
+#endif
+
+    int ret = CIwHTTPEventLoop::Send(m_socket, buf, len);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        CIwHTTPEventLoop::WouldBlock(m_socket, true);
+        ret = 0;
+    }
+
+    return ret;
+}
+
+int CIwHTTP2Connection::RecvRaw(char *buf, int len)
+{
+#ifdef IW_HTTP_SSL
+    if (m_SSL)
+    {
+        int ret = SSL_read(m_SSL, buf, len);
+        if (ret > 0)
+            return ret;
+
+        int err = SSL_get_error(m_SSL, ret);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        {
+            CIwHTTPEventLoop::WouldBlock(m_socket, err == SSL_ERROR_WANT_WRITE);
+            errno = EAGAIN;
+            return -1;
+        }
+        return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+#endif
+
+    int ret = CIwHTTPEventLoop::Recv(m_socket, buf, len, 0);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        CIwHTTPEventLoop::WouldBlock(m_socket, false);
+    return ret;
+}
+
+void CIwHTTP2Connection::OnReadable()
+{
+    for (int i = 0; !m_dead; i++)
+    {
+        if (i == H2_READS_PER_CALLBACK)
+        {
+            // Let others have a go, then carry on..
+            ScheduleNotify();
+            break;
+        }
+
+        int n = RecvRaw(&m_in[m_in_end], m_in_size - m_in_end);
+        if (n > 0)
+        {
+            m_in_end += n;
+            ParseFrames();
+            continue;
+        }
+
+        if (n == 0)
+        {
+            IwTrace(HTTP, ("(HTTP/2 connection closed by the server)"));
+            Drop();
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            IwTrace(HTTP, ("(HTTP/2 connection failed whilst reading: %d)", errno));
+            Drop();
+        }
+        break;
+    }
+
+    if (!m_dead)
+    {
+        CIwHTTPEventLoop::SocketReadable(m_socket, m_pSocket, ReadableCallback, this);
+
+        // Settings acknowledgements, pings and window updates..
+        Send();
+    }
+
+    Notify();
+}
+
+void CIwHTTP2Connection::OnWritable()
+{
+    Send();
+    Notify();
+}
+
+bool CIwHTTP2Connection::ParseFrames()
+{
+    uint32 pos = 0;
+    while (m_in_end - pos >= H2_FRAME_HEADER)
+    {
+        const uint8 *h = (const uint8 *)&m_in[pos];
+        uint32 len = (h[0] << 16) | (h[1] << 8) | h[2];
+        uint32 id = Get32(&h[5]) & H2_MAX_STREAM_ID;
+
+        // We never raise SETTINGS_MAX_FRAME_SIZE..
+        if (len > H2_DEFAULT_FRAME)
+        {
+            Fail(H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+
+        if (m_in_end - pos - H2_FRAME_HEADER < len)
+            break;
+
+        if (!HandleFrame(h[3], h[4], id, h + H2_FRAME_HEADER, len))
+            return false;
+
+        pos += H2_FRAME_HEADER + len;
+    }
+
+    // Keep any partial frame for next time..
+    memmove(m_in, &m_in[pos], m_in_end - pos);
+    m_in_end -= pos;
+    return true;
+}
+
+bool CIwHTTP2Connection::HandleFrame(uint8 type, uint8 flags, uint32 id, const uint8 *payload, uint32 len)
+{
+    // Nothing may come between a header block's frames..
+    if (m_header_stream && (type != H2_CONTINUATION || id != m_header_stream))
+    {
+        Fail(H2_PROTOCOL_ERROR);
+        return false;
+    }
+
+    switch (type)
+    {
+        case H2_DATA:
+            return HandleData(flags, id, payload, len);
+
+        case H2_HEADERS:
+            return HandleHeaders(flags, id, payload, len);
+
+        case H2_CONTINUATION:
+            if (!m_header_stream || m_header_block.size() + len > H2_MAX_HEADER_BLOCK)
+            {
+                Fail(H2_PROTOCOL_ERROR);
+                return false;
+            }
+
+            m_header_block.append((const char *)payload, len);
+            return !(flags & H2_FLAG_END_HEADERS) || EndHeaders();
+
+        case H2_PRIORITY:
+            return true;
+
+        case H2_RST_STREAM:
+        {
+            if (len != 4 || !id)
+            {
+                Fail(H2_PROTOCOL_ERROR);
+                return false;
+            }
+
+            StreamMap::iterator it = m_streams.find(id);
+            if (it != m_streams.end())
+            {
+                IwTrace(HTTP, ("(HTTP/2 stream %u reset by the server: %u)", id, Get32(payload)));
+                if (it->second->m_orphan)
+                    CloseStream(it);
+                else
+                    it->second->m_reset = true;
+            }
+            return true;
+        }
+
+        case H2_SETTINGS:
+            if (id)
+            {
+                Fail(H2_PROTOCOL_ERROR);
+                return false;
+            }
+            return HandleSettings(flags, payload, len);
+
+        case H2_PUSH_PROMISE:
+            // We said no to these..
+            Fail(H2_PROTOCOL_ERROR);
+            return false;
+
+        case H2_PING:
+            if (len != 8 || id)
+            {
+                Fail(H2_FRAME_SIZE_ERROR);
+                return false;
+            }
+
+            if (!(flags & H2_FLAG_ACK))
+                WriteFrame(H2_PING, H2_FLAG_ACK, 0, (const char *)payload, len);
+            return true;
+
+        case H2_GOAWAY:
+            return HandleGoAway(payload, len);
+
+        case H2_WINDOW_UPDATE:
+            return HandleWindowUpdate(id, payload, len);
+
+        default:
+            // Unknown types are ignored (RFC 7540 4.1)..
+            return true;
+    }
+}
+
+bool CIwHTTP2Connection::HandleData(uint8 flags, uint32 id, const uint8 *payload, uint32 len)
+{
+    if (!id)
+    {
+        Fail(H2_PROTOCOL_ERROR);
+        return false;
+    }
+
+    const uint8 *p = payload;
+    uint32 n = len;
+    if (flags & H2_FLAG_PADDED)
+    {
+        if (!n || p[0] >= n)
+        {
+            Fail(H2_PROTOCOL_ERROR);
+            return false;
+        }
+        n -= 1 + p[0];
+        p++;
+    }
+
+    StreamMap::iterator it = m_streams.find(id);
+    Stream *s = it != m_streams.end() ? it->second : NULL;
+
+    if (s && !s->m_headers && !s->m_reset)
+        ResetStream(s, H2_PROTOCOL_ERROR);
+
+    if (s && s->m_headers && !s->m_reset && !s->m_orphan)
+    {
+        s->m_in.append((const char *)p, n);
+
+        // Only the padding is given straight back..
+        StreamRead(s, len - n);
+    }
+    else
+    {
+        // Nobody wants it, but it counted against the connection's window..
+        StreamRead(NULL, len);
+    }
+
+    if (s && (flags & H2_FLAG_END_STREAM))
+    {
+        s->m_end = true;
+        if (s->m_orphan)
+            CloseStream(it);
+    }
+
+    return true;
+}
+
+bool CIwHTTP2Connection::HandleHeaders(uint8 flags, uint32 id, const uint8 *payload, uint32 len)
+{
+    if (!id)
+    {
+        Fail(H2_PROTOCOL_ERROR);
+        return false;
+    }
+
+    const uint8 *p = payload;
+    uint32 n = len;
+    uint32 pad = 0;
+    if (flags & H2_FLAG_PADDED)
+    {
+        if (!n)
+        {
+            Fail(H2_PROTOCOL_ERROR);
+            return false;
+        }
+        pad = *p++;
+        n--;
+    }
+
+    if (flags & H2_FLAG_PRIORITY)
+    {
+        if (n < 5)
+        {
+            Fail(H2_PROTOCOL_ERROR);
+            return false;
+        }
+        p += 5;
+        n -= 5;
+    }
+
+    if (pad > n)
+    {
+        Fail(H2_PROTOCOL_ERROR);
+        return false;
+    }
+
+    m_header_block.assign((const char *)p, n - pad);
+    m_header_stream = id;
+    m_header_end_stream = (flags & H2_FLAG_END_STREAM) != 0;
+
+    return !(flags & H2_FLAG_END_HEADERS) || EndHeaders();
+}
+
+bool CIwHTTP2Connection::EndHeaders()
+{
+    uint32 id = m_header_stream;
+    m_header_stream = 0;
+
+    // Every block is decoded, wanted or not, to keep the table in step..
+    CIwHTTPHPACK::HeaderList headers;
+    bool ok = m_hpack.Decode((const uint8 *)m_header_block.data(), m_header_block.size(), headers);
+    m_header_block.clear();
+
+    if (!ok)
+    {
+        IwTrace(HTTP, ("(Bad HTTP/2 header block)"));
+        Fail(H2_COMPRESSION_ERROR);
+        return false;
+    }
+
+    StreamMap::iterator it = m_streams.find(id);
+    if (it == m_streams.end())
+        return true;
+
+    Stream *s = it->second;
+    if (!s->m_headers && !s->m_reset && !s->m_orphan)
+    {
+        std::string status;
+        for (uint32 i = 0; i < headers.size(); i++)
+        {
+            if (headers[i].m_name == ":status")
+                status = headers[i].m_value;
+        }
+
+        int code = atoi(status.c_str());
+        if (code < 100)
+        {
+            ResetStream(s, H2_PROTOCOL_ERROR);
+            return true;
+        }
+
+        // Interim responses are dropped, as HTTP/1.1 ones would be if
+        // we ever asked for them..
+        if (code < 200 && !m_header_end_stream)
+            return true;
+
+        std::string &in = s->m_in;
+        in = "HTTP/1.1 ";
+        in += status;
+        in += "\r\n";
+        for (uint32 i = 0; i < headers.size(); i++)
+        {
+            if (headers[i].m_name[0] == ':')
+                continue;
+
+            in += headers[i].m_name;
+            in += ": ";
+            in += headers[i].m_value;
+            in += "\r\n";
+        }
+        in += "\r\n";
+
+        s->m_in_start = 0;
+        s->m_text_left = in.size();
+        s->m_headers = true;
+    }
+
+    // Anything later is trailers, which are ignored like chunked ones..
+    if (m_header_end_stream)
+    {
+        s->m_end = true;
+        if (s->m_orphan)
+            CloseStream(it);
+    }
+
+    return true;
+}
+
+bool CIwHTTP2Connection::HandleSettings(uint8 flags, const uint8 *payload, uint32 len)
+{
+    if (flags & H2_FLAG_ACK)
+        return true;
+
+    if (len % 6)
+    {
+        Fail(H2_FRAME_SIZE_ERROR);
+        return false;
+    }
+
+    for (uint32 i = 0; i < len; i += 6)
+    {
+        uint32 id = (payload[i] << 8) | payload[i + 1];
+        uint32 value = Get32(&payload[i + 2]);
+
+        switch (id)
+        {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                m_hpack.SetEncoderTableSize(value);
+                break;
+
+            case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+            {
+                int maxStreams = 100;
+                s3eConfigGetInt("connection", "httph2maxstreams", &maxStreams);
+                m_max_streams = MIN((uint32)MAX(maxStreams, 1), value);
+                break;
+            }
+
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            {
+                if (value > H2_MAX_WINDOW)
+                {
+                    Fail(H2_FLOW_CONTROL_ERROR);
+                    return false;
+                }
+
+                // Applies to the streams already open too, none of which
+                // may be taken past the largest window..
+                int32 delta = (int32)value - m_peer_initial_window;
+                StreamMap::iterator it;
+                for (it = m_streams.begin(); it != m_streams.end(); ++it)
+                {
+                    if (it->second->m_send_window + (int64)delta > H2_MAX_WINDOW)
+                    {
+                        Fail(H2_FLOW_CONTROL_ERROR);
+                        return false;
+                    }
+                }
+                for (it = m_streams.begin(); it != m_streams.end(); ++it)
+                    it->second->m_send_window += delta;
+                m_peer_initial_window = value;
+                break;
+            }
+
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_DEFAULT_FRAME || value > 0xffffff)
+                {
+                    Fail(H2_PROTOCOL_ERROR);
+                    return false;
+                }
+                m_peer_max_frame = value;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    WriteFrame(H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+    return true;
+}
+
+bool CIwHTTP2Connection::HandleGoAway(const uint8 *payload, uint32 len)
+{
+    if (len < 8)
+    {
+        Fail(H2_FRAME_SIZE_ERROR);
+        return false;
+    }
+
+    uint32 last = Get32(payload) & H2_MAX_STREAM_ID;
+    IwTrace(HTTP, ("(HTTP/2 server going away after stream %u: %u)", last, Get32(&payload[4])));
+
+    // No new streams. Those the server never got to can be tried again
+    // elsewhere, so they read as ended without a response..
+    m_goaway = true;
+    s_connections->remove(this);
+
+    for (StreamMap::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        if (it->first > last)
+            it->second->m_reset = true;
+    }
+
+    CheckIdle();
+    return true;
+}
+
+bool CIwHTTP2Connection::HandleWindowUpdate(uint32 id, const uint8 *payload, uint32 len)
+{
+    if (len != 4)
+    {
+        Fail(H2_FRAME_SIZE_ERROR);
+        return false;
+    }
+
+    uint32 increment = Get32(payload) & H2_MAX_WINDOW;
+
+    if (!id)
+    {
+        if (!increment || (uint32)m_send_window + increment > H2_MAX_WINDOW)
+        {
+            Fail(increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+            return false;
+        }
+        m_send_window += increment;
+        return true;
+    }
+
+    Stream *s = GetStream(id);
+    if (!s)
+        return true;
+
+    if (!increment || s->m_send_window + (int64)increment > H2_MAX_WINDOW)
+        ResetStream(s, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+    else
+        s->m_send_window += increment;
+
+    return true;
+}
+
+void CIwHTTP2Connection::Fail(uint32 error)
+{
+    if (m_dead)
+        return;
+
+    IwTrace(HTTP, ("(Closing HTTP/2 connection %s: %u)", m_key.c_str(), error));
+
+    // Say why, as far as the socket will take it, and go..
+    char payload[8];
+    Put32(payload, 0);
+    Put32(&payload[4], error);
+    WriteFrame(H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    Send();
+
+    Drop();
+}
+
+void CIwHTTP2Connection::Drop()
+{
+    if (m_dead)
+        return;
+
+    m_dead = true;
+    if (s_connections)
+        s_connections->remove(this);
+
+    CIwHTTPEventLoop::SocketReadable(m_socket, m_pSocket, NULL, NULL);
+    if (m_out_waiting)
+        CIwHTTPEventLoop::SocketWritable(m_socket, m_pSocket, NULL, NULL);
+
+#ifdef IW_HTTP_SSL
+    CIwHTTPSSLContext::Destroy(m_SSL);
+    m_SSL = NULL;
+#endif
+
+    CIwHTTPEventLoop::CloseSocket(m_socket);
+    m_socket = -1;
+    m_out.clear();
+    m_out_start = 0;
+    m_out_waiting = false;
+
+    // Every stream is finished with, those waiting are told soon..
+    for (StreamMap::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+        it->second->m_reset = true;
+
+    ScheduleNotify();
+}
+
+void CIwHTTP2Connection::CheckIdle()
+{
+    if (m_users)
+        return;
+
+    if (m_dead || m_goaway)
+    {
+        // Gone once nothing else is happening..
+        ScheduleNotify();
+    }
+    else if (!m_idle_timer)
+    {
+        int ms = 30000;
+        s3eConfigGetInt("connection", "httpidletimeout", &ms);
+        m_idle_timer = true;
+        CIwHTTPEventLoop::SetTimer(ms, IdleCallback, this);
+    }
+}
+
+void CIwHTTP2Connection::Notify()
+{
+    // Callbacks may well close streams, so find those waiting first..
+    std::vector<uint32> ids;
+    for (StreamMap::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        if (it->second->m_read_fn || it->second->m_write_fn)
+            ids.push_back(it->first);
+    }
+
+    for (uint32 i = 0; i < ids.size(); i++)
+    {
+        Stream *s = GetStream(ids[i]);
+        if (s && s->m_read_fn && IsReadable(s))
+        {
+            s3eSocketCallbackFn fn = s->m_read_fn;
+            s->m_read_fn = NULL;
+            fn(m_pSocket, NULL, s->m_read_data);
+        }
+
+        s = GetStream(ids[i]);
+        if (s && s->m_write_fn && IsWritable(s))
+        {
+            s3eSocketCallbackFn fn = s->m_write_fn;
+            s->m_write_fn = NULL;
+            fn(m_pSocket, NULL, s->m_write_data);
+        }
+    }
+}
+
+void CIwHTTP2Connection::ScheduleNotify()
+{
+    if (!m_notify_timer)
+    {
+        m_notify_timer = true;
+        CIwHTTPEventLoop::SetTimer(0, NotifyCallback, this);
+    }
+}
+
+int32 CIwHTTP2Connection::ReadableCallback(s3eSocket *, void *, void *pUserData)
+{
+    ((CIwHTTP2Connection *)pUserData)->OnReadable();
+    return 0;
+}
+
+int32 CIwHTTP2Connection::WritableCallback(s3eSocket *, void *, void *pUserData)
+{
+    ((CIwHTTP2Connection *)pUserData)->OnWritable();
+    return 0;
+}
+
+int32 CIwHTTP2Connection::NotifyCallback(void *, void *pUserData)
+{
+    CIwHTTP2Connection *self = (CIwHTTP2Connection *)pUserData;
+    self->m_notify_timer = false;
+
+    if (!self->m_users && (self->m_dead || self->m_goaway))
+    {
+        delete self;
+        return 0;
+    }
+
+    self->OnReadable();
+    return 0;
+}
+
+int32 CIwHTTP2Connection::IdleCallback(void *, void *pUserData)
+{
+    CIwHTTP2Connection *self = (CIwHTTP2Connection *)pUserData;
+    self->m_idle_timer = false;
+
+    if (!self->m_users)
+    {
+        IwTrace(HTTP_VERBOSE, ("(Idle HTTP/2 connection %s expired)", self->m_key.c_str()));
+        self->Fail(H2_NO_ERROR);
+        delete self;
+    }
+    return 0;
+}
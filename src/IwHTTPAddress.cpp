@@ -0,0 +1,79 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPAddress.h"
+
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+void CIwHTTPAddress::SetPort(uint16 port)
+{
+    if (GetFamily() == AF_INET6)
+        ((struct sockaddr_in6 *)&m_addr)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in *)&m_addr)->sin_port = htons(port);
+}
+
+void CIwHTTPAddress::Set(const s3eInetAddress &addr)
+{
+    memset(&m_addr, 0, sizeof(m_addr));
+    struct sockaddr_in *sin = (struct sockaddr_in *)&m_addr;
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = addr.m_IPAddress;
+    sin->sin_port = addr.m_Port;
+    m_len = sizeof(struct sockaddr_in);
+}
+
+bool CIwHTTPAddress::Parse(const char *str)
+{
+    if (!str)
+        return false;
+
+    memset(&m_addr, 0, sizeof(m_addr));
+
+    struct sockaddr_in *sin = (struct sockaddr_in *)&m_addr;
+    if (inet_pton(AF_INET, str, &sin->sin_addr) == 1)
+    {
+        sin->sin_family = AF_INET;
+        m_len = sizeof(struct sockaddr_in);
+        return true;
+    }
+
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&m_addr;
+    if (inet_pton(AF_INET6, str, &sin6->sin6_addr) == 1)
+    {
+        sin6->sin6_family = AF_INET6;
+        m_len = sizeof(struct sockaddr_in6);
+        return true;
+    }
+
+    return false;
+}
+
+const char* CIwHTTPAddress::ToString(char *buf, int len) const
+{
+    const void *src = (GetFamily() == AF_INET6) ?
+        (const void *)&((const struct sockaddr_in6 *)&m_addr)->sin6_addr :
+        (const void *)&((const struct sockaddr_in *)&m_addr)->sin_addr;
+
+    if (!inet_ntop(GetFamily(), src, buf, len) && len > 0)
+        buf[0] = 0;
+
+    return buf;
+}
+
+bool CIwHTTPAddress::operator==(const CIwHTTPAddress &that) const
+{
+    return m_len == that.m_len && memcmp(&m_addr, &that.m_addr, m_len) == 0;
+}
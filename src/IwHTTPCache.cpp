@@ -0,0 +1,828 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPCache.h"
+#include "IwHTTPDiskCache.h"
+#include "IwHTTPSharedCache.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "IwDebug.h"
+#include "IwMath.h"
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+// Most a heuristic freshness lifetime can be (RFC 9111 4.2.2)
+#define HEURISTIC_LIFETIME_MAX (24 * 60 * 60 * 1000ULL)
+
+// How long a shared response is kept past its freshness, to be
+// revalidated
+#define SHARED_STALE_KEEP (24 * 60 * 60 * 1000ULL)
+
+// At the start of a shared response, before its headers, Vary values and
+// body
+struct SharedHeader
+{
+    uint64 m_response_time;
+    uint64 m_initial_age;
+    uint64 m_lifetime;
+    uint32 m_no_cache;
+    uint32 m_headers_len;
+    uint32 m_vary_len;
+    uint32 m_body_len;
+};
+
+CIwHTTPCache::EntryMap* CIwHTTPCache::s_entries = NULL;
+CIwHTTPCache::LRUList* CIwHTTPCache::s_lru = NULL;
+uint32 CIwHTTPCache::s_bytes = 0;
+
+CIwHTTPCacheBody::CIwHTTPCacheBody() :
+    m_size(0),
+    m_held(true),
+    m_held_max(0),
+    m_map(NULL),
+    m_fd(-1),
+    m_file_max(0),
+    m_refs(1)
+{
+}
+
+CIwHTTPCacheBody::~CIwHTTPCacheBody()
+{
+    if (m_map)
+        munmap(m_map, m_size);
+
+    // Never finished, so never to be used..
+    if (m_fd != -1)
+        CIwHTTPDiskCache::Abandon(this);
+}
+
+bool CIwHTTPCacheBody::Append(const char *pData, uint32 len)
+{
+    if (m_held && m_size + len > m_held_max)
+    {
+        // Too big for memory, though perhaps not for the disk..
+        m_held = false;
+        std::string().swap(m_data);
+    }
+
+    if (m_held)
+        m_data.append(pData, len);
+
+    if (m_fd != -1)
+    {
+        if (m_size + len > m_file_max)
+            CIwHTTPDiskCache::Abandon(this);
+        else
+            CIwHTTPDiskCache::Write(this, pData, len);
+    }
+
+    m_size += len;
+    return m_held || m_fd != -1;
+}
+
+// Does [p, p + len) match name, ignoring case?
+static bool NameIs(const char *p, uint32 len, const char *name)
+{
+    uint32 i = 0;
+    while (i < len && name[i] && tolower(p[i]) == tolower(name[i]))
+        i++;
+    return i == len && !name[i];
+}
+
+// Do the first len characters of a and b match, ignoring case?
+static bool SameName(const char *a, const char *b, uint32 len)
+{
+    uint32 i = 0;
+    while (i < len && tolower(a[i]) == tolower(b[i]))
+        i++;
+    return i == len;
+}
+
+// Steps through the fields of a header block, skipping a response's
+// status line and the empty line a request's block starts with..
+struct FieldIter
+{
+    const std::string &m_block;
+    size_t m_pos;
+    const char *m_name;
+    uint32 m_name_len;
+    const char *m_value;
+    uint32 m_value_len;
+
+    FieldIter(const std::string &block) : m_block(block), m_pos(0) {}
+
+    bool Next()
+    {
+        const char *base = m_block.data();
+        while (m_pos < m_block.size())
+        {
+            const char *line = base + m_pos;
+            size_t eol = m_block.find('\n', m_pos);
+            if (eol == std::string::npos)
+                eol = m_block.size();
+            const char *end = base + eol;
+            m_pos = eol + 1;
+
+            const char *colon = (const char *)memchr(line, ':', end - line);
+            if (!colon || colon == line || *line == ' ' || *line == '\t' || !strncmp(line, "HTTP/", 5))
+                continue;
+
+            const char *v = colon + 1;
+            while (v < end && (*v == ' ' || *v == '\t'))
+                v++;
+            while (end > v && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+                end--;
+
+            m_name = line;
+            m_name_len = colon - line;
+            m_value = v;
+            m_value_len = end - v;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Gets a field's value, those of repeated fields joined by commas..
+static bool GetField(const std::string &block, const char *name, uint32 len, std::string &value)
+{
+    bool found = false;
+    value.clear();
+
+    FieldIter f(block);
+    while (f.Next())
+    {
+        if (f.m_name_len != len || !SameName(f.m_name, name, len))
+            continue;
+
+        if (found)
+            value += ", ";
+        value.append(f.m_value, f.m_value_len);
+        found = true;
+    }
+    return found;
+}
+
+static bool GetField(const std::string &block, const char *name, std::string &value)
+{
+    return GetField(block, name, strlen(name), value);
+}
+
+// Looks for a Cache-Control directive, optionally getting its argument..
+static bool GetDirective(const std::string &cc, const char *name, std::string *value)
+{
+    const char *p = cc.c_str();
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+
+        const char *token = p;
+        while (*p && *p != '=' && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+        bool match = NameIs(token, p - token, name);
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        const char *arg = p;
+        const char *arg_end = p;
+        if (*p == '=')
+        {
+            arg = ++p;
+            if (*p == '"')
+            {
+                arg = ++p;
+                while (*p && *p != '"')
+                    p++;
+                arg_end = p;
+                if (*p)
+                    p++;
+            }
+            else
+            {
+                while (*p && *p != ',' && *p != ' ' && *p != '\t')
+                    p++;
+                arg_end = p;
+            }
+        }
+
+        if (match)
+        {
+            if (value)
+                value->assign(arg, arg_end - arg);
+            return true;
+        }
+
+        while (*p && *p != ',')
+            p++;
+    }
+    return false;
+}
+
+// Fields about the message rather than the response, not stored or
+// updated by a 304. The content coding is only dropped with the
+// representation it described..
+static bool IsMessageField(const char *p, uint32 len, bool coding)
+{
+    return NameIs(p, len, "Connection") || NameIs(p, len, "Keep-Alive") ||
+        NameIs(p, len, "Proxy-Connection") || NameIs(p, len, "Transfer-Encoding") ||
+        NameIs(p, len, "Trailer") || NameIs(p, len, "Upgrade") ||
+        NameIs(p, len, "Content-Length") || (coding && NameIs(p, len, "Content-Encoding"));
+}
+
+static int64 DaysFromCivil(int y, int m, int d)
+{
+    y -= m <= 2;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * (int64)146097 + doe - 719468;
+}
+
+// Parses an HTTP-date in any of its three forms (RFC 9110 5.6.7) to UTC
+// ms, or 0 if it can't be understood..
+static uint64 ParseDate(const std::string &value)
+{
+    static const char months[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+
+    int day = -1, month = -1, year = -1;
+    int hour = -1, min = 0, sec = 0;
+
+    const char *p = value.c_str();
+    while (*p)
+    {
+        // Split at spaces, commas and the dashes of RFC 850 dates..
+        while (*p == ' ' || *p == ',' || *p == '-')
+            p++;
+
+        const char *t = p;
+        while (*p && *p != ' ' && *p != ',' && *p != '-')
+            p++;
+
+        uint32 len = p - t;
+        if (!len)
+            break;
+
+        if (isdigit(*t))
+        {
+            if (memchr(t, ':', len))
+                sscanf(t, "%d:%d:%d", &hour, &min, &sec);
+            else if (day == -1 && len <= 2)
+                day = atoi(t);
+            else if (year == -1)
+            {
+                year = atoi(t);
+                if (len <= 2)
+                    year += year < 70 ? 2000 : 1900;
+            }
+        }
+        else if (len >= 3 && month == -1)
+        {
+            for (int i = 0; i < 12; i++)
+            {
+                if (SameName(t, &months[i * 3], 3))
+                {
+                    month = i + 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (day < 1 || day > 31 || month < 1 || year < 1970 || hour < 0)
+        return 0;
+
+    int64 secs = ((DaysFromCivil(year, month, day) * 24 + hour) * 60 + min) * 60 + sec;
+    return secs > 0 ? secs * 1000 : 0;
+}
+
+void CIwHTTPCache::MakeKey(std::string &key, const char *uri)
+{
+    // The fragment is never sent, so doesn't tell responses apart, and
+    // nor does the case of the scheme and host..
+    const char *hash = strchr(uri, '#');
+    key.assign(uri, hash ? hash - uri : strlen(uri));
+
+    size_t host = key.find("://");
+    size_t end = host == std::string::npos ? 0 : key.find_first_of("/?", host + 3);
+    if (end == std::string::npos)
+        end = key.size();
+
+    for (size_t i = 0; i < end; i++)
+        key[i] = tolower(key[i]);
+}
+
+void CIwHTTPCache::MakeVary(std::string &vary, const std::string &headers, const std::string &request)
+{
+    vary.clear();
+
+    std::string names;
+    if (!GetField(headers, "Vary", names))
+        return;
+
+    const char *p = names.c_str();
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+
+        const char *name = p;
+        while (*p && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+
+        if (p == name)
+            break;
+
+        std::string value;
+        GetField(request, name, p - name, value);
+        vary += value;
+        vary += '\n';
+    }
+}
+
+bool CIwHTTPCache::IsCacheableRequest(const std::string &request)
+{
+    FieldIter f(request);
+    while (f.Next())
+    {
+        // Conditions and ranges of the application's own are left to the
+        // server..
+        if (NameIs(f.m_name, MIN(f.m_name_len, 3), "If-") || NameIs(f.m_name, f.m_name_len, "Range"))
+            return false;
+    }
+
+    std::string cc;
+    return !GetField(request, "Cache-Control", cc) || !GetDirective(cc, "no-store", NULL);
+}
+
+void CIwHTTPCache::Assess(const std::string &headers, CIwHTTPCacheFreshness &fresh, uint64 request_time, uint64 response_time)
+{
+    std::string cc;
+    std::string value;
+    GetField(headers, "Cache-Control", cc);
+
+    fresh.m_no_cache = GetDirective(cc, "no-cache", NULL) ||
+        (cc.empty() && GetField(headers, "Pragma", value) && GetDirective(value, "no-cache", NULL));
+
+    uint64 date = GetField(headers, "Date", value) ? ParseDate(value) : 0;
+    if (!date)
+        date = response_time;
+
+    // How long it is fresh for..
+    if (GetDirective(cc, "max-age", &value))
+    {
+        int secs = atoi(value.c_str());
+        fresh.m_lifetime = secs > 0 ? secs * 1000ULL : 0;
+    }
+    else if (GetField(headers, "Expires", value))
+    {
+        // Including those that can't be parsed, which are in the past..
+        uint64 expires = ParseDate(value);
+        fresh.m_lifetime = expires > date ? expires - date : 0;
+    }
+    else if (GetField(headers, "Last-Modified", value))
+    {
+        uint64 modified = ParseDate(value);
+        fresh.m_lifetime = modified && modified < date ? MIN((date - modified) / 10, HEURISTIC_LIFETIME_MAX) : 0;
+    }
+    else
+        fresh.m_lifetime = 0;
+
+    // ..and how old it was when it arrived (RFC 9111 4.2.3)
+    uint64 apparent_age = response_time > date ? response_time - date : 0;
+    uint64 age = 0;
+    if (GetField(headers, "Age", value) && atoi(value.c_str()) > 0)
+        age = atoi(value.c_str()) * 1000ULL;
+    if (response_time > request_time)
+        age += response_time - request_time;
+
+    fresh.m_initial_age = MAX(apparent_age, age);
+    fresh.m_response_time = response_time;
+}
+
+CIwHTTPCache::Result CIwHTTPCache::Judge(const std::string &key, const std::string &headers, const CIwHTTPCacheFreshness &fresh, const std::string &request, std::string &conditions)
+{
+    uint64 now = s3eTimerGetUTC();
+    uint64 age = fresh.m_initial_age + (now > fresh.m_response_time ? now - fresh.m_response_time : 0);
+    bool usable = !fresh.m_no_cache && age < fresh.m_lifetime;
+
+    // The request may ask for something fresher..
+    std::string cc;
+    std::string value;
+    if (GetField(request, "Cache-Control", cc))
+    {
+        if (GetDirective(cc, "no-cache", NULL))
+            usable = false;
+        else if (GetDirective(cc, "max-age", &value) && age > atoi(value.c_str()) * 1000ULL)
+            usable = false;
+    }
+    else if (GetField(request, "Pragma", value) && GetDirective(value, "no-cache", NULL))
+        usable = false;
+
+    if (!usable)
+    {
+        conditions.clear();
+        if (GetField(headers, "ETag", value))
+        {
+            conditions += "\r\nIf-None-Match: ";
+            conditions += value;
+        }
+        if (GetField(headers, "Last-Modified", value))
+        {
+            conditions += "\r\nIf-Modified-Since: ";
+            conditions += value;
+        }
+
+        // Nothing to revalidate with, so it's no use..
+        if (conditions.empty())
+            return MISS;
+    }
+
+    IwTrace(HTTP, ("(HTTP cache: %s %s)", key.c_str(), usable ? "fresh" : "revalidating"));
+    return usable ? FRESH : STALE;
+}
+
+CIwHTTPCache::Result CIwHTTPCache::Lookup(const char *uri, const std::string &request, std::string &headers, std::string &conditions, CIwHTTPCacheBody *&pBody)
+{
+    if (!uri || !IsCacheableRequest(request))
+        return MISS;
+
+    std::string key;
+    MakeKey(key, uri);
+
+    std::string vary;
+    EntryMap::iterator it;
+    if (s_entries && (it = s_entries->find(key)) != s_entries->end())
+    {
+        Entry &e = it->second;
+
+        MakeVary(vary, e.m_headers, request);
+        if (vary != e.m_vary)
+        {
+            IwTrace(HTTP_VERBOSE, ("(HTTP cache: %s varies)", key.c_str()));
+            return MISS;
+        }
+
+        // Most recently used goes to the front..
+        s_lru->splice(s_lru->begin(), *s_lru, e.m_lru);
+
+        Result result = Judge(key, e.m_headers, e.m_fresh, request, conditions);
+        if (result != MISS)
+        {
+            headers = e.m_headers;
+            pBody = e.m_body;
+            pBody->AddRef();
+        }
+        return result;
+    }
+
+    // Not in memory, but perhaps shared by another process, or on disk
+    // from an earlier run..
+    Entry e;
+    if (!LookupShared(key, e) && !CIwHTTPDiskCache::Lookup(key, e.m_headers, e.m_vary, e.m_fresh, e.m_body))
+        return MISS;
+
+    MakeVary(vary, e.m_headers, request);
+    Result result = vary == e.m_vary ? Judge(key, e.m_headers, e.m_fresh, request, conditions) : MISS;
+    if (result == MISS)
+    {
+        e.m_body->Release();
+        return MISS;
+    }
+
+    headers = e.m_headers;
+    pBody = e.m_body;
+
+    // Kept in memory for next time, if mapped counted as if held..
+    uint32 limit = GetEntryLimit();
+    if (pBody->GetSize() <= limit)
+    {
+        pBody->AddRef();
+        Insert(key, e);
+
+        int max = 4194304;
+        s3eConfigGetInt("connection", "httpcachesize", &max);
+        Trim(max);
+    }
+
+    return result;
+}
+
+void CIwHTTPCache::Revalidated(const char *uri, const std::string &response, std::string &headers, CIwHTTPCacheBody *pBody, uint64 request_time, uint64 response_time)
+{
+    // The status line stays, and stored fields are kept unless the 304
+    // has replacements for them..
+    size_t status = headers.find("\r\n");
+    std::string merged(headers, 0, status == std::string::npos ? 0 : status + 2);
+
+    FieldIter f(headers);
+    while (f.Next())
+    {
+        std::string value;
+        if (!IsMessageField(f.m_name, f.m_name_len, true) && GetField(response, f.m_name, f.m_name_len, value))
+            continue;
+
+        merged.append(f.m_name, f.m_value + f.m_value_len - f.m_name);
+        merged += "\r\n";
+    }
+
+    FieldIter g(response);
+    while (g.Next())
+    {
+        if (IsMessageField(g.m_name, g.m_name_len, true))
+            continue;
+
+        merged.append(g.m_name, g.m_value + g.m_value_len - g.m_name);
+        merged += "\r\n";
+    }
+
+    merged += "\r\n";
+    headers.swap(merged);
+
+    std::string key;
+    MakeKey(key, uri);
+
+    CIwHTTPCacheFreshness fresh;
+    Assess(headers, fresh, request_time, response_time);
+    CIwHTTPDiskCache::Update(key, fresh);
+
+    // Unless it has been replaced or dropped meanwhile..
+    EntryMap::iterator it;
+    if (!s_entries || (it = s_entries->find(key)) == s_entries->end() || it->second.m_body != pBody)
+        return;
+
+    Entry &e = it->second;
+    s_bytes += headers.size() - e.m_headers.size();
+    e.m_headers = headers;
+    e.m_fresh = fresh;
+
+    s_lru->splice(s_lru->begin(), *s_lru, e.m_lru);
+    Share(key, e);
+}
+
+uint32 CIwHTTPCache::GetEntryLimit()
+{
+    int max = 4194304;
+    s3eConfigGetInt("connection", "httpcachesize", &max);
+    if (max <= 0)
+        return 0;
+
+    int entry = 1048576;
+    s3eConfigGetInt("connection", "httpcacheentrysize", &entry);
+    return MAX(MIN(entry, max), 0);
+}
+
+CIwHTTPCacheBody* CIwHTTPCache::StartStore(const char *uri, const std::string &request, const std::string &response, uint32 code)
+{
+    // Those cacheable by default that are worth keeping..
+    switch (code)
+    {
+        case 200: case 203: case 300: case 301: case 308: case 404: case 410:
+            break;
+        default:
+            return NULL;
+    }
+
+    if (!uri || !IsCacheableRequest(request))
+        return NULL;
+
+    std::string cc;
+    std::string value;
+    GetField(response, "Cache-Control", cc);
+    if (GetDirective(cc, "no-store", NULL))
+        return NULL;
+
+    if (GetField(response, "Vary", value) && value.find('*') != std::string::npos)
+        return NULL;
+
+    // Only if it can be used without asking, or asked about cheaply..
+    if (!GetDirective(cc, "max-age", NULL) && !GetField(response, "Expires", value) &&
+        !GetField(response, "ETag", value) && !GetField(response, "Last-Modified", value))
+        return NULL;
+
+    std::string key;
+    MakeKey(key, uri);
+
+    CIwHTTPCacheBody *pBody = new CIwHTTPCacheBody;
+    pBody->m_held_max = GetEntryLimit();
+    pBody->m_held = pBody->m_held_max > 0;
+    CIwHTTPDiskCache::Create(key, pBody);
+
+    uint32 limit = MAX(pBody->m_held ? pBody->m_held_max : 0, pBody->m_fd != -1 ? pBody->m_file_max : 0);
+    if (!limit || (GetField(response, "Content-Length", value) && strtoul(value.c_str(), NULL, 10) > limit))
+    {
+        pBody->Release();
+        return NULL;
+    }
+
+    return pBody;
+}
+
+void CIwHTTPCache::Store(const char *uri, const std::string &request, const std::string &response, CIwHTTPCacheBody *pBody, bool decoded, uint64 request_time, uint64 response_time)
+{
+    if (!uri || !pBody)
+        return;
+
+    std::string key;
+    MakeKey(key, uri);
+
+    // The stored headers describe the body as it is kept..
+    Entry e;
+    size_t status = response.find("\r\n");
+    e.m_headers.assign(response, 0, status == std::string::npos ? 0 : status + 2);
+
+    FieldIter f(response);
+    while (f.Next())
+    {
+        if (IsMessageField(f.m_name, f.m_name_len, decoded))
+            continue;
+
+        e.m_headers.append(f.m_name, f.m_value + f.m_value_len - f.m_name);
+        e.m_headers += "\r\n";
+    }
+
+    char len[32];
+    sprintf(len, "Content-Length: %u\r\n\r\n", pBody->GetSize());
+    e.m_headers += len;
+
+    MakeVary(e.m_vary, e.m_headers, request);
+    Assess(e.m_headers, e.m_fresh, request_time, response_time);
+
+    // Onto disk, if it was being written there..
+    CIwHTTPDiskCache::Commit(key, e.m_headers, e.m_vary, e.m_fresh, pBody);
+
+    if (!pBody->IsHeld() || pBody->GetSize() > GetEntryLimit())
+    {
+        // Whatever was held before is out of date..
+        EntryMap::iterator it;
+        if (s_entries && (it = s_entries->find(key)) != s_entries->end())
+            Erase(it);
+        return;
+    }
+
+    e.m_body = pBody;
+    pBody->AddRef();
+    Insert(key, e);
+    Share(key, e);
+
+    IwTrace(HTTP, ("(HTTP cache: stored %s, %u bytes)", key.c_str(), pBody->GetSize()));
+
+    int max = 4194304;
+    s3eConfigGetInt("connection", "httpcachesize", &max);
+    Trim(max);
+}
+
+void CIwHTTPCache::Insert(const std::string &key, Entry &e)
+{
+    if (!s_entries)
+    {
+        s_entries = new EntryMap;
+        s_lru = new LRUList;
+    }
+
+    EntryMap::iterator it = s_entries->find(key);
+    if (it != s_entries->end())
+        Erase(it);
+
+    s_lru->push_front(key);
+    e.m_lru = s_lru->begin();
+    s_entries->insert(EntryMap::value_type(key, e));
+
+    s_bytes += key.size() + e.m_headers.size() + e.m_vary.size() + e.m_body->GetSize();
+}
+
+bool CIwHTTPCache::LookupShared(const std::string &key, Entry &e)
+{
+    std::string value;
+    uint64 expires;
+    if (!CIwHTTPSharedCache::Lookup(CIwHTTPSharedCache::RESPONSE, key, value, expires) || value.size() < sizeof(SharedHeader))
+        return false;
+
+    SharedHeader head;
+    memcpy(&head, value.data(), sizeof(head));
+    if (sizeof(head) + (uint64)head.m_headers_len + head.m_vary_len + head.m_body_len != value.size())
+        return false;
+
+    uint32 offset = sizeof(head);
+    e.m_headers.assign(value, offset, head.m_headers_len);
+    offset += head.m_headers_len;
+    e.m_vary.assign(value, offset, head.m_vary_len);
+    offset += head.m_vary_len;
+
+    e.m_fresh.m_response_time = head.m_response_time;
+    e.m_fresh.m_initial_age = head.m_initial_age;
+    e.m_fresh.m_lifetime = head.m_lifetime;
+    e.m_fresh.m_no_cache = head.m_no_cache != 0;
+
+    e.m_body = new CIwHTTPCacheBody;
+    e.m_body->m_data.assign(value, offset, head.m_body_len);
+    e.m_body->m_size = head.m_body_len;
+
+    IwTrace(HTTP_VERBOSE, ("(HTTP cache: %s shared by another process)", key.c_str()));
+    return true;
+}
+
+void CIwHTTPCache::Share(const std::string &key, const Entry &e)
+{
+    SharedHeader head;
+    head.m_response_time = e.m_fresh.m_response_time;
+    head.m_initial_age = e.m_fresh.m_initial_age;
+    head.m_lifetime = e.m_fresh.m_lifetime;
+    head.m_no_cache = e.m_fresh.m_no_cache;
+    head.m_headers_len = e.m_headers.size();
+    head.m_vary_len = e.m_vary.size();
+    head.m_body_len = e.m_body->GetSize();
+
+    uint64 len = sizeof(head) + (uint64)head.m_headers_len + head.m_vary_len + head.m_body_len;
+    if (len > CIwHTTPSharedCache::GetValueLimit(CIwHTTPSharedCache::RESPONSE, key))
+        return;
+
+    std::string value;
+    value.reserve(len);
+    value.append((const char *)&head, sizeof(head));
+    value += e.m_headers;
+    value += e.m_vary;
+    value.append(e.m_body->GetData(), head.m_body_len);
+
+    // Kept a while once stale, as it can still be revalidated..
+    uint64 fresh_until = e.m_fresh.m_response_time + e.m_fresh.m_lifetime;
+    fresh_until -= MIN(e.m_fresh.m_initial_age, fresh_until);
+    uint64 expires = MAX(fresh_until, s3eTimerGetUTC()) + SHARED_STALE_KEEP;
+    CIwHTTPSharedCache::Store(CIwHTTPSharedCache::RESPONSE, key, value, expires);
+}
+
+void CIwHTTPCache::Trim(uint32 max)
+{
+    // Drop the least recently used until within the limit..
+    while (s_bytes > max && !s_lru->empty())
+        Erase(s_entries->find(s_lru->back()));
+}
+
+void CIwHTTPCache::Erase(EntryMap::iterator it)
+{
+    Entry &e = it->second;
+    s_bytes -= it->first.size() + e.m_headers.size() + e.m_vary.size() + e.m_body->GetSize();
+
+    e.m_body->Release();
+    s_lru->erase(e.m_lru);
+    s_entries->erase(it);
+}
+
+void CIwHTTPCache::Remove(const char *uri)
+{
+    if (!uri)
+        return;
+
+    std::string key;
+    MakeKey(key, uri);
+
+    CIwHTTPDiskCache::Remove(key);
+    CIwHTTPSharedCache::Remove(CIwHTTPSharedCache::RESPONSE, key);
+
+    EntryMap::iterator it;
+    if (s_entries && (it = s_entries->find(key)) != s_entries->end())
+    {
+        IwTrace(HTTP_VERBOSE, ("(HTTP cache: dropped %s)", key.c_str()));
+        Erase(it);
+    }
+}
+
+void CIwHTTPCache::Flush()
+{
+    if (!s_entries)
+        return;
+
+    while (!s_entries->empty())
+        Erase(s_entries->begin());
+
+    delete s_entries;
+    s_entries = NULL;
+    delete s_lru;
+    s_lru = NULL;
+}
+
+uint32 CIwHTTPCache::GetSize()
+{
+    return s_entries ? s_entries->size() : 0;
+}
+
+uint32 CIwHTTPCache::GetBytes()
+{
+    return s_bytes;
+}
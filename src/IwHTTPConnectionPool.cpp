@@ -0,0 +1,213 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPConnectionPool.h"
+#include "IwHTTPEventLoop.h"
+#include "IwHTTPSSL.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "IwDebug.h"
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+#include "errno.h"
+
+CIwHTTPConnectionPool::ConnectionList* CIwHTTPConnectionPool::s_idle = NULL;
+
+void CIwHTTPConnectionPool::MakeKey(std::string &key, const char *host, uint16 port, bool secure, const char *proxy, int proxyPort)
+{
+    char buf[16];
+
+    key = secure ? "https://" : "http://";
+    if (host && strchr(host, ':'))
+    {
+        // IPv6 literal..
+        key += "[";
+        key += host;
+        key += "]";
+    }
+    else
+        key += host ? host : "";
+    sprintf(buf, ":%u", (unsigned int)port);
+    key += buf;
+
+    if (proxy)
+    {
+        key += "@";
+        key += proxy;
+        sprintf(buf, ":%d", proxyPort);
+        key += buf;
+    }
+}
+
+bool CIwHTTPConnectionPool::IsStale(const Connection &conn)
+{
+    // An idle HTTP connection must have nothing to read. A zero-byte
+    // read means the server closed it, and any data at all is something
+    // we can't match to a request. Either way it's no good to us.
+#ifdef IW_HTTP_SSL
+    if (conn.m_SSL)
+    {
+        // TLS 1.3 servers may send session tickets after the handshake,
+        // which must be read by the library rather than taken as data..
+        if (CIwHTTPSSLContext::IsIdle(conn.m_SSL))
+            return false;
+    }
+    else
+#endif
+    {
+        char c;
+        int ret = CIwHTTPEventLoop::Peek(conn.m_socket, &c, 1);
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+    }
+
+    IwTrace(HTTP, ("(Discarding stale pooled connection %s)", conn.m_key.c_str()));
+    return true;
+}
+
+void CIwHTTPConnectionPool::Close(Connection &conn)
+{
+#ifdef IW_HTTP_SSL
+    CIwHTTPSSLContext::Destroy(conn.m_SSL);
+    conn.m_SSL = NULL;
+#endif
+
+    if (conn.m_socket != -1)
+    {
+        CIwHTTPEventLoop::CloseSocket(conn.m_socket);
+        conn.m_socket = -1;
+        conn.m_pSocket = NULL;
+    }
+}
+
+void CIwHTTPConnectionPool::PurgeExpired(uint64 now)
+{
+    if (!s_idle)
+        return;
+
+    int ms = 30000;
+    s3eConfigGetInt("connection", "httpidletimeout", &ms);
+
+    // Oldest are at the back..
+    while (!s_idle->empty() && now - s_idle->back().m_idleSince >= (uint64)ms)
+    {
+        IwTrace(HTTP_VERBOSE, ("(Idle connection %s expired)", s_idle->back().m_key.c_str()));
+        Close(s_idle->back());
+        s_idle->pop_back();
+    }
+}
+
+bool CIwHTTPConnectionPool::Acquire(const std::string &key, Connection &conn)
+{
+    if (!s_idle)
+        return false;
+
+    PurgeExpired(s3eTimerGetMs());
+
+    ConnectionList::iterator it = s_idle->begin();
+    while (it != s_idle->end())
+    {
+        if (it->m_key != key)
+        {
+            ++it;
+            continue;
+        }
+
+        if (IsStale(*it))
+        {
+            Close(*it);
+            it = s_idle->erase(it);
+            continue;
+        }
+
+        conn = *it;
+        s_idle->erase(it);
+
+        IwTrace(HTTP, ("(Reusing connection %s)", key.c_str()));
+        return true;
+    }
+
+    return false;
+}
+
+void CIwHTTPConnectionPool::Release(const Connection &conn)
+{
+    int maxIdle = 8;
+    int maxPerHost = 4;
+    s3eConfigGetInt("connection", "httpmaxidleconnections", &maxIdle);
+    s3eConfigGetInt("connection", "httpmaxidleperhost", &maxPerHost);
+
+    if (maxIdle <= 0 || maxPerHost <= 0)
+    {
+        Connection closing(conn);
+        Close(closing);
+        return;
+    }
+
+    if (!s_idle)
+        s_idle = new ConnectionList;
+
+    CIwHTTPEventLoop::SocketIdle(conn.m_socket);
+
+    uint64 now = s3eTimerGetMs();
+    PurgeExpired(now);
+
+    s_idle->push_front(conn);
+    s_idle->front().m_idleSince = now;
+
+    IwTrace(HTTP_VERBOSE, ("(Pooled connection %s)", conn.m_key.c_str()));
+
+    // Enforce the limits, dropping the least recently used first..
+    int total = 0;
+    int sameHost = 0;
+    ConnectionList::iterator it = s_idle->begin();
+    while (it != s_idle->end())
+    {
+        bool same = (it->m_key == conn.m_key);
+        if (same)
+            sameHost++;
+        total++;
+
+        if (total > maxIdle || (same && sameHost > maxPerHost))
+        {
+            Close(*it);
+            it = s_idle->erase(it);
+            total--;
+            if (same)
+                sameHost--;
+            continue;
+        }
+        ++it;
+    }
+}
+
+void CIwHTTPConnectionPool::Flush()
+{
+    if (!s_idle)
+        return;
+
+    for (ConnectionList::iterator it = s_idle->begin(); it != s_idle->end(); ++it)
+        Close(*it);
+
+    delete s_idle;
+    s_idle = NULL;
+}
+
+uint32 CIwHTTPConnectionPool::GetIdleCount()
+{
+    return s_idle ? s_idle->size() : 0;
+}
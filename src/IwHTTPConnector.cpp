@@ -0,0 +1,219 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPConnector.h"
+#include "IwHTTPEventLoop.h"
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "IwDebug.h"
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+#include "errno.h"
+
+CIwHTTPConnector::CIwHTTPConnector() :
+    m_next(0),
+    m_socket(-1),
+    m_callback(NULL),
+    m_userData(NULL),
+    m_delay_timer(false),
+    m_fail_timer(false)
+{
+}
+
+CIwHTTPConnector::~CIwHTTPConnector()
+{
+    Cancel();
+}
+
+bool CIwHTTPConnector::Start(const CIwHTTPAddressList &addrs, uint16 port, s3eCallback callback, void *userData)
+{
+    Cancel();
+
+    if (addrs.empty())
+        return false;
+
+    m_addrs = addrs;
+    for (uint32 i = 0; i < m_addrs.size(); i++)
+        m_addrs[i].SetPort(port);
+
+    m_next = 0;
+    m_callback = callback;
+    m_userData = userData;
+
+    if (!StartAttempt())
+    {
+        // Nothing could even be started, but don't call back from in here..
+        m_fail_timer = true;
+        CIwHTTPEventLoop::SetTimer(0, FailCallback, this);
+    }
+
+    return true;
+}
+
+bool CIwHTTPConnector::StartAttempt()
+{
+    while (m_next < m_addrs.size())
+    {
+        const CIwHTTPAddress &addr = m_addrs[m_next++];
+
+#ifdef IW_USE_TRACING
+        char buf[64];
+        IwTrace(HTTP, ("(Connecting to %s)", addr.ToString(buf, sizeof(buf))));
+#endif
+
+        int s = socket(addr.GetFamily(), SOCK_STREAM, IPPROTO_TCP);
+        if (s == -1)
+        {
+            IwTrace(HTTP, ("(Socket creation failed)"));
+            continue;
+        }
+
+        // Set non-blocking..
+        int non_blocking = 1;
+        ioctl(s, FIONBIO, &non_blocking);
+
+        Attempt *a = new Attempt;
+        a->m_owner = this;
+        a->m_socket = s;
+        a->m_pSocket = s3esocket(s);
+        if (CIwHTTPEventLoop::Connect(s, a->m_pSocket, (const struct sockaddr *)&addr.m_addr, addr.m_len, AttemptCallback, a) != S3E_RESULT_SUCCESS)
+        {
+            IwTrace(HTTP, ("(Connect fail)"));
+            CIwHTTPEventLoop::CloseSocket(s);
+            delete a;
+            continue;
+        }
+        m_attempts.push_back(a);
+
+        // Give this one a head start before racing the next address..
+        if (m_next < m_addrs.size())
+        {
+            int ms = 250;
+            s3eConfigGetInt("connection", "httpconnectattemptdelay", &ms);
+            m_delay_timer = true;
+            CIwHTTPEventLoop::SetTimer(ms, DelayCallback, this);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+int32 CIwHTTPConnector::AttemptCallback(s3eSocket *, void *, void *pUserData)
+{
+    Attempt *a = (Attempt *)pUserData;
+    CIwHTTPConnector *self = a->m_owner;
+
+    CIwHTTPEventLoop::SocketWritable(a->m_socket, a->m_pSocket, NULL, NULL);
+    self->m_attempts.remove(a);
+
+    int err = CIwHTTPEventLoop::GetConnectError(a->m_socket);
+    if (!err)
+    {
+        // We have a winner, abandon the rest..
+        self->m_socket = a->m_socket;
+        delete a;
+        self->CloseAttempts();
+        self->Report(S3E_RESULT_SUCCESS);
+        return 0;
+    }
+
+    IwTrace(HTTP, ("(Connect attempt failed: %d)", err));
+    CIwHTTPEventLoop::CloseSocket(a->m_socket);
+    delete a;
+
+    // No point waiting out the head start, move straight on..
+    if (self->m_delay_timer)
+    {
+        self->m_delay_timer = false;
+        CIwHTTPEventLoop::CancelTimer(DelayCallback, self);
+    }
+
+    if (!self->StartAttempt() && self->m_attempts.empty())
+        self->Report(S3E_RESULT_ERROR);
+
+    return 0;
+}
+
+int32 CIwHTTPConnector::DelayCallback(void *, void *pUserData)
+{
+    CIwHTTPConnector *self = (CIwHTTPConnector *)pUserData;
+    self->m_delay_timer = false;
+
+    if (!self->StartAttempt() && self->m_attempts.empty())
+        self->Report(S3E_RESULT_ERROR);
+
+    return 0;
+}
+
+int32 CIwHTTPConnector::FailCallback(void *, void *pUserData)
+{
+    CIwHTTPConnector *self = (CIwHTTPConnector *)pUserData;
+    self->m_fail_timer = false;
+    self->Report(S3E_RESULT_ERROR);
+    return 0;
+}
+
+void CIwHTTPConnector::Report(s3eResult result)
+{
+    if (m_callback)
+        m_callback(&result, m_userData);
+}
+
+void CIwHTTPConnector::CloseAttempts()
+{
+    if (m_delay_timer)
+    {
+        m_delay_timer = false;
+        CIwHTTPEventLoop::CancelTimer(DelayCallback, this);
+    }
+
+    while (!m_attempts.empty())
+    {
+        Attempt *a = m_attempts.front();
+        m_attempts.pop_front();
+
+        CIwHTTPEventLoop::SocketWritable(a->m_socket, a->m_pSocket, NULL, NULL);
+        CIwHTTPEventLoop::CloseSocket(a->m_socket);
+        delete a;
+    }
+}
+
+void CIwHTTPConnector::Cancel()
+{
+    CloseAttempts();
+
+    if (m_fail_timer)
+    {
+        m_fail_timer = false;
+        CIwHTTPEventLoop::CancelTimer(FailCallback, this);
+    }
+
+    if (m_socket != -1)
+    {
+        CIwHTTPEventLoop::CloseSocket(m_socket);
+        m_socket = -1;
+    }
+}
+
+int CIwHTTPConnector::TakeSocket()
+{
+    int s = m_socket;
+    m_socket = -1;
+    return s;
+}
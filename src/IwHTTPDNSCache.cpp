@@ -0,0 +1,186 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPDNSCache.h"
+#include "IwHTTPSharedCache.h"
+
+#include <string.h>
+
+#include "IwDebug.h"
+#include "IwMath.h"
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+CIwHTTPDNSCache::EntryMap* CIwHTTPDNSCache::s_entries = NULL;
+CIwHTTPDNSCache::LRUList* CIwHTTPDNSCache::s_lru = NULL;
+
+CIwHTTPDNSCache::Result CIwHTTPDNSCache::Lookup(const char *host, CIwHTTPAddressList &addrs)
+{
+    if (!host)
+        return MISS;
+
+    EntryMap::iterator it;
+    if (!s_entries || (it = s_entries->find(host)) == s_entries->end())
+        return LookupShared(host, addrs);
+
+    if (s3eTimerGetMs() >= it->second.m_expires)
+    {
+        Erase(it);
+        return LookupShared(host, addrs);
+    }
+
+    // Most recently used goes to the front..
+    s_lru->splice(s_lru->begin(), *s_lru, it->second.m_lru);
+
+    if (it->second.m_failed)
+    {
+        IwTrace(HTTP, ("(DNS cache: %s failed recently)", host));
+        return FAILED;
+    }
+
+    IwTrace(HTTP_VERBOSE, ("(DNS cache: %s)", host));
+    addrs = it->second.m_addrs;
+    return HIT;
+}
+
+CIwHTTPDNSCache::Result CIwHTTPDNSCache::LookupShared(const char *host, CIwHTTPAddressList &addrs)
+{
+    std::string value;
+    uint64 expires;
+    if (!CIwHTTPSharedCache::Lookup(CIwHTTPSharedCache::DNS, host, value, expires) || value.empty())
+        return MISS;
+
+    // It may have expired since the lookup checked..
+    uint64 now = s3eTimerGetUTC();
+    if (expires <= now)
+        return MISS;
+
+    // A flag for failure, then each address's length and bytes..
+    CIwHTTPAddressList found;
+    const char *p = value.data() + 1;
+    const char *end = value.data() + value.size();
+    while (p < end)
+    {
+        CIwHTTPAddress addr;
+        addr.m_len = (uint8)*p++;
+        if (addr.m_len > sizeof(addr.m_addr) || addr.m_len > (uint32)(end - p))
+            return MISS;
+        memcpy(&addr.m_addr, p, addr.m_len);
+        p += addr.m_len;
+        found.push_back(addr);
+    }
+
+    bool failed = value[0] != 0;
+    int ttl = (int)MIN(expires - now, (uint64)0x7fffffff);
+    Keep(host, failed ? NULL : &found, ttl);
+
+    if (failed)
+    {
+        IwTrace(HTTP, ("(Shared DNS cache: %s failed recently)", host));
+        return FAILED;
+    }
+
+    IwTrace(HTTP_VERBOSE, ("(Shared DNS cache: %s)", host));
+    addrs = found;
+    return HIT;
+}
+
+void CIwHTTPDNSCache::Store(const char *host, const CIwHTTPAddressList *addrs, int ttl)
+{
+    if (!host)
+        return;
+
+    if (ttl < 0)
+    {
+        ttl = addrs ? 60000 : 5000;
+        s3eConfigGetInt("connection", addrs ? "httpdnsttl" : "httpdnsnegativettl", &ttl);
+    }
+
+    Keep(host, addrs, ttl);
+
+    // Let other processes know too..
+    std::string value(1, addrs ? 0 : 1);
+    for (uint32 i = 0; addrs && i < addrs->size(); i++)
+    {
+        const CIwHTTPAddress &addr = (*addrs)[i];
+        value += (char)addr.m_len;
+        value.append((const char *)&addr.m_addr, addr.m_len);
+    }
+    CIwHTTPSharedCache::Store(CIwHTTPSharedCache::DNS, host, value, s3eTimerGetUTC() + ttl);
+}
+
+void CIwHTTPDNSCache::Keep(const char *host, const CIwHTTPAddressList *addrs, int ttl)
+{
+    int max = 64;
+    s3eConfigGetInt("connection", "httpdnscachesize", &max);
+    if (max <= 0)
+        return;
+
+    if (!s_entries)
+    {
+        s_entries = new EntryMap;
+        s_lru = new LRUList;
+    }
+
+    EntryMap::iterator it = s_entries->find(host);
+    if (it == s_entries->end())
+    {
+        s_lru->push_front(host);
+        it = s_entries->insert(EntryMap::value_type(host, Entry())).first;
+        it->second.m_lru = s_lru->begin();
+    }
+    else
+    {
+        s_lru->splice(s_lru->begin(), *s_lru, it->second.m_lru);
+    }
+
+    Entry &e = it->second;
+    e.m_failed = (addrs == NULL);
+    if (addrs)
+        e.m_addrs = *addrs;
+    else
+        e.m_addrs.clear();
+    e.m_expires = s3eTimerGetMs() + ttl;
+
+    // Drop the least recently used beyond the limit..
+    while (s_entries->size() > (size_t)max)
+        Erase(s_entries->find(s_lru->back()));
+}
+
+void CIwHTTPDNSCache::Erase(EntryMap::iterator it)
+{
+    s_lru->erase(it->second.m_lru);
+    s_entries->erase(it);
+}
+
+void CIwHTTPDNSCache::Remove(const char *host)
+{
+    if (!s_entries || !host)
+        return;
+
+    EntryMap::iterator it = s_entries->find(host);
+    if (it != s_entries->end())
+        Erase(it);
+}
+
+void CIwHTTPDNSCache::Flush()
+{
+    delete s_entries;
+    s_entries = NULL;
+    delete s_lru;
+    s_lru = NULL;
+}
+
+uint32 CIwHTTPDNSCache::GetSize()
+{
+    return s_entries ? s_entries->size() : 0;
+}
@@ -0,0 +1,433 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPDecoder.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include "IwDebug.h"
+#include "IwMath.h"
+#include "s3eConfig.h"
+
+#ifdef IW_HTTP_ZLIB
+#include "zlib.h"
+#endif
+#ifdef IW_HTTP_BROTLI
+#include "brotli/decode.h"
+#endif
+#ifdef IW_HTTP_ZSTD
+#include "zstd.h"
+
+// Largest window accepted, as RFC 8878 asks of HTTP clients
+#define ZSTD_WINDOW_LOG_MAX 23
+#endif
+
+// Does the token [p, p + len) match name, ignoring case?
+static bool TokenIs(const char *p, uint32 len, const char *name)
+{
+    uint32 i = 0;
+    while (i < len && name[i] && tolower(p[i]) == name[i])
+        i++;
+    return i == len && !name[i];
+}
+
+const char* CIwHTTPDecoder::GetAcceptEncoding()
+{
+    static const char s_codings[] = ""
+#ifdef IW_HTTP_ZLIB
+        ", gzip, deflate"
+#endif
+#ifdef IW_HTTP_BROTLI
+        ", br"
+#endif
+#ifdef IW_HTTP_ZSTD
+        ", zstd"
+#endif
+        ;
+
+    // Skip the leading separator..
+    return sizeof(s_codings) > 1 ? s_codings + 2 : NULL;
+}
+
+CIwHTTPDecoder* CIwHTTPDecoder::Create(const char *value, uint32 len)
+{
+    const char *p = value;
+    const char *end = value + len;
+
+    CIwHTTPDecoder *decoder = NULL;
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+
+        uint32 token_len = p - token;
+        if (!token_len || TokenIs(token, token_len, "identity"))
+            continue;
+
+        if (decoder)
+        {
+            // Codings applied one over another aren't undone..
+            IwTrace(HTTP, ("(Not decoding Content-Encoding: %.*s)", (int)len, value));
+            delete decoder;
+            return NULL;
+        }
+
+#ifdef IW_HTTP_ZLIB
+        if (TokenIs(token, token_len, "gzip") || TokenIs(token, token_len, "x-gzip"))
+            decoder = new CIwHTTPDecoder(GZIP);
+        else if (TokenIs(token, token_len, "deflate"))
+            decoder = new CIwHTTPDecoder(DEFLATE);
+        else
+#endif
+#ifdef IW_HTTP_BROTLI
+        if (TokenIs(token, token_len, "br"))
+            decoder = new CIwHTTPDecoder(BROTLI);
+        else
+#endif
+#ifdef IW_HTTP_ZSTD
+        if (TokenIs(token, token_len, "zstd"))
+            decoder = new CIwHTTPDecoder(ZSTD);
+        else
+#endif
+        {
+            IwTrace(HTTP, ("(Unknown Content-Encoding: %.*s)", (int)len, value));
+            return NULL;
+        }
+    }
+
+    return decoder;
+}
+
+CIwHTTPDecoder::CIwHTTPDecoder(Coding coding) :
+    m_coding(coding),
+    m_stream(NULL),
+    m_end(false),
+    m_failed(false),
+    m_in_start(0),
+    m_in_end(0),
+    m_out(NULL),
+    m_out_size(0),
+    m_out_start(0),
+    m_out_end(0)
+{
+    int size = 16384;
+    s3eConfigGetInt("connection", "httpdecodebuffersize", &size);
+    m_in_size = MAX(size, 1024);
+    m_in = new char[m_in_size];
+}
+
+CIwHTTPDecoder::~CIwHTTPDecoder()
+{
+    if (m_stream)
+    {
+        switch (m_coding)
+        {
+#ifdef IW_HTTP_ZLIB
+            case GZIP:
+            case DEFLATE:
+                inflateEnd((z_stream *)m_stream);
+                delete (z_stream *)m_stream;
+                break;
+#endif
+#ifdef IW_HTTP_BROTLI
+            case BROTLI:
+                BrotliDecoderDestroyInstance((BrotliDecoderState *)m_stream);
+                break;
+#endif
+#ifdef IW_HTTP_ZSTD
+            case ZSTD:
+                ZSTD_freeDCtx((ZSTD_DCtx *)m_stream);
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+
+    delete[] m_in;
+    delete[] m_out;
+}
+
+const char* CIwHTTPDecoder::GetName() const
+{
+    switch (m_coding)
+    {
+        case GZIP:      return "gzip";
+        case DEFLATE:   return "deflate";
+        case BROTLI:    return "br";
+        case ZSTD:      return "zstd";
+    }
+    return "";
+}
+
+char* CIwHTTPDecoder::GetInput(uint32 &space)
+{
+    if (m_in_start && m_in_end == m_in_size)
+    {
+        // Make room behind what's still waiting..
+        memmove(m_in, &m_in[m_in_start], m_in_end - m_in_start);
+        m_in_end -= m_in_start;
+        m_in_start = 0;
+    }
+
+    space = m_in_size - m_in_end;
+    return &m_in[m_in_end];
+}
+
+void CIwHTTPDecoder::AddInput(uint32 len)
+{
+    IwAssertMsg(HTTP, m_in_end + len <= m_in_size, ("Decoder input overrun"));
+
+    // Anything after the end of the stream is of no use..
+    if (!m_end)
+        m_in_end += len;
+}
+
+bool CIwHTTPDecoder::Init()
+{
+    switch (m_coding)
+    {
+#ifdef IW_HTTP_ZLIB
+        case GZIP:
+        case DEFLATE:
+        {
+            int bits = MAX_WBITS + 16;
+            if (m_coding == DEFLATE)
+            {
+                // Meant to have a zlib wrapper, but plenty of servers send
+                // the raw stream. Look at the header to tell which..
+                if (m_in_end - m_in_start < 2)
+                    return true;
+
+                uint8 cmf = m_in[m_in_start];
+                uint8 flg = m_in[m_in_start + 1];
+                bool wrapped = (cmf & 0x0f) == Z_DEFLATED && ((cmf << 8) | flg) % 31 == 0;
+                bits = wrapped ? MAX_WBITS : -MAX_WBITS;
+            }
+
+            z_stream *z = new z_stream;
+            memset(z, 0, sizeof(*z));
+            if (inflateInit2(z, bits) != Z_OK)
+            {
+                delete z;
+                return false;
+            }
+            m_stream = z;
+            return true;
+        }
+#endif
+#ifdef IW_HTTP_BROTLI
+        case BROTLI:
+            m_stream = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+            return m_stream != NULL;
+#endif
+#ifdef IW_HTTP_ZSTD
+        case ZSTD:
+        {
+            ZSTD_DCtx *d = ZSTD_createDCtx();
+            if (!d)
+                return false;
+
+            // Don't let the server make us allocate an unbounded window..
+            ZSTD_DCtx_setParameter(d, ZSTD_d_windowLogMax, ZSTD_WINDOW_LOG_MAX);
+            m_stream = d;
+            return true;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+void CIwHTTPDecoder::Fail(const char *what)
+{
+    IwTrace(HTTP, ("(Failed to decode %s content: %s)", GetName(), what ? what : "unknown error"));
+    m_failed = true;
+}
+
+int32 CIwHTTPDecoder::DecodeStep(char *buf, uint32 len)
+{
+    uint32 in_len = m_in_end - m_in_start;
+    uint32 used = 0;
+    uint32 out = 0;
+
+    switch (m_coding)
+    {
+#ifdef IW_HTTP_ZLIB
+        case GZIP:
+        case DEFLATE:
+        {
+            z_stream *z = (z_stream *)m_stream;
+            z->next_in = (Bytef *)&m_in[m_in_start];
+            z->avail_in = in_len;
+            z->next_out = (Bytef *)buf;
+            z->avail_out = len;
+
+            int ret = inflate(z, Z_NO_FLUSH);
+            used = in_len - z->avail_in;
+            out = len - z->avail_out;
+
+            if (ret == Z_STREAM_END)
+                m_end = true;
+            else if (ret != Z_OK && ret != Z_BUF_ERROR)
+            {
+                Fail(z->msg);
+                return -1;
+            }
+            break;
+        }
+#endif
+#ifdef IW_HTTP_BROTLI
+        case BROTLI:
+        {
+            size_t avail_in = in_len;
+            const uint8_t *next_in = (const uint8_t *)&m_in[m_in_start];
+            size_t avail_out = len;
+            uint8_t *next_out = (uint8_t *)buf;
+
+            BrotliDecoderResult ret = BrotliDecoderDecompressStream((BrotliDecoderState *)m_stream,
+                &avail_in, &next_in, &avail_out, &next_out, NULL);
+            used = in_len - avail_in;
+            out = len - avail_out;
+
+            if (ret == BROTLI_DECODER_RESULT_SUCCESS)
+                m_end = true;
+            else if (ret == BROTLI_DECODER_RESULT_ERROR)
+            {
+                Fail(BrotliDecoderErrorString(BrotliDecoderGetErrorCode((BrotliDecoderState *)m_stream)));
+                return -1;
+            }
+            break;
+        }
+#endif
+#ifdef IW_HTTP_ZSTD
+        case ZSTD:
+        {
+            ZSTD_inBuffer zin = { &m_in[m_in_start], in_len, 0 };
+            ZSTD_outBuffer zout = { buf, len, 0 };
+
+            size_t ret = ZSTD_decompressStream((ZSTD_DCtx *)m_stream, &zout, &zin);
+            if (ZSTD_isError(ret))
+            {
+                Fail(ZSTD_getErrorName(ret));
+                return -1;
+            }
+            used = zin.pos;
+            out = zout.pos;
+
+            // A frame has ended and everything it held has been flushed..
+            if (!ret)
+                m_end = true;
+            break;
+        }
+#endif
+        default:
+            // Create makes none of these, there's no library for it..
+            used = in_len;
+            break;
+    }
+
+    m_in_start += used;
+    if (m_in_start == m_in_end || m_end)
+        m_in_start = m_in_end = 0;
+
+    return out;
+}
+
+int32 CIwHTTPDecoder::Decode(char *buf, uint32 len)
+{
+    if (m_failed)
+        return -1;
+
+    if (!m_stream)
+    {
+        if (m_in_start == m_in_end)
+            return 0;
+
+        if (!Init())
+        {
+            Fail("out of memory");
+            return -1;
+        }
+
+        if (!m_stream)
+            return 0;   // Not enough to go on yet
+    }
+
+    uint32 done = 0;
+    while (done < len && !m_end)
+    {
+        uint32 waiting = m_in_end - m_in_start;
+
+        int32 got = DecodeStep(&buf[done], len - done);
+        if (got < 0)
+            return -1;
+        done += got;
+
+        // Stop once the library wants more than it's been given..
+        if (!got && waiting == m_in_end - m_in_start)
+            break;
+    }
+
+    return done;
+}
+
+int32 CIwHTTPDecoder::Read(char *buf, uint32 len)
+{
+    // Anything already decoded for Peek comes first..
+    uint32 done = MIN(len, m_out_end - m_out_start);
+    if (done)
+    {
+        memcpy(buf, &m_out[m_out_start], done);
+        m_out_start += done;
+    }
+
+    if (done < len)
+    {
+        int32 got = Decode(&buf[done], len - done);
+        if (got < 0)
+            return -1;
+        done += got;
+    }
+
+    return done;
+}
+
+uint32 CIwHTTPDecoder::Peek(const char *&pData)
+{
+    if (m_out_start == m_out_end)
+    {
+        if (!m_out)
+        {
+            m_out_size = m_in_size;
+            m_out = new char[m_out_size];
+        }
+
+        int32 got = Decode(m_out, m_out_size);
+        m_out_start = 0;
+        m_out_end = MAX(got, 0);
+    }
+
+    pData = m_out ? &m_out[m_out_start] : NULL;
+    return m_out_end - m_out_start;
+}
+
+void CIwHTTPDecoder::Consume(uint32 bytes)
+{
+    IwAssertMsg(HTTP, bytes <= m_out_end - m_out_start, ("Consuming more than was decoded"));
+    m_out_start += bytes;
+}
@@ -0,0 +1,686 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPDiskCache.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "IwDebug.h"
+#include "IwMath.h"
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+#define INDEX_MAGIC 0x43444849  // "IHDC"
+#define INDEX_VERSION 1
+#define FILE_MAGIC 0x46444849   // "IHDF"
+
+// Slots a hash can be kept in
+#define SLOT_WAYS 8
+
+#define SLOT_NO_CACHE 1
+
+// Temporary files untouched for this long (seconds) are left over from a
+// crash, whichever process made them
+#define TEMP_MAX_AGE 3600
+
+struct CIwHTTPDiskCache::Header
+{
+    uint32 m_magic;
+    uint32 m_version;
+    uint32 m_slots;
+    uint32 m_reserved;
+};
+
+struct CIwHTTPDiskCache::Slot
+{
+    uint64 m_hash;          // 0 if free
+    uint64 m_response_time;
+    uint64 m_initial_age;
+    uint64 m_lifetime;
+    uint64 m_used;          // When last used (UTC ms)
+    uint32 m_size;          // Of the file
+    uint32 m_flags;
+    uint32 m_check;         // Of everything above
+    uint32 m_reserved;
+};
+
+// At the end of each file, after the body, key, headers and Vary values
+struct Footer
+{
+    uint32 m_magic;
+    uint32 m_body_len;
+    uint32 m_key_len;
+    uint32 m_headers_len;
+    uint32 m_vary_len;
+    uint32 m_reserved;
+};
+
+bool CIwHTTPDiskCache::s_tried = false;
+std::string CIwHTTPDiskCache::s_dir;
+CIwHTTPDiskCache::Header* CIwHTTPDiskCache::s_index = NULL;
+CIwHTTPDiskCache::Slot* CIwHTTPDiskCache::s_slots = NULL;
+uint32 CIwHTTPDiskCache::s_index_size = 0;
+int CIwHTTPDiskCache::s_fd = -1;
+uint64 CIwHTTPDiskCache::s_bytes = 0;
+uint32 CIwHTTPDiskCache::s_temp = 0;
+
+static uint32 Checksum(const void *p, uint32 len)
+{
+    // FNV-1a
+    const uint8 *b = (const uint8 *)p;
+    uint32 h = 2166136261U;
+    for (uint32 i = 0; i < len; i++)
+        h = (h ^ b[i]) * 16777619U;
+    return h;
+}
+
+static bool WriteAll(int fd, const void *p, uint32 len)
+{
+    const char *b = (const char *)p;
+    while (len)
+    {
+        int ret = write(fd, b, len);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        b += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool LockFile(int fd)
+{
+    while (flock(fd, LOCK_EX))
+    {
+        if (errno != EINTR)
+        {
+            IwTrace(HTTP, ("(Failed to lock HTTP disk cache index: %d)", errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ReadAll(int fd, void *p, uint32 len, off_t offset)
+{
+    char *b = (char *)p;
+    while (len)
+    {
+        int ret = pread(fd, b, len, offset);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        b += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+bool CIwHTTPDiskCache::Open()
+{
+    if (s_index)
+        return true;
+
+    // Not configured, or failed, don't keep trying on every request..
+    if (s_tried)
+        return false;
+    s_tried = true;
+
+    char dir[S3E_CONFIG_STRING_MAX];
+    if (s3eConfigGetString("connection", "httpcachedir", dir) || !dir[0])
+        return false;
+
+    s_dir = dir;
+    if (s_dir[s_dir.size() - 1] != '/')
+        s_dir += '/';
+    mkdir(s_dir.c_str(), 0755);
+
+    int entries = 1024;
+    s3eConfigGetInt("connection", "httpcachediskentries", &entries);
+    entries = MAX(entries, SLOT_WAYS);
+
+    // The index is kept open, to be locked while it's used..
+    std::string path = s_dir + "index";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        IwTrace(HTTP, ("(Failed to open HTTP disk cache %s: %d)", path.c_str(), errno));
+        return false;
+    }
+
+    if (!LockFile(fd))
+    {
+        close(fd);
+        return false;
+    }
+
+    uint32 size = sizeof(Header) + entries * sizeof(Slot);
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size != (off_t)size)
+    {
+        // Made afresh, all zeroes..
+        if (ftruncate(fd, 0) || ftruncate(fd, size))
+        {
+            IwTrace(HTTP, ("(Failed to size HTTP disk cache index: %d)", errno));
+            close(fd);
+            return false;
+        }
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        IwTrace(HTTP, ("(Failed to map HTTP disk cache index: %d)", errno));
+        close(fd);
+        return false;
+    }
+
+    s_fd = fd;
+    s_index = (Header *)map;
+    s_slots = (Slot *)(s_index + 1);
+    s_index_size = size;
+
+    if (s_index->m_magic != INDEX_MAGIC || s_index->m_version != INDEX_VERSION || s_index->m_slots != (uint32)entries)
+    {
+        // Nothing it had can be found any more..
+        IwTrace(HTTP, ("(Starting HTTP disk cache in %s)", s_dir.c_str()));
+        memset(s_slots, 0, size - sizeof(Header));
+        s_index->m_magic = INDEX_MAGIC;
+        s_index->m_version = INDEX_VERSION;
+        s_index->m_slots = entries;
+        Sweep(true);
+    }
+    else
+        Sweep(false);
+
+    // Drop any slots torn by a crash part way through writing them..
+    s_bytes = 0;
+    for (uint32 i = 0; i < s_index->m_slots; i++)
+    {
+        Slot *slot = &s_slots[i];
+        if (!slot->m_hash)
+            continue;
+
+        if (slot->m_check != Checksum(slot, (char *)&slot->m_check - (char *)slot))
+            memset(slot, 0, sizeof(*slot));
+        else
+            s_bytes += slot->m_size;
+    }
+
+    IwTrace(HTTP, ("(HTTP disk cache: %u responses, %u bytes)", GetSize(), (uint32)s_bytes));
+    Unlock();
+    return true;
+}
+
+void CIwHTTPDiskCache::Close()
+{
+    if (s_index)
+    {
+        munmap(s_index, s_index_size);
+        s_index = NULL;
+        s_slots = NULL;
+    }
+
+    if (s_fd != -1)
+    {
+        close(s_fd);
+        s_fd = -1;
+    }
+
+    s_tried = false;
+    s_bytes = 0;
+}
+
+bool CIwHTTPDiskCache::Lock()
+{
+    // Other processes can share the directory, so the index is only used
+    // while it's locked..
+    if (!LockFile(s_fd))
+        return false;
+
+    // Made afresh at another size by a process configured differently,
+    // so what is mapped is no longer all there..
+    struct stat st;
+    if (fstat(s_fd, &st) || st.st_size != (off_t)s_index_size)
+    {
+        IwTrace(HTTP, ("(HTTP disk cache index has changed size)"));
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void CIwHTTPDiskCache::Unlock()
+{
+    flock(s_fd, LOCK_UN);
+}
+
+bool CIwHTTPDiskCache::IsStaleTemp(const char *name)
+{
+    // Named <hash>.tmp<pid>.<n>, so one whose process has gone is from a
+    // capture a crash cut short. Otherwise it may still be being written,
+    // unless it has been left untouched for a long time..
+    const char *tmp = strstr(name, ".tmp");
+    char *end;
+    unsigned long pid = strtoul(tmp + 4, &end, 10);
+    if (*end == '.' && pid && kill((pid_t)pid, 0) == -1 && errno == ESRCH)
+        return true;
+
+    struct stat st;
+    return !stat((s_dir + name).c_str(), &st) && time(NULL) - st.st_mtime > TEMP_MAX_AGE;
+}
+
+void CIwHTTPDiskCache::Sweep(bool all)
+{
+    DIR *dir = opendir(s_dir.c_str());
+    if (!dir)
+        return;
+
+    // Without an index no stored file will be found again..
+    while (struct dirent *entry = readdir(dir))
+    {
+        const char *name = entry->d_name;
+        uint32 hex = 0;
+        while (isxdigit(name[hex]))
+            hex++;
+
+        if (hex != 16)
+            continue;
+
+        if (strstr(name, ".tmp") ? IsStaleTemp(name) : (all && !name[hex]))
+            unlink((s_dir + name).c_str());
+    }
+
+    closedir(dir);
+}
+
+uint64 CIwHTTPDiskCache::Hash(const std::string &key)
+{
+    // FNV-1a, 0 being kept for free slots..
+    uint64 h = 14695981039346656037ULL;
+    for (uint32 i = 0; i < key.size(); i++)
+        h = (h ^ (uint8)key[i]) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+void CIwHTTPDiskCache::MakePath(std::string &path, uint64 hash)
+{
+    char name[20];
+    sprintf(name, "%08x%08x", (uint32)(hash >> 32), (uint32)hash);
+    path = s_dir + name;
+}
+
+CIwHTTPDiskCache::Slot* CIwHTTPDiskCache::Find(uint64 hash)
+{
+    uint32 n = s_index->m_slots;
+    for (uint32 i = 0; i < SLOT_WAYS; i++)
+    {
+        Slot *slot = &s_slots[(hash + i) % n];
+        if (slot->m_hash == hash)
+            return slot;
+    }
+    return NULL;
+}
+
+CIwHTTPDiskCache::Slot* CIwHTTPDiskCache::Claim(uint64 hash)
+{
+    Slot *slot = Find(hash);
+    if (slot)
+    {
+        // Its file has been replaced already..
+        s_bytes -= slot->m_size;
+        return slot;
+    }
+
+    // A free one, otherwise the least recently used..
+    uint32 n = s_index->m_slots;
+    Slot *oldest = NULL;
+    for (uint32 i = 0; i < SLOT_WAYS; i++)
+    {
+        slot = &s_slots[(hash + i) % n];
+        if (!slot->m_hash)
+            return slot;
+
+        if (!oldest || slot->m_used < oldest->m_used)
+            oldest = slot;
+    }
+
+    Clear(oldest);
+    return oldest;
+}
+
+void CIwHTTPDiskCache::Seal(Slot *slot)
+{
+    slot->m_check = Checksum(slot, (char *)&slot->m_check - (char *)slot);
+}
+
+void CIwHTTPDiskCache::Clear(Slot *slot)
+{
+    std::string path;
+    MakePath(path, slot->m_hash);
+    unlink(path.c_str());
+
+    s_bytes -= slot->m_size;
+    memset(slot, 0, sizeof(*slot));
+}
+
+void CIwHTTPDiskCache::Trim(uint64 max)
+{
+    // Other processes store and remove responses too, so count afresh..
+    s_bytes = 0;
+    for (uint32 i = 0; i < s_index->m_slots; i++)
+    {
+        if (s_slots[i].m_hash)
+            s_bytes += s_slots[i].m_size;
+    }
+
+    // Remove the least recently used until within the limit..
+    while (s_bytes > max)
+    {
+        Slot *oldest = NULL;
+        for (uint32 i = 0; i < s_index->m_slots; i++)
+        {
+            Slot *slot = &s_slots[i];
+            if (slot->m_hash && (!oldest || slot->m_used < oldest->m_used))
+                oldest = slot;
+        }
+
+        if (!oldest)
+            break;
+        Clear(oldest);
+    }
+}
+
+void CIwHTTPDiskCache::Create(const std::string &key, CIwHTTPCacheBody *pBody)
+{
+    if (!Open())
+        return;
+
+    int max = 33554432;
+    int entry = 8388608;
+    s3eConfigGetInt("connection", "httpcachedisksize", &max);
+    s3eConfigGetInt("connection", "httpcachediskentrysize", &entry);
+    if (max <= 0 || entry <= 0)
+        return;
+
+    std::string path;
+    MakePath(path, Hash(key));
+
+    // Unique to this process, which other processes can tell is running..
+    char suffix[32];
+    sprintf(suffix, ".tmp%u.%u", (uint32)getpid(), s_temp++);
+    path += suffix;
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        IwTrace(HTTP, ("(Failed to create %s: %d)", path.c_str(), errno));
+        return;
+    }
+
+    pBody->m_fd = fd;
+    pBody->m_file = path;
+    pBody->m_file_max = MIN(entry, max);
+}
+
+bool CIwHTTPDiskCache::Write(CIwHTTPCacheBody *pBody, const char *pData, uint32 len)
+{
+    if (WriteAll(pBody->m_fd, pData, len))
+        return true;
+
+    IwTrace(HTTP, ("(Failed to write %s: %d)", pBody->m_file.c_str(), errno));
+    Abandon(pBody);
+    return false;
+}
+
+void CIwHTTPDiskCache::Abandon(CIwHTTPCacheBody *pBody)
+{
+    close(pBody->m_fd);
+    unlink(pBody->m_file.c_str());
+
+    pBody->m_fd = -1;
+    pBody->m_file.clear();
+}
+
+void CIwHTTPDiskCache::Commit(const std::string &key, const std::string &headers, const std::string &vary, const CIwHTTPCacheFreshness &fresh, CIwHTTPCacheBody *pBody)
+{
+    if (pBody->m_fd == -1 || !Open())
+        return;
+
+    Footer f;
+    f.m_magic = FILE_MAGIC;
+    f.m_body_len = pBody->GetSize();
+    f.m_key_len = key.size();
+    f.m_headers_len = headers.size();
+    f.m_vary_len = vary.size();
+    f.m_reserved = 0;
+
+    // All of it must be on disk before it can be found..
+    int fd = pBody->m_fd;
+    if (!WriteAll(fd, key.data(), key.size()) || !WriteAll(fd, headers.data(), headers.size()) ||
+        !WriteAll(fd, vary.data(), vary.size()) || !WriteAll(fd, &f, sizeof(f)) || fsync(fd))
+    {
+        IwTrace(HTTP, ("(Failed to write %s: %d)", pBody->m_file.c_str(), errno));
+        Abandon(pBody);
+        return;
+    }
+
+    uint64 hash = Hash(key);
+    std::string path;
+    MakePath(path, hash);
+
+    close(fd);
+    pBody->m_fd = -1;
+
+    // The file and its slot change together under the lock, so another
+    // process never finds one not matching the other..
+    if (!Lock())
+    {
+        unlink(pBody->m_file.c_str());
+        pBody->m_file.clear();
+        return;
+    }
+
+    if (rename(pBody->m_file.c_str(), path.c_str()))
+    {
+        IwTrace(HTTP, ("(Failed to rename %s: %d)", pBody->m_file.c_str(), errno));
+        unlink(pBody->m_file.c_str());
+        pBody->m_file.clear();
+        Unlock();
+        return;
+    }
+    pBody->m_file.clear();
+
+    Slot *slot = Claim(hash);
+    slot->m_hash = hash;
+    slot->m_response_time = fresh.m_response_time;
+    slot->m_initial_age = fresh.m_initial_age;
+    slot->m_lifetime = fresh.m_lifetime;
+    slot->m_used = s3eTimerGetUTC();
+    slot->m_size = f.m_body_len + f.m_key_len + f.m_headers_len + f.m_vary_len + sizeof(f);
+    slot->m_flags = fresh.m_no_cache ? SLOT_NO_CACHE : 0;
+    Seal(slot);
+    s_bytes += slot->m_size;
+
+    IwTrace(HTTP, ("(HTTP disk cache: stored %s, %u bytes)", key.c_str(), f.m_body_len));
+
+    int max = 33554432;
+    s3eConfigGetInt("connection", "httpcachedisksize", &max);
+    Trim(MAX(max, 0));
+    Unlock();
+}
+
+bool CIwHTTPDiskCache::Lookup(const std::string &key, std::string &headers, std::string &vary, CIwHTTPCacheFreshness &fresh, CIwHTTPCacheBody *&pBody)
+{
+    if (!Open() || !Lock())
+        return false;
+
+    bool found = LookupInternal(key, headers, vary, fresh, pBody);
+    Unlock();
+    return found;
+}
+
+bool CIwHTTPDiskCache::LookupInternal(const std::string &key, std::string &headers, std::string &vary, CIwHTTPCacheFreshness &fresh, CIwHTTPCacheBody *&pBody)
+{
+    Slot *slot = Find(Hash(key));
+    if (!slot)
+        return false;
+
+    std::string path;
+    MakePath(path, slot->m_hash);
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        Clear(slot);
+        return false;
+    }
+
+    // The file must be the one the slot was written for..
+    Footer f;
+    struct stat st;
+    bool ok = !fstat(fd, &st) && st.st_size == (off_t)slot->m_size && slot->m_size >= sizeof(f) &&
+        ReadAll(fd, &f, sizeof(f), slot->m_size - sizeof(f)) && f.m_magic == FILE_MAGIC &&
+        (uint64)f.m_body_len + f.m_key_len + f.m_headers_len + f.m_vary_len + sizeof(f) == slot->m_size;
+
+    std::string meta;
+    if (ok)
+    {
+        meta.resize(f.m_key_len + f.m_headers_len + f.m_vary_len);
+        ok = meta.empty() || ReadAll(fd, &meta[0], meta.size(), f.m_body_len);
+    }
+
+    if (!ok)
+    {
+        IwTrace(HTTP, ("(HTTP disk cache: dropped damaged %s)", path.c_str()));
+        close(fd);
+        Clear(slot);
+        return false;
+    }
+
+    // Another key with the same hash..
+    if (meta.compare(0, f.m_key_len, key))
+    {
+        close(fd);
+        return false;
+    }
+
+    void *map = NULL;
+    if (f.m_body_len)
+    {
+        map = mmap(NULL, f.m_body_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            IwTrace(HTTP, ("(Failed to map %s: %d)", path.c_str(), errno));
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+
+    headers.assign(meta, f.m_key_len, f.m_headers_len);
+    vary.assign(meta, f.m_key_len + f.m_headers_len, f.m_vary_len);
+
+    fresh.m_response_time = slot->m_response_time;
+    fresh.m_initial_age = slot->m_initial_age;
+    fresh.m_lifetime = slot->m_lifetime;
+    fresh.m_no_cache = (slot->m_flags & SLOT_NO_CACHE) != 0;
+
+    pBody = new CIwHTTPCacheBody;
+    pBody->m_map = map;
+    pBody->m_size = f.m_body_len;
+    pBody->m_held = !map;
+
+    slot->m_used = s3eTimerGetUTC();
+    Seal(slot);
+
+    IwTrace(HTTP_VERBOSE, ("(HTTP disk cache: found %s)", key.c_str()));
+    return true;
+}
+
+void CIwHTTPDiskCache::Update(const std::string &key, const CIwHTTPCacheFreshness &fresh)
+{
+    if (!Open() || !Lock())
+        return;
+
+    Slot *slot = Find(Hash(key));
+    if (slot)
+    {
+        slot->m_response_time = fresh.m_response_time;
+        slot->m_initial_age = fresh.m_initial_age;
+        slot->m_lifetime = fresh.m_lifetime;
+        slot->m_flags = fresh.m_no_cache ? SLOT_NO_CACHE : 0;
+        slot->m_used = s3eTimerGetUTC();
+        Seal(slot);
+    }
+    Unlock();
+}
+
+void CIwHTTPDiskCache::Remove(const std::string &key)
+{
+    if (!Open() || !Lock())
+        return;
+
+    Slot *slot = Find(Hash(key));
+    if (slot)
+        Clear(slot);
+    Unlock();
+}
+
+void CIwHTTPDiskCache::Flush()
+{
+    if (!Open() || !Lock())
+        return;
+
+    for (uint32 i = 0; i < s_index->m_slots; i++)
+    {
+        if (s_slots[i].m_hash)
+            Clear(&s_slots[i]);
+    }
+    Unlock();
+}
+
+uint32 CIwHTTPDiskCache::GetSize()
+{
+    if (!s_index)
+        return 0;
+
+    uint32 count = 0;
+    for (uint32 i = 0; i < s_index->m_slots; i++)
+    {
+        if (s_slots[i].m_hash)
+            count++;
+    }
+    return count;
+}
+
+uint64 CIwHTTPDiskCache::GetBytes()
+{
+    return s_bytes;
+}
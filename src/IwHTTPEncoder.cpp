@@ -0,0 +1,275 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPEncoder.h"
+
+#include <string.h>
+
+#include "IwDebug.h"
+#include "IwMath.h"
+#include "s3eConfig.h"
+
+#ifdef IW_HTTP_ZLIB
+#include "zlib.h"
+#endif
+#ifdef IW_HTTP_ZSTD
+#include "zstd.h"
+
+// Higher levels want windows larger than servers need accept (RFC 8878)
+#define ZSTD_LEVEL_MAX 19
+#endif
+
+bool CIwHTTPEncoder::IsSupported(Coding coding)
+{
+    switch (coding)
+    {
+#ifdef IW_HTTP_ZLIB
+        case GZIP:
+            return true;
+#endif
+#ifdef IW_HTTP_ZSTD
+        case ZSTD:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+CIwHTTPEncoder* CIwHTTPEncoder::Create(Coding coding)
+{
+    if (!IsSupported(coding))
+        return NULL;
+
+    CIwHTTPEncoder *encoder = new CIwHTTPEncoder(coding);
+    if (!encoder->Init())
+    {
+        IwTrace(HTTP, ("(Failed to set up %s encoder)", encoder->GetName()));
+        delete encoder;
+        return NULL;
+    }
+
+    return encoder;
+}
+
+CIwHTTPEncoder::CIwHTTPEncoder(Coding coding) :
+    m_coding(coding),
+    m_stream(NULL),
+    m_end(false),
+    m_total_in(0),
+    m_total_out(0),
+    m_out_start(0),
+    m_out_end(0)
+{
+    int size = 16384;
+    s3eConfigGetInt("connection", "httpencodebuffersize", &size);
+    m_out_size = MAX(size, 1024);
+    m_out = new char[m_out_size];
+}
+
+CIwHTTPEncoder::~CIwHTTPEncoder()
+{
+    if (m_stream)
+    {
+        switch (m_coding)
+        {
+#ifdef IW_HTTP_ZLIB
+            case GZIP:
+                deflateEnd((z_stream *)m_stream);
+                delete (z_stream *)m_stream;
+                break;
+#endif
+#ifdef IW_HTTP_ZSTD
+            case ZSTD:
+                ZSTD_freeCCtx((ZSTD_CCtx *)m_stream);
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+
+    delete[] m_out;
+}
+
+const char* CIwHTTPEncoder::GetName() const
+{
+    switch (m_coding)
+    {
+        case GZIP:      return "gzip";
+        case ZSTD:      return "zstd";
+    }
+    return "";
+}
+
+bool CIwHTTPEncoder::Init()
+{
+    int level = 0;
+    s3eConfigGetInt("connection", "httpencodelevel", &level);
+
+    switch (m_coding)
+    {
+#ifdef IW_HTTP_ZLIB
+        case GZIP:
+        {
+            z_stream *z = new z_stream;
+            memset(z, 0, sizeof(*z));
+
+            level = level > 0 ? MIN(level, Z_BEST_COMPRESSION) : Z_DEFAULT_COMPRESSION;
+            if (deflateInit2(z, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                delete z;
+                return false;
+            }
+            m_stream = z;
+            return true;
+        }
+#endif
+#ifdef IW_HTTP_ZSTD
+        case ZSTD:
+        {
+            ZSTD_CCtx *c = ZSTD_createCCtx();
+            if (!c)
+                return false;
+
+            if (level > 0)
+                ZSTD_CCtx_setParameter(c, ZSTD_c_compressionLevel, MIN(level, ZSTD_LEVEL_MAX));
+            m_stream = c;
+            return true;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+void CIwHTTPEncoder::Reset()
+{
+    m_end = false;
+    m_total_in = m_total_out = 0;
+    m_out_start = m_out_end = 0;
+
+    switch (m_coding)
+    {
+#ifdef IW_HTTP_ZLIB
+        case GZIP:
+            deflateReset((z_stream *)m_stream);
+            break;
+#endif
+#ifdef IW_HTTP_ZSTD
+        case ZSTD:
+            ZSTD_CCtx_reset((ZSTD_CCtx *)m_stream, ZSTD_reset_session_only);
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+int32 CIwHTTPEncoder::Encode(const char *buf, uint32 len, bool finish)
+{
+    uint32 used = 0;
+    uint32 out = 0;
+
+    switch (m_coding)
+    {
+#ifdef IW_HTTP_ZLIB
+        case GZIP:
+        {
+            z_stream *z = (z_stream *)m_stream;
+            uint32 space = GetSpace();
+            z->next_in = (Bytef *)buf;
+            z->avail_in = len;
+            z->next_out = (Bytef *)&m_out[m_out_end];
+            z->avail_out = space;
+
+            int ret = deflate(z, finish ? Z_FINISH : Z_NO_FLUSH);
+            used = len - z->avail_in;
+            out = space - z->avail_out;
+
+            if (ret == Z_STREAM_END)
+                m_end = true;
+            else if (ret != Z_OK && ret != Z_BUF_ERROR)
+            {
+                IwTrace(HTTP, ("(Failed to encode gzip content: %s)", z->msg ? z->msg : "unknown error"));
+                return -1;
+            }
+            break;
+        }
+#endif
+#ifdef IW_HTTP_ZSTD
+        case ZSTD:
+        {
+            ZSTD_inBuffer zin = { buf, len, 0 };
+            ZSTD_outBuffer zout = { &m_out[m_out_end], GetSpace(), 0 };
+
+            size_t ret = ZSTD_compressStream2((ZSTD_CCtx *)m_stream, &zout, &zin, finish ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(ret))
+            {
+                IwTrace(HTTP, ("(Failed to encode zstd content: %s)", ZSTD_getErrorName(ret)));
+                return -1;
+            }
+            used = zin.pos;
+            out = zout.pos;
+
+            // Nothing left to flush of the last frame..
+            if (finish && !ret)
+                m_end = true;
+            break;
+        }
+#endif
+        default:
+            // Create makes none of these, there's no library for it..
+            used = len;
+            m_end = finish;
+            break;
+    }
+
+    m_out_end += out;
+    m_total_in += used;
+    m_total_out += out;
+
+    return used;
+}
+
+int32 CIwHTTPEncoder::Write(const char *buf, uint32 len)
+{
+    IwAssertMsg(HTTP, !m_end, ("Encoder written to after it was finished"));
+    return Encode(buf, len, false);
+}
+
+bool CIwHTTPEncoder::Finish()
+{
+    while (!m_end && GetSpace())
+    {
+        if (Encode(NULL, 0, true) < 0)
+            return false;
+    }
+
+    return true;
+}
+
+uint32 CIwHTTPEncoder::Peek(const char *&pData) const
+{
+    pData = &m_out[m_out_start];
+    return m_out_end - m_out_start;
+}
+
+void CIwHTTPEncoder::Consume(uint32 bytes)
+{
+    IwAssertMsg(HTTP, bytes <= m_out_end - m_out_start, ("Consuming more than was encoded"));
+    m_out_start += bytes;
+
+    // All gone, so the whole buffer is free again..
+    if (m_out_start == m_out_end)
+        m_out_start = m_out_end = 0;
+}
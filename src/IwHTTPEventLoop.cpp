@@ -0,0 +1,1345 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPEventLoop.h"
+#include "IwHTTPRing.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "IwDebug.h"
+#include "IwMath.h"
+#include "s3eConfig.h"
+#include "s3eDevice.h"
+
+#if defined(__linux__)
+
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+
+#include <map>
+#include <utility>
+#include <vector>
+
+// Events taken from the kernel per Run
+#define EVENTS_PER_WAIT 256
+
+// What a ring completion was for, in the low bits of its user data
+#define RING_READ 0
+#define RING_WRITE 1
+#define RING_FILE 2     // Reading an upload, linked to the send of it
+#define RING_CONNECT 3
+#define RING_OPS 3
+
+struct Watch
+{
+    int m_fd;
+    s3eSocket *m_pSocket;
+    s3eSocketCallbackFn m_read_fn;
+    void *m_read_data;
+    s3eSocketCallbackFn m_write_fn;
+    void *m_write_data;
+    bool m_readable;    // Edge seen since reading last blocked
+    bool m_writable;    // Edge seen since writing last blocked
+    bool m_posted;      // In s_posted
+
+    // With the ring, reads go into m_in and writes come from m_out, once
+    // they have been given a buffer..
+    char *m_in;
+    uint32 m_in_start;
+    uint32 m_in_end;
+    int m_in_error;
+    bool m_in_eof;
+    bool m_reading;
+    bool m_idle;        // The read in the ring is being cancelled
+    char *m_out;
+    uint32 m_out_len;
+    uint32 m_out_done;
+    int64 m_out_offset; // Where in a file m_out goes
+    int64 m_offset;     // Where in a file the next write goes, -1 if not known
+    int m_out_error;
+    bool m_writing;
+    bool m_connecting;
+    int m_connect_error;    // -1 if not connected through the ring
+    struct sockaddr_storage m_addr;
+    uint32 m_ops;       // Waiting for completions
+    bool m_closed;      // Only waiting for completions
+    bool m_file;        // Not a socket, so not in epoll
+};
+
+struct TimerKey
+{
+    uint64 m_due;
+    uint64 m_seq;   // Orders timers due together, newest last
+
+    bool operator<(const TimerKey &other) const
+    {
+        return m_due != other.m_due ? m_due < other.m_due : m_seq < other.m_seq;
+    }
+};
+
+struct Timer;
+typedef std::map<TimerKey, Timer> TimerQueue;
+typedef std::multimap<std::pair<s3eCallback, void*>, TimerQueue::iterator> TimerIndex;
+
+struct Timer
+{
+    s3eCallback m_fn;
+    void *m_data;
+    TimerIndex::iterator m_index;
+};
+
+typedef std::vector<std::pair<s3eCallback, void*> > CallbackList;
+
+// -1 not yet decided, 0 s3e, 1 native
+static int s_native = -1;
+static int s_epoll = -1;
+static int s_timerfd = -1;
+static int s_eventfd = -1;
+static std::vector<Watch*> s_watches;   // By fd
+static std::vector<int> s_posted;   // Fds with a callback ready
+static TimerQueue s_timers;
+static TimerIndex s_timer_index;
+static uint64 s_timer_seq = 0;
+static uint64 s_armed = 0;  // When the timerfd goes off, 0 if it doesn't
+static s3eThreadLock *s_queue_lock = NULL;
+static CallbackList s_queue;    // From other threads
+
+#ifdef IW_HTTP_IO_URING
+static CIwHTTPRing *s_ring = NULL;
+static char *s_buffers = (char *)MAP_FAILED;
+static uint32 s_buffer_size = 0;
+static uint32 s_buffer_count = 0;
+static bool s_fixed = false;    // Buffers registered with the ring
+static std::vector<char*> s_free_buffers;
+static std::vector<Watch*> s_closing;   // Closed, still in the ring
+
+static void OpenRing();
+static void CloseRing();
+static void Reap();
+static void Forget(Watch *w);
+#endif
+
+static void ArmTimer();
+static int32 RunTimers();
+static int32 RunQueued();
+static int32 RunPosted();
+
+static uint64 Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool Open()
+{
+    if (s_native != -1)
+        return s_native == 1;
+
+    s_native = 0;
+
+    int native = 0;
+    s3eConfigGetInt("connection", "httpepoll", &native);
+    if (!native)
+        return false;
+
+    s_epoll = epoll_create1(EPOLL_CLOEXEC);
+    s_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    s_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    s_queue_lock = s3eThreadAvailable() ? s3eThreadLockCreate() : NULL;
+
+    bool ok = s_epoll != -1 && s_timerfd != -1 && s_eventfd != -1;
+    for (int i = 0; ok && i < 2; i++)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = i ? s_eventfd : s_timerfd;
+        ok = epoll_ctl(s_epoll, EPOLL_CTL_ADD, ev.data.fd, &ev) == 0;
+    }
+
+    if (!ok)
+    {
+        IwTrace(HTTP, ("(Failed to start epoll loop: %d, using s3e)", errno));
+        CIwHTTPEventLoop::Terminate();
+        s_native = 0;
+        return false;
+    }
+
+    IwTrace(HTTP, ("(Using epoll loop)"));
+    s_native = 1;
+
+#ifdef IW_HTTP_IO_URING
+    OpenRing();
+#endif
+    return true;
+}
+
+bool CIwHTTPEventLoop::IsNative()
+{
+    return Open();
+}
+
+void CIwHTTPEventLoop::Terminate()
+{
+#ifdef IW_HTTP_IO_URING
+    CloseRing();
+#endif
+
+    for (uint32 i = 0; i < s_watches.size(); i++)
+        delete s_watches[i];
+    s_watches.clear();
+    s_posted.clear();
+    s_timers.clear();
+    s_timer_index.clear();
+    s_armed = 0;
+    s_queue.clear();
+
+    if (s_queue_lock)
+    {
+        s3eThreadLockDestroy(s_queue_lock);
+        s_queue_lock = NULL;
+    }
+
+    int *fds[] = { &s_epoll, &s_timerfd, &s_eventfd };
+    for (int i = 0; i < 3; i++)
+    {
+        if (*fds[i] != -1)
+        {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+
+    s_native = -1;
+}
+
+static Watch* GetWatch(int fd, s3eSocket *pSocket, bool create, bool poll = true)
+{
+    if (fd < 0)
+        return NULL;
+
+    if ((uint32)fd < s_watches.size() && s_watches[fd])
+        return s_watches[fd];
+
+    if (!create)
+        return NULL;
+
+    // Added the once, for both ways, until it is closed. Files are only
+    // ever written through the ring, so aren't added at all..
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (poll && epoll_ctl(s_epoll, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        IwTrace(HTTP, ("(Failed to add socket %d to epoll: %d)", fd, errno));
+        return NULL;
+    }
+
+    if ((uint32)fd >= s_watches.size())
+        s_watches.resize(fd + 1, NULL);
+
+    Watch *w = new Watch;
+    w->m_fd = fd;
+    w->m_pSocket = pSocket;
+    w->m_read_fn = NULL;
+    w->m_read_data = NULL;
+    w->m_write_fn = NULL;
+    w->m_write_data = NULL;
+    w->m_readable = false;
+    w->m_writable = false;
+    w->m_posted = false;
+    w->m_in = NULL;
+    w->m_in_start = 0;
+    w->m_in_end = 0;
+    w->m_in_error = 0;
+    w->m_in_eof = false;
+    w->m_reading = false;
+    w->m_idle = false;
+    w->m_out = NULL;
+    w->m_out_len = 0;
+    w->m_out_done = 0;
+    w->m_out_offset = 0;
+    w->m_offset = -1;
+    w->m_out_error = 0;
+    w->m_writing = false;
+    w->m_connecting = false;
+    w->m_connect_error = -1;
+    w->m_ops = 0;
+    w->m_closed = false;
+    w->m_file = !poll;
+    s_watches[fd] = w;
+    return w;
+}
+
+static void Post(Watch *w)
+{
+    if (!w->m_posted)
+    {
+        w->m_posted = true;
+        s_posted.push_back(w->m_fd);
+    }
+}
+
+#ifdef IW_HTTP_IO_URING
+static void OpenRing()
+{
+    int ring = 0;
+    s3eConfigGetInt("connection", "httpiouring", &ring);
+    if (!ring)
+        return;
+
+    int entries = 256;
+    int count = 64;
+    int size = 65536;
+    s3eConfigGetInt("connection", "httpringentries", &entries);
+    s3eConfigGetInt("connection", "httpringbuffers", &count);
+    s3eConfigGetInt("connection", "httpringbuffersize", &size);
+    entries = MAX(entries, 16);
+    s_buffer_count = MAX(count, 2);
+    s_buffer_size = (MAX(size, 4096) + 4095) & ~4095;
+
+    // Each buffer has at most a read or a send and the file read linked to
+    // it, and a cancel for each, waiting on completions..
+    s_ring = new CIwHTTPRing;
+    bool ok = s_ring->Open(entries, MAX((uint32)entries * 2, s_buffer_count * 4));
+    if (ok)
+    {
+        s_buffers = (char *)mmap(NULL, s_buffer_size * s_buffer_count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ok = s_buffers != MAP_FAILED;
+    }
+    if (ok)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = s_ring->GetFD();
+        ok = epoll_ctl(s_epoll, EPOLL_CTL_ADD, ev.data.fd, &ev) == 0;
+    }
+
+    if (!ok)
+    {
+        IwTrace(HTTP, ("(Not using io_uring: %d)", errno));
+        CloseRing();
+        return;
+    }
+
+    // Unregistered buffers still do, just with the pages looked up each time..
+    s_fixed = s_ring->RegisterBuffer(s_buffers, s_buffer_size * s_buffer_count);
+
+    for (uint32 i = s_buffer_count; i-- > 0; )
+        s_free_buffers.push_back(&s_buffers[i * s_buffer_size]);
+
+    IwTrace(HTTP, ("(Using io_uring, %u %sbuffers of %u)", s_buffer_count, s_fixed ? "registered " : "", s_buffer_size));
+}
+
+static void FreeWatch(Watch *w)
+{
+    if (w->m_in)
+        s_free_buffers.push_back(w->m_in);
+    if (w->m_out)
+        s_free_buffers.push_back(w->m_out);
+    delete w;
+}
+
+static void CloseRing()
+{
+    if (!s_ring)
+        return;
+
+    // The kernel mustn't be left reading into the buffers once they're
+    // gone, so everything in the ring is cancelled and seen through..
+    for (uint32 i = 0; i < s_watches.size(); i++)
+    {
+        if (s_watches[i] && s_watches[i]->m_ops)
+        {
+            Forget(s_watches[i]);
+            s_watches[i] = NULL;
+        }
+    }
+    while (!s_closing.empty() && s_ring->Submit(1) != -1)
+        Reap();
+
+    for (uint32 i = 0; i < s_closing.size(); i++)
+        delete s_closing[i];
+    s_closing.clear();
+
+    delete s_ring;
+    s_ring = NULL;
+
+    if (s_buffers != MAP_FAILED)
+    {
+        munmap(s_buffers, s_buffer_size * s_buffer_count);
+        s_buffers = (char *)MAP_FAILED;
+    }
+    s_free_buffers.clear();
+    s_fixed = false;
+}
+
+static struct io_uring_sqe* Prepare(Watch *w, int op, uint8 opcode, int fd, const void *pAddr, uint32 len, uint64 offset)
+{
+    struct io_uring_sqe *sqe = s_ring->GetSQE();
+    if (!sqe)
+        return NULL;
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)pAddr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t)w | op;
+    w->m_ops++;
+    return sqe;
+}
+
+static void Cancel(Watch *w, int op)
+{
+    // Its completion has no watch, so is ignored..
+    struct io_uring_sqe *sqe = s_ring->GetSQE();
+    if (sqe)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)w | op;
+    }
+}
+
+static void Forget(Watch *w)
+{
+    if (!w->m_ops)
+    {
+        FreeWatch(w);
+        return;
+    }
+
+    // The kernel holds on to the socket until what's in the ring is
+    // done, which for a read could be never..
+    w->m_closed = true;
+    w->m_read_fn = NULL;
+    w->m_write_fn = NULL;
+    s_closing.push_back(w);
+
+    if (w->m_reading)
+        Cancel(w, RING_READ);
+    if (w->m_writing)
+    {
+        Cancel(w, RING_FILE);
+        Cancel(w, RING_WRITE);
+    }
+    if (w->m_connecting)
+        Cancel(w, RING_CONNECT);
+}
+
+static Watch* GetRingWatch(int fd, bool write, bool socket)
+{
+    if (s_native != 1 || !s_ring)
+        return NULL;
+
+    Watch *w = GetWatch(fd, NULL, true, socket);
+    if (!w)
+        return NULL;
+
+    // Once given a buffer the watch keeps it, so reads or writes that
+    // have started through the ring stay there. Without one they go
+    // straight to the socket..
+    char *&buf = write ? w->m_out : w->m_in;
+    if (!buf)
+    {
+        if (s_free_buffers.empty())
+            return NULL;
+
+        buf = s_free_buffers.back();
+        s_free_buffers.pop_back();
+    }
+
+    return w;
+}
+
+static void ReleaseIn(Watch *w)
+{
+    // Read directly from now on, having a look first in case an edge was
+    // missed while the ring had it..
+    s_free_buffers.push_back(w->m_in);
+    w->m_in = NULL;
+    w->m_in_start = 0;
+    w->m_in_end = 0;
+    w->m_readable = true;
+}
+
+static bool SubmitRead(Watch *w)
+{
+    struct io_uring_sqe *sqe = Prepare(w, RING_READ, s_fixed ? IORING_OP_READ_FIXED : IORING_OP_RECV, w->m_fd, w->m_in, s_buffer_size, 0);
+    if (!sqe)
+        return false;
+
+    w->m_reading = true;
+    return true;
+}
+
+static bool SubmitWrite(Watch *w)
+{
+    // Sends rather than writes to sockets, so there's no SIGPIPE..
+    const char *pBuf = &w->m_out[w->m_out_done];
+    uint32 len = w->m_out_len - w->m_out_done;
+    struct io_uring_sqe *sqe;
+    if (!w->m_file)
+    {
+        sqe = Prepare(w, RING_WRITE, IORING_OP_SEND, w->m_fd, pBuf, len, 0);
+        if (sqe)
+            sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    else
+        sqe = Prepare(w, RING_WRITE, s_fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, w->m_fd, pBuf, len, w->m_out_offset + w->m_out_done);
+
+    if (!sqe)
+        return false;
+
+    w->m_writing = true;
+    w->m_writable = false;
+    return true;
+}
+
+static void Complete(const struct io_uring_cqe &cqe)
+{
+    Watch *w = (Watch *)(uintptr_t)(cqe.user_data & ~(uint64)RING_OPS);
+    if (!w)
+        return;
+
+    int op = (int)(cqe.user_data & RING_OPS);
+    int res = cqe.res;
+    w->m_ops--;
+
+    if (w->m_closed)
+    {
+        if (!w->m_ops)
+        {
+            for (uint32 i = 0; i < s_closing.size(); i++)
+            {
+                if (s_closing[i] == w)
+                {
+                    s_closing.erase(s_closing.begin() + i);
+                    break;
+                }
+            }
+            FreeWatch(w);
+        }
+        return;
+    }
+
+    switch (op)
+    {
+    case RING_READ:
+        w->m_reading = false;
+        if (w->m_idle)
+        {
+            // Anything it did read is kept, for the socket to be seen as
+            // stale..
+            w->m_idle = false;
+            if (res == -ECANCELED || res == -EINTR || res == -EAGAIN)
+            {
+                ReleaseIn(w);
+                break;
+            }
+        }
+        if (res > 0)
+        {
+            w->m_in_start = 0;
+            w->m_in_end = res;
+        }
+        else if (res == 0)
+            w->m_in_eof = true;
+        else if (res == -EAGAIN || res == -EINTR)
+            SubmitRead(w);
+        else
+            w->m_in_error = -res;
+        w->m_readable = w->m_in_end > w->m_in_start || w->m_in_eof || w->m_in_error;
+        break;
+
+    case RING_FILE:
+        // Short, so the send linked to it is cancelled..
+        if (res != (int)w->m_out_len)
+            w->m_out_error = res < 0 ? -res : EIO;
+        break;
+
+    case RING_WRITE:
+        if (res > 0)
+        {
+            w->m_out_done += res;
+            if (w->m_out_done < w->m_out_len && SubmitWrite(w))
+                break;
+        }
+        else if (!w->m_out_error)
+            w->m_out_error = res < 0 ? -res : EIO;
+        w->m_writing = false;
+        w->m_writable = true;
+        break;
+
+    case RING_CONNECT:
+        // Readable too, in case there's been an edge while connecting..
+        w->m_connecting = false;
+        w->m_connect_error = res < 0 ? -res : 0;
+        w->m_writable = true;
+        if (!w->m_in)
+            w->m_readable = true;
+        break;
+    }
+
+    if ((w->m_readable && w->m_read_fn) || (w->m_writable && w->m_write_fn))
+        Post(w);
+}
+
+static void Reap()
+{
+    struct io_uring_cqe cqe;
+    while (s_ring->GetCQE(cqe))
+        Complete(cqe);
+}
+#endif
+
+s3eResult CIwHTTPEventLoop::SocketReadable(int fd, s3eSocket *pSocket, s3eSocketCallbackFn fn, void *pUserData)
+{
+    if (!Open())
+        return s3eSocketReadable(pSocket, fn, pUserData);
+
+    Watch *w = GetWatch(fd, pSocket, fn != NULL);
+    if (!w)
+        return fn ? S3E_RESULT_ERROR : S3E_RESULT_SUCCESS;
+
+    w->m_pSocket = pSocket;
+    w->m_read_fn = fn;
+    w->m_read_data = pUserData;
+
+#ifdef IW_HTTP_IO_URING
+    // Read through the ring, so there has to be a read in it to wait on.
+    // Failing that it's read directly..
+    if (fn && w->m_in && !w->m_readable && !w->m_reading && !SubmitRead(w))
+        w->m_readable = true;
+#endif
+
+    // Nothing has said it would block since it last could be read..
+    if (fn && w->m_readable)
+        Post(w);
+
+    return S3E_RESULT_SUCCESS;
+}
+
+s3eResult CIwHTTPEventLoop::SocketWritable(int fd, s3eSocket *pSocket, s3eSocketCallbackFn fn, void *pUserData)
+{
+    if (!Open())
+        return s3eSocketWritable(pSocket, fn, pUserData);
+
+    Watch *w = GetWatch(fd, pSocket, fn != NULL);
+    if (!w)
+        return fn ? S3E_RESULT_ERROR : S3E_RESULT_SUCCESS;
+
+    w->m_pSocket = pSocket;
+    w->m_write_fn = fn;
+    w->m_write_data = pUserData;
+
+    if (fn && w->m_writable)
+        Post(w);
+
+    return S3E_RESULT_SUCCESS;
+}
+
+void CIwHTTPEventLoop::WouldBlock(int fd, bool write)
+{
+    if (s_native != 1)
+        return;
+
+    // Through the ring it's the completions that say..
+    Watch *w = GetWatch(fd, NULL, false);
+    if (!w || (write ? w->m_out : w->m_in) || w->m_connecting)
+        return;
+
+    if (write)
+        w->m_writable = false;
+    else
+        w->m_readable = false;
+}
+
+void CIwHTTPEventLoop::CloseSocket(int fd)
+{
+    Watch *w = s_native == 1 ? GetWatch(fd, NULL, false) : NULL;
+    if (w)
+    {
+        // Closing takes it out of the epoll set; a socket given the
+        // same fd starts afresh..
+        s_watches[fd] = NULL;
+#ifdef IW_HTTP_IO_URING
+        Forget(w);
+#else
+        delete w;
+#endif
+    }
+
+    close(fd);
+}
+
+void CIwHTTPEventLoop::CloseFile(int fd)
+{
+    CloseSocket(fd);
+}
+
+void CIwHTTPEventLoop::SocketIdle(int fd)
+{
+#ifdef IW_HTTP_IO_URING
+    Watch *w = s_native == 1 && s_ring ? GetWatch(fd, NULL, false) : NULL;
+    if (!w)
+        return;
+
+    // An idle socket shouldn't be holding buffers, or have a read waiting
+    // on it that would take whatever the server sends..
+    if (w->m_in && w->m_reading)
+    {
+        w->m_idle = true;
+        Cancel(w, RING_READ);
+    }
+    else if (w->m_in && w->m_in_end == w->m_in_start && !w->m_in_eof && !w->m_in_error)
+        ReleaseIn(w);
+
+    if (w->m_out && !w->m_writing && !w->m_out_error)
+    {
+        s_free_buffers.push_back(w->m_out);
+        w->m_out = NULL;
+        w->m_out_len = 0;
+        w->m_out_done = 0;
+        w->m_writable = true;
+    }
+#endif
+}
+
+int CIwHTTPEventLoop::Peek(int fd, char *pBuf, int len)
+{
+#ifdef IW_HTTP_IO_URING
+    // What the ring has read is looked at, but no read is started..
+    Watch *w = s_native == 1 ? GetWatch(fd, NULL, false) : NULL;
+    if (w && w->m_in)
+    {
+        if (w->m_in_end > w->m_in_start)
+        {
+            int n = MIN((uint32)len, w->m_in_end - w->m_in_start);
+            memcpy(pBuf, &w->m_in[w->m_in_start], n);
+            return n;
+        }
+
+        if (w->m_in_error)
+        {
+            errno = w->m_in_error;
+            return -1;
+        }
+
+        if (w->m_in_eof)
+            return 0;
+    }
+#endif
+
+    return recv(fd, pBuf, len, MSG_PEEK);
+}
+
+int CIwHTTPEventLoop::Recv(int fd, char *pBuf, int len, int flags)
+{
+#ifdef IW_HTTP_IO_URING
+    Watch *w = GetRingWatch(fd, false, true);
+    if (w)
+    {
+        if (w->m_in_end > w->m_in_start)
+        {
+            int n = MIN((uint32)len, w->m_in_end - w->m_in_start);
+            memcpy(pBuf, &w->m_in[w->m_in_start], n);
+            if (flags & MSG_PEEK)
+                return n;
+
+            // All taken, so read the next lot while this one is dealt with..
+            w->m_in_start += n;
+            if (w->m_in_start == w->m_in_end)
+            {
+                w->m_in_start = w->m_in_end = 0;
+                w->m_readable = false;
+                if (!w->m_in_eof && !w->m_in_error)
+                    SubmitRead(w);
+            }
+            return n;
+        }
+
+        if (w->m_in_error)
+        {
+            errno = w->m_in_error;
+            return -1;
+        }
+
+        if (w->m_in_eof)
+            return 0;
+
+        if (w->m_reading || SubmitRead(w))
+        {
+            w->m_readable = false;
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+#endif
+
+    return recv(fd, pBuf, len, flags);
+}
+
+int CIwHTTPEventLoop::Send(int fd, const char *pBuf, int len)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)pBuf;
+    iov.iov_len = len;
+    return SendMsg(fd, &iov, 1);
+}
+
+int CIwHTTPEventLoop::SendMsg(int fd, const struct iovec *iov, int n)
+{
+#ifdef IW_HTTP_IO_URING
+    Watch *w = GetRingWatch(fd, true, true);
+    if (w)
+    {
+        if (w->m_out_error)
+        {
+            errno = w->m_out_error;
+            return -1;
+        }
+
+        if (w->m_writing)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        // Taken as far as it fits, and sent from there..
+        uint32 len = 0;
+        for (int i = 0; i < n && len < s_buffer_size; i++)
+        {
+            uint32 part = MIN(iov[i].iov_len, s_buffer_size - len);
+            memcpy(&w->m_out[len], iov[i].iov_base, part);
+            len += part;
+        }
+
+        w->m_out_len = len;
+        w->m_out_done = 0;
+        if (!len || SubmitWrite(w))
+            return len;
+    }
+#endif
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = n;
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+int CIwHTTPEventLoop::SendFile(int fd, int file, off_t *pOffset, uint32 count)
+{
+#ifdef IW_HTTP_IO_URING
+    Watch *w = GetRingWatch(fd, true, true);
+    if (w)
+    {
+        if (w->m_out_error)
+        {
+            errno = w->m_out_error;
+            return -1;
+        }
+
+        if (w->m_writing)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        // The file is read into the buffer and sent from it, the send
+        // only going once the read has all it asked for..
+        if (s_ring->GetSpace() < 2)
+            s_ring->Submit();
+
+        if (s_ring->GetSpace() >= 2)
+        {
+            uint32 len = MIN(count, s_buffer_size);
+            struct io_uring_sqe *sqe = Prepare(w, RING_FILE, s_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, file, w->m_out, len, *pOffset);
+            sqe->flags |= IOSQE_IO_LINK;
+
+            w->m_out_len = len;
+            w->m_out_done = 0;
+            SubmitWrite(w);
+            *pOffset += len;
+            return len;
+        }
+    }
+#endif
+
+    return sendfile(fd, file, pOffset, count);
+}
+
+int CIwHTTPEventLoop::Write(int fd, const char *pBuf, int len)
+{
+#ifdef IW_HTTP_IO_URING
+    Watch *w = GetRingWatch(fd, true, false);
+    if (w)
+    {
+        if (w->m_out_error)
+        {
+            errno = w->m_out_error;
+            return -1;
+        }
+
+        if (w->m_writing)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if (!len)
+            return 0;
+
+        if (w->m_offset == -1)
+            w->m_offset = MAX(lseek(fd, 0, SEEK_CUR), 0);
+
+        w->m_out_len = MIN((uint32)len, s_buffer_size);
+        w->m_out_done = 0;
+        w->m_out_offset = w->m_offset;
+        memcpy(w->m_out, pBuf, w->m_out_len);
+        if (SubmitWrite(w))
+        {
+            w->m_offset += w->m_out_len;
+            return w->m_out_len;
+        }
+
+        int ret = pwrite(fd, pBuf, w->m_out_len, w->m_offset);
+        if (ret > 0)
+            w->m_offset += ret;
+        return ret;
+    }
+#endif
+
+    return write(fd, pBuf, len);
+}
+
+bool CIwHTTPEventLoop::IsWriting(int fd)
+{
+    Watch *w = s_native == 1 ? GetWatch(fd, NULL, false) : NULL;
+    return w && w->m_writing;
+}
+
+uint32 CIwHTTPEventLoop::GetRingBufferSize()
+{
+#ifdef IW_HTTP_IO_URING
+    if (Open() && s_ring)
+        return s_buffer_size;
+#endif
+    return 0;
+}
+
+s3eResult CIwHTTPEventLoop::Connect(int fd, s3eSocket *pSocket, const struct sockaddr *pAddr, socklen_t len, s3eSocketCallbackFn fn, void *pUserData)
+{
+#ifdef IW_HTTP_IO_URING
+    Watch *w = Open() && s_ring && len <= sizeof(struct sockaddr_storage) ? GetWatch(fd, pSocket, true) : NULL;
+    if (w && !w->m_connecting)
+    {
+        // The address has to stay put until the kernel is done with it..
+        memcpy(&w->m_addr, pAddr, len);
+        if (Prepare(w, RING_CONNECT, IORING_OP_CONNECT, fd, &w->m_addr, 0, len))
+        {
+            w->m_connecting = true;
+            w->m_readable = false;
+            w->m_writable = false;
+            w->m_pSocket = pSocket;
+            w->m_write_fn = fn;
+            w->m_write_data = pUserData;
+            return S3E_RESULT_SUCCESS;
+        }
+    }
+#endif
+
+    if (connect(fd, pAddr, len) == -1 && errno != EINPROGRESS && errno != EWOULDBLOCK)
+        return S3E_RESULT_ERROR;
+
+    // The outcome shows up as the socket becoming writable..
+    return SocketWritable(fd, pSocket, fn, pUserData);
+}
+
+int CIwHTTPEventLoop::GetConnectError(int fd)
+{
+    Watch *w = s_native == 1 ? GetWatch(fd, NULL, false) : NULL;
+    if (w && w->m_connect_error != -1)
+        return w->m_connect_error;
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+    return err;
+}
+
+s3eResult CIwHTTPEventLoop::SetTimer(uint32 ms, s3eCallback fn, void *pUserData)
+{
+    if (!Open())
+        return s3eTimerSetTimer(ms, fn, pUserData);
+
+    TimerKey key;
+    key.m_due = Now() + ms;
+    key.m_seq = s_timer_seq++;
+
+    Timer t;
+    t.m_fn = fn;
+    t.m_data = pUserData;
+    TimerQueue::iterator it = s_timers.insert(TimerQueue::value_type(key, t)).first;
+    it->second.m_index = s_timer_index.insert(TimerIndex::value_type(std::make_pair(fn, pUserData), it));
+
+    if (!s_armed || key.m_due < s_armed)
+        ArmTimer();
+
+    return S3E_RESULT_SUCCESS;
+}
+
+s3eResult CIwHTTPEventLoop::CancelTimer(s3eCallback fn, void *pUserData)
+{
+    if (!Open())
+        return s3eTimerCancelTimer(fn, pUserData);
+
+    // The timerfd is left as it is; going off early does no harm..
+    std::pair<TimerIndex::iterator, TimerIndex::iterator> range = s_timer_index.equal_range(std::make_pair(fn, pUserData));
+    for (TimerIndex::iterator it = range.first; it != range.second; ++it)
+        s_timers.erase(it->second);
+    s_timer_index.erase(range.first, range.second);
+
+    return S3E_RESULT_SUCCESS;
+}
+
+static void ArmTimer()
+{
+    uint64 due = s_timers.empty() ? 0 : s_timers.begin()->first.m_due;
+    if (due == s_armed)
+        return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = due / 1000;
+    its.it_value.tv_nsec = (due % 1000) * 1000000;
+    if (timerfd_settime(s_timerfd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+        s_armed = due;
+}
+
+s3eResult CIwHTTPEventLoop::EnqueueCallback(s3eThread *pThread, s3eCallback fn, void *pUserData)
+{
+    if (s_native != 1)
+        return s3eThreadEnqueueCallback(pThread, fn, pUserData);
+
+    if (s_queue_lock)
+        s3eThreadLockAcquire(s_queue_lock);
+    s_queue.push_back(std::make_pair(fn, pUserData));
+    if (s_queue_lock)
+        s3eThreadLockRelease(s_queue_lock);
+
+    uint64 one = 1;
+    if (write(s_eventfd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        return S3E_RESULT_ERROR;
+
+    return S3E_RESULT_SUCCESS;
+}
+
+int32 CIwHTTPEventLoop::Run(int32 ms)
+{
+    if (!Open())
+    {
+        s3eDeviceYield(ms);
+        return 0;
+    }
+
+#ifdef IW_HTTP_IO_URING
+    // Everything asked of the ring since the last Run goes in together..
+    if (s_ring)
+        s_ring->Submit();
+#endif
+
+    // Don't wait if there are callbacks ready already..
+    struct epoll_event events[EVENTS_PER_WAIT];
+    int n = epoll_wait(s_epoll, events, EVENTS_PER_WAIT, s_posted.empty() ? ms : 0);
+    if (n == -1 && errno != EINTR)
+        IwTrace(HTTP, ("(epoll_wait failed: %d)", errno));
+
+    bool timers = false;
+    bool queued = false;
+    for (int i = 0; i < n; i++)
+    {
+        int fd = events[i].data.fd;
+        uint32 ev = events[i].events;
+        if (fd == s_timerfd)
+        {
+            uint64 expirations;
+            if (read(s_timerfd, &expirations, sizeof(expirations)) > 0)
+                s_armed = 0;
+            timers = true;
+            continue;
+        }
+        if (fd == s_eventfd)
+        {
+            uint64 count;
+            read(s_eventfd, &count, sizeof(count));
+            queued = true;
+            continue;
+        }
+#ifdef IW_HTTP_IO_URING
+        if (s_ring && fd == s_ring->GetFD())
+            continue;
+#endif
+
+        Watch *w = GetWatch(fd, NULL, false);
+        if (!w || w->m_connecting)
+            continue;
+
+        // Errors and hangups are found out by reading or writing. Ways
+        // that go through the ring are left to its completions..
+        if ((ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !w->m_in)
+            w->m_readable = true;
+        if ((ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && !w->m_out)
+            w->m_writable = true;
+
+        if ((w->m_readable && w->m_read_fn) || (w->m_writable && w->m_write_fn))
+            Post(w);
+    }
+
+#ifdef IW_HTTP_IO_URING
+    // Its fd only says there's something to reap, so it isn't looked for..
+    if (s_ring)
+        Reap();
+#endif
+
+    int32 made = 0;
+    if (timers)
+        made += RunTimers();
+    if (queued)
+        made += RunQueued();
+    made += RunPosted();
+    return made;
+}
+
+static int32 RunTimers()
+{
+    // Timers set by these callbacks wait for the next Run, even if due..
+    uint64 now = Now();
+    uint64 seq = s_timer_seq;
+    int32 made = 0;
+    while (!s_timers.empty())
+    {
+        TimerQueue::iterator it = s_timers.begin();
+        if (it->first.m_due > now || it->first.m_seq >= seq)
+            break;
+
+        Timer t = it->second;
+        s_timer_index.erase(t.m_index);
+        s_timers.erase(it);
+
+        t.m_fn(NULL, t.m_data);
+        made++;
+    }
+
+    // Gone off, so it's for whatever is next..
+    ArmTimer();
+    return made;
+}
+
+static int32 RunQueued()
+{
+    CallbackList queue;
+    if (s_queue_lock)
+        s3eThreadLockAcquire(s_queue_lock);
+    queue.swap(s_queue);
+    if (s_queue_lock)
+        s3eThreadLockRelease(s_queue_lock);
+
+    for (uint32 i = 0; i < queue.size(); i++)
+        queue[i].first(NULL, queue[i].second);
+
+    return queue.size();
+}
+
+static int32 RunPosted()
+{
+    // Those posted by these callbacks wait for the next Run..
+    std::vector<int> posted;
+    posted.swap(s_posted);
+
+    int32 made = 0;
+    for (uint32 i = 0; i < posted.size(); i++)
+    {
+        // Each callback can close or wait on any socket, this one too..
+        Watch *w = GetWatch(posted[i], NULL, false);
+        if (!w || !w->m_posted)
+            continue;
+        w->m_posted = false;
+
+        if (w->m_readable && w->m_read_fn)
+        {
+            s3eSocketCallbackFn fn = w->m_read_fn;
+            w->m_read_fn = NULL;
+            fn(w->m_pSocket, NULL, w->m_read_data);
+            made++;
+
+            w = GetWatch(posted[i], NULL, false);
+            if (!w)
+                continue;
+        }
+
+        if (w->m_writable && w->m_write_fn)
+        {
+            s3eSocketCallbackFn fn = w->m_write_fn;
+            w->m_write_fn = NULL;
+            fn(w->m_pSocket, NULL, w->m_write_data);
+            made++;
+        }
+    }
+
+    return made;
+}
+
+#else
+
+// Elsewhere it's s3e's loop..
+
+#include <string.h>
+
+bool CIwHTTPEventLoop::IsNative()
+{
+    return false;
+}
+
+int32 CIwHTTPEventLoop::Run(int32 ms)
+{
+    s3eDeviceYield(ms);
+    return 0;
+}
+
+s3eResult CIwHTTPEventLoop::SocketReadable(int, s3eSocket *pSocket, s3eSocketCallbackFn fn, void *pUserData)
+{
+    return s3eSocketReadable(pSocket, fn, pUserData);
+}
+
+s3eResult CIwHTTPEventLoop::SocketWritable(int, s3eSocket *pSocket, s3eSocketCallbackFn fn, void *pUserData)
+{
+    return s3eSocketWritable(pSocket, fn, pUserData);
+}
+
+void CIwHTTPEventLoop::WouldBlock(int, bool)
+{
+}
+
+void CIwHTTPEventLoop::CloseSocket(int fd)
+{
+    close(fd);
+}
+
+void CIwHTTPEventLoop::CloseFile(int fd)
+{
+    close(fd);
+}
+
+void CIwHTTPEventLoop::SocketIdle(int)
+{
+}
+
+int CIwHTTPEventLoop::Peek(int fd, char *pBuf, int len)
+{
+    return recv(fd, pBuf, len, MSG_PEEK);
+}
+
+int CIwHTTPEventLoop::Recv(int fd, char *pBuf, int len, int flags)
+{
+    return recv(fd, pBuf, len, flags);
+}
+
+int CIwHTTPEventLoop::Send(int fd, const char *pBuf, int len)
+{
+#ifdef MSG_NOSIGNAL
+    return send(fd, pBuf, len, MSG_NOSIGNAL);
+#else
+    return send(fd, pBuf, len, 0);
+#endif
+}
+
+int CIwHTTPEventLoop::SendMsg(int fd, const struct iovec *iov, int n)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = n;
+#ifdef MSG_NOSIGNAL
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
+    return sendmsg(fd, &msg, 0);
+#endif
+}
+
+int CIwHTTPEventLoop::SendFile(int, int, off_t *, uint32)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int CIwHTTPEventLoop::Write(int fd, const char *pBuf, int len)
+{
+    return write(fd, pBuf, len);
+}
+
+bool CIwHTTPEventLoop::IsWriting(int)
+{
+    return false;
+}
+
+uint32 CIwHTTPEventLoop::GetRingBufferSize()
+{
+    return 0;
+}
+
+s3eResult CIwHTTPEventLoop::Connect(int fd, s3eSocket *pSocket, const struct sockaddr *pAddr, socklen_t len, s3eSocketCallbackFn fn, void *pUserData)
+{
+    if (connect(fd, pAddr, len) == -1 && errno != EINPROGRESS && errno != EWOULDBLOCK)
+        return S3E_RESULT_ERROR;
+
+    return s3eSocketWritable(pSocket, fn, pUserData);
+}
+
+int CIwHTTPEventLoop::GetConnectError(int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+    return err;
+}
+
+s3eResult CIwHTTPEventLoop::SetTimer(uint32 ms, s3eCallback fn, void *pUserData)
+{
+    return s3eTimerSetTimer(ms, fn, pUserData);
+}
+
+s3eResult CIwHTTPEventLoop::CancelTimer(s3eCallback fn, void *pUserData)
+{
+    return s3eTimerCancelTimer(fn, pUserData);
+}
+
+s3eResult CIwHTTPEventLoop::EnqueueCallback(s3eThread *pThread, s3eCallback fn, void *pUserData)
+{
+    return s3eThreadEnqueueCallback(pThread, fn, pUserData);
+}
+
+void CIwHTTPEventLoop::Terminate()
+{
+}
+
+#endif
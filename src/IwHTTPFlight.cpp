@@ -0,0 +1,219 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPFlight.h"
+#include "IwHTTP.h"
+#include "IwHTTPCache.h"
+
+#include "IwDebug.h"
+#include "s3eConfig.h"
+
+CIwHTTPFlight::FlightMap* CIwHTTPFlight::s_flights = NULL;
+
+CIwHTTPFlight::CIwHTTPFlight(const std::string &key, CIwHTTP *pLeader) :
+    m_key(key),
+    m_leader(pLeader),
+    m_content_length(0),
+    m_body(NULL),
+    m_open(true),
+    m_streamed(false),
+    m_complete(false),
+    m_failed(false),
+    m_overflowed(false)
+{
+}
+
+CIwHTTPFlight::~CIwHTTPFlight()
+{
+    Close();
+    if (m_body)
+        m_body->Release();
+}
+
+CIwHTTPFlight* CIwHTTPFlight::Join(const std::string &key, CIwHTTP *pHTTP)
+{
+    if (!s_flights)
+        s_flights = new FlightMap;
+
+    FlightMap::iterator it = s_flights->find(key);
+    if (it == s_flights->end())
+    {
+        CIwHTTPFlight *flight = new CIwHTTPFlight(key, pHTTP);
+        s_flights->insert(FlightMap::value_type(key, flight));
+        return flight;
+    }
+
+    CIwHTTPFlight *flight = it->second;
+    flight->m_followers.push_back(pHTTP);
+
+    // Already answered, so there's something to hand over now..
+    if (flight->IsReady())
+        pHTTP->WakeFlight();
+
+    return flight;
+}
+
+void CIwHTTPFlight::Leave(CIwHTTP *pHTTP)
+{
+    if (pHTTP == m_leader)
+    {
+        m_leader = NULL;
+        if (!IsReady() && !m_failed && !m_overflowed && !m_followers.empty())
+        {
+            // Someone else asks instead, starting afresh..
+            IwTrace(HTTP, ("(Handing request on to a joined one)"));
+            if (m_body)
+            {
+                m_body->Release();
+                m_body = NULL;
+            }
+            m_leader = m_followers.front();
+            m_followers.pop_front();
+            m_leader->WakeFlight();
+        }
+        else if (!m_complete && !m_failed && !m_overflowed)
+        {
+            if (IsReady())
+                IwTrace(HTTP, ("(Request given up part way through the body)"));
+            Fail();
+        }
+    }
+    else
+        m_followers.remove(pHTTP);
+
+    if (!m_leader && m_followers.empty())
+        delete this;
+}
+
+void CIwHTTPFlight::Answer(const std::string &headers, int32 content_length, CIwHTTPCacheBody *pBody)
+{
+    m_headers = headers;
+    m_content_length = content_length;
+
+    if (pBody)
+    {
+        pBody->AddRef();
+        m_body = pBody;
+        m_complete = true;
+        Close();
+    }
+    else
+    {
+        int max = 1048576;
+        s3eConfigGetInt("connection", "httpcoalescesize", &max);
+
+        m_body = new CIwHTTPCacheBody;
+        m_body->m_held_max = max > 0 ? max : 0;
+
+        // Nobody to feed, so nobody can join..
+        if (m_followers.empty())
+        {
+            m_complete = true;
+            Close();
+        }
+        else if (content_length > max)
+        {
+            Overflow();
+            return;
+        }
+        else if (content_length > 0)
+        {
+            // Handed out in place as it arrives, so it must never move..
+            m_body->m_data.reserve(content_length);
+            m_streamed = true;
+        }
+    }
+
+    if (!IsReady())
+        return;
+
+    IwTrace(HTTP_VERBOSE, ("(Answering %u joined requests)", GetFollowerCount()));
+    Wake();
+}
+
+void CIwHTTPFlight::Feed(const char *pData, uint32 len)
+{
+    if (!len || m_complete || m_failed || m_overflowed)
+        return;
+
+    // A streamed body has room for the length it was said to be, and
+    // no more..
+    if (m_streamed && m_body->GetSize() + len > (uint32)m_content_length)
+    {
+        IwTrace(HTTP, ("(Joined response is longer than its Content-Length)"));
+        Fail();
+        return;
+    }
+
+    if (!m_body->Append(pData, len))
+    {
+        Overflow();
+        return;
+    }
+
+    if (m_streamed)
+        Wake();
+}
+
+void CIwHTTPFlight::Complete()
+{
+    if (m_complete || m_failed || m_overflowed)
+        return;
+
+    m_complete = true;
+    Close();
+
+    if (!m_streamed)
+        IwTrace(HTTP_VERBOSE, ("(Answering %u joined requests)", GetFollowerCount()));
+    Wake();
+}
+
+void CIwHTTPFlight::Fail()
+{
+    m_failed = true;
+    Close();
+    Wake();
+}
+
+void CIwHTTPFlight::Overflow()
+{
+    // Nobody has had any of it, so each can ask for it themselves..
+    IwTrace(HTTP, ("(Response too big to share, sending %u joined requests)", GetFollowerCount()));
+    m_overflowed = true;
+    Close();
+    Wake();
+}
+
+void CIwHTTPFlight::Close()
+{
+    if (!m_open)
+        return;
+
+    m_open = false;
+    s_flights->erase(m_key);
+    if (s_flights->empty())
+    {
+        delete s_flights;
+        s_flights = NULL;
+    }
+}
+
+void CIwHTTPFlight::Wake()
+{
+    for (std::list<CIwHTTP*>::iterator it = m_followers.begin(); it != m_followers.end(); ++it)
+        (*it)->WakeFlight();
+}
+
+uint32 CIwHTTPFlight::GetSize()
+{
+    return s_flights ? s_flights->size() : 0;
+}
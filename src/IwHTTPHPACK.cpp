@@ -0,0 +1,552 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPHPACK.h"
+
+#include <string.h>
+
+#include "IwDebug.h"
+
+// Default size of either dynamic table, before SETTINGS say otherwise
+#define HPACK_TABLE_SIZE 4096
+
+// Each entry counts for this much more than its name and value
+#define HPACK_ENTRY_OVERHEAD 32
+
+// Longest string or biggest integer we accept from a peer
+#define HPACK_MAX_STRING 65536
+
+// The static table (RFC 7541 Appendix A), index 1 first
+static const char* const s_static[][2] =
+{
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+
+#define HPACK_STATIC_COUNT (sizeof(s_static) / sizeof(s_static[0]))
+
+// Huffman code lengths by symbol (RFC 7541 Appendix B), the last being
+// EOS. The code is canonical, so the codes themselves follow from these..
+static const uint8 s_huff_lengths[257] =
+{
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+#define HUFF_EOS 256
+#define HUFF_MAX_LENGTH 30
+
+static bool s_huff_init = false;
+static uint32 s_huff_codes[257];
+static uint32 s_huff_first[HUFF_MAX_LENGTH + 1];    // First code of each length
+static uint16 s_huff_count[HUFF_MAX_LENGTH + 1];    // Codes of each length
+static uint16 s_huff_offset[HUFF_MAX_LENGTH + 1];   // Where they start in..
+static uint16 s_huff_symbols[257];                  // ..the symbols by code
+
+CIwHTTPHPACK::CIwHTTPHPACK() :
+    m_encoder(HPACK_TABLE_SIZE),
+    m_decoder(HPACK_TABLE_SIZE),
+    m_size_update(false)
+{
+    HuffmanInit();
+}
+
+void CIwHTTPHPACK::Table::Add(const std::string &name, const std::string &value)
+{
+    // An entry too big for the table just empties it (RFC 7541 4.4)..
+    uint32 size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+    if (size > m_max_size)
+    {
+        Evict(m_max_size);
+        return;
+    }
+
+    Evict(size);
+
+    Header h;
+    h.m_name = name;
+    h.m_value = value;
+    m_entries.push_front(h);
+    m_size += size;
+}
+
+void CIwHTTPHPACK::Table::SetMaxSize(uint32 size)
+{
+    m_max_size = size;
+    Evict(0);
+}
+
+void CIwHTTPHPACK::Table::Evict(uint32 size)
+{
+    // Make room for size more bytes, oldest first..
+    while (!m_entries.empty() && m_size + size > m_max_size)
+    {
+        const Header &h = m_entries.back();
+        m_size -= h.m_name.size() + h.m_value.size() + HPACK_ENTRY_OVERHEAD;
+        m_entries.pop_back();
+    }
+}
+
+void CIwHTTPHPACK::SetEncoderTableSize(uint32 size)
+{
+    // We never want more than the default, but must go down to the limit..
+    uint32 use = size < HPACK_TABLE_SIZE ? size : HPACK_TABLE_SIZE;
+    if (use != m_encoder.GetMaxSize())
+    {
+        m_encoder.SetMaxSize(use);
+        m_size_update = true;
+    }
+}
+
+void CIwHTTPHPACK::BeginBlock(std::string &out)
+{
+    if (m_size_update)
+    {
+        m_size_update = false;
+        EncodeInteger(out, 0x20, 5, m_encoder.GetMaxSize());
+    }
+}
+
+bool CIwHTTPHPACK::GetEntry(uint32 index, std::string &name, std::string &value) const
+{
+    if (index == 0)
+        return false;
+
+    if (index <= HPACK_STATIC_COUNT)
+    {
+        name = s_static[index - 1][0];
+        value = s_static[index - 1][1];
+        return true;
+    }
+
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= m_decoder.GetCount())
+        return false;
+
+    name = m_decoder.Get(index).m_name;
+    value = m_decoder.Get(index).m_value;
+    return true;
+}
+
+int CIwHTTPHPACK::FindEncoded(const std::string &name, const std::string &value, bool &name_only) const
+{
+    // A full match anywhere wins, otherwise the first with the same name..
+    int found = 0;
+    name_only = true;
+
+    for (uint32 i = 0; i < HPACK_STATIC_COUNT; i++)
+    {
+        if (name != s_static[i][0])
+            continue;
+
+        if (value == s_static[i][1])
+        {
+            name_only = false;
+            return i + 1;
+        }
+
+        if (!found)
+            found = i + 1;
+    }
+
+    for (uint32 i = 0; i < m_encoder.GetCount(); i++)
+    {
+        const Header &h = m_encoder.Get(i);
+        if (h.m_name != name)
+            continue;
+
+        if (h.m_value == value)
+        {
+            name_only = false;
+            return HPACK_STATIC_COUNT + 1 + i;
+        }
+
+        if (!found)
+            found = HPACK_STATIC_COUNT + 1 + i;
+    }
+
+    return found;
+}
+
+bool CIwHTTPHPACK::ShouldIndex(const std::string &name, const std::string &value, bool &never)
+{
+    // Credentials mustn't be compressed along with guessable data, nor
+    // kept by intermediaries (RFC 7541 7.1)..
+    never = (name == "authorization" || name == "proxy-authorization" ||
+        (name == "cookie" && value.size() < 20));
+    if (never)
+        return false;
+
+    // These change with nearly every request, so would only push out
+    // entries that are of use..
+    return name != ":path" && name != "content-length" && name != "if-modified-since" &&
+        name != "if-none-match" && name != "range" &&
+        name.size() + value.size() + HPACK_ENTRY_OVERHEAD <= HPACK_TABLE_SIZE / 4;
+}
+
+void CIwHTTPHPACK::Encode(std::string &out, const std::string &name, const std::string &value)
+{
+    bool name_only;
+    int index = FindEncoded(name, value, name_only);
+
+    if (index && !name_only)
+    {
+        // Indexed header field..
+        EncodeInteger(out, 0x80, 7, index);
+        return;
+    }
+
+    bool never;
+    bool add = ShouldIndex(name, value, never) && m_encoder.GetMaxSize() > 0;
+
+    // Literal, with incremental indexing, never indexed or without indexing..
+    if (add)
+        EncodeInteger(out, 0x40, 6, index);
+    else
+        EncodeInteger(out, never ? 0x10 : 0x00, 4, index);
+
+    if (!index)
+        EncodeString(out, name);
+    EncodeString(out, value);
+
+    if (add)
+        m_encoder.Add(name, value);
+}
+
+bool CIwHTTPHPACK::Decode(const uint8 *data, uint32 len, HeaderList &headers)
+{
+    const uint8 *p = data;
+    const uint8 *end = data + len;
+    bool first = true;
+
+    while (p < end)
+    {
+        uint8 b = *p;
+        uint32 index;
+
+        if (b & 0x80)
+        {
+            // Indexed header field..
+            if (!DecodeInteger(p, end, 7, index))
+                return false;
+
+            Header h;
+            if (!GetEntry(index, h.m_name, h.m_value))
+            {
+                IwTrace(HTTP, ("(HPACK index %u out of range)", index));
+                return false;
+            }
+            headers.push_back(h);
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            // Dynamic table size update, only at the start of a block..
+            if (!first || !DecodeInteger(p, end, 5, index) || index > HPACK_TABLE_SIZE)
+                return false;
+
+            m_decoder.SetMaxSize(index);
+            continue;
+        }
+        else
+        {
+            // A literal, the name indexed or given..
+            bool add = (b & 0xc0) == 0x40;
+            if (!DecodeInteger(p, end, add ? 6 : 4, index))
+                return false;
+
+            Header h;
+            std::string value;
+            if (index)
+            {
+                if (!GetEntry(index, h.m_name, value))
+                {
+                    IwTrace(HTTP, ("(HPACK index %u out of range)", index));
+                    return false;
+                }
+            }
+            else if (!DecodeString(p, end, h.m_name))
+                return false;
+
+            if (!DecodeString(p, end, h.m_value))
+                return false;
+
+            if (add)
+                m_decoder.Add(h.m_name, h.m_value);
+            headers.push_back(h);
+        }
+
+        first = false;
+    }
+
+    return true;
+}
+
+void CIwHTTPHPACK::EncodeInteger(std::string &out, uint8 first, uint32 prefix, uint32 value)
+{
+    // RFC 7541 5.1: the prefix holds small values, bigger ones carry on
+    // 7 bits at a time..
+    uint32 max = (1 << prefix) - 1;
+    if (value < max)
+    {
+        out += (char)(first | value);
+        return;
+    }
+
+    out += (char)(first | max);
+    value -= max;
+    while (value >= 0x80)
+    {
+        out += (char)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+bool CIwHTTPHPACK::DecodeInteger(const uint8 *&p, const uint8 *end, uint32 prefix, uint32 &value)
+{
+    if (p >= end)
+        return false;
+
+    uint32 max = (1 << prefix) - 1;
+    value = *p++ & max;
+    if (value < max)
+        return true;
+
+    for (uint32 shift = 0; p < end; shift += 7)
+    {
+        // Padding with empty continuation bytes mustn't shift past 32 bits..
+        if (shift > 28)
+            return false;
+
+        uint8 b = *p++;
+        value += (uint32)(b & 0x7f) << shift;
+        if (value > HPACK_MAX_STRING)
+            return false;
+
+        if (!(b & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+void CIwHTTPHPACK::EncodeString(std::string &out, const std::string &str)
+{
+    uint32 huff = HuffmanLength(str);
+    if (huff < str.size())
+    {
+        EncodeInteger(out, 0x80, 7, huff);
+        HuffmanEncode(out, str);
+    }
+    else
+    {
+        EncodeInteger(out, 0x00, 7, str.size());
+        out += str;
+    }
+}
+
+bool CIwHTTPHPACK::DecodeString(const uint8 *&p, const uint8 *end, std::string &str)
+{
+    if (p >= end)
+        return false;
+
+    bool huff = (*p & 0x80) != 0;
+    uint32 len;
+    if (!DecodeInteger(p, end, 7, len) || len > (uint32)(end - p))
+        return false;
+
+    const uint8 *s = p;
+    p += len;
+
+    if (huff)
+        return HuffmanDecode(s, len, str);
+
+    str.assign((const char *)s, len);
+    return true;
+}
+
+void CIwHTTPHPACK::HuffmanInit()
+{
+    if (s_huff_init)
+        return;
+
+    // Count the codes of each length..
+    memset(s_huff_count, 0, sizeof(s_huff_count));
+    for (uint32 i = 0; i <= HUFF_EOS; i++)
+        s_huff_count[s_huff_lengths[i]]++;
+
+    // ..so each length's first code and place in the symbol list follow..
+    uint32 code = 0;
+    uint32 offset = 0;
+    for (uint32 len = 1; len <= HUFF_MAX_LENGTH; len++)
+    {
+        s_huff_first[len] = code;
+        s_huff_offset[len] = offset;
+        code = (code + s_huff_count[len]) << 1;
+        offset += s_huff_count[len];
+    }
+
+    // ..then codes go to symbols in order within each length
+    uint32 next[HUFF_MAX_LENGTH + 1];
+    memcpy(next, s_huff_first, sizeof(next));
+    for (uint32 i = 0; i <= HUFF_EOS; i++)
+    {
+        uint32 len = s_huff_lengths[i];
+        s_huff_codes[i] = next[len];
+        s_huff_symbols[s_huff_offset[len] + next[len] - s_huff_first[len]] = i;
+        next[len]++;
+    }
+
+    IwAssertMsg(HTTP, s_huff_codes[HUFF_EOS] == 0x3fffffff, ("HPACK Huffman code built wrongly"));
+    s_huff_init = true;
+}
+
+uint32 CIwHTTPHPACK::HuffmanLength(const std::string &str)
+{
+    uint32 bits = 0;
+    for (uint32 i = 0; i < str.size(); i++)
+        bits += s_huff_lengths[(uint8)str[i]];
+
+    return (bits + 7) / 8;
+}
+
+void CIwHTTPHPACK::HuffmanEncode(std::string &out, const std::string &str)
+{
+    uint64 acc = 0;
+    uint32 bits = 0;
+
+    for (uint32 i = 0; i < str.size(); i++)
+    {
+        uint8 c = (uint8)str[i];
+        acc = (acc << s_huff_lengths[c]) | s_huff_codes[c];
+        bits += s_huff_lengths[c];
+
+        while (bits >= 8)
+        {
+            bits -= 8;
+            out += (char)(acc >> bits);
+        }
+    }
+
+    // Pad with the start of EOS, which is all ones..
+    if (bits)
+        out += (char)((acc << (8 - bits)) | (0xff >> bits));
+}
+
+bool CIwHTTPHPACK::HuffmanDecode(const uint8 *p, uint32 len, std::string &str)
+{
+    // Canonical decoding, a bit at a time: a code of a given length is one
+    // of that length's if it's no less than the first of them..
+    str.clear();
+    uint32 code = 0;
+    uint32 bits = 0;
+
+    for (uint32 i = 0; i < len; i++)
+    {
+        for (int b = 7; b >= 0; b--)
+        {
+            code = (code << 1) | ((p[i] >> b) & 1);
+            bits++;
+
+            uint32 n = code - s_huff_first[bits];
+            if (n < s_huff_count[bits])
+            {
+                uint32 sym = s_huff_symbols[s_huff_offset[bits] + n];
+                if (sym == HUFF_EOS)
+                    return false;
+
+                str += (char)sym;
+                code = 0;
+                bits = 0;
+            }
+            else if (bits == HUFF_MAX_LENGTH)
+                return false;
+        }
+    }
+
+    // What's left must be padding, at most 7 bits of EOS..
+    return bits <= 7 && code == (1u << bits) - 1;
+}
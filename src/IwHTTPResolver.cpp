@@ -0,0 +1,390 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPResolver.h"
+#include "IwHTTPDNSCache.h"
+#include "IwHTTPEventLoop.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "IwDebug.h"
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+CIwHTTPResolver::LookupMap* CIwHTTPResolver::s_lookups = NULL;
+std::list<CIwHTTPResolver::Lookup *>* CIwHTTPResolver::s_jobs = NULL;
+s3eThreadLock* CIwHTTPResolver::s_lock = NULL;  //never gets destroyed, but delay init
+s3eThreadSem* CIwHTTPResolver::s_jobSem = NULL;
+s3eThread* CIwHTTPResolver::s_mainThread = NULL;
+s3eThread** CIwHTTPResolver::s_workers = NULL;
+int CIwHTTPResolver::s_numWorkers = 0;
+int CIwHTTPResolver::s_family = AF_UNSPEC;
+bool CIwHTTPResolver::s_terminate = false;
+bool CIwHTTPResolver::s_bLookupInProgress = false;
+bool CIwHTTPResolver::s_bIssueTimer = false;
+
+void CIwHTTPResolver::Lock()
+{
+    if (s_lock != NULL)
+        s3eThreadLockAcquire(s_lock);
+}
+
+void CIwHTTPResolver::Unlock()
+{
+    if (s_lock != NULL)
+        s3eThreadLockRelease(s_lock);
+}
+
+CIwHTTPResolver::Waiter* CIwHTTPResolver::Resolve(const char *host, s3eCallback callback, void *userData)
+{
+    if (!host || !*host)
+        return NULL;
+
+    if (!s_lookups)
+    {
+        s_lookups = new LookupMap;
+        s_jobs = new std::list<Lookup *>;
+        if (s3eThreadAvailable())
+            s_lock = s3eThreadLockCreate();
+    }
+
+    Lookup *lookup;
+    LookupMap::iterator it = s_lookups->find(host);
+    if (it != s_lookups->end())
+    {
+        // Someone is already looking this one up..
+        IwTrace(HTTP_VERBOSE, ("(Joining lookup of %s)", host));
+        lookup = it->second;
+    }
+    else
+    {
+        lookup = new Lookup;
+        lookup->m_host = host;
+        memset(&lookup->m_inet, 0, sizeof(lookup->m_inet));
+        s_lookups->insert(LookupMap::value_type(lookup->m_host, lookup));
+
+        Lock();
+        s_jobs->push_back(lookup);
+        Unlock();
+
+        if (StartWorkers())
+            s3eThreadSemPost(s_jobSem);
+        else
+            Issue();
+    }
+
+    Waiter *w = new Waiter;
+    w->m_lookup = lookup;
+    w->m_callback = callback;
+    w->m_userData = userData;
+    w->m_it = lookup->m_waiters.insert(lookup->m_waiters.end(), w);
+
+    return w;
+}
+
+void CIwHTTPResolver::Cancel(Waiter *waiter)
+{
+    if (!waiter)
+        return;
+
+    // The lookup itself carries on; its result still goes in the cache..
+    waiter->m_lookup->m_waiters.erase(waiter->m_it);
+    delete waiter;
+}
+
+bool CIwHTTPResolver::StartWorkers()
+{
+    if (s_numWorkers)
+        return true;
+
+    if (!s3eThreadAvailable() || s_lock == NULL)
+        return false;
+
+    int num = 4;
+    s3eConfigGetInt("connection", "httpdnsthreads", &num);
+    if (num <= 0)
+        return false;
+
+    int ipv6 = 1;
+    s3eConfigGetInt("connection", "httpipv6", &ipv6);
+    s_family = ipv6 ? AF_UNSPEC : AF_INET;
+
+    // Results are handed back through whichever loop this thread runs..
+    s_mainThread = s3eThreadGetCurrent();
+    CIwHTTPEventLoop::IsNative();
+    s_jobSem = s3eThreadSemCreate(0);
+    if (!s_jobSem)
+        return false;
+
+    s_terminate = false;
+    s_workers = new s3eThread*[num];
+    for (int i = 0; i < num; i++)
+    {
+        s3eThread *t = s3eThreadCreate(WorkerMain, NULL, NULL);
+        if (!t)
+            break;
+        s_workers[s_numWorkers++] = t;
+    }
+
+    if (!s_numWorkers)
+    {
+        IwTrace(HTTP, ("(Failed to start DNS threads, resolving serially)"));
+        delete[] s_workers;
+        s_workers = NULL;
+        s3eThreadSemDestroy(s_jobSem);
+        s_jobSem = NULL;
+        return false;
+    }
+
+    IwTrace(HTTP, ("(Started %d DNS threads)", s_numWorkers));
+    return true;
+}
+
+void* CIwHTTPResolver::WorkerMain(void *)
+{
+    while (true)
+    {
+        // Wake up now and again to check for termination..
+        if (s3eThreadSemWait(s_jobSem, 1000) != S3E_RESULT_SUCCESS && !s_terminate)
+            continue;
+
+        Lock();
+        Lookup *job = NULL;
+        if (!s_terminate && !s_jobs->empty())
+        {
+            job = s_jobs->front();
+            s_jobs->pop_front();
+        }
+        bool quit = s_terminate;
+        Unlock();
+
+        if (quit)
+            break;
+
+        if (!job)
+            continue;
+
+        // Only this thread touches the job until it's handed back..
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = s_family;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo *res = NULL;
+        if (getaddrinfo(job->m_host.c_str(), NULL, &hints, &res) == 0)
+        {
+            for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+            {
+                if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) ||
+                    ai->ai_addrlen > sizeof(struct sockaddr_storage))
+                    continue;
+
+                CIwHTTPAddress addr;
+                memset(&addr.m_addr, 0, sizeof(addr.m_addr));
+                memcpy(&addr.m_addr, ai->ai_addr, ai->ai_addrlen);
+                addr.m_len = ai->ai_addrlen;
+
+                if (std::find(job->m_addrs.begin(), job->m_addrs.end(), addr) == job->m_addrs.end())
+                    job->m_addrs.push_back(addr);
+            }
+            Interleave(job->m_addrs);
+        }
+
+        if (res)
+            freeaddrinfo(res);
+
+        CIwHTTPEventLoop::EnqueueCallback(s_mainThread, CompleteCallback, job);
+    }
+
+    return NULL;
+}
+
+void CIwHTTPResolver::Issue()
+{
+    // On platforms with true async DNS via a thread s3eInetLookup can
+    // have called it's callback before returning. If you issue the next
+    // lookup during that callback the lookup ID's can get out of sync
+    // and lookups will fail thereafter. Doing the lookup on the next
+    // yield fixes this at the module level.
+    // Only seen on iPhone so far.
+    if (!s_bIssueTimer)
+    {
+        s_bIssueTimer = true;
+        CIwHTTPEventLoop::SetTimer(0, IssueCallback, NULL);
+    }
+}
+
+int32 CIwHTTPResolver::IssueCallback(void *, void *)
+{
+    s_bIssueTimer = false;
+
+    if (s_bLookupInProgress)
+        return 0;
+
+    // The lookup in progress stays at the front until it completes..
+    Lock();
+    Lookup *job = s_jobs->empty() ? NULL : s_jobs->front();
+    Unlock();
+
+    if (!job)
+        return 0;
+
+    // s3eInetLookup knows nothing of IPv6, so deal with literals here..
+    CIwHTTPAddress literal;
+    if (literal.Parse(job->m_host.c_str()))
+    {
+        job->m_addrs.push_back(literal);
+        s_bLookupInProgress = true;
+        InetLookupCallback(NULL, job);
+        return 0;
+    }
+
+    s_bLookupInProgress =
+        (s3eInetLookup(job->m_host.c_str(), &job->m_inet, InetLookupCallback, job) == S3E_RESULT_SUCCESS);
+
+    if (!s_bLookupInProgress)
+    {
+        IwTrace(HTTP, ("DNS lookup failed"));
+        // Failed to even start the lookup, inform immediately..
+        InetLookupCallback(NULL, job);
+    }
+
+    return 0;
+}
+
+int32 CIwHTTPResolver::InetLookupCallback(void *pSysData, void *pUserData)
+{
+    Lookup *job = (Lookup *)pUserData;
+    s_bLookupInProgress = false;
+
+    Lock();
+    IwAssert(HTTP, !s_jobs->empty() && s_jobs->front() == job);
+    s_jobs->pop_front();
+    Unlock();
+
+    if (pSysData)
+    {
+        CIwHTTPAddress addr;
+        addr.Set(job->m_inet);
+        job->m_addrs.push_back(addr);
+    }
+    Complete(job);
+
+    // Need to keep DNS running..
+    Issue();
+
+    return S3E_RESULT_SUCCESS;
+}
+
+int32 CIwHTTPResolver::CompleteCallback(void *, void *pUserData)
+{
+    Complete((Lookup *)pUserData);
+    return 0;
+}
+
+void CIwHTTPResolver::Complete(Lookup *lookup)
+{
+    IwTrace(HTTP_VERBOSE, ("(Resolved %s: %d addresses)", lookup->m_host.c_str(), (int)lookup->m_addrs.size()));
+
+    bool ok = !lookup->m_addrs.empty();
+    s_lookups->erase(lookup->m_host);
+    CIwHTTPDNSCache::Store(lookup->m_host.c_str(), ok ? &lookup->m_addrs : NULL);
+
+    // A callback may well cancel other waiters on this lookup, so take
+    // them off one at a time..
+    while (!lookup->m_waiters.empty())
+    {
+        Waiter *w = lookup->m_waiters.front();
+        lookup->m_waiters.pop_front();
+
+        s3eCallback callback = w->m_callback;
+        void *userData = w->m_userData;
+        delete w;
+
+        callback(ok ? &lookup->m_addrs : NULL, userData);
+    }
+
+    delete lookup;
+}
+
+void CIwHTTPResolver::Interleave(CIwHTTPAddressList &addrs)
+{
+    // Keep the system's preferences within each family, but alternate
+    // between families starting with the preferred one (RFC 8305 4)..
+    if (addrs.size() < 3)
+        return;
+
+    int first = addrs[0].GetFamily();
+    CIwHTTPAddressList a, b;
+    for (uint32 i = 0; i < addrs.size(); i++)
+        (addrs[i].GetFamily() == first ? a : b).push_back(addrs[i]);
+
+    addrs.clear();
+    for (uint32 i = 0; i < a.size() || i < b.size(); i++)
+    {
+        if (i < a.size())
+            addrs.push_back(a[i]);
+        if (i < b.size())
+            addrs.push_back(b[i]);
+    }
+}
+
+void CIwHTTPResolver::Terminate()
+{
+    if (!s_numWorkers)
+        return;
+
+    Lock();
+    s_terminate = true;
+    Unlock();
+
+    for (int i = 0; i < s_numWorkers; i++)
+        s3eThreadSemPost(s_jobSem);
+
+    for (int i = 0; i < s_numWorkers; i++)
+        s3eThreadJoin(s_workers[i], NULL);
+
+    delete[] s_workers;
+    s_workers = NULL;
+    s_numWorkers = 0;
+    s3eThreadSemDestroy(s_jobSem);
+    s_jobSem = NULL;
+
+    // Whatever never got started fails, without the failure being
+    // cached. As in Complete a callback may cancel other waiters..
+    while (!s_jobs->empty())
+    {
+        Lookup *lookup = s_jobs->front();
+        s_jobs->pop_front();
+        s_lookups->erase(lookup->m_host);
+
+        while (!lookup->m_waiters.empty())
+        {
+            Waiter *w = lookup->m_waiters.front();
+            lookup->m_waiters.pop_front();
+
+            s3eCallback callback = w->m_callback;
+            void *userData = w->m_userData;
+            delete w;
+
+            callback(NULL, userData);
+        }
+        delete lookup;
+    }
+}
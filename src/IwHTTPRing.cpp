@@ -0,0 +1,229 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPRing.h"
+
+#ifdef IW_HTTP_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "IwDebug.h"
+
+CIwHTTPRing::CIwHTTPRing() :
+    m_fd(-1),
+    m_sq_map(MAP_FAILED),
+    m_sq_map_size(0),
+    m_cq_map(MAP_FAILED),
+    m_cq_map_size(0),
+    m_sqes((struct io_uring_sqe *)MAP_FAILED),
+    m_sqes_size(0),
+    m_sq_head(NULL),
+    m_sq_tail(NULL),
+    m_sq_array(NULL),
+    m_sq_flags(NULL),
+    m_sq_mask(0),
+    m_sq_entries(0),
+    m_queued(0),
+    m_cq_head(NULL),
+    m_cq_tail(NULL),
+    m_cq_mask(0),
+    m_cqes(NULL)
+{
+}
+
+CIwHTTPRing::~CIwHTTPRing()
+{
+    Close();
+}
+
+bool CIwHTTPRing::Open(uint32 entries, uint32 cq_entries)
+{
+    Close();
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+
+    m_fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (m_fd == -1)
+    {
+        IwTrace(HTTP, ("(io_uring_setup failed: %d)", errno));
+        return false;
+    }
+
+    // Without these sockets would be read by blocking kernel threads, and
+    // completions could be dropped..
+    if (!(p.features & IORING_FEAT_FAST_POLL) || !(p.features & IORING_FEAT_NODROP))
+    {
+        IwTrace(HTTP, ("(io_uring is too old: features %x)", p.features));
+        Close();
+        return false;
+    }
+
+    m_sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && m_cq_map_size > m_sq_map_size)
+        m_sq_map_size = m_cq_map_size;
+
+    m_sq_map = mmap(NULL, m_sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        m_cq_map = m_sq_map;
+    else if (m_sq_map != MAP_FAILED)
+        m_cq_map = mmap(NULL, m_cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (m_cq_map != MAP_FAILED)
+        m_sqes = (struct io_uring_sqe *)mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+
+    if (m_sqes == MAP_FAILED)
+    {
+        IwTrace(HTTP, ("(Failed to map io_uring: %d)", errno));
+        Close();
+        return false;
+    }
+
+    char *sq = (char *)m_sq_map;
+    m_sq_head = (unsigned *)(sq + p.sq_off.head);
+    m_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    m_sq_array = (unsigned *)(sq + p.sq_off.array);
+    m_sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    m_sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    m_sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+
+    char *cq = (char *)m_cq_map;
+    m_cq_head = (unsigned *)(cq + p.cq_off.head);
+    m_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    m_cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Entries are always used in order, so the array never changes..
+    for (unsigned i = 0; i < m_sq_entries; i++)
+        m_sq_array[i] = i;
+
+    IwTrace(HTTP, ("(io_uring open: %u entries, %u completions)", p.sq_entries, p.cq_entries));
+    return true;
+}
+
+void CIwHTTPRing::Close()
+{
+    if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqes_size);
+    if (m_cq_map != MAP_FAILED && m_cq_map != m_sq_map)
+        munmap(m_cq_map, m_cq_map_size);
+    if (m_sq_map != MAP_FAILED)
+        munmap(m_sq_map, m_sq_map_size);
+
+    m_sqes = (struct io_uring_sqe *)MAP_FAILED;
+    m_cq_map = MAP_FAILED;
+    m_sq_map = MAP_FAILED;
+    m_queued = 0;
+
+    if (m_fd != -1)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool CIwHTTPRing::RegisterBuffer(void *pBuf, uint32 len)
+{
+    struct iovec iov;
+    iov.iov_base = pBuf;
+    iov.iov_len = len;
+
+    if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1)
+    {
+        IwTrace(HTTP, ("(Failed to register io_uring buffers: %d)", errno));
+        return false;
+    }
+
+    return true;
+}
+
+uint32 CIwHTTPRing::GetSpace() const
+{
+    unsigned head = *(volatile unsigned *)m_sq_head;
+    return m_sq_entries - (*m_sq_tail + m_queued - head);
+}
+
+struct io_uring_sqe* CIwHTTPRing::GetSQE()
+{
+    if (!GetSpace())
+    {
+        Submit();
+        if (!GetSpace())
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &m_sqes[(*m_sq_tail + m_queued) & m_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    m_queued++;
+    return sqe;
+}
+
+int CIwHTTPRing::Submit(uint32 wait)
+{
+    // The entries must be seen before the tail that covers them..
+    if (m_queued)
+    {
+        __sync_synchronize();
+        *(volatile unsigned *)m_sq_tail = *m_sq_tail + m_queued;
+        m_queued = 0;
+    }
+
+    __sync_synchronize();
+    unsigned pending = *m_sq_tail - *(volatile unsigned *)m_sq_head;
+    if (!pending && !wait)
+        return 0;
+
+    int ret;
+    do
+        ret = (int)syscall(__NR_io_uring_enter, m_fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (ret == -1 && errno == EINTR);
+
+    // Those not taken are still in the ring for next time..
+    if (ret == -1)
+        IwTrace(HTTP, ("(io_uring_enter failed: %d)", errno));
+
+    return ret;
+}
+
+bool CIwHTTPRing::GetCQE(struct io_uring_cqe &cqe)
+{
+    unsigned head = *m_cq_head;
+    unsigned tail = *(volatile unsigned *)m_cq_tail;
+#ifdef IORING_SQ_CQ_OVERFLOW
+    if (head == tail && (*(volatile unsigned *)m_sq_flags & IORING_SQ_CQ_OVERFLOW))
+    {
+        // The kernel held on to some that didn't fit, ask for them..
+        syscall(__NR_io_uring_enter, m_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+        tail = *(volatile unsigned *)m_cq_tail;
+    }
+#endif
+    if (head == tail)
+        return false;
+
+    // Read the entry only after seeing the tail that covers it, and free
+    // its place only after it has been read..
+    __sync_synchronize();
+    cqe = m_cqes[head & m_cq_mask];
+    __sync_synchronize();
+    *(volatile unsigned *)m_cq_head = head + 1;
+    return true;
+}
+
+#endif /* IW_HTTP_IO_URING */
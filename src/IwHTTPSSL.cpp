@@ -0,0 +1,277 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPSSL.h"
+
+#ifdef IW_HTTP_SSL
+
+#include "IwHTTPSharedCache.h"
+
+#include "IwDebug.h"
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+#include "openssl/ssl.h"
+
+#include <string.h>
+
+#define DEFAULT_CIPHERS \
+    "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+    "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:" \
+    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:" \
+    "AES128-GCM-SHA256:AES256-GCM-SHA384:ECDHE-RSA-AES128-SHA:AES128-SHA"
+
+SSL_CTX* CIwHTTPSSLContext::s_ctx = NULL;
+CIwHTTPSSLContext::EntryMap* CIwHTTPSSLContext::s_entries = NULL;
+CIwHTTPSSLContext::LRUList* CIwHTTPSSLContext::s_lru = NULL;
+
+SSL_CTX* CIwHTTPSSLContext::GetContext()
+{
+    if (s_ctx)
+        return s_ctx;
+
+    // The highest version both sides speak..
+    s_ctx = SSL_CTX_new(SSLv23_client_method());
+    if (!s_ctx)
+        return NULL;
+
+    // Turn off verification of certs..
+    SSL_CTX_set_verify(s_ctx, SSL_VERIFY_NONE, NULL);
+
+    // AEAD suites with forward secrecy first, CBC only for servers that
+    // offer nothing better..
+    char ciphers[S3E_CONFIG_STRING_MAX];
+    if (s3eConfigGetString("connection", "httptlsciphers", ciphers))
+        strcpy(ciphers, DEFAULT_CIPHERS);
+    if (SSL_CTX_set_cipher_list(s_ctx, ciphers) != SSL_SUCCESS)
+        IwTrace(HTTP, ("(No usable TLS ciphers in %s, using the defaults)", ciphers));
+
+#ifdef HAVE_TLS13
+    // TLS 1.3 tickets come after the handshake, so are stored as they
+    // arrive rather than looked for once it's done..
+    SSL_CTX_set_session_cache_mode(s_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(s_ctx, NewSessionCallback);
+#endif
+
+    return s_ctx;
+}
+
+SSL* CIwHTTPSSLContext::Create(int socket, const std::string &key)
+{
+    SSL_CTX *ctx = GetContext();
+    if (!ctx)
+        return NULL;
+
+    SSL *ssl = SSL_new(ctx);
+    if (!ssl)
+        return NULL;
+
+    // Set socket to use..
+    SSL_set_fd(ssl, socket);
+
+#ifdef HAVE_SESSION_TICKET
+    CyaSSL_UseSessionTicket(ssl);
+#endif
+
+#ifdef HAVE_TLS13
+    // For NewSessionCallback to know where a ticket belongs..
+    SSL_set_app_data(ssl, new std::string(key));
+#endif
+
+    EntryMap::iterator it;
+    if (s_entries && (it = s_entries->find(key)) != s_entries->end())
+    {
+        // The server decides whether to resume, a full handshake follows
+        // if it won't..
+        IwTrace(HTTP_VERBOSE, ("(Offering to resume TLS session for %s)", key.c_str()));
+        SSL_set_session(ssl, it->second.m_session);
+        s_lru->splice(s_lru->begin(), *s_lru, it->second.m_lru);
+    }
+#ifdef HAVE_EXT_CACHE
+    else if (SSL_SESSION *session = LookupShared(key))
+    {
+        IwTrace(HTTP_VERBOSE, ("(Offering to resume shared TLS session for %s)", key.c_str()));
+        SSL_set_session(ssl, session);
+        Store(key, session, false);
+    }
+#endif
+
+    return ssl;
+}
+
+void CIwHTTPSSLContext::Destroy(SSL *ssl)
+{
+    if (ssl)
+    {
+        SSL_shutdown(ssl);
+#ifdef HAVE_TLS13
+        delete (std::string *)SSL_get_app_data(ssl);
+#endif
+        SSL_free(ssl);
+    }
+}
+
+void CIwHTTPSSLContext::Established(SSL *ssl, const std::string &key)
+{
+    if (SSL_session_reused(ssl))
+        IwTrace(HTTP, ("(Resumed TLS session for %s)", key.c_str()));
+
+#ifndef HAVE_TLS13
+    SSL_SESSION *session = SSL_get1_session(ssl);
+    if (session)
+        Store(key, session);
+#endif
+}
+
+bool CIwHTTPSSLContext::IsIdle(SSL *ssl)
+{
+    // Peeking makes the library read whatever has arrived, handling
+    // post-handshake messages itself. Only application data, a close or
+    // an error come back to us..
+    char c;
+    int ret = SSL_peek(ssl, &c, 1);
+    if (ret > 0)
+        return false;
+
+    return SSL_get_error(ssl, ret) == SSL_ERROR_WANT_READ;
+}
+
+#ifdef HAVE_TLS13
+int CIwHTTPSSLContext::NewSessionCallback(SSL *ssl, SSL_SESSION *session)
+{
+    const std::string *key = (const std::string *)SSL_get_app_data(ssl);
+    if (!key)
+        return 0;
+
+    Store(*key, session);
+    return 1;
+}
+
+bool CIwHTTPSSLContext::CanSendEarlyData(SSL *ssl)
+{
+    int enabled = 0;
+    s3eConfigGetInt("connection", "httptlsearlydata", &enabled);
+    if (!enabled)
+        return false;
+
+    // Only a session being resumed, from a server that said it would
+    // take early data..
+    SSL_SESSION *session = SSL_get_session(ssl);
+    return session && SSL_SESSION_get_max_early_data(session) > 0;
+}
+#endif
+
+#ifdef HAVE_EXT_CACHE
+SSL_SESSION* CIwHTTPSSLContext::LookupShared(const std::string &key)
+{
+    std::string value;
+    uint64 expires;
+    if (!CIwHTTPSharedCache::Lookup(CIwHTTPSharedCache::TLS, key, value, expires))
+        return NULL;
+
+    const unsigned char *p = (const unsigned char *)value.data();
+    return d2i_SSL_SESSION(NULL, &p, value.size());
+}
+
+void CIwHTTPSSLContext::Share(const std::string &key, SSL_SESSION *session)
+{
+    int len = i2d_SSL_SESSION(session, NULL);
+    if (len <= 0 || (uint32)len > CIwHTTPSharedCache::GetValueLimit(CIwHTTPSharedCache::TLS, key))
+        return;
+
+    std::string value(len, 0);
+    unsigned char *p = (unsigned char *)&value[0];
+    if (i2d_SSL_SESSION(session, &p) != len)
+        return;
+
+    uint64 expires = s3eTimerGetUTC() + (uint64)SSL_SESSION_get_timeout(session) * 1000;
+    CIwHTTPSharedCache::Store(CIwHTTPSharedCache::TLS, key, value, expires);
+}
+#endif
+
+void CIwHTTPSSLContext::Store(const std::string &key, SSL_SESSION *session, bool share)
+{
+    int max = 32;
+    s3eConfigGetInt("connection", "httptlssessioncachesize", &max);
+    if (max <= 0)
+    {
+        SSL_SESSION_free(session);
+        return;
+    }
+
+#ifdef HAVE_EXT_CACHE
+    if (share)
+        Share(key, session);
+#endif
+
+    if (!s_entries)
+    {
+        s_entries = new EntryMap;
+        s_lru = new LRUList;
+    }
+
+    EntryMap::iterator it = s_entries->find(key);
+    if (it == s_entries->end())
+    {
+        s_lru->push_front(key);
+        it = s_entries->insert(EntryMap::value_type(key, Entry())).first;
+        it->second.m_lru = s_lru->begin();
+    }
+    else
+    {
+        s_lru->splice(s_lru->begin(), *s_lru, it->second.m_lru);
+        SSL_SESSION_free(it->second.m_session);
+    }
+    it->second.m_session = session;
+
+    // Drop the least recently used beyond the limit..
+    while (s_entries->size() > (size_t)max)
+        Erase(s_entries->find(s_lru->back()));
+}
+
+void CIwHTTPSSLContext::Erase(EntryMap::iterator it)
+{
+    SSL_SESSION_free(it->second.m_session);
+    s_lru->erase(it->second.m_lru);
+    s_entries->erase(it);
+}
+
+void CIwHTTPSSLContext::Forget(const std::string &key)
+{
+    if (!s_entries)
+        return;
+
+    EntryMap::iterator it = s_entries->find(key);
+    if (it != s_entries->end())
+        Erase(it);
+}
+
+void CIwHTTPSSLContext::Flush()
+{
+    if (!s_entries)
+        return;
+
+    while (!s_entries->empty())
+        Erase(s_entries->begin());
+
+    delete s_entries;
+    s_entries = NULL;
+    delete s_lru;
+    s_lru = NULL;
+}
+
+uint32 CIwHTTPSSLContext::GetSize()
+{
+    return s_entries ? s_entries->size() : 0;
+}
+
+#endif /* IW_HTTP_SSL */
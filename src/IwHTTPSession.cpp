@@ -0,0 +1,360 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPSession.h"
+#include "IwHTTP2.h"
+#include "IwHTTPConnectionPool.h"
+#include "IwHTTPEventLoop.h"
+
+#include <sstream>
+#include <stdio.h>
+
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+CIwHTTPSession::CIwHTTPSession() :
+    m_inFlight(0),
+    m_queued(0),
+    m_headers_gen(0),
+    m_pump_timer(false)
+{
+    int maxConcurrent = 64;
+    int maxPerHost = 6;
+    int pipelineDepth = 1;
+    s3eConfigGetInt("connection", "httpsessionmaxconcurrent", &maxConcurrent);
+    s3eConfigGetInt("connection", "httpsessionmaxperhost", &maxPerHost);
+    s3eConfigGetInt("connection", "httpsessionpipelinedepth", &pipelineDepth);
+
+    m_maxConcurrent = maxConcurrent > 0 ? maxConcurrent : 0;
+    m_maxPerHost = maxPerHost > 0 ? maxPerHost : 0;
+    m_pipelineDepth = pipelineDepth > 1 ? pipelineDepth : 1;
+}
+
+CIwHTTPSession::~CIwHTTPSession()
+{
+    CancelAll();
+
+    if (m_pump_timer)
+        CIwHTTPEventLoop::CancelTimer(PumpCallback, this);
+
+    for (uint32 i = 0; i < m_requests.size(); i++)
+    {
+        m_requests[i]->m_session = NULL;
+        delete m_requests[i];
+    }
+}
+
+CIwHTTP* CIwHTTPSession::Get(const char *URI, s3eCallback cb, void *pUserData)
+{
+    return Request(CIwHTTP::GET, URI, NULL, 0, cb, pUserData);
+}
+
+CIwHTTP* CIwHTTPSession::Head(const char *URI, s3eCallback cb, void *pUserData)
+{
+    return Request(CIwHTTP::HEAD, URI, NULL, 0, cb, pUserData);
+}
+
+CIwHTTP* CIwHTTPSession::Delete(const char *URI, s3eCallback cb, void *pUserData)
+{
+    return Request(CIwHTTP::DELETE, URI, NULL, 0, cb, pUserData);
+}
+
+CIwHTTP* CIwHTTPSession::Post(const char *URI, const char* Body, int32 BodyLength, s3eCallback cb, void *pUserData)
+{
+    return Request(CIwHTTP::POST, URI, Body, BodyLength, cb, pUserData);
+}
+
+CIwHTTP* CIwHTTPSession::Put(const char *URI, const char* Body, int32 BodyLength, s3eCallback cb, void *pUserData)
+{
+    return Request(CIwHTTP::PUT, URI, Body, BodyLength, cb, pUserData);
+}
+
+CIwHTTP* CIwHTTPSession::AllocRequest()
+{
+    if (m_free.size())
+    {
+        CIwHTTP *request = m_free.back();
+        m_free.pop_back();
+        return request;
+    }
+
+    CIwHTTP *request = new CIwHTTP;
+    request->m_session = this;
+    m_requests.append(request);
+    return request;
+}
+
+CIwHTTP* CIwHTTPSession::Request(CIwHTTP::SendType type, const char *URI, const char* Body, int32 BodyLength, s3eCallback cb, void *pUserData)
+{
+    IwAssert(HTTP, URI);
+
+    Pending p;
+    p.m_request = AllocRequest();
+    p.m_gen = p.m_request->m_session_gen;
+    p.m_type = type;
+    p.m_URI = URI;
+    if (Body != NULL && BodyLength > 0)
+        p.m_body.assign(Body, BodyLength);
+    p.m_callback = cb;
+    p.m_data = pUserData;
+
+    // Requests are limited per host:port..
+    CIwURI uri(URI);
+    char port[8];
+    sprintf(port, ":%u", (unsigned int)uri.GetPort());
+    p.m_host = uri.GetHost() ? uri.GetHost() : "";
+    p.m_host += port;
+
+    if (m_queue.empty() && CanStart(p))
+    {
+        if (!Start(p))
+        {
+            Release(p.m_request);
+            return NULL;
+        }
+        return p.m_request;
+    }
+
+    // Hold the request back until there's room. Until then the handle
+    // behaves as if waiting for headers..
+    IwTrace(HTTP_VERBOSE, ("(Session queued %s)", URI));
+    p.m_request->m_bGetInProgress = true;
+    p.m_request->m_Status = S3E_RESULT_SUCCESS;
+    p.m_request->m_session_state = CIwHTTP::SESSION_QUEUED;
+    m_queue.push_back(p);
+    m_queued++;
+
+    return p.m_request;
+}
+
+bool CIwHTTPSession::CanStart(const Pending &p) const
+{
+    if (m_maxConcurrent && m_inFlight >= m_maxConcurrent)
+        return false;
+
+    if (m_maxPerHost)
+    {
+        HostCounts::const_iterator it = m_hostCounts.find(p.m_host);
+        if (it != m_hostCounts.end() && it->second >= m_maxPerHost)
+        {
+            // Streams on an HTTP/2 connection don't count against it..
+            std::string key;
+            CIwURI uri(p.m_URI.c_str());
+            CIwHTTPConnectionPool::MakeKey(key, uri.GetHost(), uri.GetPort(), uri.GetProtocol() == CIwURI::HTTPS, NULL, 0);
+            if (CIwHTTP2Connection::Find(key))
+                return true;
+
+            // Some of those may be pipelined, leaving room for another
+            // connection, or there may be room in a pipeline..
+            return m_pipelineDepth > 1 &&
+                (CountConnections(p.m_host) < m_maxPerHost ||
+                 FindPipelineTail(p.m_host, p.m_type, !p.m_body.empty()) != NULL);
+        }
+    }
+
+    return true;
+}
+
+uint32 CIwHTTPSession::CountConnections(const std::string &host) const
+{
+    // Every request in flight has a connection of its own, except those
+    // pipelined behind another..
+    uint32 count = 0;
+    for (uint32 i = 0; i < m_requests.size(); i++)
+    {
+        const CIwHTTP *r = m_requests[i];
+        if (r->m_session_state == CIwHTTP::SESSION_ACTIVE && !r->m_pipe_prev && r->m_session_host == host)
+            count++;
+    }
+    return count;
+}
+
+CIwHTTP* CIwHTTPSession::FindPipelineTail(const std::string &host, CIwHTTP::SendType type, bool hasBody) const
+{
+    // Only requests that can safely be sent again are pipelined..
+    if (m_pipelineDepth <= 1 || hasBody || (type != CIwHTTP::GET && type != CIwHTTP::HEAD) ||
+        m_noPipeline.find(host) != m_noPipeline.end())
+        return NULL;
+
+    // ..behind the shortest pipeline with room
+    CIwHTTP *best = NULL;
+    uint32 bestLen = m_pipelineDepth;
+    for (uint32 i = 0; i < m_requests.size(); i++)
+    {
+        CIwHTTP *r = m_requests[i];
+        if (r->m_session_state != CIwHTTP::SESSION_ACTIVE || r->m_session_host != host || !r->CanPipelineAfter())
+            continue;
+
+        uint32 len = r->PipelineLength();
+        if (len < bestLen)
+        {
+            best = r;
+            bestLen = len;
+        }
+    }
+
+    return best;
+}
+
+CIwHTTP* CIwHTTPSession::PipelineTail(CIwHTTP *request) const
+{
+    // New connections are preferred while the host is allowed more..
+    const std::string &host = request->m_session_host;
+    if (!m_maxPerHost || m_pipelineDepth <= 1 || CountConnections(host) < m_maxPerHost)
+        return NULL;
+
+    return FindPipelineTail(host, request->m_Type, !request->m_data.empty());
+}
+
+void CIwHTTPSession::PipelineFailed(const std::string &host)
+{
+    if (m_noPipeline.insert(host).second)
+        IwTrace(HTTP, ("(Pipelining to %s failed, no longer pipelining to it)", host.c_str()));
+}
+
+void CIwHTTPSession::RequestSent()
+{
+    // A queued request may be able to follow it on its connection..
+    if (m_pipelineDepth > 1)
+        SchedulePump();
+}
+
+bool CIwHTTPSession::Start(Pending &p)
+{
+    CIwHTTP *request = p.m_request;
+    request->m_bGetInProgress = false;
+    request->m_session_state = CIwHTTP::SESSION_NONE;
+    request->m_session_host = p.m_host;
+
+    const char *body = p.m_body.empty() ? NULL : p.m_body.data();
+    if (request->Send(p.m_type, p.m_URI.c_str(), body, p.m_body.size(), p.m_callback, p.m_data) != S3E_RESULT_SUCCESS)
+        return false;
+
+    request->m_session_state = CIwHTTP::SESSION_ACTIVE;
+    m_inFlight++;
+    m_hostCounts[p.m_host]++;
+    return true;
+}
+
+void CIwHTTPSession::Pump()
+{
+    // Start as many queued requests as the limits allow, in order, but
+    // without letting a busy host hold up requests to others..
+    std::list<Pending>::iterator it = m_queue.begin();
+    while (it != m_queue.end() && (!m_maxConcurrent || m_inFlight < m_maxConcurrent))
+    {
+        if (it->m_gen != it->m_request->m_session_gen)
+        {
+            // Released or cancelled whilst queued..
+            it = m_queue.erase(it);
+            continue;
+        }
+
+        if (!CanStart(*it))
+        {
+            ++it;
+            continue;
+        }
+
+        Pending p = *it;
+        it = m_queue.erase(it);
+        m_queued--;
+
+        if (!Start(p))
+        {
+            IwTrace(HTTP, ("(Session failed to start %s)", p.m_URI.c_str()));
+            p.m_request->m_Status = S3E_RESULT_ERROR;
+            if (p.m_callback)
+                p.m_callback(p.m_request, p.m_data);
+        }
+    }
+}
+
+int32 CIwHTTPSession::PumpCallback(void *, void *pUserData)
+{
+    CIwHTTPSession *self = (CIwHTTPSession *)pUserData;
+    self->m_pump_timer = false;
+    self->Pump();
+    return 0;
+}
+
+void CIwHTTPSession::RequestFinished(CIwHTTP *request)
+{
+    m_inFlight--;
+
+    HostCounts::iterator it = m_hostCounts.find(request->m_session_host);
+    if (it != m_hostCounts.end() && --it->second == 0)
+        m_hostCounts.erase(it);
+
+    // Start the next ones on the next yield, not from within the
+    // finishing request..
+    SchedulePump();
+}
+
+void CIwHTTPSession::SchedulePump()
+{
+    if (m_queued && !m_pump_timer)
+    {
+        m_pump_timer = true;
+        CIwHTTPEventLoop::SetTimer(0, PumpCallback, this);
+    }
+}
+
+void CIwHTTPSession::Release(CIwHTTP *request)
+{
+    if (!request || request->m_session != this)
+        return;
+
+    if (request->m_session_state == CIwHTTP::SESSION_QUEUED)
+    {
+        request->m_session_state = CIwHTTP::SESSION_NONE;
+        m_queued--;
+    }
+
+    // Invalidate any queue entry and wind the request up..
+    request->m_session_gen++;
+    request->Cancel();
+    request->m_req_headers.clear();
+    request->m_header_block_valid = false;
+
+    m_free.append(request);
+}
+
+void CIwHTTPSession::CancelAll()
+{
+    for (uint32 i = 0; i < m_requests.size(); i++)
+    {
+        CIwHTTP *request = m_requests[i];
+        if (request->m_session_state == CIwHTTP::SESSION_QUEUED)
+        {
+            request->m_session_state = CIwHTTP::SESSION_NONE;
+            request->m_session_gen++;
+            request->m_Status = S3E_RESULT_ERROR;
+            m_queued--;
+        }
+        request->Cancel();
+    }
+    m_queue.clear();
+}
+
+void CIwHTTPSession::SetRequestHeader(const char *pName, int32 val)
+{
+    std::ostringstream b;
+    b << val;
+    SetRequestHeader(pName, b.str());
+}
+
+void CIwHTTPSession::SetRequestHeader(const char *pName, const std::string &val)
+{
+    CIwHTTP::SetHeader(m_req_headers, pName, val);
+    m_headers_gen++;
+}
@@ -0,0 +1,370 @@
+/*
+ * (C) 2001-2012 Marmalade. All Rights Reserved.
+ *
+ * This document is protected by copyright, and contains information
+ * proprietary to Marmalade.
+ *
+ * This file consists of source code released by Marmalade under
+ * the terms of the accompanying End User License Agreement (EULA).
+ * Please do not use this program/source code before you have read the
+ * EULA and have agreed to be bound by its terms.
+ */
+
+#include "IwHTTPSharedCache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "IwDebug.h"
+#include "IwMath.h"
+#include "s3eConfig.h"
+#include "s3eTimer.h"
+
+#define SHARED_MAGIC 0x43534849  // "IHSC"
+#define SHARED_VERSION 1
+
+// Header states
+#define STATE_EMPTY 0
+#define STATE_LAYING_OUT 1
+#define STATE_READY 2
+
+// How long to wait for another process to lay the file out
+#define LAYOUT_WAIT_MS 1000
+
+// Slots a hash can be kept in
+#define SLOT_WAYS 4
+
+// Times a reader tries a slot that keeps being written
+#define READ_TRIES 4
+
+#define DNS_SLOTS 256
+#define DNS_SLOT_SIZE 1024
+#define TLS_SLOTS 128
+#define TLS_SLOT_SIZE 4096
+
+// Room left in response slots for the key, beyond httpsharedentrysize
+#define RESPONSE_KEY_ROOM 1024
+
+struct CIwHTTPSharedCache::Header
+{
+    volatile uint32 m_state;
+    uint32 m_magic;
+    uint32 m_version;
+    uint32 m_size;
+    struct
+    {
+        uint32 m_offset;
+        uint32 m_slots;
+        uint32 m_slot_size;
+        uint32 m_reserved;
+    } m_tables[TABLE_COUNT];
+};
+
+struct CIwHTTPSharedCache::Slot
+{
+    volatile uint32 m_seq;      // Odd while being written
+    volatile uint32 m_writer;   // Process writing it, 0 if none
+    uint64 m_hash;              // 0 if free
+    uint64 m_expires;           // UTC ms
+    uint32 m_key_len;
+    uint32 m_value_len;
+    // The key then the value follow
+};
+
+bool CIwHTTPSharedCache::s_tried = false;
+CIwHTTPSharedCache::Header* CIwHTTPSharedCache::s_header = NULL;
+uint32 CIwHTTPSharedCache::s_size = 0;
+
+static uint64 Hash(const std::string &key)
+{
+    // FNV-1a, 0 being kept for free slots..
+    uint64 h = 14695981039346656037ULL;
+    for (uint32 i = 0; i < key.size(); i++)
+        h = (h ^ (uint8)key[i]) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+bool CIwHTTPSharedCache::Open()
+{
+    if (s_header)
+        return true;
+
+    // Not configured, or failed, don't keep trying on every request..
+    if (s_tried)
+        return false;
+    s_tried = true;
+
+    char path[S3E_CONFIG_STRING_MAX];
+    if (s3eConfigGetString("connection", "httpsharedcache", path) || !path[0])
+        return false;
+
+    int size = 4194304;
+    s3eConfigGetInt("connection", "httpsharedcachesize", &size);
+    int entry = 32768;
+    s3eConfigGetInt("connection", "httpsharedentrysize", &entry);
+
+    uint32 response_slot = (sizeof(Slot) + RESPONSE_KEY_ROOM + MAX(entry, 0) + 7) & ~7;
+    uint32 fixed = sizeof(Header) + DNS_SLOTS * DNS_SLOT_SIZE + TLS_SLOTS * TLS_SLOT_SIZE;
+    if (size <= 0 || (uint32)size < fixed + response_slot)
+    {
+        IwTrace(HTTP, ("(HTTP shared cache needs at least %u bytes)", fixed + response_slot));
+        return false;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+    {
+        IwTrace(HTTP, ("(Failed to open HTTP shared cache %s: %d)", path, errno));
+        return false;
+    }
+
+    // Another process may be sizing it too, to the same size..
+    struct stat st;
+    if (fstat(fd, &st) || (st.st_size == 0 && ftruncate(fd, size)))
+    {
+        IwTrace(HTTP, ("(Failed to size HTTP shared cache: %d)", errno));
+        close(fd);
+        return false;
+    }
+    if (st.st_size && st.st_size != (off_t)size)
+    {
+        IwTrace(HTTP, ("(HTTP shared cache %s is shared at a different size)", path));
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        IwTrace(HTTP, ("(Failed to map HTTP shared cache: %d)", errno));
+        return false;
+    }
+
+    Header *header = (Header *)map;
+    if (__sync_bool_compare_and_swap(&header->m_state, STATE_EMPTY, STATE_LAYING_OUT))
+    {
+        // First here, the file being all zeroes..
+        IwTrace(HTTP, ("(Starting HTTP shared cache %s)", path));
+        header->m_magic = SHARED_MAGIC;
+        header->m_version = SHARED_VERSION;
+        header->m_size = size;
+
+        uint32 offset = sizeof(Header);
+        header->m_tables[DNS].m_offset = offset;
+        header->m_tables[DNS].m_slots = DNS_SLOTS;
+        header->m_tables[DNS].m_slot_size = DNS_SLOT_SIZE;
+        offset += DNS_SLOTS * DNS_SLOT_SIZE;
+
+        header->m_tables[TLS].m_offset = offset;
+        header->m_tables[TLS].m_slots = TLS_SLOTS;
+        header->m_tables[TLS].m_slot_size = TLS_SLOT_SIZE;
+        offset += TLS_SLOTS * TLS_SLOT_SIZE;
+
+        header->m_tables[RESPONSE].m_offset = offset;
+        header->m_tables[RESPONSE].m_slots = (size - offset) / response_slot;
+        header->m_tables[RESPONSE].m_slot_size = response_slot;
+
+        __sync_synchronize();
+        header->m_state = STATE_READY;
+    }
+    else
+    {
+        uint64 give_up = s3eTimerGetMs() + LAYOUT_WAIT_MS;
+        while (header->m_state != STATE_READY && s3eTimerGetMs() < give_up)
+            usleep(1000);
+        __sync_synchronize();
+    }
+
+    // Its layout is whatever the process that made it chose..
+    bool ok = header->m_state == STATE_READY && header->m_magic == SHARED_MAGIC &&
+        header->m_version == SHARED_VERSION && header->m_size == (uint32)size;
+    for (uint32 t = 0; ok && t < TABLE_COUNT; t++)
+    {
+        ok = header->m_tables[t].m_slot_size >= sizeof(Slot) &&
+            header->m_tables[t].m_offset >= sizeof(Header) &&
+            header->m_tables[t].m_offset + (uint64)header->m_tables[t].m_slots * header->m_tables[t].m_slot_size <= (uint32)size;
+    }
+    if (!ok)
+    {
+        IwTrace(HTTP, ("(HTTP shared cache %s isn't usable)", path));
+        munmap(map, size);
+        return false;
+    }
+
+    s_header = header;
+    s_size = size;
+    return true;
+}
+
+void CIwHTTPSharedCache::Close()
+{
+    if (s_header)
+    {
+        munmap(s_header, s_size);
+        s_header = NULL;
+    }
+
+    s_tried = false;
+}
+
+CIwHTTPSharedCache::Slot* CIwHTTPSharedCache::GetSlot(Table table, uint32 index)
+{
+    return (Slot *)((char *)s_header + s_header->m_tables[table].m_offset + index * s_header->m_tables[table].m_slot_size);
+}
+
+bool CIwHTTPSharedCache::BeginWrite(Slot *slot)
+{
+    uint32 pid = getpid();
+    uint32 writer = __sync_val_compare_and_swap(&slot->m_writer, 0, pid);
+    if (writer)
+    {
+        // Someone else is writing it, unless they died doing so..
+        if (kill(writer, 0) == 0 || errno != ESRCH)
+            return false;
+        if (!__sync_bool_compare_and_swap(&slot->m_writer, writer, pid))
+            return false;
+        IwTrace(HTTP, ("(HTTP shared cache: taking over slot from process %u)", writer));
+    }
+
+    // Already odd if taken over..
+    slot->m_seq = slot->m_seq | 1;
+    __sync_synchronize();
+    return true;
+}
+
+void CIwHTTPSharedCache::EndWrite(Slot *slot)
+{
+    __sync_synchronize();
+    slot->m_seq = slot->m_seq + 1;
+    __sync_lock_release(&slot->m_writer);
+}
+
+bool CIwHTTPSharedCache::Read(Table table, Slot *slot, uint64 hash, const std::string &key, std::string *value, uint64 *expires)
+{
+    uint32 room = s_header->m_tables[table].m_slot_size - sizeof(Slot);
+    const char *data = (const char *)(slot + 1);
+
+    for (uint32 tries = 0; tries < READ_TRIES; tries++)
+    {
+        uint32 seq = slot->m_seq;
+        __sync_synchronize();
+        if (seq & 1)
+        {
+            usleep(0);
+            continue;
+        }
+
+        // What is copied may be torn, so check the lengths before using
+        // them; the sequence count tells whether it was..
+        uint64 expiry = slot->m_expires;
+        uint32 key_len = slot->m_key_len;
+        uint32 value_len = slot->m_value_len;
+        bool match = slot->m_hash == hash && key_len == key.size() &&
+            value_len <= room - key_len && !memcmp(data, key.data(), key_len);
+        if (match && value)
+            value->assign(data + key_len, value_len);
+
+        __sync_synchronize();
+        if (slot->m_seq != seq)
+            continue;
+
+        if (match && expires)
+            *expires = expiry;
+        return match;
+    }
+
+    return false;
+}
+
+uint32 CIwHTTPSharedCache::GetValueLimit(Table table, const std::string &key)
+{
+    if (!Open())
+        return 0;
+
+    uint32 room = s_header->m_tables[table].m_slot_size - sizeof(Slot);
+    return key.size() < room ? room - key.size() : 0;
+}
+
+bool CIwHTTPSharedCache::Lookup(Table table, const std::string &key, std::string &value, uint64 &expires)
+{
+    if (!Open())
+        return false;
+
+    uint32 slots = s_header->m_tables[table].m_slots;
+    uint64 hash = Hash(key);
+    for (uint32 i = 0; slots && i < SLOT_WAYS; i++)
+    {
+        Slot *slot = GetSlot(table, (hash + i) % slots);
+        if (slot->m_hash == hash && Read(table, slot, hash, key, &value, &expires))
+            return expires > s3eTimerGetUTC();
+    }
+
+    return false;
+}
+
+void CIwHTTPSharedCache::Store(Table table, const std::string &key, const std::string &value, uint64 expires)
+{
+    if (!Open() || value.size() > GetValueLimit(table, key))
+        return;
+
+    uint32 slots = s_header->m_tables[table].m_slots;
+    if (!slots)
+        return;
+
+    // Its own slot, else a free or expired one, else the one expiring
+    // soonest..
+    uint64 hash = Hash(key);
+    uint64 now = s3eTimerGetUTC();
+    Slot *best = NULL;
+    for (uint32 i = 0; i < SLOT_WAYS; i++)
+    {
+        Slot *slot = GetSlot(table, (hash + i) % slots);
+        if (slot->m_hash == hash && Read(table, slot, hash, key, NULL, NULL))
+        {
+            best = slot;
+            break;
+        }
+
+        if (!best || (best->m_hash && best->m_expires > now && (!slot->m_hash || slot->m_expires < best->m_expires)))
+            best = slot;
+    }
+
+    if (!BeginWrite(best))
+        return;
+
+    best->m_hash = hash;
+    best->m_expires = expires;
+    best->m_key_len = key.size();
+    best->m_value_len = value.size();
+    char *data = (char *)(best + 1);
+    memcpy(data, key.data(), key.size());
+    memcpy(data + key.size(), value.data(), value.size());
+
+    EndWrite(best);
+}
+
+void CIwHTTPSharedCache::Remove(Table table, const std::string &key)
+{
+    if (!Open())
+        return;
+
+    uint32 slots = s_header->m_tables[table].m_slots;
+    uint64 hash = Hash(key);
+    for (uint32 i = 0; slots && i < SLOT_WAYS; i++)
+    {
+        Slot *slot = GetSlot(table, (hash + i) % slots);
+        if (slot->m_hash != hash || !Read(table, slot, hash, key, NULL, NULL) || !BeginWrite(slot))
+            continue;
+
+        slot->m_hash = 0;
+        slot->m_key_len = 0;
+        slot->m_value_len = 0;
+        EndWrite(slot);
+    }
+}
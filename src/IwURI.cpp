@@ -101,8 +101,34 @@ void CIwURI::ParseURI()
     }
 
     char *pChar = m_pHost;
-    while (pChar && *pChar && *pChar != '/' && *pChar != ':' && *pChar != '?') pChar++;
-    if (pChar && *pChar)
+    char *pClose = (pChar && *pChar == '[') ? strchr(pChar, ']') : NULL;
+    if (pClose)
+    {
+        // An IPv6 literal (RFC 3986 3.2.2). The brackets aren't part of
+        // the host, so skip the opening one and terminate on the closing..
+        m_pHost = ++pChar;
+        m_pRemoved = pClose;
+        m_removed = *m_pRemoved;
+        *pClose = 0;
+
+        pChar = pClose + 1;
+        if (*pChar == ':')
+        {
+            m_port = atoi(++pChar);
+            while (isdigit(*pChar)) pChar++;
+        }
+
+        if (*pChar == '/')
+            m_pTail = ++pChar;
+        else if (*pChar == '?')
+            m_pTail = pChar;
+    }
+    else
+    {
+        while (pChar && *pChar && *pChar != '/' && *pChar != ':' && *pChar != '?') pChar++;
+    }
+
+    if (!pClose && pChar && *pChar)
     {
         if (*pChar == '/' || *pChar == '?')
         {